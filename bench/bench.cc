@@ -0,0 +1,456 @@
+//
+// Created by denn nevera on 2019-07-15.
+//
+
+#include "capy/amqp.h"
+#include "stand_in/server.h"
+#include "../src/broker_impl/metrics.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#ifndef CAPY_AMQP_VERSION
+#define CAPY_AMQP_VERSION "unknown"
+#endif
+
+using namespace capy::amqp;
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Options {
+    size_t publish_count = 2000;
+    size_t fetch_count   = 2000;
+    size_t listen_count  = 20000;
+    size_t inflight      = 1000;
+    size_t dispatch      = 5000000;
+    size_t batch         = 100;
+    std::string address;
+    std::string output;
+    std::string trace;
+};
+
+static Options parse_options(int argc, char* argv[]) {
+
+  Options options;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto next = [&]() -> std::string {
+        if (i + 1 >= argc) {
+          std::cerr << "capy_amqp_bench: " << arg << " needs a value" << std::endl;
+          ::exit(2);
+        }
+        return argv[++i];
+    };
+
+    if      (arg == "--publish")  options.publish_count = std::stoul(next());
+    else if (arg == "--fetch")    options.fetch_count = std::stoul(next());
+    else if (arg == "--listen")   options.listen_count = std::stoul(next());
+    else if (arg == "--inflight") options.inflight = std::stoul(next());
+    else if (arg == "--dispatch") options.dispatch = std::stoul(next());
+    else if (arg == "--batch")    options.batch = std::stoul(next());
+    else if (arg == "--address")  options.address = next();
+    else if (arg == "--output")   options.output = next();
+    else if (arg == "--trace")    options.trace = next();
+    else {
+      std::cerr << "usage: capy_amqp_bench [--publish N] [--fetch N] [--listen N] [--inflight N] [--dispatch N] [--batch N] "
+                   "[--address amqp://...] [--output file.json] [--trace trace.json]" << std::endl;
+      ::exit(2);
+    }
+  }
+
+  return options;
+}
+
+static double seconds_since(const bench_clock::time_point& started) {
+  return std::chrono::duration<double>(bench_clock::now() - started).count();
+}
+
+static size_t resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+static capy::json latency_json(const HistogramSnapshot& h) {
+  return {
+          {"count", h.count},
+          {"mean_us", h.mean()},
+          {"min_us", h.min},
+          {"p50_us", h.value_at_percentile(50)},
+          {"p90_us", h.value_at_percentile(90)},
+          {"p99_us", h.value_at_percentile(99)},
+          {"p999_us", h.value_at_percentile(99.9)},
+          {"max_us", h.max}
+  };
+}
+
+static Broker bind_broker(const Address& address, const ConnectionOptions& options = ConnectionOptions()) {
+  auto broker = Broker::Bind(address, "amq.topic", Broker::heartbeat_timeout, options, [](const capy::Error&){});
+  if (!broker) {
+    std::cerr << "capy_amqp_bench: bind error: " << broker.error() << std::endl;
+    ::exit(1);
+  }
+  broker->run();
+  return *broker;
+}
+
+static void wait_listening(DeferredListen& deferred, const DeferredListen::DataHandler& on_data) {
+  std::promise<void> ready;
+  deferred
+          .on_data(on_data)
+          .on_success([&ready]{
+              try { ready.set_value(); } catch (...) {}
+          })
+          .on_error([](const capy::Error& error){
+              std::cerr << "capy_amqp_bench: listen error: " << error << std::endl;
+          });
+  ready.get_future().wait();
+}
+
+///
+/// publish throughput: every publish is a committed transaction
+///
+static capy::json bench_publish(const Address& address, size_t count) {
+
+  auto broker = bind_broker(address);
+  capy::json message = {{"action", "bench"}, {"payload", std::string(64, 'p')}};
+
+  size_t errors = 0;
+  auto started = bench_clock::now();
+
+  for (size_t i = 0; i < count; ++i) {
+    if (broker.publish(message, "bench.publish")) errors++;
+  }
+
+  auto elapsed = seconds_since(started);
+
+  return {
+          {"count", count},
+          {"errors", errors},
+          {"seconds", elapsed},
+          {"messages_per_second", static_cast<double>(count) / elapsed},
+          {"commit_latency", latency_json(broker.get_metrics().publish_latency)}
+  };
+}
+
+///
+/// fetch rpc latency: sequential round trips through an echo worker
+///
+static capy::json bench_fetch(const Address& address, size_t count) {
+
+  auto worker = bind_broker(address);
+
+  wait_listening(worker.listen("capy-bench-echo", {"bench.echo"}),
+                 [](const Request &request, Replay* replay){
+                     if (request) replay->message = request->message;
+                     else replay->message = capy::make_unexpected(request.error());
+                     replay->commit();
+                 });
+
+  auto client = bind_broker(address);
+  capy::json message = {{"action", "echo"}, {"payload", std::string(64, 'f')}};
+
+  Histogram latency;
+  size_t errors = 0;
+  auto started = bench_clock::now();
+
+  for (size_t i = 0; i < count; ++i) {
+    std::promise<bool> reply;
+    auto sent = bench_clock::now();
+
+    client.fetch(message, "bench.echo")
+            .on_data([&reply](const Payload& payload){
+                try { reply.set_value(static_cast<bool>(payload)); } catch (...) {}
+            })
+            .on_error([&reply](const capy::Error&){
+                try { reply.set_value(false); } catch (...) {}
+            });
+
+    if (!reply.get_future().get()) errors++;
+    latency.record(sent);
+  }
+
+  auto elapsed = seconds_since(started);
+
+  return {
+          {"count", count},
+          {"errors", errors},
+          {"seconds", elapsed},
+          {"requests_per_second", static_cast<double>(count) / elapsed},
+          {"latency", latency_json(latency.snapshot())}
+  };
+}
+
+///
+/// listen throughput: messages are injected by the stand-in broker, every one is handled and replied
+///
+static capy::json bench_listen(const Address& address,
+                               bench::StandInBroker* stand_in,
+                               size_t count,
+                               const ConnectionOptions& options = ConnectionOptions(),
+                               const std::string& name = "listen") {
+
+  if (!stand_in) return {{"skipped", "needs the stand-in broker"}};
+
+  auto worker = bind_broker(address, options);
+
+  std::atomic<size_t> handled(0);
+  std::promise<void> done;
+
+  wait_listening(worker.listen("capy-bench-" + name, {"bench." + name}),
+                 [&handled, &done, count](const Request &request, Replay* replay){
+                     (void) request;
+                     replay->message = capy::json({{"ok", true}});
+                     replay->commit();
+                     if (++handled == count) done.set_value();
+                 });
+
+  auto body = capy::json::to_msgpack(capy::json({{"action", "listen"}, {"payload", std::string(64, 'l')}}));
+
+  auto started = bench_clock::now();
+
+  stand_in->inject("amq.topic", "bench." + name, std::string(body.begin(), body.end()), count);
+
+  done.get_future().wait();
+
+  auto elapsed = seconds_since(started);
+  auto metrics = worker.get_metrics();
+
+  return {
+          {"count", count},
+          {"seconds", elapsed},
+          {"messages_per_second", static_cast<double>(count) / elapsed},
+          {"write_flushes", metrics.write_flushes},
+          {"bytes_per_flush", metrics.flush_size.mean()},
+          {"handler_time", latency_json(metrics.handler_time)},
+          {"replay_latency", latency_json(metrics.replay_latency)},
+          {"queueing_delay", latency_json(metrics.queueing_delay)}
+  };
+}
+
+///
+/// batched listen throughput: the same injected load is handled in batches acknowledged by multiple ack
+///
+static capy::json bench_listen_batch(const Address& address, bench::StandInBroker* stand_in, size_t count, size_t max_batch) {
+
+  if (!stand_in) return {{"skipped", "needs the stand-in broker"}};
+
+  auto worker = bind_broker(address);
+
+  std::atomic<size_t> handled(0);
+  std::atomic<size_t> batches(0);
+  std::promise<void> ready;
+  std::promise<void> done;
+
+  worker.listen_batch("capy-bench-listen-batch", {"bench.listen.batch"}, max_batch, std::chrono::milliseconds(5))
+          .on_data([&handled, &batches, &done, count](const Requests &requests, const Replays &replays){
+              for (auto replay: replays) {
+                replay->message = capy::json({{"ok", true}});
+                replay->commit();
+              }
+              batches++;
+              if ((handled += requests.size()) == count) done.set_value();
+          })
+          .on_success([&ready]{
+              try { ready.set_value(); } catch (...) {}
+          })
+          .on_error([](const capy::Error& error){
+              std::cerr << "capy_amqp_bench: listen batch error: " << error << std::endl;
+          });
+
+  ready.get_future().wait();
+
+  auto body = capy::json::to_msgpack(capy::json({{"action", "listen"}, {"payload", std::string(64, 'l')}}));
+
+  auto started = bench_clock::now();
+
+  stand_in->inject("amq.topic", "bench.listen.batch", std::string(body.begin(), body.end()), count);
+
+  done.get_future().wait();
+
+  auto elapsed = seconds_since(started);
+  auto metrics = worker.get_metrics();
+
+  return {
+          {"count", count},
+          {"max_batch", max_batch},
+          {"batches", batches.load()},
+          {"seconds", elapsed},
+          {"messages_per_second", static_cast<double>(count) / elapsed},
+          {"batch_handler_time", latency_json(metrics.handler_time)},
+          {"batch_ack_latency", latency_json(metrics.ack_latency)}
+  };
+}
+
+///
+/// transport throughput: the listen load is handled over every transport supported by the build
+///
+static capy::json bench_transport(const Address& address, bench::StandInBroker* stand_in, size_t count) {
+
+  capy::json report;
+
+  for (auto transport: {ConnectionOptions::Transport::libuv, ConnectionOptions::Transport::io_uring}) {
+
+    ConnectionOptions options;
+    options.transport = transport;
+
+    auto name = transport == ConnectionOptions::Transport::libuv ? "libuv" : "io_uring";
+
+    auto probe = Broker::Bind(address, "amq.topic", Broker::heartbeat_timeout, options, [](const capy::Error&){});
+
+    if (!probe) {
+      report[name] = {{"skipped", probe.error().message()}};
+      continue;
+    }
+
+    report[name] = bench_listen(address, stand_in, count, options, std::string("transport.") + name);
+  }
+
+  return report;
+}
+
+///
+/// memory per in-flight fetch: requests without a worker stay in flight
+///
+static capy::json bench_inflight(const Address& address, bench::StandInBroker* stand_in, size_t count) {
+
+  auto client = bind_broker(address);
+  capy::json message = {{"action", "void"}};
+
+  auto queues = stand_in ? stand_in->get_queues_count() : 0;
+  auto before = resident_bytes();
+
+  for (size_t i = 0; i < count; ++i) {
+    client.fetch(message, "bench.void").on_data([](const Payload&){});
+  }
+
+  if (stand_in) {
+    auto deadline = bench_clock::now() + std::chrono::seconds(10);
+    while (stand_in->get_queues_count() < queues + count && bench_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  else {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+
+  auto after = resident_bytes();
+
+  return {
+          {"count", count},
+          {"outstanding", client.get_metrics().fetch_outstanding},
+          {"resident_bytes_before", before},
+          {"resident_bytes_after", after},
+          {"bytes_per_request", static_cast<double>(after > before ? after - before : 0) / static_cast<double>(count)},
+          {"includes_stand_in", stand_in != nullptr}
+  };
+}
+
+///
+/// deferred dispatch cost: locked handlers versus sealed ones, in the single thread and under contention
+///
+static double dispatch_ns(bool sealed, size_t threads_count, size_t count) {
+
+  DeferredFetch deferred;
+  std::atomic<size_t> received(0);
+
+  deferred.on_data([&received](const Payload& payload){
+      if (payload) received.fetch_add(1, std::memory_order_relaxed);
+  });
+
+  if (sealed) deferred.seal();
+
+  Payload payload = capy::json({{"ok", true}});
+  auto per_thread = count / threads_count;
+
+  std::vector<std::thread> threads;
+  auto started = bench_clock::now();
+
+  for (size_t t = 0; t < threads_count; ++t) {
+    threads.emplace_back([&deferred, &payload, per_thread]{
+        for (size_t i = 0; i < per_thread; ++i) deferred.report_data(payload);
+    });
+  }
+
+  for (auto& thread: threads) thread.join();
+
+  return seconds_since(started) * 1e9 / static_cast<double>(per_thread * threads_count);
+}
+
+static capy::json bench_dispatch(size_t count) {
+
+  auto threads = std::max(std::thread::hardware_concurrency(), 2u);
+
+  return {
+          {"count", count},
+          {"threads", threads},
+          {"locked_ns_per_message", dispatch_ns(false, 1, count)},
+          {"sealed_ns_per_message", dispatch_ns(true, 1, count)},
+          {"locked_contended_ns_per_message", dispatch_ns(false, threads, count)},
+          {"sealed_contended_ns_per_message", dispatch_ns(true, threads, count)}
+  };
+}
+
+int main(int argc, char* argv[]) {
+
+  auto options = parse_options(argc, argv);
+
+  std::unique_ptr<bench::StandInBroker> stand_in;
+
+  if (options.address.empty()) {
+    stand_in = std::make_unique<bench::StandInBroker>();
+    if (auto error = stand_in->start()) {
+      std::cerr << "capy_amqp_bench: stand-in error: " << error << std::endl;
+      return 1;
+    }
+    options.address = stand_in->get_address();
+  }
+
+  auto address = Address::From(options.address);
+
+  if (!address) {
+    std::cerr << "capy_amqp_bench: address error: " << address.error() << std::endl;
+    return 1;
+  }
+
+  capy::json report = {
+          {"suite", "capy_amqp_bench"},
+          {"version", CAPY_AMQP_VERSION},
+          {"broker", stand_in ? "stand-in" : options.address},
+          {"timestamp", static_cast<int64_t>(time(nullptr))},
+          {"hardware_concurrency", std::thread::hardware_concurrency()}
+  };
+
+  report["benchmarks"]["publish"]  = bench_publish(*address, options.publish_count);
+  report["benchmarks"]["fetch"]    = bench_fetch(*address, options.fetch_count);
+  report["benchmarks"]["listen"]   = bench_listen(*address, stand_in.get(), options.listen_count);
+  report["benchmarks"]["listen_batch"] = bench_listen_batch(*address, stand_in.get(), options.listen_count, options.batch);
+  report["benchmarks"]["transport"] = bench_transport(*address, stand_in.get(), options.listen_count);
+  report["benchmarks"]["inflight"] = bench_inflight(*address, stand_in.get(), options.inflight);
+  report["benchmarks"]["dispatch"] = bench_dispatch(options.dispatch);
+
+  if (options.output.empty()) {
+    std::cout << report.dump(2) << std::endl;
+  }
+  else {
+    std::ofstream(options.output) << report.dump(2) << std::endl;
+  }
+
+  if (!options.trace.empty()) {
+    std::ofstream(options.trace) << trace::to_chrome_json() << std::endl;
+  }
+
+  ///
+  /// broker loops are detached, leave them to the process exit
+  ///
+  std::cout.flush();
+  ::_exit(0);
+}
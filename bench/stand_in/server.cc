@@ -0,0 +1,1150 @@
+//
+// Created by denn nevera on 2019-07-15.
+//
+
+#include "server.h"
+#include "capy/amqp_broker.h"
+
+#include <uv.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace capy::amqp::bench {
+
+    ///
+    /// MARK: - wire protocol
+    ///
+
+    namespace frame {
+        static constexpr uint8_t method    = 1;
+        static constexpr uint8_t header    = 2;
+        static constexpr uint8_t body      = 3;
+        static constexpr uint8_t heartbeat = 8;
+        static constexpr uint8_t end       = 0xCE;
+    }
+
+    static constexpr uint32_t frame_max   = 131072;
+    static constexpr uint16_t channel_max = 2047;
+
+    constexpr uint32_t method_id(uint16_t class_id, uint16_t method) {
+      return (static_cast<uint32_t>(class_id) << 16) | method;
+    }
+
+    struct Reader {
+        const uint8_t* data;
+        size_t size;
+        size_t offset = 0;
+
+        Reader(const std::string& payload, size_t from = 0):
+                data(reinterpret_cast<const uint8_t*>(payload.data())), size(payload.size()), offset(from) {}
+
+        void need(size_t n) const {
+          if (offset + n > size) throw std::out_of_range("stand-in: frame is truncated");
+        }
+
+        uint8_t octet() { need(1); return data[offset++]; }
+
+        uint16_t short_uint() {
+          need(2);
+          uint16_t v = (uint16_t(data[offset]) << 8) | data[offset + 1];
+          offset += 2;
+          return v;
+        }
+
+        uint32_t long_uint() {
+          need(4);
+          uint32_t v = 0;
+          for (int i = 0; i < 4; ++i) v = (v << 8) | data[offset++];
+          return v;
+        }
+
+        uint64_t longlong_uint() {
+          need(8);
+          uint64_t v = 0;
+          for (int i = 0; i < 8; ++i) v = (v << 8) | data[offset++];
+          return v;
+        }
+
+        std::string shortstr() {
+          auto n = octet();
+          need(n);
+          std::string s(reinterpret_cast<const char*>(data + offset), n);
+          offset += n;
+          return s;
+        }
+
+        std::string longstr() {
+          auto n = long_uint();
+          need(n);
+          std::string s(reinterpret_cast<const char*>(data + offset), n);
+          offset += n;
+          return s;
+        }
+
+        void skip_table() {
+          auto n = long_uint();
+          need(n);
+          offset += n;
+        }
+    };
+
+    struct Writer {
+        std::string buffer;
+
+        Writer& octet(uint8_t v) { buffer.push_back(static_cast<char>(v)); return *this; }
+        Writer& short_uint(uint16_t v) { octet(v >> 8); return octet(v & 0xff); }
+        Writer& long_uint(uint32_t v) { for (int i = 3; i >= 0; --i) octet((v >> (i * 8)) & 0xff); return *this; }
+        Writer& longlong_uint(uint64_t v) { for (int i = 7; i >= 0; --i) octet((v >> (i * 8)) & 0xff); return *this; }
+        Writer& shortstr(const std::string& s) { octet(static_cast<uint8_t>(s.size())); buffer += s; return *this; }
+        Writer& longstr(const std::string& s) { long_uint(static_cast<uint32_t>(s.size())); buffer += s; return *this; }
+        Writer& raw(const std::string& s) { buffer += s; return *this; }
+    };
+
+    static std::string server_properties() {
+
+      Writer capabilities;
+      for (auto name: {"publisher_confirms", "consumer_cancel_notify", "basic.nack", "exchange_exchange_bindings"}) {
+        capabilities.shortstr(name).octet('t').octet(1);
+      }
+
+      Writer properties;
+      properties.shortstr("product").octet('S').longstr("capy-amqp-stand-in");
+      properties.shortstr("version").octet('S').longstr("0.9.1");
+      properties.shortstr("capabilities").octet('F').longstr(capabilities.buffer);
+
+      return Writer().longstr(properties.buffer).buffer;
+    }
+
+    static std::vector<std::string> split_words(const std::string& key) {
+      std::vector<std::string> words;
+      std::string word;
+      std::istringstream stream(key);
+      while (std::getline(stream, word, '.')) words.push_back(word);
+      return words;
+    }
+
+    static bool topic_match(const std::vector<std::string>& pattern, size_t p,
+                            const std::vector<std::string>& key, size_t k) {
+      if (p == pattern.size()) return k == key.size();
+
+      if (pattern[p] == "#") {
+        for (size_t i = k; i <= key.size(); ++i) {
+          if (topic_match(pattern, p + 1, key, i)) return true;
+        }
+        return false;
+      }
+
+      if (k == key.size()) return false;
+
+      if (pattern[p] == "*" || pattern[p] == key[k]) return topic_match(pattern, p + 1, key, k + 1);
+
+      return false;
+    }
+
+    ///
+    /// MARK: - broker state
+    ///
+
+    struct StoredMessage {
+        std::string exchange;
+        std::string routing_key;
+        std::string header;
+        std::string body;
+        bool redelivered = false;
+    };
+
+    using MessagePtr = std::shared_ptr<StoredMessage>;
+
+    struct ConnectionState;
+
+    struct Consumer {
+        ConnectionState* connection;
+        uint16_t channel;
+        std::string tag;
+        bool noack;
+    };
+
+    struct Queue {
+        std::string name;
+        bool exclusive = false;
+        bool auto_delete = false;
+        ConnectionState* owner = nullptr;
+        std::deque<MessagePtr> messages;
+        std::vector<Consumer> consumers;
+        size_t next_consumer = 0;
+    };
+
+    struct Binding {
+        std::string queue;
+        std::string key;
+    };
+
+    struct Exchange {
+        std::string type;
+        std::vector<Binding> bindings;
+    };
+
+    struct Unacked {
+        std::string queue;
+        MessagePtr message;
+    };
+
+    struct ChannelState {
+        uint16_t prefetch = 0;
+        uint64_t next_delivery_tag = 1;
+        std::map<uint64_t, Unacked> unacked;
+
+        bool tx = false;
+        std::vector<MessagePtr> tx_pending;
+
+        bool confirm = false;
+        uint64_t next_publish_seq = 1;
+
+        bool assembling = false;
+        bool closing = false;
+        uint64_t body_size = 0;
+        MessagePtr incoming;
+    };
+
+    struct ConnectionState {
+        uv_tcp_t handle;
+        StandInBrokerImpl* broker;
+        std::string input;
+        std::string output;
+        bool started = false;
+        bool closing = false;
+        size_t pending_writes = 0;
+        std::map<uint16_t, ChannelState> channels;
+    };
+
+    struct WriteRequest {
+        uv_write_t request;
+        std::string data;
+        ConnectionState* connection;
+    };
+
+    class StandInBrokerImpl {
+
+    public:
+
+        StandInBrokerImpl(const std::string& host, uint16_t port):
+                host_(host), port_(port) {
+
+          uv_loop_init(&loop_);
+
+          exchanges_["amq.topic"]  = Exchange{"topic", {}};
+          exchanges_["amq.direct"] = Exchange{"direct", {}};
+          exchanges_["amq.fanout"] = Exchange{"fanout", {}};
+        }
+
+        ~StandInBrokerImpl() {
+          stop();
+          uv_loop_close(&loop_);
+        }
+
+        Error start() {
+
+          struct sockaddr_in addr = {};
+
+          uv_ip4_addr(host_.c_str(), port_, &addr);
+
+          uv_tcp_init(&loop_, &server_);
+          server_.data = this;
+
+          if (auto code = uv_tcp_bind(&server_, reinterpret_cast<const struct sockaddr*>(&addr), 0)) {
+            return Error(BrokerError::CONNECTION, error_string("stand-in bind: %s", uv_strerror(code)));
+          }
+
+          if (auto code = uv_listen(reinterpret_cast<uv_stream_t*>(&server_), 128, on_connection)) {
+            return Error(BrokerError::CONNECTION, error_string("stand-in listen: %s", uv_strerror(code)));
+          }
+
+          struct sockaddr_storage bound = {};
+          int length = sizeof(bound);
+          uv_tcp_getsockname(&server_, reinterpret_cast<struct sockaddr*>(&bound), &length);
+          port_ = ntohs(reinterpret_cast<struct sockaddr_in*>(&bound)->sin_port);
+
+          uv_async_init(&loop_, &wakeup_, on_wakeup);
+          wakeup_.data = this;
+
+          thread_ = std::thread([this]{
+              uv_run(&loop_, UV_RUN_DEFAULT);
+          });
+
+          return Error(CommonError::OK);
+        }
+
+        void stop() {
+          if (!thread_.joinable()) return;
+
+          post([this]{
+              uv_walk(&loop_, [](uv_handle_t* handle, void* arg){
+                  auto broker = static_cast<StandInBrokerImpl*>(arg);
+                  if (uv_is_closing(handle)) return;
+                  if (handle->type == UV_TCP && handle != reinterpret_cast<uv_handle_t*>(&broker->server_)) {
+                    uv_close(handle, on_close_connection_handle);
+                  }
+                  else {
+                    uv_close(handle, nullptr);
+                  }
+              }, this);
+          });
+
+          thread_.join();
+        }
+
+        uint16_t get_port() const { return port_; }
+
+        const std::string& get_host() const { return host_; }
+
+        void post(const std::function<void()>& task) {
+          {
+            std::lock_guard lock(tasks_mutex_);
+            tasks_.push_back(task);
+          }
+          uv_async_send(&wakeup_);
+        }
+
+        void inject(const std::string& exchange, const std::string& routing_key, const std::string& body, size_t count) {
+          post([this, exchange, routing_key, body, count]{
+
+              Writer header;
+              header.short_uint(60).short_uint(0).longlong_uint(body.size()).short_uint(0);
+
+              for (size_t i = 0; i < count; ++i) {
+                auto message = std::make_shared<StoredMessage>();
+                message->exchange = exchange;
+                message->routing_key = routing_key;
+                message->header = header.buffer;
+                message->body = body;
+                route(message);
+              }
+          });
+        }
+
+        size_t get_queues_count() {
+          std::promise<size_t> count;
+          post([this, &count]{ count.set_value(queues_.size()); });
+          return count.get_future().get();
+        }
+
+    private:
+
+        std::string host_;
+        uint16_t port_;
+        uv_loop_t loop_;
+        uv_tcp_t server_;
+        uv_async_t wakeup_;
+        std::thread thread_;
+
+        std::mutex tasks_mutex_;
+        std::vector<std::function<void()>> tasks_;
+
+        std::map<std::string, Exchange> exchanges_;
+        std::map<std::string, Queue> queues_;
+        std::set<ConnectionState*> dirty_;
+        uint64_t generated_ = 0;
+
+        ///
+        /// MARK: - libuv callbacks
+        ///
+
+        static void on_wakeup(uv_async_t* handle) {
+          auto broker = static_cast<StandInBrokerImpl*>(handle->data);
+
+          std::vector<std::function<void()>> tasks;
+          {
+            std::lock_guard lock(broker->tasks_mutex_);
+            tasks.swap(broker->tasks_);
+          }
+
+          for (auto& task: tasks) task();
+
+          broker->flush();
+        }
+
+        static void on_connection(uv_stream_t* server, int status) {
+          if (status < 0) return;
+
+          auto broker = static_cast<StandInBrokerImpl*>(server->data);
+          auto connection = new ConnectionState();
+
+          connection->broker = broker;
+          uv_tcp_init(&broker->loop_, &connection->handle);
+          connection->handle.data = connection;
+
+          if (uv_accept(server, reinterpret_cast<uv_stream_t*>(&connection->handle)) != 0) {
+            uv_close(reinterpret_cast<uv_handle_t*>(&connection->handle), on_close_connection_handle);
+            return;
+          }
+
+          uv_tcp_nodelay(&connection->handle, 1);
+
+          uv_read_start(reinterpret_cast<uv_stream_t*>(&connection->handle),
+                        [](uv_handle_t*, size_t suggested, uv_buf_t* buf) {
+                            buf->base = static_cast<char*>(malloc(suggested));
+                            buf->len = suggested;
+                        },
+                        on_read);
+        }
+
+        static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+          auto connection = static_cast<ConnectionState*>(stream->data);
+          auto broker = connection->broker;
+
+          if (nread > 0) {
+            connection->input.append(buf->base, static_cast<size_t>(nread));
+            try {
+              broker->process(connection);
+            }
+            catch (std::exception&) {
+              broker->disconnect(connection);
+            }
+          }
+          else if (nread < 0) {
+            broker->disconnect(connection);
+          }
+
+          free(buf->base);
+
+          broker->flush();
+        }
+
+        static void on_close_connection_handle(uv_handle_t* handle) {
+          auto connection = static_cast<ConnectionState*>(handle->data);
+          connection->broker->forget(connection);
+          delete connection;
+        }
+
+        static void on_write(uv_write_t* request, int status) {
+          (void) status;
+          auto write = reinterpret_cast<WriteRequest*>(request);
+          auto connection = write->connection;
+
+          connection->pending_writes--;
+
+          if (connection->closing && connection->pending_writes == 0
+              && !uv_is_closing(reinterpret_cast<uv_handle_t*>(&connection->handle))) {
+            uv_close(reinterpret_cast<uv_handle_t*>(&connection->handle), on_close_connection_handle);
+          }
+
+          delete write;
+        }
+
+        ///
+        /// MARK: - output
+        ///
+
+        void flush() {
+          for (auto connection: dirty_) {
+            if (connection->output.empty()) continue;
+            if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&connection->handle))) continue;
+
+            auto write = new WriteRequest();
+            write->connection = connection;
+            write->data.swap(connection->output);
+
+            uv_buf_t buf = uv_buf_init(write->data.data(), static_cast<unsigned int>(write->data.size()));
+
+            connection->pending_writes++;
+            uv_write(&write->request, reinterpret_cast<uv_stream_t*>(&connection->handle), &buf, 1, on_write);
+          }
+          dirty_.clear();
+        }
+
+        void send_frame(ConnectionState* connection, uint8_t type, uint16_t channel, const std::string& payload) {
+          Writer frame;
+          frame.octet(type).short_uint(channel).long_uint(static_cast<uint32_t>(payload.size()))
+                  .raw(payload).octet(frame::end);
+          connection->output += frame.buffer;
+          dirty_.insert(connection);
+        }
+
+        void send_method(ConnectionState* connection, uint16_t channel, uint16_t class_id, uint16_t method,
+                         const Writer& arguments = Writer()) {
+          Writer payload;
+          payload.short_uint(class_id).short_uint(method).raw(arguments.buffer);
+          send_frame(connection, frame::method, channel, payload.buffer);
+        }
+
+        void send_content(ConnectionState* connection, uint16_t channel, const StoredMessage& message) {
+          send_frame(connection, frame::header, channel, message.header);
+
+          const size_t chunk = frame_max - 8;
+          for (size_t offset = 0; offset < message.body.size(); offset += chunk) {
+            send_frame(connection, frame::body, channel, message.body.substr(offset, chunk));
+          }
+        }
+
+        void channel_error(ConnectionState* connection, uint16_t channel, uint16_t code, const std::string& text,
+                           uint16_t class_id, uint16_t method) {
+          send_method(connection, channel, 20, 40,
+                      Writer().short_uint(code).shortstr(text).short_uint(class_id).short_uint(method));
+          connection->channels[channel].closing = true;
+        }
+
+        void connection_error(ConnectionState* connection, uint16_t code, const std::string& text,
+                              uint16_t class_id, uint16_t method) {
+          send_method(connection, 0, 10, 50,
+                      Writer().short_uint(code).shortstr(text).short_uint(class_id).short_uint(method));
+          connection->closing = true;
+        }
+
+        ///
+        /// MARK: - connection lifecycle
+        ///
+
+        void disconnect(ConnectionState* connection) {
+
+          for (auto& [id, channel]: connection->channels) {
+            release_channel(connection, id, channel);
+          }
+          connection->channels.clear();
+          connection->closing = true;
+
+          if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&connection->handle))) {
+            uv_close(reinterpret_cast<uv_handle_t*>(&connection->handle), on_close_connection_handle);
+          }
+        }
+
+        void forget(ConnectionState* connection) {
+
+          for (auto& [id, channel]: connection->channels) {
+            release_channel(connection, id, channel);
+          }
+          connection->channels.clear();
+
+          for (auto it = queues_.begin(); it != queues_.end();) {
+            if (it->second.owner == connection) it->second.owner = nullptr;
+            if (it->second.exclusive && !it->second.owner) it = queues_.erase(it);
+            else ++it;
+          }
+
+          dirty_.erase(connection);
+        }
+
+        void release_channel(ConnectionState* connection, uint16_t id, ChannelState& channel) {
+
+          std::set<std::string> touched;
+
+          for (auto& [tag, unacked]: channel.unacked) {
+            (void) tag;
+            auto queue = queues_.find(unacked.queue);
+            if (queue == queues_.end()) continue;
+            unacked.message->redelivered = true;
+            queue->second.messages.push_front(unacked.message);
+            touched.insert(unacked.queue);
+          }
+          channel.unacked.clear();
+
+          for (auto it = queues_.begin(); it != queues_.end();) {
+            auto& consumers = it->second.consumers;
+            auto size = consumers.size();
+
+            consumers.erase(std::remove_if(consumers.begin(), consumers.end(), [connection, id](const Consumer& c){
+                return c.connection == connection && c.channel == id;
+            }), consumers.end());
+
+            if (size != consumers.size() && consumers.empty() && it->second.auto_delete) {
+              touched.erase(it->first);
+              it = queues_.erase(it);
+            }
+            else {
+              ++it;
+            }
+          }
+
+          for (auto& name: touched) dispatch(name);
+        }
+
+        ///
+        /// MARK: - frames processing
+        ///
+
+        void process(ConnectionState* connection) {
+
+          if (!connection->started) {
+            if (connection->input.size() < 8) return;
+
+            if (connection->input.compare(0, 4, "AMQP") != 0) {
+              throw std::runtime_error("stand-in: protocol header is expected");
+            }
+
+            connection->input.erase(0, 8);
+            connection->started = true;
+
+            send_method(connection, 0, 10, 10,
+                        Writer().octet(0).octet(9).raw(server_properties()).longstr("PLAIN").longstr("en_US"));
+          }
+
+          size_t offset = 0;
+
+          while (connection->input.size() - offset >= 7) {
+
+            Reader head(connection->input, offset);
+
+            auto type = head.octet();
+            auto channel = head.short_uint();
+            auto size = head.long_uint();
+
+            if (connection->input.size() - offset < 8 + size) break;
+
+            if (static_cast<uint8_t>(connection->input[offset + 7 + size]) != frame::end) {
+              throw std::runtime_error("stand-in: frame end is expected");
+            }
+
+            std::string payload = connection->input.substr(offset + 7, size);
+            offset += 8 + size;
+
+            switch (type) {
+              case frame::method:
+                on_method(connection, channel, payload);
+                break;
+              case frame::header:
+                on_header(connection, channel, payload);
+                break;
+              case frame::body:
+                on_body(connection, channel, payload);
+                break;
+              case frame::heartbeat:
+                send_frame(connection, frame::heartbeat, 0, "");
+                break;
+              default:
+                throw std::runtime_error("stand-in: unknown frame type");
+            }
+
+            if (connection->closing) break;
+          }
+
+          connection->input.erase(0, offset);
+        }
+
+        void on_method(ConnectionState* connection, uint16_t channel_id, const std::string& payload) {
+
+          Reader args(payload);
+
+          auto class_id = args.short_uint();
+          auto method = args.short_uint();
+
+          if (channel_id != 0 && connection->channels.count(channel_id)
+              && connection->channels[channel_id].closing
+              && method_id(class_id, method) != method_id(20, 41)
+              && method_id(class_id, method) != method_id(20, 40)) {
+            ///
+            /// frames after channel.close are discarded until close-ok
+            ///
+            return;
+          }
+
+          auto& channel = connection->channels[channel_id];
+
+          switch (method_id(class_id, method)) {
+
+            ///
+            /// connection
+            ///
+
+            case method_id(10, 11): // start-ok
+              send_method(connection, 0, 10, 30,
+                          Writer().short_uint(channel_max).long_uint(frame_max).short_uint(0));
+              break;
+
+            case method_id(10, 31): // tune-ok
+              break;
+
+            case method_id(10, 40): // open
+              send_method(connection, 0, 10, 41, Writer().shortstr(""));
+              break;
+
+            case method_id(10, 50): // close
+              send_method(connection, 0, 10, 51);
+              for (auto& [id, state]: connection->channels) release_channel(connection, id, state);
+              connection->channels.clear();
+              connection->closing = true;
+              break;
+
+            case method_id(10, 51): // close-ok
+              disconnect(connection);
+              break;
+
+            ///
+            /// channel
+            ///
+
+            case method_id(20, 10): // open
+              channel = ChannelState();
+              send_method(connection, channel_id, 20, 11, Writer().longstr(""));
+              break;
+
+            case method_id(20, 40): // close
+              release_channel(connection, channel_id, channel);
+              connection->channels.erase(channel_id);
+              send_method(connection, channel_id, 20, 41);
+              break;
+
+            case method_id(20, 41): // close-ok
+              release_channel(connection, channel_id, channel);
+              connection->channels.erase(channel_id);
+              break;
+
+            ///
+            /// exchange
+            ///
+
+            case method_id(40, 10): { // declare
+              args.short_uint();
+              auto name = args.shortstr();
+              auto type = args.shortstr();
+              auto bits = args.octet();
+              args.skip_table();
+
+              if (!exchanges_.count(name)) {
+                if (bits & 0x01) {
+                  channel_error(connection, channel_id, 404, "NOT_FOUND - no exchange '" + name + "'", 40, 10);
+                  break;
+                }
+                exchanges_[name] = Exchange{type, {}};
+              }
+
+              if (!(bits & 0x10)) send_method(connection, channel_id, 40, 11);
+              break;
+            }
+
+            case method_id(40, 20): { // delete
+              args.short_uint();
+              auto name = args.shortstr();
+              auto bits = args.octet();
+              exchanges_.erase(name);
+              if (!(bits & 0x02)) send_method(connection, channel_id, 40, 21);
+              break;
+            }
+
+            ///
+            /// queue
+            ///
+
+            case method_id(50, 10): { // declare
+              args.short_uint();
+              auto name = args.shortstr();
+              auto bits = args.octet();
+              args.skip_table();
+
+              if (name.empty()) name = "amq.gen-" + std::to_string(++generated_);
+
+              auto found = queues_.find(name);
+
+              if (found == queues_.end()) {
+                if (bits & 0x01) {
+                  channel_error(connection, channel_id, 404, "NOT_FOUND - no queue '" + name + "'", 50, 10);
+                  break;
+                }
+                auto& queue = queues_[name];
+                queue.name = name;
+                queue.exclusive = bits & 0x04;
+                queue.auto_delete = bits & 0x08;
+                queue.owner = connection;
+                found = queues_.find(name);
+              }
+
+              if (!(bits & 0x10)) {
+                send_method(connection, channel_id, 50, 11,
+                            Writer().shortstr(name)
+                                    .long_uint(static_cast<uint32_t>(found->second.messages.size()))
+                                    .long_uint(static_cast<uint32_t>(found->second.consumers.size())));
+              }
+              break;
+            }
+
+            case method_id(50, 20): { // bind
+              args.short_uint();
+              auto queue = args.shortstr();
+              auto exchange = args.shortstr();
+              auto key = args.shortstr();
+              auto bits = args.octet();
+              args.skip_table();
+
+              if (!queues_.count(queue) || !exchanges_.count(exchange)) {
+                channel_error(connection, channel_id, 404, "NOT_FOUND - no queue or exchange", 50, 20);
+                break;
+              }
+
+              auto& bindings = exchanges_[exchange].bindings;
+              bool exists = std::any_of(bindings.begin(), bindings.end(), [&](const Binding& b){
+                  return b.queue == queue && b.key == key;
+              });
+              if (!exists) bindings.push_back(Binding{queue, key});
+
+              if (!(bits & 0x01)) send_method(connection, channel_id, 50, 21);
+              break;
+            }
+
+            case method_id(50, 50): { // unbind
+              args.short_uint();
+              auto queue = args.shortstr();
+              auto exchange = args.shortstr();
+              auto key = args.shortstr();
+
+              if (exchanges_.count(exchange)) {
+                auto& bindings = exchanges_[exchange].bindings;
+                bindings.erase(std::remove_if(bindings.begin(), bindings.end(), [&](const Binding& b){
+                    return b.queue == queue && b.key == key;
+                }), bindings.end());
+              }
+
+              send_method(connection, channel_id, 50, 51);
+              break;
+            }
+
+            case method_id(50, 30): { // purge
+              args.short_uint();
+              auto name = args.shortstr();
+              auto bits = args.octet();
+              uint32_t count = 0;
+              if (queues_.count(name)) {
+                count = static_cast<uint32_t>(queues_[name].messages.size());
+                queues_[name].messages.clear();
+              }
+              if (!(bits & 0x01)) send_method(connection, channel_id, 50, 31, Writer().long_uint(count));
+              break;
+            }
+
+            case method_id(50, 40): { // delete
+              args.short_uint();
+              auto name = args.shortstr();
+              auto bits = args.octet();
+              uint32_t count = 0;
+              if (queues_.count(name)) {
+                count = static_cast<uint32_t>(queues_[name].messages.size());
+                queues_.erase(name);
+              }
+              if (!(bits & 0x04)) send_method(connection, channel_id, 50, 41, Writer().long_uint(count));
+              break;
+            }
+
+            ///
+            /// basic
+            ///
+
+            case method_id(60, 10): { // qos
+              args.long_uint();
+              channel.prefetch = args.short_uint();
+              send_method(connection, channel_id, 60, 11);
+              break;
+            }
+
+            case method_id(60, 20): { // consume
+              args.short_uint();
+              auto queue = args.shortstr();
+              auto tag = args.shortstr();
+              auto bits = args.octet();
+              args.skip_table();
+
+              auto found = queues_.find(queue);
+
+              if (found == queues_.end()) {
+                channel_error(connection, channel_id, 404, "NOT_FOUND - no queue '" + queue + "'", 60, 20);
+                break;
+              }
+
+              if (tag.empty()) tag = "amq.ctag-" + std::to_string(++generated_);
+
+              found->second.consumers.push_back(Consumer{connection, channel_id, tag, (bits & 0x02) != 0});
+
+              if (!(bits & 0x08)) send_method(connection, channel_id, 60, 21, Writer().shortstr(tag));
+
+              dispatch(queue);
+              break;
+            }
+
+            case method_id(60, 30): { // cancel
+              auto tag = args.shortstr();
+              auto bits = args.octet();
+
+              for (auto it = queues_.begin(); it != queues_.end();) {
+                auto& consumers = it->second.consumers;
+                auto size = consumers.size();
+                consumers.erase(std::remove_if(consumers.begin(), consumers.end(), [&](const Consumer& c){
+                    return c.connection == connection && c.channel == channel_id && c.tag == tag;
+                }), consumers.end());
+
+                if (size != consumers.size() && consumers.empty() && it->second.auto_delete)
+                  it = queues_.erase(it);
+                else
+                  ++it;
+              }
+
+              if (!(bits & 0x01)) send_method(connection, channel_id, 60, 31, Writer().shortstr(tag));
+              break;
+            }
+
+            case method_id(60, 40): { // publish
+              args.short_uint();
+              channel.incoming = std::make_shared<StoredMessage>();
+              channel.incoming->exchange = args.shortstr();
+              channel.incoming->routing_key = args.shortstr();
+              channel.assembling = true;
+              channel.body_size = 0;
+              break;
+            }
+
+            case method_id(60, 80): { // ack
+              auto tag = args.longlong_uint();
+              auto multiple = (args.octet() & 0x01) != 0;
+              settle(channel, tag, multiple, false);
+              break;
+            }
+
+            case method_id(60, 90): { // reject
+              auto tag = args.longlong_uint();
+              auto requeue = (args.octet() & 0x01) != 0;
+              settle(channel, tag, false, requeue);
+              break;
+            }
+
+            case method_id(60, 120): { // nack
+              auto tag = args.longlong_uint();
+              auto bits = args.octet();
+              settle(channel, tag, (bits & 0x01) != 0, (bits & 0x02) != 0);
+              break;
+            }
+
+            ///
+            /// confirm
+            ///
+
+            case method_id(85, 10): { // select
+              auto bits = args.octet();
+              channel.confirm = true;
+              if (!(bits & 0x01)) send_method(connection, channel_id, 85, 11);
+              break;
+            }
+
+            ///
+            /// tx
+            ///
+
+            case method_id(90, 10): // select
+              channel.tx = true;
+              send_method(connection, channel_id, 90, 11);
+              break;
+
+            case method_id(90, 20): { // commit
+              auto pending = std::move(channel.tx_pending);
+              channel.tx_pending.clear();
+              for (auto& message: pending) route(message);
+              send_method(connection, channel_id, 90, 21);
+              break;
+            }
+
+            case method_id(90, 30): // rollback
+              channel.tx_pending.clear();
+              send_method(connection, channel_id, 90, 31);
+              break;
+
+            default:
+              connection_error(connection, 540, "NOT_IMPLEMENTED", class_id, method);
+              break;
+          }
+        }
+
+        void on_header(ConnectionState* connection, uint16_t channel_id, const std::string& payload) {
+          auto& channel = connection->channels[channel_id];
+
+          if (!channel.assembling) throw std::runtime_error("stand-in: unexpected content header");
+
+          Reader args(payload);
+          args.short_uint();
+          args.short_uint();
+          channel.body_size = args.longlong_uint();
+          channel.incoming->header = payload;
+
+          if (channel.body_size == 0) complete_publish(connection, channel_id, channel);
+        }
+
+        void on_body(ConnectionState* connection, uint16_t channel_id, const std::string& payload) {
+          auto& channel = connection->channels[channel_id];
+
+          if (!channel.assembling) throw std::runtime_error("stand-in: unexpected content body");
+
+          channel.incoming->body += payload;
+
+          if (channel.incoming->body.size() >= channel.body_size) complete_publish(connection, channel_id, channel);
+        }
+
+        void complete_publish(ConnectionState* connection, uint16_t channel_id, ChannelState& channel) {
+          auto message = channel.incoming;
+
+          channel.assembling = false;
+          channel.incoming = nullptr;
+
+          if (channel.tx) {
+            channel.tx_pending.push_back(message);
+          }
+          else {
+            route(message);
+          }
+
+          if (channel.confirm) {
+            send_method(connection, channel_id, 60, 80,
+                        Writer().longlong_uint(channel.next_publish_seq++).octet(0));
+          }
+        }
+
+        ///
+        /// MARK: - routing and delivering
+        ///
+
+        void route(const MessagePtr& message) {
+
+          std::set<std::string> targets;
+
+          if (message->exchange.empty()) {
+            if (queues_.count(message->routing_key)) targets.insert(message->routing_key);
+          }
+          else {
+            auto exchange = exchanges_.find(message->exchange);
+            if (exchange == exchanges_.end()) return;
+
+            auto key = split_words(message->routing_key);
+
+            for (auto& binding: exchange->second.bindings) {
+              bool match = false;
+
+              if (exchange->second.type == "fanout") {
+                match = true;
+              }
+              else if (exchange->second.type == "topic") {
+                match = topic_match(split_words(binding.key), 0, key, 0);
+              }
+              else {
+                match = binding.key == message->routing_key;
+              }
+
+              if (match) targets.insert(binding.queue);
+            }
+          }
+
+          for (auto& name: targets) {
+            auto queue = queues_.find(name);
+            if (queue == queues_.end()) continue;
+            queue->second.messages.push_back(message);
+            dispatch(name);
+          }
+        }
+
+        void dispatch(const std::string& name) {
+
+          auto found = queues_.find(name);
+          if (found == queues_.end()) return;
+
+          auto& queue = found->second;
+
+          while (!queue.messages.empty() && !queue.consumers.empty()) {
+
+            Consumer* consumer = nullptr;
+
+            for (size_t i = 0; i < queue.consumers.size(); ++i) {
+              auto& candidate = queue.consumers[(queue.next_consumer + i) % queue.consumers.size()];
+              auto& channel = candidate.connection->channels[candidate.channel];
+
+              if (candidate.noack || channel.prefetch == 0 || channel.unacked.size() < channel.prefetch) {
+                consumer = &candidate;
+                queue.next_consumer = (queue.next_consumer + i + 1) % queue.consumers.size();
+                break;
+              }
+            }
+
+            if (!consumer) break;
+
+            auto message = queue.messages.front();
+            queue.messages.pop_front();
+
+            auto& channel = consumer->connection->channels[consumer->channel];
+            auto tag = channel.next_delivery_tag++;
+
+            if (!consumer->noack) channel.unacked[tag] = Unacked{name, message};
+
+            send_method(consumer->connection, consumer->channel, 60, 60,
+                        Writer()
+                                .shortstr(consumer->tag)
+                                .longlong_uint(tag)
+                                .octet(message->redelivered ? 1 : 0)
+                                .shortstr(message->exchange)
+                                .shortstr(message->routing_key));
+
+            send_content(consumer->connection, consumer->channel, *message);
+          }
+        }
+
+        void settle(ChannelState& channel, uint64_t tag, bool multiple, bool requeue) {
+
+          std::set<std::string> touched;
+
+          auto last = multiple ? channel.unacked.upper_bound(tag) : channel.unacked.find(tag);
+          auto first = multiple ? channel.unacked.begin() : last;
+
+          if (!multiple) {
+            if (last == channel.unacked.end()) return;
+            ++last;
+          }
+
+          for (auto it = first; it != last; ++it) {
+            touched.insert(it->second.queue);
+            if (requeue) {
+              auto queue = queues_.find(it->second.queue);
+              if (queue != queues_.end()) {
+                it->second.message->redelivered = true;
+                queue->second.messages.push_front(it->second.message);
+              }
+            }
+          }
+
+          channel.unacked.erase(first, last);
+
+          for (auto& name: touched) dispatch(name);
+        }
+    };
+
+    ///
+    /// MARK: - interface
+    ///
+
+    StandInBroker::StandInBroker(const std::string& host, uint16_t port):
+            impl_(std::make_unique<StandInBrokerImpl>(host, port)) {}
+
+    StandInBroker::~StandInBroker() = default;
+
+    Error StandInBroker::start() {
+      return impl_->start();
+    }
+
+    void StandInBroker::stop() {
+      impl_->stop();
+    }
+
+    uint16_t StandInBroker::get_port() const {
+      return impl_->get_port();
+    }
+
+    std::string StandInBroker::get_address() const {
+      return "amqp://guest:guest@" + impl_->get_host() + ":" + std::to_string(impl_->get_port()) + "/";
+    }
+
+    void StandInBroker::inject(const std::string& exchange, const std::string& routing_key, const std::string& body, size_t count) {
+      impl_->inject(exchange, routing_key, body, count);
+    }
+
+    size_t StandInBroker::get_queues_count() {
+      return impl_->get_queues_count();
+    }
+}
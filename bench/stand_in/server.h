@@ -0,0 +1,80 @@
+//
+// Created by denn nevera on 2019-07-15.
+//
+
+#pragma once
+
+#include "capy/amqp_common.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace capy::amqp::bench {
+
+    class StandInBrokerImpl;
+
+    /**
+     * Minimal in-process AMQP 0-9-1 broker on libuv. It supports exchange/queue declaration, bindings,
+     * publishing, consuming, acks, transactions and publisher confirms, enough to drive the library
+     * without RabbitMQ. The broker runs its own loop thread.
+     */
+    class StandInBroker {
+
+    public:
+
+        /***
+         * Create stand-in broker
+         * @param host listening host
+         * @param port listening port, 0 to choose any free port
+         */
+        explicit StandInBroker(const std::string& host = "127.0.0.1", uint16_t port = 0);
+
+        StandInBroker(const StandInBroker&) = delete;
+        StandInBroker(StandInBroker&&) = delete;
+
+        ~StandInBroker();
+
+        /***
+         * Bind listening socket and start the loop thread
+         * @return error state
+         */
+        Error start();
+
+        /***
+         * Stop the loop thread and close all connections
+         */
+        void stop();
+
+        /***
+         * Get listening port
+         * @return port number
+         */
+        uint16_t get_port() const;
+
+        /***
+         * Get AMQP url of the broker
+         * @return url string
+         */
+        std::string get_address() const;
+
+        /***
+         * Publish messages from the broker side without a client connection
+         * @param exchange exchange name
+         * @param routing_key routing key
+         * @param body message body
+         * @param count copies count
+         */
+        void inject(const std::string& exchange, const std::string& routing_key, const std::string& body, size_t count = 1);
+
+        /***
+         * Get declared queues count, it is evaluated in the broker loop
+         * @return queues count
+         */
+        size_t get_queues_count();
+
+    private:
+        std::unique_ptr<StandInBrokerImpl> impl_;
+    };
+}
@@ -9,6 +9,10 @@
 #include "capy/amqp_address.h"
 #include "capy/amqp_broker.h"
 #include "capy/amqp_deferred.h"
+#include "capy/amqp_metrics.h"
+#include "capy/amqp_sharding.h"
+#include "capy/amqp_threads.h"
+#include "capy/amqp_trace.h"
 #include "capy/dispatchq.h"
 #include "dotenv/dotenv.h"
 
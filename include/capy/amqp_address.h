@@ -6,7 +6,11 @@
 
 #include <optional>
 #include <string>
+#include <string_view>
 #include <functional>
+#include <chrono>
+#include <memory>
+#include <vector>
 
 
 #include "capy/amqp_common.h"
@@ -64,14 +68,26 @@ namespace capy::amqp {
             unknown
         };
 
+        /**
+         * Cluster node
+         */
+        struct Node {
+            std::string hostname;
+            uint16_t port;
+        };
+
     public:
 
         /***
-         * Create new Address object from address string
+         * Create new Address object from address string:
+         * amqp[s]://[user:password@]host[:port][,host[:port]...][/vhost][?heartbeat=60&channel_max=0&frame_max=131072&connection_timeout=5000]
+         * User, password and vhost are percent-decoded, IPv6 host is enclosed in brackets.
+         * Comma separated hosts are nodes of the same cluster.
+         * Parsed addresses are interned, so the same address string is parsed once
          * @param address string
          * @return expected result or capy:Error
          */
-        static capy::Result<Address> From(const std::string &address);
+        static capy::Result<Address> From(std::string_view address);
 
         /**
          * Copy Address object
@@ -92,17 +108,23 @@ namespace capy::amqp {
         const Protocol get_protocol() const;
 
         /**
-         * Get host
+         * Get host, it is the first node of the cluster address
          * @return - host string
          */
         const std::string& get_hostname() const;
 
         /**
-         * Get port
+         * Get port of the first node
          * @return port number
          */
         const uint16_t get_port() const;
 
+        /**
+         * Get cluster nodes in the address order
+         * @return nodes list, it contains one node at least
+         */
+        const std::vector<Node>& get_nodes() const;
+
         /**
          * Get virtual host
          * @return port number
@@ -115,6 +137,32 @@ namespace capy::amqp {
          */
         const Login& get_login() const;
 
+        /**
+         * Get heartbeat timeout is requested by heartbeat query parameter
+         * @return seconds or nullopt if it is not set
+         */
+        std::optional<uint16_t> get_heartbeat() const;
+
+        /**
+         * Get channel_max query parameter
+         * @return max channels number or nullopt if it is not set
+         */
+        std::optional<uint16_t> get_channel_max() const;
+
+        /**
+         * Get frame_max query parameter. It is not applied by the broker:
+         * AMQP-CPP takes the frame size proposed by the server in connection.tune
+         * @return max frame size or nullopt if it is not set
+         */
+        std::optional<uint32_t> get_frame_max() const;
+
+        /**
+         * Get connection_timeout query parameter, it limits connecting and the AMQP handshake
+         * unless ConnectionOptions::connection_timeout is set
+         * @return timeout or nullopt if it is not set
+         */
+        std::optional<std::chrono::milliseconds> get_connection_timeout() const;
+
         /***
          * Destroy the object
          */
@@ -13,12 +13,16 @@
 #include <thread>
 #include <algorithm>
 #include <map>
+#include <chrono>
 
 #include "capy/dispatchq.h"
 #include "capy/amqp_common.h"
 #include "capy/amqp_address.h"
 #include "capy/amqp_expected.h"
 #include "capy/amqp_deferred.h"
+#include "capy/amqp_metrics.h"
+#include "capy/amqp_sharding.h"
+#include "capy/amqp_threads.h"
 
 namespace capy::amqp {
 
@@ -45,13 +49,45 @@ namespace capy::amqp {
         LISTENER_CONFLICT,
         EMPTY_REPLAY,
         DATA_RESPONSE,
+        NO_REPLAY,
+        SHUTDOWN,
+        SPOOL,
 
         LAST
     };
 
+    /**
+     * Broker worker threads pool
+     */
     class BrokerTaskQueue:public capy::dispatchq::Queue{
     public:
-        BrokerTaskQueue():Queue(std::max(std::thread::hardware_concurrency(),2u)){};
+
+        /***
+         * Configure worker threads, it must be called before the first task is dispatched by Task::Instance()
+         * @param size worker threads count, zero means hardware concurrency
+         * @param affinity worker threads placement
+         * @return error if the queue has been already created
+         */
+        static Error Configure(size_t size, const ThreadAffinity& affinity = ThreadAffinity());
+
+        /***
+         * Get workers placement error, the queue is created by the call if it has not been created yet
+         * @return error if the affinity is not applied to worker threads
+         */
+        static Error get_error();
+
+        BrokerTaskQueue();
+
+    private:
+
+        /***
+         * Worker threads inherit CPU set, name and memory policy of the creating thread,
+         * so the creating thread takes workers placement while the queue is constructed
+         * @return worker threads count
+         */
+        static size_t prepare_workers();
+
+        static void restore_creator();
     };
 
     class Task:public Singleton<BrokerTaskQueue>
@@ -61,6 +97,393 @@ namespace capy::amqp {
         Task(){};
     };
 
+    /**
+     * Scatter-gather fetching completion policy
+     */
+    struct FetchPolicy {
+
+        /**
+         * Completion condition
+         */
+        enum class Complete:int {
+            /**
+             * wait replies from all workers
+             */
+            all = 0,
+            /**
+             * wait the first k replies
+             */
+            first_k
+        };
+
+        /**
+         * Completion condition
+         */
+        Complete complete = Complete::all;
+
+        /**
+         * Replies quorum is used for Complete::first_k
+         */
+        size_t k = 0;
+
+        /**
+         * Gathering deadline, partial result is reported when it expires. Zero means no deadline
+         */
+        std::chrono::milliseconds deadline = std::chrono::milliseconds(0);
+
+        /***
+         * Wait all replies
+         * @param deadline gathering deadline
+         * @return policy
+         */
+        static FetchPolicy All(std::chrono::milliseconds deadline = std::chrono::milliseconds(0)) {
+          return FetchPolicy{Complete::all, 0, deadline};
+        }
+
+        /***
+         * Wait the first k replies
+         * @param k replies quorum
+         * @param deadline gathering deadline
+         * @return policy
+         */
+        static FetchPolicy FirstK(size_t k, std::chrono::milliseconds deadline = std::chrono::milliseconds(0)) {
+          return FetchPolicy{Complete::first_k, k, deadline};
+        }
+    };
+
+    /**
+     * Client cache of idempotent fetch replies
+     */
+    struct ReplyCaching {
+
+        /**
+         * Cached replies size limit, the least recently used replies are evicted. Zero disables caching
+         */
+        size_t max_bytes = 0;
+
+        /**
+         * Reply is fetched again when it is cached longer than ttl
+         */
+        std::chrono::milliseconds ttl = std::chrono::seconds(5);
+    };
+
+    /**
+     * Listener deduplication of redelivered and republished requests by message id
+     */
+    struct Deduplication {
+
+        /**
+         * Message ids are kept by the listener, zero disables deduplication
+         */
+        size_t capacity = 0;
+
+        /**
+         * Message id is forgotten when no duplicate is received during the window
+         */
+        std::chrono::milliseconds window = std::chrono::minutes(5);
+
+        /**
+         * Cached replays size limit, replays of least recently seen messages are dropped first
+         */
+        size_t max_replay_bytes = 16 * 1024 * 1024;
+    };
+
+    /**
+     * Listening consumers policy
+     */
+    struct ListenPolicy {
+
+        /**
+         * Consumers are started at once, every consumer has its own channel
+         */
+        size_t concurrency = 1;
+
+        /**
+         * Consumers count upper bound when scaling by queue depth, it is not less than concurrency
+         */
+        size_t max_concurrency = 1;
+
+        /**
+         * Unacknowledged deliveries per consumer, zero means unlimited
+         */
+        uint16_t prefetch = 0;
+
+        /**
+         * Queue depth per consumer: a consumer is added when the queue has more messages than
+         * depth_per_consumer * consumers, and removed when it has less
+         */
+        uint32_t depth_per_consumer = 1000;
+
+        /**
+         * Queue depth sampling interval, zero disables scaling
+         */
+        std::chrono::milliseconds scale_interval = std::chrono::milliseconds(1000);
+
+        /**
+         * Queue is declared with x-max-priority when it is not zero. Prefetched deliveries
+         * are handled by priority, the higher priority first
+         */
+        uint8_t max_priority = 0;
+
+        /**
+         * Duplicate requests are not passed to the handler, the cached replay is sent instead
+         * if it is still kept
+         */
+        Deduplication deduplication = Deduplication();
+
+        /***
+         * Fixed consumers count
+         * @param concurrency consumers count
+         * @param prefetch unacknowledged deliveries per consumer
+         * @return policy
+         */
+        static ListenPolicy Fixed(size_t concurrency, uint16_t prefetch = 0) {
+          return ListenPolicy{concurrency, concurrency, prefetch, 1000, std::chrono::milliseconds(0)};
+        }
+
+        /***
+         * Consumers count follows the queue depth
+         * @param concurrency minimal consumers count
+         * @param max_concurrency maximal consumers count
+         * @param prefetch unacknowledged deliveries per consumer
+         * @param depth_per_consumer queue depth is drained by one consumer
+         * @param scale_interval queue depth sampling interval
+         * @return policy
+         */
+        static ListenPolicy Scaled(size_t concurrency,
+                                   size_t max_concurrency,
+                                   uint16_t prefetch = 0,
+                                   uint32_t depth_per_consumer = 1000,
+                                   std::chrono::milliseconds scale_interval = std::chrono::milliseconds(1000)) {
+          return ListenPolicy{concurrency, max_concurrency, prefetch, depth_per_consumer, scale_interval};
+        }
+
+        /***
+         * Priority queue consumer
+         * @param max_priority queue maximal priority
+         * @param prefetch unacknowledged deliveries are reordered by priority
+         * @return policy
+         */
+        static ListenPolicy Prioritized(uint8_t max_priority, uint16_t prefetch = 0) {
+          return ListenPolicy{1, 1, prefetch, 1000, std::chrono::milliseconds(0), max_priority};
+        }
+    };
+
+    /**
+     * Large messages chunking options. Every frame is a separate AMQP message and it is acknowledged
+     * on receipt, so competing consumers in different processes get only some frames of the message
+     * and it is lost. Chunking is for queues consumed by a single process and receivers built with capy
+     */
+    struct Chunking {
+
+        /**
+         * Serialized messages larger than the threshold are split to frames, zero disables chunking.
+         * Chunking is disabled by default
+         */
+        size_t threshold = 0;
+
+        /**
+         * Frame size
+         */
+        size_t frame_size = 1024 * 1024;
+
+        /**
+         * Memory cap of partially assembled messages
+         */
+        size_t memory_cap = 256 * 1024 * 1024;
+    };
+
+    /**
+     * Payload compression options
+     */
+    struct Compression {
+
+        /**
+         * Compression codec, it is sent as message content-encoding
+         */
+        enum class Codec:int {
+            none = 0,
+            lz4,
+            zstd
+        };
+
+        /**
+         * Codec
+         */
+        Codec codec = Codec::none;
+
+        /**
+         * Serialized messages smaller than threshold are sent as is
+         */
+        size_t threshold = 1024;
+
+        /**
+         * Compression level, zero means codec default, higher level compresses more and slower.
+         * Positive LZ4 level selects LZ4 HC with the level up to 12, negative LZ4 level is
+         * the fast mode acceleration, as zstd negative levels
+         */
+        int level = 0;
+
+        /**
+         * Shared dictionary, receivers must use the same one
+         */
+        std::string dictionary;
+
+        /***
+         * LZ4 compression
+         * @param threshold compression threshold
+         * @param level zero is the fast mode, positive level is LZ4 HC level
+         * @return options
+         */
+        static Compression LZ4(size_t threshold = 1024, int level = 0) {
+          return Compression{Codec::lz4, threshold, level, ""};
+        }
+
+        /***
+         * Zstandard compression
+         * @param level compression level
+         * @param threshold compression threshold
+         * @return options
+         */
+        static Compression Zstd(int level = 3, size_t threshold = 1024) {
+          return Compression{Codec::zstd, threshold, level, ""};
+        }
+    };
+
+    /**
+     * Local disk spool of publishes while the broker is unreachable
+     */
+    struct Spooling {
+
+        /**
+         * Spool directory, empty directory disables spooling
+         */
+        std::string directory;
+
+        /**
+         * Memory-mapped segment file size, it limits the size of a spooled message
+         */
+        size_t segment_size = 16 * 1024 * 1024;
+
+        /**
+         * Disk usage limit of all segments, publishes are failed when it is reached
+         */
+        size_t max_bytes = 256 * 1024 * 1024;
+
+        /**
+         * Interval of draining retries after a failure
+         */
+        std::chrono::milliseconds retry_interval = std::chrono::seconds(1);
+    };
+
+    /**
+     * Connection and socket options
+     */
+    struct ConnectionOptions {
+
+        enum class Transport:int {
+            /**
+             * libuv TCP handle
+             */
+            libuv = 0,
+            /**
+             * io_uring with registered write buffers, multishot receive and batched submission.
+             * It is available on Linux if the library is built with liburing
+             */
+            io_uring
+        };
+
+        /**
+         * Socket I/O backend
+         */
+        Transport transport = Transport::libuv;
+
+        /**
+         * Max channels opened on one connection, the next connection is opened when it is reached.
+         * Zero means channel_max parameter of the address or no limit
+         */
+        uint16_t channel_max = 0;
+
+        /**
+         * Disable Nagle's algorithm
+         */
+        bool tcp_nodelay = true;
+
+        /**
+         * SO_SNDBUF size, zero keeps the system default
+         */
+        int send_buffer = 0;
+
+        /**
+         * SO_RCVBUF size, zero keeps the system default
+         */
+        int receive_buffer = 0;
+
+        /**
+         * TCP keepalive idle time, zero disables keepalive probes
+         */
+        std::chrono::seconds keepalive = std::chrono::seconds(0);
+
+        /**
+         * Time to connect the socket and complete the AMQP handshake, the connection is lost when it expires.
+         * Zero means connection_timeout parameter of the address or no limit
+         */
+        std::chrono::milliseconds connection_timeout = std::chrono::milliseconds(0);
+    };
+
+    /**
+     * Cluster node selection of new connections
+     */
+    struct NodeSelection {
+
+        enum class Policy:int {
+            /**
+             * Node with the lowest handshake RTT
+             */
+            fastest = 0,
+            /**
+             * Node with the fewest connections, handshake RTT breaks ties
+             */
+            balanced
+        };
+
+        Policy policy = Policy::balanced;
+
+        /**
+         * Failed node is not selected during the interval, then it is probed by the next connection
+         */
+        std::chrono::milliseconds retry_after = std::chrono::seconds(5);
+
+        /**
+         * Move connections of overloaded nodes to the recovered node, channels opened on
+         * the moved connection are kept until they are closed. It is applied by balanced policy
+         */
+        bool rebalance = true;
+    };
+
+    /**
+     * Cluster node state
+     */
+    struct NodeState {
+        std::string hostname;
+        uint16_t port = 0;
+
+        /**
+         * Smoothed handshake round trip, zero if the node has not been connected yet
+         */
+        std::chrono::microseconds rtt = std::chrono::microseconds(0);
+
+        /**
+         * Open connections count
+         */
+        size_t connections = 0;
+
+        /**
+         * Node is not excluded by recent failure
+         */
+        bool available = true;
+    };
+
     class BrokerImpl;
 
     /**
@@ -96,6 +519,23 @@ namespace capy::amqp {
                 uint16_t heartbeat_timeout,
                 const ErrorHandler& on_error);
 
+        /***
+         * Bind broker with connection options
+         *
+         * @param address AMQP address
+         * @param exchange_name exchange name
+         * @param heartbeat_timeout heartbeat timeout, heartbeat parameter of the address takes precedence
+         * @param options connection and socket options are applied to every connection
+         * @param on_error exchange declaration error handler
+         * @return expected Broker object or Error report
+         */
+        static Result <Broker> Bind(
+                const Address& address,
+                const std::string& exchange_name,
+                uint16_t heartbeat_timeout,
+                const ConnectionOptions& options,
+                const ErrorHandler& on_error);
+
         static Result <Broker> Bind(
                 const Address& address,
                 const std::string& exchange_name){
@@ -123,9 +563,13 @@ namespace capy::amqp {
          * Publish message with routing key and exit
          * @param message object message
          * @param routing_key routing key is listened by consumers or workers
+         * @param priority message priority, it is used by queues declared with x-max-priority
+         * @param message_id idempotency key, listeners skip retried publishes with the same id.
+         *                   A unique id is generated when it is empty
          * @return error object if some fails occurred
          */
-        Error publish(const json& message, const std::string& routing_key);
+        Error publish(const json& message, const std::string& routing_key, uint8_t priority = 0,
+                      const std::string& message_id = "");
 
         /***
          *
@@ -133,10 +577,51 @@ namespace capy::amqp {
          *
          * @param message request actions with payload
          * @param routing_key routing key
-         * @param on_data messaging handling
+         * @param priority request priority, it is used by queues declared with x-max-priority
+         * @param message_id idempotency key, listeners replay the kept reply to retried requests with the same id.
+         *                   A unique id is generated when it is empty
          * @return error or ok
          */
-        DeferredFetch& fetch(const json& message, const std::string& routing_key);
+        DeferredFetch& fetch(const json& message, const std::string& routing_key, uint8_t priority = 0,
+                             const std::string& message_id = "");
+
+        /***
+         *
+         * Request message and receive streaming replay sent by Replay::send_chunk()
+         *
+         * @param message request actions with payload
+         * @param routing_key routing key
+         * @return deferred chunks, on_data is called for every chunk in order, on_finalize at the end of stream
+         */
+        DeferredFetch& fetch_stream(const json& message, const std::string& routing_key);
+
+        /***
+         *
+         * Request message of idempotent action and fetch result through the reply cache. Cached reply
+         * is reported without publishing, identical requests in flight share the single broker request.
+         * The request is started by seal() of the returned deferred, so handlers must be set before it.
+         * It is the same when caching is disabled. A fetch that is not sealed is never sent, it is kept
+         * as outstanding until the broker is shut down
+         *
+         * @param message request actions with payload
+         * @param routing_key routing key
+         * @param priority request priority, it is used by queues declared with x-max-priority
+         * @return deferred reply, it is reported by the loop thread
+         */
+        DeferredFetch& fetch_cached(const json& message, const std::string& routing_key, uint8_t priority = 0);
+
+        /***
+         *
+         * Scatter the same request to many workers and gather their replies through the single reply queue
+         *
+         * @param message request actions with payload
+         * @param routing_keys routing keys of workers
+         * @param policy completion policy
+         * @return deferred replies ordered as routing keys, missed replies contain BrokerError::NO_REPLAY
+         */
+        DeferredFetchMany& fetch_many(const json& message,
+                                      const std::vector<std::string>& routing_keys,
+                                      const FetchPolicy& policy = FetchPolicy());
 
         /**
          * Listen queue bound list of certain topic keys
@@ -146,9 +631,166 @@ namespace capy::amqp {
          */
         DeferredListen& listen(const std::string& queue, const std::vector<std::string>& keys);
 
+        /**
+         * Listen queue by many consumers on their own channels
+         * @param queue queue name
+         * @param keys topic keys
+         * @param policy consumers count, prefetch and scaling by queue depth
+         */
+        DeferredListen& listen(const std::string& queue, const std::vector<std::string>& keys, const ListenPolicy& policy);
+
+        /**
+         * Listen queue and handle requests in batches. Deliveries are acknowledged by the single multiple ack
+         * when all replays of the batch are committed
+         * @param queue queue name
+         * @param keys topic keys
+         * @param max_batch batch is handled when it has max_batch requests
+         * @param max_wait or when max_wait expires since its first request
+         * @param policy queue arguments, such as max_priority, must be the same as other listeners of the queue
+         *               declare. Consumers count and prefetch are not used, the batch bounds prefetch
+         */
+        DeferredListenBatch& listen_batch(const std::string& queue,
+                                          const std::vector<std::string>& keys,
+                                          size_t max_batch,
+                                          std::chrono::milliseconds max_wait,
+                                          const ListenPolicy& policy = ListenPolicy());
+
+        /**
+         * Listen range of shards, the queue is bound to routing keys <prefix>.<shard> of the range.
+         * Bindings of the previously claimed shards are not removed, use the queue per range
+         * @param queue queue name
+         * @param prefix shards routing key prefix
+         * @param shards shards count
+         * @param range claimed shards, see ShardRange::Claim(...)
+         * @param policy consumers policy
+         */
+        DeferredListen& listen_shards(const std::string& queue,
+                                      const std::string& prefix,
+                                      uint32_t shards,
+                                      const ShardRange& range,
+                                      const ListenPolicy& policy = ListenPolicy());
+
+        /***
+         * Get shard map, it is cached by the prefix and rebuilt when shards count changes
+         * @param prefix shards routing key prefix
+         * @param shards shards count
+         * @return shard map
+         */
+        std::shared_ptr<const ShardMap> shard_map(const std::string& prefix, uint32_t shards);
+
+        /***
+         * Map entity key to the shard routing key by consistent hashing
+         * @param prefix shards routing key prefix
+         * @param shards shards count
+         * @param key entity key
+         * @return routing key <prefix>.<shard>
+         */
+        std::string shard_routing_key(const std::string& prefix, uint32_t shards, const std::string& key);
+
+
+        /***
+         * Get queue statistics by passive declaration on the control channel. The call blocks until
+         * the declaration is confirmed or the control channel timeout expires, so it can not be called
+         * by listen and fetch handlers unless the statistics are cached: use sample_queue() there
+         * @param queue queue name
+         * @param ttl statistics younger than ttl are taken from the cache
+         * @return queue statistics, error if the queue does not exist or CommonError::NOT_SUPPORTED
+         *         if it is called by the loop thread
+         */
+        Result<QueueStats> queue_stats(const std::string& queue,
+                                       std::chrono::milliseconds ttl = std::chrono::milliseconds(1000));
+
+        /***
+         * Sample queue statistics periodically, on_data is called with the rate of change of every sample
+         * @param queue queue name
+         * @param interval sampling interval
+         * @return deferred samples
+         */
+        DeferredQueueStats& sample_queue(const std::string& queue, std::chrono::milliseconds interval);
+
+        /***
+         * Stop queue statistics sampling
+         * @param queue queue name
+         */
+        void stop_sampling(const std::string& queue);
+
+        /***
+         * Enable large messages chunking, messages are not chunked by default.
+         * Frames of the message must be consumed by the same process, so do not enable it
+         * for queues are listened by many worker processes
+         * @param chunking options
+         */
+        void set_chunking(const Chunking& chunking);
+
+        /***
+         * Set payload compression of published messages and replays. Received messages are decompressed
+         * according to their content-encoding regardless of the options
+         * @param compression options
+         * @return error if the codec is not supported by the build
+         */
+        Error set_compression(const Compression& compression);
+
+        /***
+         * Enable local disk spool. Messages published while the broker is unreachable are appended
+         * to the spool and the call succeeds, spooled messages are republished in order with publisher
+         * confirms when the connection is restored. Messages are published after the spool is drained
+         * @param spooling options, empty directory disables spooling
+         * @return error if the spool directory can not be opened
+         */
+        Error set_spooling(const Spooling& spooling);
+
+        /***
+         * Set reply cache of fetch_cached(), replies cached before are dropped
+         * @param caching options, zero max bytes disables caching
+         */
+        void set_reply_caching(const ReplyCaching& caching);
+
+        /***
+         * Set cluster node selection of new connections
+         * @param selection options
+         */
+        void set_node_selection(const NodeSelection& selection);
+
+        /***
+         * Get cluster nodes state
+         * @return nodes in the address order
+         */
+        std::vector<NodeState> get_nodes() const;
+
+        /***
+         * Set leader nodes of quorum queues. Consumers of the queue listened after are connected
+         * to its leader node, so deliveries skip the intra-cluster hop. Unknown or failed
+         * leader node falls back to the node selection
+         * @param leaders queue name to node host or host:port of the address
+         */
+        void set_queue_leaders(const std::map<std::string, std::string>& leaders);
 
         void run(const Launch launch = Launch::async);
 
+        /***
+         * Run broker loop in the thread with affinity
+         * @param launch launching type, sync loop applies affinity to the current thread
+         * @param affinity loop thread placement, per-loop buffers are allocated on its NUMA node
+         * @return error if affinity of the loop or of BrokerTaskQueue workers is not applied,
+         *         the loop is started anyway
+         */
+        Error run(const Launch launch, const ThreadAffinity& affinity);
+
+        /***
+         * Stop the broker gracefully. Consumers are cancelled, prefetched requests are still handled,
+         * then it waits for replays and fetches are in flight, closes channels and connections,
+         * stops the loop and joins the loop thread. It must not be called by the loop thread
+         * @param deadline in-flight draining timeout, connections are closed anyway when it expires
+         * @return BrokerError::SHUTDOWN if replays or fetches are not completed before the deadline
+         */
+        Error shutdown(std::chrono::milliseconds deadline = std::chrono::seconds(5));
+
+        /***
+         * Current broker metrics
+         * @return metrics snapshot, use capy::amqp::to_prometheus(...) to export them
+         */
+        MetricsSnapshot get_metrics();
+
     protected:
         Broker();
         Broker(const std::shared_ptr<BrokerImpl>& impl);
@@ -265,6 +265,25 @@ namespace capy {
 
         };
 
+        /**
+         * Get snapshot of the keys
+         *
+         * @retval keys of not expired values
+         */
+        std::vector<Key> keys() {
+
+          std::vector<Key> keys;
+
+          for (auto shard: this->shards) {
+            std::scoped_lock lock(*shard->guard);
+            for (auto& item: shard->map) {
+              if (!item.second->expired()) keys.push_back(item.first);
+            }
+          }
+
+          return keys;
+        }
+
         size_t flush() {
           size_t count = 0;
           for(auto shard: this->shards) {
@@ -7,6 +7,8 @@
 #include <iostream>
 #include <exception>
 #include <optional>
+#include <vector>
+#include <chrono>
 
 #include "capy/amqp_expected.h"
 #include "capy/amqp_cache.h"
@@ -155,6 +157,26 @@ namespace capy::amqp {
          */
         std::string routing_key;
 
+        /**
+         * W3C trace context of the request, empty if the publisher did not send it
+         */
+        std::string traceparent;
+
+        /**
+         * Time the request waited in the broker: receiving time versus publishing timestamp, zero if unknown
+         */
+        std::chrono::microseconds queueing_delay = std::chrono::microseconds(0);
+
+        /**
+         * Request priority, zero if the publisher did not set it
+         */
+        uint8_t priority = 0;
+
+        /**
+         * Message id of the request is kept by republishing, empty if the publisher did not set it
+         */
+        std::string message_id;
+
         Rpc() = default;
         Rpc(const Rpc&) = default;
         Rpc(const std::string& key, const capy::json& message):PayloadContainer(message), routing_key(key){};
@@ -165,11 +187,46 @@ namespace capy::amqp {
      */
     typedef Result<json> Payload;
 
+    /**
+     * Expected scatter-gather fetching responses, ordered as requested routing keys
+     */
+    typedef std::vector<Payload> Payloads;
+
     /**
      * Expected listening request data type. Contains json-like structure of action key and routing key of queue
      */
     typedef Result<Rpc> Request;
 
+    /**
+     * Queue statistics are reported by passive queue declaration
+     */
+    struct QueueStats {
+        /**
+         * Queue name
+         */
+        std::string queue;
+
+        /**
+         * Ready messages count
+         */
+        uint32_t message_count = 0;
+
+        /**
+         * Active consumers count
+         */
+        uint32_t consumer_count = 0;
+
+        /**
+         * Messages count rate of change per second since the previous sample, positive when backlog grows
+         */
+        double message_rate = 0;
+
+        /**
+         * Sampling time
+         */
+        std::chrono::steady_clock::time_point sampled_at;
+    };
+
     /**
     * Replay data container
     */
@@ -199,10 +256,17 @@ namespace capy::amqp {
         Replay(Replay&&) = default;
 
         /**
-         * Commit replay and send message to queue
+         * Commit replay and send message to queue. After send_chunk() it sends the last chunk
+         * and the end of stream marker, the message may be empty then
          */
         virtual void commit() = 0;
 
+        /**
+         * Send message as the next chunk of streaming replay and clear it, the stream is finished by commit().
+         * Chunks are received by Broker::fetch_stream(...)
+         */
+        virtual void send_chunk() = 0;
+
         /**
          * Destroy replay object
          */
@@ -214,6 +278,38 @@ namespace capy::amqp {
         virtual void on_complete(const Handler&) = 0;
     };
 
+    /**
+     * Non-owning view of contiguous objects
+     * @tparam T object type
+     */
+    template<class T>
+    class Span {
+    public:
+        Span():data_(nullptr), size_(0) {}
+        Span(T* data, size_t size):data_(data), size_(size) {}
+
+        T* begin() const { return data_; }
+        T* end() const { return data_ + size_; }
+        T& operator[](size_t index) const { return data_[index]; }
+        T* data() const { return data_; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+    private:
+        T* data_;
+        size_t size_;
+    };
+
+    /**
+     * Batch of listening requests
+     */
+    typedef Span<const Request> Requests;
+
+    /**
+     * Replays of the requests batch, ordered as requests
+     */
+    typedef Span<Replay* const> Replays;
+
     /***
      * Common error codes
      */
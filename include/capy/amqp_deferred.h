@@ -4,6 +4,7 @@
 
 #pragma once
 #include "capy/amqp_common.h"
+#include "capy/amqp_function.h"
 #include "capy/dispatchq.h"
 
 #include <functional>
@@ -18,8 +19,24 @@ namespace capy::amqp {
 
     class Channel;
 
+    namespace detail {
+
+        /***
+         * Deferred objects are dispatching events by the thread, the innermost is on the top
+         */
+        struct DispatchFrame {
+            const void* owner;
+            const DispatchFrame* previous;
+        };
+
+        inline thread_local const DispatchFrame* dispatching = nullptr;
+    }
+
     /***
-     * Deferred handlers object
+     * Deferred handlers object. Handlers are guarded by the lock until the object is sealed,
+     * sealed object dispatches events without locking and ignores new handlers.
+     * Handlers of the unsealed object can not be set by its own handlers: such registration is
+     * rejected and reported to the error handler, seal() is allowed
      * @tparam Types
      */
     template<class ... Types>
@@ -48,7 +65,10 @@ namespace capy::amqp {
          * @param error - error state
          */
         Deferred(const Error &error = Error(CommonError::OK)):
-                error_(error) {}
+                error_(error),
+                failed_(false),
+                error_pending_(static_cast<bool>(error)),
+                sealed_(false) {}
 
         /***
          * Copy constructor
@@ -68,7 +88,7 @@ namespace capy::amqp {
          * @return true or false
          */
         operator bool() const {
-          return !failed_;
+          return !failed_.load(std::memory_order_relaxed);
         }
 
         /**
@@ -81,8 +101,9 @@ namespace capy::amqp {
          * @return the object
          */
         const Deferred &report_data(Types... parameters) const {
-          std::shared_lock lock(mutex_);
-          if (*this && data_handler_) data_handler_.value()(parameters...);
+          dispatch([&]{
+              if (*this && data_handler_) data_handler_(parameters...);
+          });
           return *this;
         }
 
@@ -91,9 +112,10 @@ namespace capy::amqp {
          * @return the object
          */
         const Deferred &report_success() {
-          std::shared_lock lock(mutex_);
-          failed_ = false;
-          if (success_handler_) success_handler_.value()();
+          dispatch([this]{
+              failed_.store(false, std::memory_order_relaxed);
+              if (success_handler_) success_handler_();
+          });
           return *this;
         }
 
@@ -103,13 +125,13 @@ namespace capy::amqp {
          * @return the object
          */
         const Deferred &report_error(const Error &error) {
-          std::shared_lock lock(mutex_);
-          error_ = error;
-          if (error_) {
-            failed_ = true;
-            if (error_handler_) error_handler_.value()(error_);
-            error_ = Error(CommonError::OK);
-          }
+          dispatch([this, &error]{
+              error_pending_.store(false, std::memory_order_relaxed);
+              if (error) {
+                failed_.store(true, std::memory_order_relaxed);
+                if (error_handler_) error_handler_(error);
+              }
+          });
           return *this;
         }
 
@@ -118,8 +140,9 @@ namespace capy::amqp {
          * @param callback
          * @return the object
          */
-        Deferred &on_data(const DataHandler &callback) {
-          data_handler_ = callback;
+        template<class Callback>
+        Deferred &on_data(Callback&& callback) {
+          assign(data_handler_, std::forward<Callback>(callback));
           return *this;
         }
 
@@ -128,8 +151,9 @@ namespace capy::amqp {
          * @param callback
          * @return the object
          */
-        Deferred &on_success(const SuccessHandler &callback) {
-          success_handler_ = callback;
+        template<class Callback>
+        Deferred &on_success(Callback&& callback) {
+          assign(success_handler_, std::forward<Callback>(callback));
           return *this;
         }
 
@@ -138,8 +162,9 @@ namespace capy::amqp {
          * @param callback
          * @return the object
          */
-        Deferred &on_error(const ErrorHandler &callback) {
-          error_handler_ = callback;
+        template<class Callback>
+        Deferred &on_error(Callback&& callback) {
+          assign(error_handler_, std::forward<Callback>(callback));
           return *this;
         }
 
@@ -148,30 +173,104 @@ namespace capy::amqp {
          * @param callback
          * @return the object
          */
-        Deferred &on_finalize(const FinalizeHandler &callback) {
-          finalize_handler_ = callback;
+        template<class Callback>
+        Deferred &on_finalize(Callback&& callback) {
+          assign(finalize_handler_, std::forward<Callback>(callback));
           return *this;
         }
 
+        /***
+         * Complete handlers registration, events are dispatched without locking since then
+         * @return the object
+         */
+        Deferred &seal() {
+          if (is_dispatching()) {
+            ///
+            /// Handlers are not changed while the lock is shared by the dispatching thread
+            ///
+            if (sealed_.exchange(true, std::memory_order_acq_rel)) return *this;
+          }
+          else {
+            std::unique_lock lock(mutex_);
+            if (sealed_.exchange(true, std::memory_order_acq_rel)) return *this;
+          }
+          on_sealed();
+          return *this;
+        }
+
+        /***
+         * Check handlers registration is completed
+         * @return true if the object is sealed
+         */
+        bool is_sealed() const {
+          return sealed_.load(std::memory_order_acquire);
+        }
+
         /**
         *  Destructor
         */
         virtual ~Deferred() {
-          if (error_ && error_handler_) error_handler_.value()(error_);
-          if (finalize_handler_) finalize_handler_.value()();
+          if (error_pending_ && error_ && error_handler_) error_handler_(error_);
+          if (finalize_handler_) finalize_handler_();
           reset();
         }
 
     protected:
-        std::optional<DataHandler>     data_handler_     = std::nullopt;
-        std::optional<SuccessHandler>  success_handler_  = std::nullopt;
-        std::optional<ErrorHandler>    error_handler_    = std::nullopt;
-        std::optional<FinalizeHandler> finalize_handler_ = std::nullopt;
+        SmallFunction<void(Types...)>        data_handler_;
+        SmallFunction<void()>                success_handler_;
+        SmallFunction<void(const Error &)>   error_handler_;
+        SmallFunction<void()>                finalize_handler_;
+
+        /***
+         * Handlers registration is completed, it is called once by seal() without the lock
+         */
+        virtual void on_sealed() {}
 
     private:
         mutable std::shared_mutex mutex_;
         Error error_;
-        bool failed_;
+        std::atomic_bool failed_;
+        std::atomic_bool error_pending_;
+        std::atomic_bool sealed_;
+
+        template<class Dispatcher>
+        void dispatch(const Dispatcher &dispatcher) const {
+          if (sealed_.load(std::memory_order_acquire)) {
+            dispatcher();
+            return;
+          }
+          std::shared_lock lock(mutex_);
+
+          struct Guard {
+              detail::DispatchFrame frame;
+              explicit Guard(const void* owner): frame{owner, detail::dispatching} { detail::dispatching = &frame; }
+              ~Guard() { detail::dispatching = frame.previous; }
+          } guard(this);
+
+          dispatcher();
+        }
+
+        bool is_dispatching() const {
+          for (auto frame = detail::dispatching; frame; frame = frame->previous) {
+            if (frame->owner == this) return true;
+          }
+          return false;
+        }
+
+        template<class Handler, class Callback>
+        void assign(Handler &handler, Callback&& callback) {
+          if (sealed_.load(std::memory_order_acquire)) return;
+          if (is_dispatching()) {
+            ///
+            /// The running handler holds the shared lock, it can not be taken exclusively
+            ///
+            if (error_handler_) error_handler_(Error(CommonError::NOT_SUPPORTED, "handler can not be set by the handler"));
+            return;
+          }
+          std::unique_lock lock(mutex_);
+          if (sealed_.load(std::memory_order_relaxed)) return;
+          handler = Handler(std::forward<Callback>(callback));
+        }
 
         void reset(){
           data_handler_.reset();
@@ -190,4 +289,19 @@ namespace capy::amqp {
     * Listener handling action request and replies
     */
     using DeferredListen = Deferred<const Request&, Replay*>;
+
+    /***
+    * Listener handling batches of requests and their replies
+    */
+    using DeferredListenBatch = Deferred<const Requests&, const Replays&>;
+
+    /***
+    * Scatter-gather fetcher handling replies collected from many workers
+    */
+    using DeferredFetchMany = Deferred<const Payloads&>;
+
+    /***
+    * Periodic queue statistics sampler
+    */
+    using DeferredQueueStats = Deferred<const QueueStats&>;
 }
\ No newline at end of file
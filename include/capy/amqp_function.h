@@ -0,0 +1,163 @@
+//
+// Created by denn nevera on 2019-07-18.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace capy::amqp {
+
+    template<class Signature, size_t Capacity = 56>
+    class SmallFunction;
+
+    /***
+     * Move-only callable wrapper with inline storage. Callables fit the buffer are stored
+     * without heap allocation, the larger ones are allocated on heap
+     * @tparam R result type
+     * @tparam Args arguments
+     * @tparam Capacity inline buffer size
+     */
+    template<class R, class ... Args, size_t Capacity>
+    class SmallFunction<R(Args...), Capacity> {
+
+        template<class F>
+        struct is_nullable: std::false_type {};
+
+        template<class Signature>
+        struct is_nullable<std::function<Signature>>: std::true_type {};
+
+        template<class F>
+        struct is_nullable<F*>: std::true_type {};
+
+    public:
+
+        /***
+         * Callable is stored without heap allocation
+         * @tparam F callable type
+         */
+        template<class F>
+        static constexpr bool is_inline =
+                sizeof(F) <= Capacity
+                && alignof(F) <= alignof(std::max_align_t)
+                && std::is_nothrow_move_constructible_v<F>;
+
+        SmallFunction() noexcept = default;
+
+        SmallFunction(std::nullptr_t) noexcept {}
+
+        template<class F,
+                class D = std::decay_t<F>,
+                class = std::enable_if_t<!std::is_same_v<D, SmallFunction> && std::is_invocable_r_v<R, D&, Args...>>>
+        SmallFunction(F&& callable) {
+
+          if constexpr (is_nullable<D>::value) {
+            if (!callable) return;
+          }
+
+          if constexpr (is_inline<D>) {
+            new (buffer_) D(std::forward<F>(callable));
+            ops_ = &inline_ops<D>;
+          }
+          else {
+            *reinterpret_cast<D**>(buffer_) = new D(std::forward<F>(callable));
+            ops_ = &heap_ops<D>;
+          }
+        }
+
+        SmallFunction(SmallFunction&& that) noexcept {
+          move_from(that);
+        }
+
+        SmallFunction& operator=(SmallFunction&& that) noexcept {
+          if (this != &that) {
+            reset();
+            move_from(that);
+          }
+          return *this;
+        }
+
+        SmallFunction(const SmallFunction&) = delete;
+        SmallFunction& operator=(const SmallFunction&) = delete;
+
+        ~SmallFunction() {
+          reset();
+        }
+
+        explicit operator bool() const noexcept {
+          return ops_ != nullptr;
+        }
+
+        R operator()(Args... args) const {
+          return ops_->invoke(const_cast<unsigned char*>(buffer_), std::forward<Args>(args)...);
+        }
+
+        /***
+         * Check the callable is stored in the inline buffer
+         * @return true if it was not allocated on heap
+         */
+        bool is_stored_inline() const noexcept {
+          return ops_ && ops_->stored_inline;
+        }
+
+        void reset() noexcept {
+          if (ops_) {
+            ops_->destroy(buffer_);
+            ops_ = nullptr;
+          }
+        }
+
+    private:
+
+        struct Ops {
+            R    (*invoke)(void* storage, Args&&... args);
+            void (*move)(void* from, void* to) noexcept;
+            void (*destroy)(void* storage) noexcept;
+            bool stored_inline;
+        };
+
+        template<class F>
+        static constexpr Ops inline_ops = {
+                [](void* storage, Args&&... args) -> R {
+                    return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+                },
+                [](void* from, void* to) noexcept {
+                  new (to) F(std::move(*static_cast<F*>(from)));
+                  static_cast<F*>(from)->~F();
+                },
+                [](void* storage) noexcept {
+                  static_cast<F*>(storage)->~F();
+                },
+                true
+        };
+
+        template<class F>
+        static constexpr Ops heap_ops = {
+                [](void* storage, Args&&... args) -> R {
+                    return (**static_cast<F**>(storage))(std::forward<Args>(args)...);
+                },
+                [](void* from, void* to) noexcept {
+                  *static_cast<F**>(to) = *static_cast<F**>(from);
+                },
+                [](void* storage) noexcept {
+                  delete *static_cast<F**>(storage);
+                },
+                false
+        };
+
+        alignas(std::max_align_t) unsigned char buffer_[Capacity] = {};
+        const Ops* ops_ = nullptr;
+
+        void move_from(SmallFunction& that) noexcept {
+          if (that.ops_) {
+            that.ops_->move(that.buffer_, buffer_);
+            ops_ = that.ops_;
+            that.ops_ = nullptr;
+          }
+        }
+    };
+}
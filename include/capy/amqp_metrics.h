@@ -0,0 +1,245 @@
+//
+// Created by denn nevera on 2019-07-12.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace capy::amqp {
+
+    /**
+     * Merged latency histogram state. Values are microseconds,
+     * buckets are HDR-like: linear inside every power of two with 16 sub buckets
+     */
+    struct HistogramSnapshot {
+
+        /**
+         * Number of recorded values
+         */
+        uint64_t count = 0;
+
+        /**
+         * Sum of recorded values
+         */
+        uint64_t sum = 0;
+
+        /**
+         * Minimal recorded value
+         */
+        uint64_t min = 0;
+
+        /**
+         * Maximal recorded value
+         */
+        uint64_t max = 0;
+
+        /**
+         * Bucket counters
+         */
+        std::vector<uint64_t> buckets;
+
+        /***
+         * Mean value
+         * @return mean in microseconds
+         */
+        double mean() const;
+
+        /***
+         * Value at percentile
+         * @param percentile in range [0,100]
+         * @return the highest value equivalent to the bucket which contains the percentile
+         */
+        uint64_t value_at_percentile(double percentile) const;
+
+        /***
+         * Bucket index of the value
+         * @param value microseconds
+         * @return bucket index
+         */
+        static size_t bucket_index(uint64_t value);
+
+        /***
+         * The highest value which is counted by the bucket
+         * @param index bucket index
+         * @return microseconds
+         */
+        static uint64_t bucket_upper_bound(size_t index);
+
+        /**
+         * Buckets count
+         */
+        static size_t bucket_count();
+    };
+
+    /**
+     * Broker metrics snapshot
+     */
+    struct MetricsSnapshot {
+
+        /**
+         * Published messages
+         */
+        uint64_t publish_count = 0;
+
+        /**
+         * Published serialized bytes
+         */
+        uint64_t publish_bytes = 0;
+
+        /**
+         * Failed publishing
+         */
+        uint64_t publish_errors = 0;
+
+        /**
+         * Fetch requests
+         */
+        uint64_t fetch_count = 0;
+
+        /**
+         * Fetch requests are waiting replies
+         */
+        uint64_t fetch_outstanding = 0;
+
+        /**
+         * Received listener deliveries
+         */
+        uint64_t listen_count = 0;
+
+        /**
+         * Received listener bytes
+         */
+        uint64_t listen_bytes = 0;
+
+        /**
+         * Listener deliveries could not be processed
+         */
+        uint64_t listen_errors = 0;
+
+        /**
+         * Opened connections
+         */
+        uint64_t connections_opened = 0;
+
+        /**
+         * Lost connections, the next opened connection of a thread is reconnect
+         */
+        uint64_t connections_lost = 0;
+
+        /**
+         * Reconnects after connection lost
+         */
+        uint64_t reconnects = 0;
+
+        /**
+         * Opened channels
+         */
+        uint64_t channels_opened = 0;
+
+        /**
+         * Closed channels
+         */
+        uint64_t channels_closed = 0;
+
+        /**
+         * Socket writes of coalesced frames
+         */
+        uint64_t write_flushes = 0;
+
+        /**
+         * Frames passed to socket writes
+         */
+        uint64_t write_frames = 0;
+
+        /**
+         * Bytes written to sockets
+         */
+        uint64_t write_bytes = 0;
+
+        /**
+         * Publishes appended to the spool
+         */
+        uint64_t spooled = 0;
+
+        /**
+         * Spooled messages republished and confirmed
+         */
+        uint64_t spool_drained = 0;
+
+        /**
+         * Publishes failed because the spool is full
+         */
+        uint64_t spool_rejected = 0;
+
+        /**
+         * Duplicate requests are not passed to listener handlers
+         */
+        uint64_t duplicates = 0;
+
+        /**
+         * Cached replays are sent to duplicate requests
+         */
+        uint64_t duplicate_replays = 0;
+
+        /**
+         * Cached fetch replies reported without publishing
+         */
+        uint64_t reply_cache_hits = 0;
+
+        /**
+         * Cached fetches published to the broker
+         */
+        uint64_t reply_cache_misses = 0;
+
+        /**
+         * Cached fetches joined the identical fetch in flight
+         */
+        uint64_t reply_cache_collapsed = 0;
+
+        /**
+         * Publish transaction commit latency
+         */
+        HistogramSnapshot publish_latency;
+
+        /**
+         * Fetch round-trip latency
+         */
+        HistogramSnapshot fetch_latency;
+
+        /**
+         * Listener handler execution time
+         */
+        HistogramSnapshot handler_time;
+
+        /**
+         * Delivery receiving to ack latency
+         */
+        HistogramSnapshot ack_latency;
+
+        /**
+         * Delivery receiving to replay commit latency
+         */
+        HistogramSnapshot replay_latency;
+
+        /**
+         * Publishing to delivery receiving latency, time the request waited in the broker
+         */
+        HistogramSnapshot queueing_delay;
+
+        /**
+         * Bytes per socket write, values are bytes instead of microseconds
+         */
+        HistogramSnapshot flush_size;
+    };
+
+    /***
+     * Export metrics in Prometheus text exposition format
+     * @param snapshot metrics snapshot
+     * @param prefix metrics names prefix
+     * @return text
+     */
+    std::string to_prometheus(const MetricsSnapshot& snapshot, const std::string& prefix = "capy_amqp");
+}
@@ -0,0 +1,101 @@
+//
+// Created by denn nevera on 2019-07-24.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace capy::amqp {
+
+    /**
+     * Range of shards claimed by a worker: [first, last)
+     */
+    struct ShardRange {
+
+        /**
+         * First claimed shard
+         */
+        uint32_t first = 0;
+
+        /**
+         * Shard next to the last claimed one
+         */
+        uint32_t last = 0;
+
+        /***
+         * Even shards range of a worker
+         * @param shards shards count
+         * @param worker worker index
+         * @param workers workers count
+         * @return shards range, empty if there are more workers than shards
+         */
+        static ShardRange Claim(uint32_t shards, uint32_t worker, uint32_t workers);
+
+        bool contains(uint32_t shard) const { return shard >= first && shard < last; }
+        bool empty() const { return last <= first; }
+    };
+
+    /**
+     * Consistent-hash shard map: entity keys are mapped to routing keys <prefix>.<shard> by jump consistent hash.
+     * When shards count grows from n to n+1 only 1/(n+1) of keys are moved to the new shard.
+     * Key hash is FNV-1a, it is the same in all processes and platforms
+     */
+    class ShardMap {
+
+    public:
+
+        /***
+         * Create shard map
+         * @param prefix routing key prefix
+         * @param shards shards count, it is not less than 1
+         */
+        ShardMap(const std::string& prefix, uint32_t shards);
+
+        /***
+         * Stable 64-bit hash of entity key
+         * @param key entity key
+         * @return hash
+         */
+        static uint64_t hash(const std::string& key);
+
+        /***
+         * Jump consistent hash
+         * @param hash key hash
+         * @param buckets buckets count
+         * @return bucket index
+         */
+        static uint32_t jump(uint64_t hash, uint32_t buckets);
+
+        /***
+         * Get shard of entity key
+         * @param key entity key
+         * @return shard index
+         */
+        uint32_t get_shard(const std::string& key) const;
+
+        /***
+         * Get routing key of entity key
+         * @param key entity key
+         * @return shard routing key
+         */
+        const std::string& get_routing_key(const std::string& key) const;
+
+        /***
+         * Get routing keys of shards range, they are bound to the worker queue
+         * @param range shards range
+         * @return routing keys
+         */
+        std::vector<std::string> get_routing_keys(const ShardRange& range) const;
+
+        const std::string& get_prefix() const { return prefix_; }
+
+        uint32_t get_shards_count() const { return static_cast<uint32_t>(routing_keys_.size()); }
+
+    private:
+        std::string prefix_;
+        std::vector<std::string> routing_keys_;
+    };
+}
@@ -0,0 +1,82 @@
+//
+// Created by denn nevera on 2019-07-25.
+//
+
+#pragma once
+
+#include "capy/amqp_common.h"
+
+#include <string>
+#include <vector>
+
+namespace capy::amqp {
+
+    /**
+     * Thread placement: CPU set, profiler visible name and NUMA local memory
+     */
+    struct ThreadAffinity {
+
+        /**
+         * CPU ids the thread is pinned to, empty means no pinning
+         */
+        std::vector<int> cpus;
+
+        /**
+         * Thread name, it is truncated to 15 characters on Linux. Empty means the name is not changed
+         */
+        std::string name;
+
+        /**
+         * Thread memory is preferably allocated on the NUMA node of the pinned CPUs
+         */
+        bool numa_local = true;
+
+        /**
+         * Memory policy mode captured by Current(), it is restored by apply() unless numa_local is set.
+         * Negative means the memory policy is left as is
+         */
+        int memory_mode = -1;
+
+        /**
+         * Memory policy nodes mask captured by Current()
+         */
+        std::vector<unsigned long> memory_nodes;
+
+        /***
+         * Pin to CPU set
+         * @param cpus CPU ids
+         * @param name thread name
+         * @return affinity
+         */
+        static ThreadAffinity Pinned(const std::vector<int>& cpus, const std::string& name = "") {
+          return ThreadAffinity{cpus, name, true, -1, {}};
+        }
+
+        /***
+         * CPU ids range [first, last]
+         * @param first the first CPU id
+         * @param last the last CPU id
+         * @return CPU ids
+         */
+        static std::vector<int> Range(int first, int last);
+
+        /***
+         * Check affinity changes nothing
+         * @return true if neither CPUs nor name are set
+         */
+        bool empty() const { return cpus.empty() && name.empty(); }
+
+        /***
+         * Apply to the current thread. Threads started by the current thread inherit its CPU set,
+         * name and memory policy on Linux
+         * @return error if the platform does not support pinning or CPU set is invalid
+         */
+        Error apply() const;
+
+        /***
+         * Capture the current thread placement and memory policy to restore it later
+         * @return current affinity
+         */
+        static ThreadAffinity Current();
+    };
+}
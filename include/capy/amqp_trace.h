@@ -0,0 +1,27 @@
+//
+// Created by denn nevera on 2019-07-17.
+//
+
+#pragma once
+
+#include <string>
+
+namespace capy::amqp::trace {
+
+    /***
+     * Tracing is compiled in with -DCAPY_AMQP_TRACING=ON
+     * @return true if spans are recorded
+     */
+    bool enabled();
+
+    /***
+     * Dump spans recorded by all threads in Chrome trace event format (chrome://tracing, Perfetto)
+     * @return json string
+     */
+    std::string to_chrome_json();
+
+    /***
+     * Drop recorded spans
+     */
+    void reset();
+}
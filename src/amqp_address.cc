@@ -5,15 +5,14 @@
 #include "capy/amqp_address.h"
 
 #include <string>
-#include <iostream>
-#include <sstream>
+#include <string_view>
+#include <charconv>
 #include <cctype>
 #include <assert.h>
 #include <system_error>
-#include <regex>
-#include <locale>         // std::locale, std::toupper
-#include <algorithm>
 #include <memory>
+#include <map>
+#include <mutex>
 #include <vector>
 
 namespace capy::amqp {
@@ -43,150 +42,341 @@ namespace capy::amqp {
 
         Address::Protocol protocol;
         LoginImp  login;
-        string hostname;
+        vector<Address::Node> nodes;
         string vhost;
-        uint16_t port;
 
+        std::optional<uint16_t> heartbeat;
+        std::optional<uint16_t> channel_max;
+        std::optional<uint32_t> frame_max;
+        std::optional<std::chrono::milliseconds> connection_timeout;
 
         AddressImpl() = default;
     };
 
-    /// Utils
-    std::vector<std::string> split(const std::string& s, char delimiter)
-    {
-      std::vector<std::string> tokens;
-      std::string token;
-      std::istringstream tokenStream(s);
-      while (std::getline(tokenStream, token, delimiter))
-      {
-        tokens.push_back(token);
+    ///
+    /// MARK: - parsing
+    ///
+
+    static constexpr uint16_t amqp_port  = 5672;
+    static constexpr uint16_t amqps_port = 5671;
+
+    /***
+     * Interned addresses are dropped at once when the table grows over the limit
+     */
+    static constexpr size_t interned_max = 1024;
+
+    static bool iequals(string_view a, string_view b) {
+      if (a.size() != b.size()) return false;
+      for (size_t i = 0; i < a.size(); ++i) {
+        if (tolower(static_cast<unsigned char>(a[i])) != tolower(static_cast<unsigned char>(b[i]))) return false;
       }
-      return tokens;
+      return true;
     }
 
-    ///
-    /// Interface
-    ///
+    static int hex_digit(char c) {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+      return -1;
+    }
 
-    Address::Address():imp_(nullptr){
-      assert("Address::Address is protected. Use Address(\"amqp://login@host:port/vhost\") constructor");
+    /***
+     * Decode %XX sequences
+     * @param input uri component
+     * @param output decoded component
+     * @return false if a sequence is broken
+     */
+    static bool percent_decode(string_view input, string& output) {
+
+      output.clear();
+      output.reserve(input.size());
+
+      for (size_t i = 0; i < input.size(); ++i) {
+
+        if (input[i] != '%') {
+          output.push_back(input[i]);
+          continue;
+        }
+
+        if (i + 2 >= input.size()) return false;
+
+        auto high = hex_digit(input[i + 1]);
+        auto low  = hex_digit(input[i + 2]);
+
+        if (high < 0 || low < 0) return false;
+
+        output.push_back(static_cast<char>(high << 4 | low));
+        i += 2;
+      }
+
+      return true;
     }
 
-    Address::~Address() {}
+    template<class T>
+    static bool parse_number(string_view input, T& value) {
+      if (input.empty()) return false;
+      auto [end, error] = from_chars(input.data(), input.data() + input.size(), value);
+      return error == errc() && end == input.data() + input.size();
+    }
 
-    Address& Address::operator=(const capy::amqp::Address &address) {
-      this->imp_ = address.imp_;
-      return *this;
+    static capy::Error parse_error(const char* format, string_view component) {
+      return capy::Error(AddressError::PARSE, error_string(format, string(component).c_str()));
     }
 
-    Address::Address(const capy::amqp::Address &address):imp_(address.imp_) {}
+    static capy::Error parse_query(string_view query, AddressImpl& imp) {
 
-    Address::Address(const std::shared_ptr<capy::amqp::AddressImpl> &impl):imp_(impl) {}
+      while (!query.empty()) {
 
-    capy::Result<Address> Address::From(const std::string &address) {
+        auto amp = query.find('&');
+        auto parameter = query.substr(0, amp);
+        query = amp == string_view::npos ? string_view() : query.substr(amp + 1);
 
-      if (address.empty()) {
-        return capy::make_unexpected(capy::Error(AddressError::EMPTY));
-      }
+        if (parameter.empty()) continue;
+
+        auto eq = parameter.find('=');
+        auto key = parameter.substr(0, eq);
+        auto value = eq == string_view::npos ? string_view() : parameter.substr(eq + 1);
+
+        if (key == "heartbeat") {
+          uint16_t seconds;
+          if (!parse_number(value, seconds)) return parse_error("Address heartbeat %s is not correct", value);
+          imp.heartbeat = seconds;
+        }
+        else if (key == "channel_max") {
+          uint16_t channels;
+          if (!parse_number(value, channels)) return parse_error("Address channel_max %s is not correct", value);
+          imp.channel_max = channels;
+        }
+        else if (key == "frame_max") {
+          uint32_t size;
+          if (!parse_number(value, size)) return parse_error("Address frame_max %s is not correct", value);
+          imp.frame_max = size;
+        }
+        else if (key == "connection_timeout") {
+          uint32_t milliseconds;
+          if (!parse_number(value, milliseconds))
+            return parse_error("Address connection_timeout %s is not correct", value);
+          imp.connection_timeout = std::chrono::milliseconds(milliseconds);
+        }
 
-      try{
+        ///
+        /// Other parameters are defined by broker implementations and ignored
+        ///
+      }
 
-        regex ex("(amqp?|amqps)://(\\w+:{0,1}\\w*@)?([^/ :]+):?([^/ ]*)(/?[^ #?]*)\\x3f?([^ #]*)#?([^ ]*)");
-        cmatch what;
+      return capy::Error(CommonError::OK);
+    }
 
-        if (regex_match(address.c_str(), what, ex)) {
+    /***
+     * Parse host[:port], IPv6 host is enclosed in brackets
+     */
+    static capy::Error parse_node(string_view authority, Address::Protocol protocol, Address::Node& node) {
 
-          string proto = std::string(what[1].first, what[1].second);
+      string_view host;
+      string_view port;
 
-          transform(proto.begin(), proto.end(), proto.begin(), ::toupper);
+      if (!authority.empty() && authority.front() == '[') {
 
-          Address::Protocol aProtocol = Address::Protocol::unknown;
+        auto closing = authority.find(']');
 
-          if ( proto == "AMQP") {
-            aProtocol = Address::Protocol::amqp;
-          }
-          else if (proto == "AMQPS") {
-            aProtocol = Address::Protocol::amqps;
-          }
-          else {
-            return capy::make_unexpected(capy::Error(AddressError::PARSE,
-                    error_string("Url Protocol %s is not supported yet", proto.c_str())));
-          }
+        if (closing == string_view::npos) {
+          return parse_error("Address host %s is not correct", authority);
+        }
 
-          auto imp = shared_ptr<AddressImpl>(new AddressImpl);
+        host = authority.substr(1, closing - 1);
+        auto tail = authority.substr(closing + 1);
 
-          imp->protocol = aProtocol;
+        if (!tail.empty()) {
+          if (tail.front() != ':') return parse_error("Address host %s is not correct", authority);
+          port = tail.substr(1);
+        }
+      }
+      else {
+        auto colon = authority.find(':');
+        host = authority.substr(0, colon);
+        if (colon != string_view::npos) port = authority.substr(colon + 1);
+      }
 
-          imp->hostname = string(what[3].first, what[3].second);
-          string port = string(what[4].first, what[4].second);
+      if (host.empty()) {
+        return capy::Error(AddressError::PARSE, "Address host is empty");
+      }
 
-          if (port.empty()){
+      node.hostname = string(host);
 
-            imp->port = 5672;
+      if (port.empty()) {
+        node.port = protocol == Address::Protocol::amqps ? amqps_port : amqp_port;
+      }
+      else if (!parse_number(port, node.port)) {
+        return parse_error("Address port number %s is out of range", port);
+      }
 
-          }
+      return capy::Error(CommonError::OK);
+    }
 
-          else {
+    /***
+     * Parse amqp uri in one pass over the components
+     * @param address uri
+     * @return address implementation or error
+     */
+    static capy::Result<shared_ptr<AddressImpl>> parse(string_view address) {
 
-            int port_num = std::stoi(port, nullptr, 0);
+      auto scheme_end = address.find("://");
 
-            if (port_num>=0 && port_num <= 65535) {
+      if (scheme_end == string_view::npos) {
+        return capy::make_unexpected(capy::Error(AddressError::PARSE, "Url scheme is not found"));
+      }
 
-              imp->port = (uint16_t) port_num;
+      auto imp = make_shared<AddressImpl>();
 
-            } else {
+      auto scheme = address.substr(0, scheme_end);
 
-              return capy::make_unexpected(capy::Error(AddressError::PARSE,
-                                                       error_string("Address port number %s is out of range", port.c_str())));
-            }
-          }
+      if (iequals(scheme, "amqp")) {
+        imp->protocol = Address::Protocol::amqp;
+      }
+      else if (iequals(scheme, "amqps")) {
+        imp->protocol = Address::Protocol::amqps;
+      }
+      else {
+        return capy::make_unexpected(parse_error("Url Protocol %s is not supported yet", scheme));
+      }
 
-          imp->vhost = string(what[5].first, what[5].second);
+      auto rest = address.substr(scheme_end + 3);
 
-          string login = string(what[2].first, what[2].second);
+      rest = rest.substr(0, rest.find('#'));
 
-          if (login.empty()){
-            imp->login.user = "guest";
-            imp->login.password = "guest";
-          }
-          else {
+      auto query_begin = rest.find('?');
 
-            login.pop_back();
+      if (query_begin != string_view::npos) {
+        if (auto error = parse_query(rest.substr(query_begin + 1), *imp)) {
+          return capy::make_unexpected(error);
+        }
+        rest = rest.substr(0, query_begin);
+      }
 
-            vector<string> login_vector = split(login, ':');
+      auto path_begin = rest.find('/');
+      auto authority = rest.substr(0, path_begin);
+      auto path = path_begin == string_view::npos ? string_view() : rest.substr(path_begin + 1);
 
-            if (login_vector.size()<2){
-              return capy::make_unexpected(capy::Error(AddressError::PARSE,
-                                                       error_string("LoginImp %s is not correct", port.c_str())));
-            }
+      ///
+      /// user:password@
+      ///
+      auto at = authority.rfind('@');
 
-            imp->login.user = login_vector[0];
-            imp->login.password = login_vector[1];
+      if (at == string_view::npos) {
+        imp->login.user = "guest";
+        imp->login.password = "guest";
+      }
+      else {
 
-          }
+        auto userinfo = authority.substr(0, at);
+        auto colon = userinfo.find(':');
 
-          return Address(std::move(imp));
+        if (colon == string_view::npos || colon == 0) {
+          return capy::make_unexpected(parse_error("LoginImp %s is not correct", userinfo.substr(0, colon)));
+        }
 
+        if (!percent_decode(userinfo.substr(0, colon), imp->login.user)
+            ||
+            !percent_decode(userinfo.substr(colon + 1), imp->login.password)) {
+          return capy::make_unexpected(parse_error("LoginImp %s is not correct", userinfo.substr(0, colon)));
         }
-        else {
-          return capy::make_unexpected(capy::Error(AddressError::PARSE));
+
+        authority = authority.substr(at + 1);
+      }
+
+      ///
+      /// host[:port],host[:port]...
+      ///
+      while (true) {
+
+        auto comma = authority.find(',');
+
+        Address::Node node;
+
+        if (auto error = parse_node(authority.substr(0, comma), imp->protocol, node)) {
+          return capy::make_unexpected(error);
         }
+
+        imp->nodes.push_back(std::move(node));
+
+        if (comma == string_view::npos) break;
+
+        authority = authority.substr(comma + 1);
       }
-      catch (const std::exception &exception) {
-        return capy::make_unexpected(capy::Error(AddressError::PARSE,exception.what()));
+
+      ///
+      /// Vhost keeps leading slash: /vhost, encoded %2F selects the default vhost
+      ///
+      if (!percent_decode(path, imp->vhost)) {
+        return capy::make_unexpected(parse_error("Address vhost %s is not correct", path));
       }
-      catch (...) {
-        return capy::make_unexpected(capy::Error(CommonError::UNKNOWN));
+
+      if (imp->vhost.empty() || imp->vhost.front() != '/') {
+        imp->vhost.insert(imp->vhost.begin(), '/');
       }
 
+      return imp;
+    }
+
+    ///
+    /// Interface
+    ///
+
+    Address::Address():imp_(nullptr){
+      assert("Address::Address is protected. Use Address(\"amqp://login@host:port/vhost\") constructor");
+    }
+
+    Address::~Address() {}
+
+    Address& Address::operator=(const capy::amqp::Address &address) {
+      this->imp_ = address.imp_;
+      return *this;
+    }
+
+    Address::Address(const capy::amqp::Address &address):imp_(address.imp_) {}
+
+    Address::Address(const std::shared_ptr<capy::amqp::AddressImpl> &impl):imp_(impl) {}
+
+    capy::Result<Address> Address::From(std::string_view address) {
+
+      if (address.empty()) {
+        return capy::make_unexpected(capy::Error(AddressError::EMPTY));
+      }
+
+      static std::mutex interned_mutex;
+      static std::map<std::string, shared_ptr<AddressImpl>, std::less<>> interned;
+
+      {
+        std::lock_guard lock(interned_mutex);
+        auto found = interned.find(address);
+        if (found != interned.end()) return Address(found->second);
+      }
+
+      auto imp = parse(address);
+
+      if (!imp) {
+        return capy::make_unexpected(imp.error());
+      }
+
+      {
+        std::lock_guard lock(interned_mutex);
+        if (interned.size() >= interned_max) interned.clear();
+        interned.emplace(address, *imp);
+      }
+
+      return Address(*imp);
     }
 
     const std::string& Address::get_hostname() const {
-      return imp_->hostname;
+      return imp_->nodes.front().hostname;
     }
 
     const uint16_t Address::get_port() const {
-      return imp_->port;
+      return imp_->nodes.front().port;
+    }
+
+    const std::vector<Address::Node>& Address::get_nodes() const {
+      return imp_->nodes;
     }
 
     const std::string& Address::get_vhost() const {
@@ -194,13 +384,29 @@ namespace capy::amqp {
     }
 
     const Address::Protocol Address::get_protocol() const {
-      return  Address::Protocol::amqp;
+      return  imp_->protocol;
     }
 
     const Login& Address::get_login() const {
       return imp_->login;
     }
 
+    std::optional<uint16_t> Address::get_heartbeat() const {
+      return imp_->heartbeat;
+    }
+
+    std::optional<uint16_t> Address::get_channel_max() const {
+      return imp_->channel_max;
+    }
+
+    std::optional<uint32_t> Address::get_frame_max() const {
+      return imp_->frame_max;
+    }
+
+    std::optional<std::chrono::milliseconds> Address::get_connection_timeout() const {
+      return imp_->connection_timeout;
+    }
+
     std::string AddressErrorCategory::message(int ev) const {
       switch (ev) {
         case static_cast<int>(AddressError::PARSE):
@@ -7,6 +7,7 @@
 
 #include <assert.h>
 #include <atomic>
+#include <mutex>
 #include <thread>
 #include <future>
 
@@ -18,6 +19,7 @@
 
 #include "broker_impl/handler.h"
 #include "broker_impl/broker.h"
+#include "deferred_mpl/deferred.h"
 
 namespace capy::amqp {
 
@@ -29,10 +31,41 @@ namespace capy::amqp {
             const std::string &exchange_name,
             uint16_t heartbeat_timeout,
             const ErrorHandler& on_error) {
+      return Broker::Bind(address, exchange_name, heartbeat_timeout, ConnectionOptions(), on_error);
+    }
+
+    Result <Broker> Broker::Bind(
+            const capy::amqp::Address &address,
+            const std::string &exchange_name,
+            uint16_t heartbeat_timeout,
+            const ConnectionOptions& options,
+            const ErrorHandler& on_error) {
 
       try {
 
-        auto impl = std::make_shared<BrokerImpl>(address, exchange_name, heartbeat_timeout);
+        ///
+        /// Connection options set explicitly take precedence, zero options are taken from the query
+        /// parameters of the address. Heartbeat parameter of the address replaces heartbeat_timeout
+        ///
+        auto connection_options = options;
+
+        if (connection_options.channel_max == 0) {
+          connection_options.channel_max = address.get_channel_max().value_or(0);
+        }
+
+        if (connection_options.connection_timeout.count() == 0) {
+          connection_options.connection_timeout = address.get_connection_timeout().value_or(std::chrono::milliseconds(0));
+        }
+
+        if (auto error = ConnectionHandler::Check(connection_options.transport)) {
+          return capy::make_unexpected(error);
+        }
+
+        auto impl = std::shared_ptr<BrokerImpl>(new BrokerImpl(address,
+                                                               exchange_name,
+                                                               address.get_heartbeat().value_or(heartbeat_timeout),
+                                                               connection_options),
+                                                BrokerImpl::Release);
 
         auto channel = impl->connections_->new_channel();
 
@@ -61,6 +94,73 @@ namespace capy::amqp {
 
     }
 
+    //
+    // MARK: - task queue
+    //
+    struct TaskQueueConfig {
+        std::mutex mutex;
+        size_t size = 0;
+        ThreadAffinity affinity;
+        ThreadAffinity creator;
+        bool created = false;
+        Error error = Error(CommonError::OK);
+    };
+
+    static TaskQueueConfig& task_queue_config() {
+      static TaskQueueConfig config;
+      return config;
+    }
+
+    Error BrokerTaskQueue::Configure(size_t size, const ThreadAffinity &affinity) {
+      auto& config = task_queue_config();
+      std::lock_guard lock(config.mutex);
+
+      if (config.created) {
+        return Error(CommonError::NOT_SUPPORTED, "broker task queue has been already created");
+      }
+
+      config.size = size;
+      config.affinity = affinity;
+
+      return Error(CommonError::OK);
+    }
+
+    size_t BrokerTaskQueue::prepare_workers() {
+      auto& config = task_queue_config();
+      std::lock_guard lock(config.mutex);
+
+      config.created = true;
+
+      if (!config.affinity.empty()) {
+        config.creator = ThreadAffinity::Current();
+        config.error = config.affinity.apply();
+      }
+
+      return config.size > 0 ? config.size : std::max(std::thread::hardware_concurrency(),2u);
+    }
+
+    Error BrokerTaskQueue::get_error() {
+      Task::Instance();
+
+      auto& config = task_queue_config();
+      std::lock_guard lock(config.mutex);
+
+      return config.error;
+    }
+
+    void BrokerTaskQueue::restore_creator() {
+      auto& config = task_queue_config();
+      std::lock_guard lock(config.mutex);
+
+      if (!config.affinity.empty()) {
+        config.creator.apply();
+      }
+    }
+
+    BrokerTaskQueue::BrokerTaskQueue():Queue(prepare_workers()) {
+      restore_creator();
+    }
+
     //
     // Broker constructors
     //
@@ -71,8 +171,28 @@ namespace capy::amqp {
     //
     // fetch
     //
-    DeferredFetch& Broker::fetch(const capy::json& message, const std::string& routing_key) {
-      return impl_->fetch_message(message, routing_key);
+    DeferredFetch& Broker::fetch(const capy::json& message,
+                                 const std::string& routing_key,
+                                 uint8_t priority,
+                                 const std::string& message_id) {
+      return impl_->fetch_message(message, routing_key, false, priority, message_id);
+    }
+
+    DeferredFetch& Broker::fetch_stream(const capy::json& message, const std::string& routing_key) {
+      return impl_->fetch_message(message, routing_key, true);
+    }
+
+    DeferredFetch& Broker::fetch_cached(const capy::json& message, const std::string& routing_key, uint8_t priority) {
+      return impl_->fetch_cached_message(message, routing_key, priority);
+    }
+
+    //
+    // fetch many
+    //
+    DeferredFetchMany& Broker::fetch_many(const capy::json& message,
+                                          const std::vector<std::string>& routing_keys,
+                                          const FetchPolicy& policy) {
+      return impl_->fetch_many_messages(message, routing_keys, policy);
     }
 
     //
@@ -81,18 +201,114 @@ namespace capy::amqp {
     DeferredListen& Broker::listen(
             const std::string& queue,
             const std::vector<std::string>& routing_keys) {
-      return impl_->listen_messages(queue,routing_keys);
+      return impl_->listen_messages(queue,routing_keys,ListenPolicy());
+    }
+
+    DeferredListen& Broker::listen(
+            const std::string& queue,
+            const std::vector<std::string>& routing_keys,
+            const ListenPolicy& policy) {
+      return impl_->listen_messages(queue,routing_keys,policy);
+    }
+
+    DeferredListenBatch& Broker::listen_batch(
+            const std::string& queue,
+            const std::vector<std::string>& routing_keys,
+            size_t max_batch,
+            std::chrono::milliseconds max_wait,
+            const ListenPolicy& policy) {
+      return impl_->listen_batch_messages(queue, routing_keys, max_batch, max_wait, policy);
+    }
+
+    //
+    // sharding
+    //
+    DeferredListen& Broker::listen_shards(
+            const std::string& queue,
+            const std::string& prefix,
+            uint32_t shards,
+            const ShardRange& range,
+            const ListenPolicy& policy) {
+      return impl_->listen_messages(queue, impl_->get_shard_map(prefix, shards)->get_routing_keys(range), policy);
+    }
+
+    std::shared_ptr<const ShardMap> Broker::shard_map(const std::string& prefix, uint32_t shards) {
+      return impl_->get_shard_map(prefix, shards);
+    }
+
+    std::string Broker::shard_routing_key(const std::string& prefix, uint32_t shards, const std::string& key) {
+      return impl_->get_shard_map(prefix, shards)->get_routing_key(key);
+    }
+
+    //
+    // queue statistics
+    //
+    Result<QueueStats> Broker::queue_stats(const std::string& queue, std::chrono::milliseconds ttl) {
+      return impl_->get_queue_stats(queue, ttl);
+    }
+
+    DeferredQueueStats& Broker::sample_queue(const std::string& queue, std::chrono::milliseconds interval) {
+      return impl_->sample_queue(queue, interval);
+    }
+
+    void Broker::stop_sampling(const std::string& queue) {
+      impl_->stop_sampling(queue);
+    }
+
+    void Broker::set_chunking(const Chunking& chunking) {
+      impl_->set_chunking(chunking);
+    }
+
+    Error Broker::set_compression(const Compression& compression) {
+      return impl_->set_compression(compression);
+    }
+
+    Error Broker::set_spooling(const Spooling& spooling) {
+      return impl_->set_spooling(spooling);
+    }
+
+    void Broker::set_reply_caching(const ReplyCaching& caching) {
+      impl_->set_reply_caching(caching);
+    }
+
+    void Broker::set_node_selection(const NodeSelection& selection) {
+      impl_->set_node_selection(selection);
+    }
+
+    std::vector<NodeState> Broker::get_nodes() const {
+      return impl_->get_nodes();
+    }
+
+    void Broker::set_queue_leaders(const std::map<std::string, std::string>& leaders) {
+      impl_->set_queue_leaders(leaders);
     }
 
     void Broker::run(const Launch launch) {
       impl_->run(launch);
     }
 
+    Error Broker::run(const Launch launch, const ThreadAffinity& affinity) {
+      auto error = impl_->run(launch, affinity);
+      if (error) return error;
+      return BrokerTaskQueue::get_error();
+    }
+
+    Error Broker::shutdown(std::chrono::milliseconds deadline) {
+      return impl_->shutdown(deadline);
+    }
+
+    MetricsSnapshot Broker::get_metrics() {
+      return impl_->get_metrics();
+    }
+
     //
     // publish
     //
-    Error Broker::publish(const capy::json& message, const std::string& routing_key) {
-      return impl_->publish_message(message, routing_key);
+    Error Broker::publish(const capy::json& message,
+                          const std::string& routing_key,
+                          uint8_t priority,
+                          const std::string& message_id) {
+      return impl_->publish_message(message, routing_key, priority, message_id);
     }
 
     ///
@@ -103,6 +319,12 @@ namespace capy::amqp {
       switch (ev) {
         case static_cast<int>(BrokerError::CONNECTION):
           return "ConnectionCache error";
+        case static_cast<int>(BrokerError::NO_REPLAY):
+          return "No replay received";
+        case static_cast<int>(BrokerError::SHUTDOWN):
+          return "Broker is shut down";
+        case static_cast<int>(BrokerError::SPOOL):
+          return "Spool error";
         default:
           return ErrorCategory::message(ev);
       }
@@ -0,0 +1,160 @@
+//
+// Created by denn nevera on 2019-07-12.
+//
+
+#include "capy/amqp_metrics.h"
+
+#include <sstream>
+#include <algorithm>
+
+namespace capy::amqp {
+
+    ///
+    /// HDR-like layout: values less than 2^sub_bits are counted linearly,
+    /// every next power of two is split to 2^(sub_bits-1) equal sub buckets
+    ///
+    static constexpr unsigned sub_bits = 5;
+    static constexpr unsigned half_count = 1u << (sub_bits - 1);
+    static constexpr unsigned max_magnitude = 36;
+
+    size_t HistogramSnapshot::bucket_index(uint64_t value) {
+
+      value = std::min(value, (uint64_t(1) << max_magnitude) - 1);
+
+      if (value < (uint64_t(1) << sub_bits)) return static_cast<size_t>(value);
+
+      unsigned magnitude = 63 - static_cast<unsigned>(__builtin_clzll(value));
+      unsigned shift = magnitude - sub_bits + 1;
+
+      return static_cast<size_t>((shift << (sub_bits - 1)) + (value >> shift));
+    }
+
+    uint64_t HistogramSnapshot::bucket_upper_bound(size_t index) {
+
+      if (index < (1u << sub_bits)) return index;
+
+      uint64_t shift = (index >> (sub_bits - 1)) - 1;
+      uint64_t sub = index - (shift << (sub_bits - 1));
+
+      return ((sub + 1) << shift) - 1;
+    }
+
+    size_t HistogramSnapshot::bucket_count() {
+      return bucket_index((uint64_t(1) << max_magnitude) - 1) + 1;
+    }
+
+    double HistogramSnapshot::mean() const {
+      return count == 0 ? 0 : static_cast<double>(sum) / static_cast<double>(count);
+    }
+
+    uint64_t HistogramSnapshot::value_at_percentile(double percentile) const {
+
+      if (count == 0) return 0;
+
+      percentile = std::clamp(percentile, 0.0, 100.0);
+
+      auto rank = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(count) + 0.5);
+      rank = std::max<uint64_t>(rank, 1);
+
+      uint64_t total = 0;
+
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        total += buckets[i];
+        if (total >= rank) {
+          return std::clamp(bucket_upper_bound(i), min, max);
+        }
+      }
+
+      return max;
+    }
+
+    ///
+    /// MARK: - prometheus
+    ///
+
+    static void counter(std::ostream &os, const std::string &name, const char *help, uint64_t value, const char *type = "counter") {
+      os << "# HELP " << name << " " << help << "\n";
+      os << "# TYPE " << name << " " << type << "\n";
+      os << name << " " << value << "\n";
+    }
+
+    static const std::vector<uint64_t> latency_bounds = {
+            50, 100, 250, 500,
+            1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+            1000000, 2500000, 5000000, 10000000
+    };
+
+    static const std::vector<uint64_t> size_bounds = {
+            64, 256, 1024, 4096, 16384, 65536, 262144, 1048576
+    };
+
+    /***
+     * Export histogram
+     * @param bounds bucket bounds in recorded units
+     * @param scale recorded units per exported unit, microseconds are exported as seconds
+     */
+    static void histogram(std::ostream &os,
+                          const std::string &name,
+                          const char *help,
+                          const HistogramSnapshot &h,
+                          const std::vector<uint64_t> &bounds = latency_bounds,
+                          double scale = 1e6) {
+
+      os << "# HELP " << name << " " << help << "\n";
+      os << "# TYPE " << name << " histogram\n";
+
+      uint64_t cumulative = 0;
+      size_t index = 0;
+
+      for (auto bound: bounds) {
+        for (; index < h.buckets.size() && HistogramSnapshot::bucket_upper_bound(index) <= bound; ++index) {
+          cumulative += h.buckets[index];
+        }
+        os << name << "_bucket{le=\"" << static_cast<double>(bound) / scale << "\"} " << cumulative << "\n";
+      }
+
+      os << name << "_bucket{le=\"+Inf\"} " << h.count << "\n";
+      os << name << "_sum " << static_cast<double>(h.sum) / scale << "\n";
+      os << name << "_count " << h.count << "\n";
+    }
+
+    std::string to_prometheus(const MetricsSnapshot& s, const std::string& prefix) {
+
+      std::ostringstream os;
+
+      counter(os, prefix + "_publish_total", "Published messages", s.publish_count);
+      counter(os, prefix + "_publish_bytes_total", "Published serialized bytes", s.publish_bytes);
+      counter(os, prefix + "_publish_errors_total", "Failed publishing", s.publish_errors);
+      counter(os, prefix + "_fetch_total", "Fetch requests", s.fetch_count);
+      counter(os, prefix + "_fetch_outstanding", "Fetch requests are waiting replies", s.fetch_outstanding, "gauge");
+      counter(os, prefix + "_listen_total", "Received listener deliveries", s.listen_count);
+      counter(os, prefix + "_listen_bytes_total", "Received listener bytes", s.listen_bytes);
+      counter(os, prefix + "_listen_errors_total", "Listener deliveries could not be processed", s.listen_errors);
+      counter(os, prefix + "_connections_opened_total", "Opened connections", s.connections_opened);
+      counter(os, prefix + "_connections_lost_total", "Lost connections", s.connections_lost);
+      counter(os, prefix + "_reconnects_total", "Reconnects after connection lost", s.reconnects);
+      counter(os, prefix + "_channels_opened_total", "Opened channels", s.channels_opened);
+      counter(os, prefix + "_channels_closed_total", "Closed channels", s.channels_closed);
+      counter(os, prefix + "_write_flushes_total", "Socket writes of coalesced frames", s.write_flushes);
+      counter(os, prefix + "_write_frames_total", "Frames passed to socket writes", s.write_frames);
+      counter(os, prefix + "_write_bytes_total", "Bytes written to sockets", s.write_bytes);
+      counter(os, prefix + "_spooled_total", "Publishes appended to the spool", s.spooled);
+      counter(os, prefix + "_spool_drained_total", "Spooled messages republished and confirmed", s.spool_drained);
+      counter(os, prefix + "_spool_rejected_total", "Publishes failed because the spool is full", s.spool_rejected);
+      counter(os, prefix + "_duplicates_total", "Duplicate requests are not passed to listener handlers", s.duplicates);
+      counter(os, prefix + "_duplicate_replays_total", "Cached replays are sent to duplicate requests", s.duplicate_replays);
+      counter(os, prefix + "_reply_cache_hits_total", "Cached fetch replies reported without publishing", s.reply_cache_hits);
+      counter(os, prefix + "_reply_cache_misses_total", "Cached fetches published to the broker", s.reply_cache_misses);
+      counter(os, prefix + "_reply_cache_collapsed_total", "Cached fetches joined the identical fetch in flight", s.reply_cache_collapsed);
+
+      histogram(os, prefix + "_publish_latency_seconds", "Publish transaction commit latency", s.publish_latency);
+      histogram(os, prefix + "_fetch_latency_seconds", "Fetch round-trip latency", s.fetch_latency);
+      histogram(os, prefix + "_handler_seconds", "Listener handler execution time", s.handler_time);
+      histogram(os, prefix + "_ack_latency_seconds", "Delivery receiving to ack latency", s.ack_latency);
+      histogram(os, prefix + "_replay_latency_seconds", "Delivery receiving to replay commit latency", s.replay_latency);
+      histogram(os, prefix + "_queueing_delay_seconds", "Publishing to delivery receiving latency", s.queueing_delay);
+      histogram(os, prefix + "_flush_size_bytes", "Bytes per socket write", s.flush_size, size_bounds, 1);
+
+      return os.str();
+    }
+}
@@ -0,0 +1,80 @@
+//
+// Created by denn nevera on 2019-07-24.
+//
+
+#include "capy/amqp_sharding.h"
+
+#include <algorithm>
+
+namespace capy::amqp {
+
+    ShardRange ShardRange::Claim(uint32_t shards, uint32_t worker, uint32_t workers) {
+
+      if (workers == 0 || worker >= workers) return ShardRange();
+
+      auto first = static_cast<uint32_t>(static_cast<uint64_t>(shards) * worker / workers);
+      auto last = static_cast<uint32_t>(static_cast<uint64_t>(shards) * (worker + 1) / workers);
+
+      return ShardRange{first, last};
+    }
+
+    ShardMap::ShardMap(const std::string &prefix, uint32_t shards):
+            prefix_(prefix),
+            routing_keys_()
+    {
+      ///
+      /// Routing keys are built once, lookups do not allocate
+      ///
+      routing_keys_.reserve(std::max<uint32_t>(shards, 1));
+      for (uint32_t shard = 0; shard < std::max<uint32_t>(shards, 1); ++shard) {
+        routing_keys_.push_back(prefix_ + "." + std::to_string(shard));
+      }
+    }
+
+    uint64_t ShardMap::hash(const std::string &key) {
+      uint64_t hash = 14695981039346656037ull;
+      for (auto c: key) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+      }
+      return hash;
+    }
+
+    ///
+    /// Lamping, Veach: A Fast, Minimal Memory, Consistent Hash Algorithm
+    ///
+    uint32_t ShardMap::jump(uint64_t hash, uint32_t buckets) {
+
+      int64_t b = -1, j = 0;
+
+      while (j < static_cast<int64_t>(buckets)) {
+        b = j;
+        hash = hash * 2862933555777941757ull + 1;
+        j = static_cast<int64_t>(static_cast<double>(b + 1) *
+                                 (static_cast<double>(1ll << 31) / static_cast<double>((hash >> 33) + 1)));
+      }
+
+      return static_cast<uint32_t>(std::max<int64_t>(b, 0));
+    }
+
+    uint32_t ShardMap::get_shard(const std::string &key) const {
+      return jump(hash(key), get_shards_count());
+    }
+
+    const std::string& ShardMap::get_routing_key(const std::string &key) const {
+      return routing_keys_[get_shard(key)];
+    }
+
+    std::vector<std::string> ShardMap::get_routing_keys(const ShardRange &range) const {
+
+      std::vector<std::string> keys;
+
+      auto last = std::min(range.last, get_shards_count());
+
+      for (auto shard = range.first; shard < last; ++shard) {
+        keys.push_back(routing_keys_[shard]);
+      }
+
+      return keys;
+    }
+}
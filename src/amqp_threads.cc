@@ -0,0 +1,181 @@
+//
+// Created by denn nevera on 2019-07-25.
+//
+
+#include "capy/amqp_threads.h"
+
+#include <pthread.h>
+
+#ifdef __linux__
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+namespace capy::amqp {
+
+    std::vector<int> ThreadAffinity::Range(int first, int last) {
+      std::vector<int> cpus;
+      for (auto cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+      return cpus;
+    }
+
+#ifdef __linux__
+
+    static constexpr size_t max_thread_name = 15;
+    static constexpr unsigned long max_numa_nodes = 1024;
+
+    ///
+    /// MARK: - NUMA memory policy, set_mempolicy is called directly to avoid libnuma dependency
+    ///
+
+    /***
+     * NUMA node of CPU is linked as /sys/devices/system/cpu/cpu<N>/node<K>
+     */
+    static int cpu_node(int cpu) {
+
+      auto path = error_string("/sys/devices/system/cpu/cpu%i", cpu);
+      auto dir = opendir(path.c_str());
+
+      if (!dir) return -1;
+
+      int node = -1;
+
+      while (auto entry = readdir(dir)) {
+        if (std::strncmp(entry->d_name, "node", 4) == 0 && std::isdigit(entry->d_name[4])) {
+          node = std::atoi(entry->d_name + 4);
+          break;
+        }
+      }
+
+      closedir(dir);
+
+      return node;
+    }
+
+    static Error set_local_memory(const cpu_set_t& cpus) {
+
+      constexpr size_t bits = 8 * sizeof(unsigned long);
+      unsigned long mask[max_numa_nodes / bits] = {};
+      bool found = false;
+
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+
+        if (!CPU_ISSET(cpu, &cpus)) continue;
+
+        auto node = cpu_node(cpu);
+
+        if (node < 0 || static_cast<unsigned long>(node) >= max_numa_nodes) continue;
+
+        mask[node / bits] |= 1ul << (node % bits);
+        found = true;
+      }
+
+      if (!found) return Error(CommonError::NOT_FOUND, "numa node is not found");
+
+      ///
+      /// Preferred policy falls back to other nodes when the local one is exhausted
+      ///
+      if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, max_numa_nodes) != 0) {
+        return Error(CommonError::NOT_SUPPORTED, error_string("set_mempolicy: %i", errno));
+      }
+
+      return Error(CommonError::OK);
+    }
+
+    Error ThreadAffinity::apply() const {
+
+      if (!name.empty()) {
+        pthread_setname_np(pthread_self(), name.substr(0, max_thread_name).c_str());
+      }
+
+      if (cpus.empty()) return Error(CommonError::OK);
+
+      cpu_set_t set;
+      CPU_ZERO(&set);
+
+      for (auto cpu: cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+          return Error(CommonError::OUT_OF_RANGE, error_string("cpu %i is out of range", cpu));
+        }
+        CPU_SET(cpu, &set);
+      }
+
+      if (auto code = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        return Error(CommonError::OUT_OF_RANGE, error_string("pthread_setaffinity_np: %i", code));
+      }
+
+      ///
+      /// Memory placement is advisory, kernels without NUMA leave it as is
+      ///
+      if (numa_local) {
+        set_local_memory(set);
+      }
+      else if (memory_mode >= 0) {
+        syscall(SYS_set_mempolicy, memory_mode,
+                memory_nodes.empty() ? nullptr : memory_nodes.data(),
+                memory_nodes.size() * 8 * sizeof(unsigned long));
+      }
+
+      return Error(CommonError::OK);
+    }
+
+    ThreadAffinity ThreadAffinity::Current() {
+
+      ThreadAffinity affinity;
+      affinity.numa_local = false;
+
+      ///
+      /// Memory policy may be inherited from numactl, it is restored as it is
+      ///
+      int mode = 0;
+      std::vector<unsigned long> nodes(max_numa_nodes / (8 * sizeof(unsigned long)), 0);
+
+      if (syscall(SYS_get_mempolicy, &mode, nodes.data(), max_numa_nodes, nullptr, 0) == 0) {
+        affinity.memory_mode = mode;
+        affinity.memory_nodes = std::move(nodes);
+      }
+
+      char name[max_thread_name + 1] = {};
+      if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) affinity.name = name;
+
+      cpu_set_t set;
+      CPU_ZERO(&set);
+
+      if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+          if (CPU_ISSET(cpu, &set)) affinity.cpus.push_back(cpu);
+        }
+      }
+
+      return affinity;
+    }
+
+#else
+
+    Error ThreadAffinity::apply() const {
+
+#ifdef __APPLE__
+      if (!name.empty()) pthread_setname_np(name.c_str());
+#endif
+
+      if (!cpus.empty()) {
+        return Error(CommonError::NOT_SUPPORTED, "thread pinning is not supported by the platform");
+      }
+
+      return Error(CommonError::OK);
+    }
+
+    ThreadAffinity ThreadAffinity::Current() {
+      ThreadAffinity affinity;
+      affinity.numa_local = false;
+      return affinity;
+    }
+
+#endif
+}
@@ -0,0 +1,159 @@
+//
+// Created by denn nevera on 2019-07-17.
+//
+
+#include "broker_impl/trace.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+
+namespace capy::amqp::trace {
+
+    ///
+    /// MARK: - W3C trace context
+    ///
+
+    static constexpr size_t trace_id_size = 32;
+    static constexpr size_t span_id_size = 16;
+    static constexpr size_t traceparent_size = 3 + trace_id_size + 1 + span_id_size + 3;
+
+    static std::string random_hex(size_t size) {
+
+      static const char digits[] = "0123456789abcdef";
+      thread_local std::mt19937_64 generator(std::random_device{}());
+
+      std::string hex(size, '0');
+
+      for (size_t i = 0; i < size; i += 16) {
+        auto value = generator();
+        for (size_t j = i; j < std::min(size, i + 16); ++j, value >>= 4) {
+          hex[j] = digits[value & 0xf];
+        }
+      }
+
+      return hex;
+    }
+
+    static bool is_hex(const std::string& value, size_t from, size_t size) {
+      bool zero = true;
+      for (auto i = from; i < from + size; ++i) {
+        auto c = value[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+        if (c != '0') zero = false;
+      }
+      return !zero;
+    }
+
+    bool is_traceparent(const std::string& traceparent) {
+      return traceparent.size() == traceparent_size
+             && traceparent.compare(0, 3, "00-") == 0
+             && traceparent[3 + trace_id_size] == '-'
+             && traceparent[traceparent_size - 3] == '-'
+             && is_hex(traceparent, 3, trace_id_size)
+             && is_hex(traceparent, 4 + trace_id_size, span_id_size);
+    }
+
+    std::string make_traceparent() {
+      return "00-" + random_hex(trace_id_size) + "-" + random_hex(span_id_size) + "-01";
+    }
+
+    std::string child_traceparent(const std::string& parent) {
+      if (!is_traceparent(parent)) return make_traceparent();
+      return parent.substr(0, 4 + trace_id_size) + random_hex(span_id_size) + parent.substr(traceparent_size - 3);
+    }
+
+    uint64_t wall_clock_us() {
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+
+    ///
+    /// MARK: - spans
+    ///
+
+#ifdef CAPY_AMQP_TRACING
+
+    static std::mutex& registry_mutex() {
+      static std::mutex mutex;
+      return mutex;
+    }
+
+    static std::vector<std::shared_ptr<Ring>>& registry() {
+      static std::vector<std::shared_ptr<Ring>> rings;
+      return rings;
+    }
+
+    Ring& local_ring() {
+      thread_local std::shared_ptr<Ring> ring = []{
+          std::lock_guard lock(registry_mutex());
+          auto ring = std::make_shared<Ring>(static_cast<uint32_t>(registry().size() + 1));
+          registry().push_back(ring);
+          return ring;
+      }();
+      return *ring;
+    }
+
+    bool enabled() { return true; }
+
+    std::string to_chrome_json() {
+
+      std::vector<std::shared_ptr<Ring>> rings;
+      {
+        std::lock_guard lock(registry_mutex());
+        rings = registry();
+      }
+
+      std::ostringstream os;
+      os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+      bool first = true;
+      auto pid = getpid();
+
+      for (auto& ring: rings) {
+
+        os << (first ? "" : ",")
+           << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << ring->thread
+           << ",\"args\":{\"name\":\"capy-" << ring->thread << "\"}}";
+        first = false;
+
+        auto head = ring->head.load(std::memory_order_acquire);
+        auto from = head > Ring::capacity ? head - Ring::capacity : 0;
+
+        for (auto i = from; i < head; ++i) {
+          auto event = ring->events[i % Ring::capacity];
+          if (!event.name || event.end < event.begin) continue;
+
+          os << ",{\"name\":\"" << event.name << "\",\"cat\":\"capy\",\"ph\":\"X\""
+             << ",\"ts\":" << static_cast<double>(event.begin) / 1000.0
+             << ",\"dur\":" << static_cast<double>(event.end - event.begin) / 1000.0
+             << ",\"pid\":" << pid << ",\"tid\":" << ring->thread << "}";
+        }
+      }
+
+      os << "]}";
+
+      return os.str();
+    }
+
+    void reset() {
+      std::lock_guard lock(registry_mutex());
+      for (auto& ring: registry()) {
+        ring->head.store(0, std::memory_order_release);
+      }
+    }
+
+#else
+
+    bool enabled() { return false; }
+
+    std::string to_chrome_json() { return "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[]}"; }
+
+    void reset() {}
+
+#endif
+}
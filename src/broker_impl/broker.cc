@@ -5,6 +5,7 @@
 #include "broker.h"
 #include "capy/amqp_common.h"
 #include "../deferred_mpl/deferred.h"
+#include "trace.h"
 
 #include <condition_variable>
 #include <sstream>
@@ -16,11 +17,13 @@ namespace capy::amqp {
         complete_handler_.value()(this);
         commit_handler_ = std::nullopt;
       }
+      delete stream_;
     }
 
     ReplayImpl::ReplayImpl():
             Replay(),
             commit_handler_(std::nullopt),
+            chunk_handler_(std::nullopt),
             complete_handler_(std::nullopt)
     {}
 
@@ -32,6 +35,16 @@ namespace capy::amqp {
       commit_handler_ = commit_handler;
     }
 
+    void ReplayImpl::set_chunk(const Handler& chunk_handler) {
+      chunk_handler_ = chunk_handler;
+    }
+
+    void ReplayImpl::send_chunk() {
+      if (chunk_handler_) {
+        chunk_handler_.value()(this);
+      }
+    }
+
     void ReplayImpl::commit() {
       if (commit_handler_) {
         commit_handler_.value()(this);
@@ -39,275 +52,2243 @@ namespace capy::amqp {
       }
     }
 
-//    static void monitor(uv_timer_t *handle){
-//      auto broker = static_cast<BrokerImpl*>(handle->data);
-//      std::cout << "monitor ping ... " << broker << std::endl;
-//    }
+//    static void monitor(uv_timer_t *handle){
+//      auto broker = static_cast<BrokerImpl*>(handle->data);
+//      std::cout << "monitor ping ... " << broker << std::endl;
+//    }
+
+    ///
+    /// MARK: - trace context
+    ///
+
+    static const char* traceparent_header = "traceparent";
+    static const char* published_at_header = "x-capy-published-at";
+    static const char* sequence_header = "x-capy-sequence";
+    static const char* stream_end_header = "x-capy-stream-end";
+
+    /***
+     * Inject trace context and publishing time in microseconds to the message headers
+     */
+    static void stamp_envelope(AMQP::Envelope &envelope,
+                               const std::string &traceparent,
+                               AMQP::Table headers = AMQP::Table()) {
+
+      auto published_at = trace::wall_clock_us();
+
+      headers.set(traceparent_header, AMQP::LongString(traceparent));
+      headers.set(published_at_header, AMQP::ULongLong(published_at));
+
+      envelope.setHeaders(headers);
+      envelope.setTimestamp(published_at / 1000000);
+    }
+
+    /***
+     * Extract trace context and queueing delay from the received message
+     */
+    static void unstamp_message(const AMQP::Message &message, uint64_t received_at, Rpc &rpc) {
+
+      uint64_t published_at = 0;
+
+      if (message.hasHeaders()) {
+        auto& headers = message.headers();
+
+        if (headers.contains(traceparent_header) && headers.get(traceparent_header).isString()) {
+          auto& traceparent = static_cast<const std::string&>(headers.get(traceparent_header));
+          if (trace::is_traceparent(traceparent)) rpc.traceparent = traceparent;
+        }
+
+        if (headers.contains(published_at_header) && headers.get(published_at_header).isInteger()) {
+          published_at = static_cast<uint64_t>(headers.get(published_at_header));
+        }
+      }
+
+      if (message.hasMessageID()) rpc.message_id = message.messageID();
+
+      if (published_at == 0 && message.hasTimestamp()) {
+        published_at = message.timestamp() * 1000000;
+      }
+
+      if (published_at > 0 && received_at > published_at) {
+        rpc.queueing_delay = std::chrono::microseconds(received_at - published_at);
+      }
+    }
+
+    ///
+    /// MARK: - streaming replay
+    ///
+
+    static void set_stream_headers(AMQP::Table &headers, uint64_t sequence, bool last) {
+      headers.set(sequence_header, AMQP::ULongLong(sequence));
+      if (last) headers.set(stream_end_header, AMQP::BooleanSet(true));
+    }
+
+    /***
+     * Read chunk position of streaming replay
+     * @return false if the message is not a chunk
+     */
+    static bool stream_position(const AMQP::Message &message, uint64_t &sequence, bool &last) {
+
+      if (!message.hasHeaders()) return false;
+
+      auto& headers = message.headers();
+
+      if (!headers.contains(sequence_header) || !headers.get(sequence_header).isInteger()) return false;
+
+      sequence = static_cast<uint64_t>(headers.get(sequence_header));
+      last = headers.contains(stream_end_header);
+
+      return true;
+    }
+
+    ///
+    /// MARK: - large messages chunking
+    ///
+
+    static const char* chunk_id_header = "x-capy-chunk-id";
+    static const char* chunk_index_header = "x-capy-chunk-index";
+    static const char* chunk_total_header = "x-capy-chunk-total";
+    static const char* chunk_offset_header = "x-capy-chunk-offset";
+    static const char* chunk_size_header = "x-capy-chunk-size";
+
+    static uint64_t integer_header(const AMQP::Table &headers, const char *name) {
+      if (!headers.contains(name) || !headers.get(name).isInteger()) return 0;
+      return static_cast<uint64_t>(headers.get(name));
+    }
+
+    void BrokerImpl::set_chunking(const Chunking &chunking) {
+      std::lock_guard lock(chunking_mutex_);
+      chunking_ = chunking;
+      chunking_.frame_size = std::max<size_t>(chunking_.frame_size, 1);
+      reassembler_.set_memory_cap(chunking_.memory_cap);
+    }
+
+    Chunking BrokerImpl::get_chunking() const {
+      std::lock_guard lock(chunking_mutex_);
+      return chunking_;
+    }
+
+    Error BrokerImpl::set_compression(const Compression &compression) {
+
+      auto codec = Codec::Make(compression);
+
+      if (!codec) return codec.error();
+
+      std::lock_guard lock(chunking_mutex_);
+      codec_ = *codec;
+
+      return Error(CommonError::OK);
+    }
+
+    Error BrokerImpl::set_spooling(const Spooling &spooling) {
+
+      stop_draining();
+
+      std::shared_ptr<Spool> spool = nullptr;
+
+      if (!spooling.directory.empty()) {
+        auto opened = Spool::Open(spooling);
+        if (!opened) return opened.error();
+        spool = *opened;
+      }
+
+      {
+        std::lock_guard lock(spool_mutex_);
+        spool_ = spool;
+        draining_ = spool != nullptr;
+        spool_pending_ = true;
+      }
+
+      if (spool) drainer_ = std::thread([this]{ drain(); });
+
+      return Error(CommonError::OK);
+    }
+
+    std::shared_ptr<Spool> BrokerImpl::get_spool() {
+      std::lock_guard lock(spool_mutex_);
+      return spool_;
+    }
+
+    void BrokerImpl::set_reply_caching(const ReplyCaching &caching) {
+      std::lock_guard lock(reply_cache_mutex_);
+      reply_cache_ = caching.max_bytes > 0 ? std::make_shared<ReplyCache>(caching) : nullptr;
+    }
+
+    std::shared_ptr<ReplyCache> BrokerImpl::get_reply_cache() const {
+      std::lock_guard lock(reply_cache_mutex_);
+      return reply_cache_;
+    }
+
+    std::shared_ptr<Codec> BrokerImpl::get_codec() const {
+      std::lock_guard lock(chunking_mutex_);
+      return codec_;
+    }
+
+    void BrokerImpl::set_queue_leaders(const std::map<std::string, std::string> &leaders) {
+      std::lock_guard lock(leaders_mutex_);
+      leaders_ = leaders;
+    }
+
+    size_t BrokerImpl::get_leader(const std::string &queue) const {
+
+      std::lock_guard lock(leaders_mutex_);
+
+      auto leader = leaders_.find(queue);
+
+      if (leader == leaders_.end()) return NodeSelector::npos;
+
+      return connections_->get_nodes()->find(leader->second);
+    }
+
+    void BrokerImpl::set_node_selection(const NodeSelection &selection) {
+      connections_->get_nodes()->set_selection(selection);
+    }
+
+    std::vector<NodeState> BrokerImpl::get_nodes() const {
+      return connections_->get_nodes()->get_states();
+    }
+
+    void BrokerImpl::publish_frames(AMQP::Channel &channel,
+                                    const std::string &exchange,
+                                    const std::string &routing_key,
+                                    const std::vector<std::uint8_t> &data,
+                                    int flags,
+                                    const EnvelopePreparer &prepare) {
+
+      auto chunking = get_chunking();
+      auto codec = get_codec();
+
+      ///
+      /// Whole message is compressed before chunking, frames share its content-encoding
+      ///
+      std::vector<std::uint8_t> compressed;
+      auto is_compressed = codec->compress(data, compressed);
+      auto& payload = is_compressed ? compressed : data;
+
+      auto body = static_cast<const char*>((const void *)payload.data());
+
+      auto publish = [&](AMQP::Envelope &envelope, AMQP::Table &&headers) {
+          prepare(envelope, std::move(headers));
+          if (is_compressed) envelope.setContentEncoding(codec->get_encoding());
+          channel.publish(exchange, routing_key, envelope, flags);
+      };
+
+      if (chunking.threshold == 0 || payload.size() <= chunking.threshold) {
+        AMQP::Envelope envelope(body, static_cast<uint64_t>(payload.size()));
+        publish(envelope, AMQP::Table());
+        return;
+      }
+
+      ///
+      /// Frames refer to the encoded message, they are not copied
+      ///
+      auto message_id = make_message_id();
+      auto total = (payload.size() + chunking.frame_size - 1) / chunking.frame_size;
+
+      for (size_t index = 0; index < total; ++index) {
+
+        auto offset = index * chunking.frame_size;
+        auto length = std::min(chunking.frame_size, payload.size() - offset);
+
+        AMQP::Table headers;
+        headers.set(chunk_id_header, AMQP::LongString(message_id));
+        headers.set(chunk_index_header, AMQP::ULong(static_cast<uint32_t>(index)));
+        headers.set(chunk_total_header, AMQP::ULong(static_cast<uint32_t>(total)));
+        headers.set(chunk_offset_header, AMQP::ULongLong(offset));
+        headers.set(chunk_size_header, AMQP::ULongLong(payload.size()));
+
+        AMQP::Envelope envelope(body + offset, static_cast<uint64_t>(length));
+        publish(envelope, std::move(headers));
+      }
+    }
+
+    Result<bool> BrokerImpl::assemble(const AMQP::Message &message, std::vector<std::uint8_t> &buffer) {
+
+      auto body = static_cast<const std::uint8_t *>((const void *) message.body());
+
+      if (!message.hasHeaders() || !message.headers().contains(chunk_id_header)) {
+        buffer.assign(body, body + message.bodySize());
+        return decompress(message, buffer);
+      }
+
+      auto& headers = message.headers();
+
+      Reassembler::Frame frame;
+      frame.message_id = static_cast<const std::string&>(headers.get(chunk_id_header));
+      frame.index = static_cast<uint32_t>(integer_header(headers, chunk_index_header));
+      frame.total = static_cast<uint32_t>(integer_header(headers, chunk_total_header));
+      frame.offset = integer_header(headers, chunk_offset_header);
+      frame.size = integer_header(headers, chunk_size_header);
+
+      auto state = reassembler_.push(frame, body, message.bodySize(), buffer);
+
+      if (!state) return capy::make_unexpected(state.error());
+
+      if (*state != Reassembler::State::complete) return false;
+
+      return decompress(message, buffer);
+    }
+
+    Result<bool> BrokerImpl::decompress(const AMQP::Message &message, std::vector<std::uint8_t> &buffer) {
+
+      ///
+      /// Encodings the codec does not produce, such as utf-8 or identity, are passed through
+      ///
+      if (!message.hasContentEncoding() || !Codec::is_compressed(message.contentEncoding())) return true;
+
+      auto decompressed = get_codec()->decompress(message.contentEncoding(), buffer);
+
+      if (!decompressed) return capy::make_unexpected(decompressed.error());
+
+      buffer = std::move(*decompressed);
+
+      return true;
+    }
+
+    /***
+     * Encode worker replay, errors and empty replay are sent as error objects
+     * @param message replay message
+     * @param allow_empty empty message is the end of stream marker
+     * @return msgpack data
+     */
+    static std::vector<std::uint8_t> encode_replay(const Payload &message, bool allow_empty) {
+
+      if (!message.has_value()) {
+        return json::to_msgpack(capy::json({"error",
+                                            {{"code", message.error().value()}, {"message", message.error().message()}}}));
+      }
+
+      if (message.value().empty() && !allow_empty) {
+        return json::to_msgpack(capy::json({"error",
+                                            {{"code", BrokerError::EMPTY_REPLAY}, {"message", "worker replay is empty"}}}));
+      }
+
+      return json::to_msgpack(message.value().empty() ? capy::json() : message.value());
+    }
+
+    inline static std::string create_unique_id() {
+      static int n = 1;
+      std::ostringstream os;
+      os << n++;
+      return os.str();
+    }
+
+    BrokerImpl::BrokerImpl(const capy::amqp::Address &address,
+                           const std::string &exchange_name,
+                           uint16_t heartbeat_timeout,
+                           const ConnectionOptions &options):
+            exchange_name_(exchange_name),
+            metrics_(std::make_shared<Metrics>()),
+            loop_(std::shared_ptr<uv_loop_t>(uv_loop_t_allocator(), uv_loop_t_deallocator())),
+            connections_(std::make_unique<ConnectionCache>(address,
+                                                           loop_,
+                                                           [this](const std::function<void()>& task){ post(task); },
+                                                           heartbeat_timeout,
+                                                           options,
+                                                           metrics_)),
+            dispatch_(std::make_unique<PriorityDispatch>(loop_.get())),
+            fetchers_(),
+            gatherers_(),
+            listeners_(),
+            batch_listeners_(),
+            samplers_(),
+            queue_stats_(),
+            shard_maps_(),
+            control_mutex_(),
+            control_(nullptr),
+            control_failed_(false),
+            chunking_mutex_(),
+            chunking_(),
+            reassembler_(chunking_.memory_cap),
+            codec_(*Codec::Make(Compression())),
+            reply_cache_mutex_(),
+            reply_cache_(nullptr),
+            flights_mutex_(),
+            flights_(),
+            spool_mutex_(),
+            spool_wakeup_(),
+            spool_(nullptr),
+            draining_(false),
+            spool_pending_(false),
+            drainer_(),
+            stopping_(false),
+            released_(false),
+            cancelled_(false),
+            cancelling_(0),
+            replays_(0),
+            tasks_mutex_(),
+            tasks_(),
+            wakeup_(new uv_async_t),
+            loop_running_(false),
+            loop_thread_id_()
+    {
+      uv_async_init(loop_.get(), wakeup_, run_tasks);
+      wakeup_->data = this;
+
+      ///
+      /// Posting tasks does not keep the loop alive
+      ///
+      uv_unref(reinterpret_cast<uv_handle_t*>(wakeup_));
+    }
+
+    BrokerImpl::~BrokerImpl() {
+
+      stop_draining();
+
+      if (thread_loop_.joinable()) {
+        if (thread_loop_.get_id() == std::this_thread::get_id()) {
+          ///
+          /// Broker released by a handler is deleted by its loop thread after uv_run returns
+          ///
+          thread_loop_.detach();
+        }
+        else {
+          shutdown(std::chrono::milliseconds(0));
+        }
+      }
+
+      control_.reset();
+
+      ///
+      /// Deferred objects close their timers and channels before the connections
+      ///
+      samplers_.flush();
+      listeners_.flush();
+      batch_listeners_.flush();
+      fetchers_.flush();
+      gatherers_.flush();
+
+      connections_->flush();
+
+      uv_close(reinterpret_cast<uv_handle_t*>(wakeup_), [](uv_handle_t* handle){
+          delete reinterpret_cast<uv_async_t*>(handle);
+      });
+
+      dispatch_->close();
+
+      ///
+      /// Stopped connections close their sockets, cancelled resolving is completed by the next pass
+      ///
+      for (int pass = 0; pass < 2; ++pass) {
+        uv_run(loop_.get(), UV_RUN_NOWAIT);
+      }
+    }
+
+    void BrokerImpl::Release(BrokerImpl *impl) {
+
+      {
+        std::lock_guard lock(impl->tasks_mutex_);
+
+        if (impl->loop_thread_id_ == std::this_thread::get_id()) {
+          ///
+          /// The last broker reference is released by a handler, the broker and its loop are still
+          /// used by the callers on the stack, so the loop is stopped and deletes the broker when loop() returns
+          ///
+          impl->released_ = true;
+          if (impl->loop_running_) uv_stop(impl->loop_.get());
+          return;
+        }
+      }
+
+      delete impl;
+    }
+
+    ///
+    /// MARK: - loop
+    ///
+
+    void BrokerImpl::post(const std::function<void()> &task) {
+      {
+        std::lock_guard lock(tasks_mutex_);
+        if (loop_running_ && loop_thread_id_ != std::this_thread::get_id()) {
+          tasks_.push_back(task);
+          uv_async_send(wakeup_);
+          return;
+        }
+      }
+      task();
+    }
+
+    void BrokerImpl::post_later(const std::function<void()> &task) {
+      std::lock_guard lock(tasks_mutex_);
+      tasks_.push_back(task);
+      uv_async_send(wakeup_);
+    }
+
+    void BrokerImpl::run_tasks(uv_async_t *handle) {
+
+      auto broker = static_cast<BrokerImpl*>(handle->data);
+
+      std::vector<std::function<void()>> tasks;
+
+      {
+        std::lock_guard lock(broker->tasks_mutex_);
+        tasks.swap(broker->tasks_);
+      }
+
+      for (auto& task: tasks) task();
+    }
+
+    void BrokerImpl::loop() {
+
+      {
+        std::lock_guard lock(tasks_mutex_);
+        loop_thread_id_ = std::this_thread::get_id();
+        loop_running_ = true;
+      }
+
+      /**
+        uv_timer_t timer_req;
+
+        timer_req.data = this;
+
+        uv_timer_init(loop_.get(), &timer_req);
+        xuv_timer_start(&timer_req, monitor, 0, 1000);
+       */
+
+      uv_run(loop_.get(), UV_RUN_DEFAULT);
+
+      {
+        std::lock_guard lock(tasks_mutex_);
+        loop_running_ = false;
+      }
+
+      ///
+      /// Tasks were posted while the loop was exiting
+      ///
+      run_tasks(wakeup_);
+
+      bool released = false;
+
+      {
+        std::lock_guard lock(tasks_mutex_);
+        loop_thread_id_ = std::thread::id();
+        released = released_;
+      }
+
+      if (released) delete this;
+    }
+
+    void BrokerImpl::run(const Broker::Launch launch) {
+
+      if (stopping_) return;
+
+      switch (launch) {
+        case Broker::Launch ::async:
+          thread_loop_ = std::thread([this] {
+              loop();
+          });
+          break;
+
+        case Broker::Launch::sync:
+          loop();
+          break;
+      }
+    }
+
+    Error BrokerImpl::run(const Broker::Launch launch, const ThreadAffinity &affinity) {
+
+      if (stopping_) return Error(BrokerError::SHUTDOWN, "broker loop is not started");
+
+      switch (launch) {
+        case Broker::Launch::async:
+        {
+          std::promise<Error> applied;
+          auto result = applied.get_future();
+
+          thread_loop_ = std::thread([this, affinity, &applied] {
+
+              ///
+              /// Loop buffers are allocated by the loop thread, so they follow its memory policy
+              ///
+              applied.set_value(affinity.apply());
+
+              loop();
+          });
+
+          return result.get();
+        }
+
+        case Broker::Launch::sync:
+        {
+          auto error = affinity.apply();
+          loop();
+          return error;
+        }
+      }
+
+      return Error(CommonError::OK);
+    }
+
+    ///
+    /// MARK: - shutdown
+    ///
+
+    void BrokerImpl::cancel_consumers() {
+
+      auto cancel = [this](const std::vector<std::pair<Channel*, std::string>>& consumers) {
+          for (auto& [channel, tag]: consumers) {
+            cancelling_++;
+            channel->cancel(tag)
+                    .onSuccess([this](const std::string &tag){
+                        (void) tag;
+                        cancelling_--;
+                    })
+                    .onError([this](const char *message) {
+                        (void) message;
+                        cancelling_--;
+                    });
+          }
+      };
+
+      for (auto& id: listeners_.keys()) {
+        if (auto listener = listeners_.get(id)) cancel(listener->get_consumer_tags());
+      }
+
+      for (auto& id: batch_listeners_.keys()) {
+        if (auto listener = batch_listeners_.get(id)) cancel(listener->get_consumer_tags());
+        flush_batch(id);
+      }
+
+      ///
+      /// Prefetched deliveries of priority queues are handled in the priority order
+      ///
+      dispatch_->drain();
+
+      cancelled_ = true;
+    }
+
+    void BrokerImpl::close_connections() {
+
+      std::lock_guard lock(control_mutex_);
+
+      control_.reset();
+
+      ///
+      /// Channels are closed by the deferred destructors
+      ///
+      samplers_.flush();
+      listeners_.flush();
+      batch_listeners_.flush();
+      fetchers_.flush();
+      gatherers_.flush();
+
+      connections_->close();
+    }
+
+    Error BrokerImpl::shutdown(std::chrono::milliseconds deadline) {
+
+      {
+        std::lock_guard lock(tasks_mutex_);
+        if (loop_running_ && loop_thread_id_ == std::this_thread::get_id()) {
+          return Error(CommonError::NOT_SUPPORTED, "broker can not be shut down by the loop thread");
+        }
+      }
+
+      if (stopping_.exchange(true)) return Error(CommonError::OK);
+
+      auto expires = std::chrono::steady_clock::now() + deadline;
+
+      auto wait = [this, &expires](const std::function<bool()>& done){
+          while (!done()) {
+            {
+              std::lock_guard lock(tasks_mutex_);
+              if (!loop_running_) return false;
+            }
+            if (std::chrono::steady_clock::now() >= expires) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+          }
+          return true;
+      };
+
+      post([this]{ cancel_consumers(); });
+
+      ///
+      /// Replays are committed by transactions, so their commit-ok is the broker confirmation
+      ///
+      auto drained = wait([this]{
+          return cancelled_ && cancelling_ == 0 && replays_ == 0 && fetchers_.metrics() + gatherers_.metrics() == 0;
+      });
+
+      auto replays = replays_.load();
+      auto fetches = fetchers_.metrics() + gatherers_.metrics();
+
+      ///
+      /// Messages left in the spool are republished by the next process
+      ///
+      stop_draining();
+
+      post([this]{ close_connections(); });
+
+      wait([this]{ return connections_->is_closed(); });
+
+      ///
+      /// Loop is stopped even if the server does not confirm closing or some handles are still active
+      ///
+      post([this]{
+          std::lock_guard lock(tasks_mutex_);
+          if (loop_running_) uv_stop(loop_.get());
+      });
+
+      if (thread_loop_.joinable()) thread_loop_.join();
+
+      if (!drained) {
+        return Error(BrokerError::SHUTDOWN,
+                     error_string("shutdown deadline is expired: %zu replays, %zu fetches are not completed",
+                                  replays, fetches));
+      }
+
+      return Error(CommonError::OK);
+    }
+
+    MetricsSnapshot BrokerImpl::get_metrics() {
+      auto snapshot = metrics_->snapshot();
+      snapshot.fetch_outstanding = fetchers_.metrics() + gatherers_.metrics();
+      return snapshot;
+    }
+
+    ///
+    /// MARK: - queue statistics
+    ///
+
+    static constexpr auto control_timeout = std::chrono::seconds(5);
+
+    void BrokerImpl::request_queue_stats(const std::string &queue, const QueueStatsHandler &on_stats) {
+
+      std::lock_guard lock(control_mutex_);
+
+      ///
+      /// Passive declaration of absent queue closes the channel
+      ///
+      if (!control_ || control_failed_) {
+        control_.reset(connections_->new_channel());
+        control_failed_ = false;
+      }
+
+      control_
+
+              ->declareQueue(queue, AMQP::passive)
+
+              .onSuccess([this, queue, on_stats](const std::string &name, uint32_t messagecount, uint32_t consumercount) {
+                  (void) name;
+
+                  QueueStats stats;
+                  stats.queue = queue;
+                  stats.message_count = messagecount;
+                  stats.consumer_count = consumercount;
+                  stats.sampled_at = std::chrono::steady_clock::now();
+
+                  if (auto previous = queue_stats_.get(queue)) {
+                    auto seconds = std::chrono::duration<double>(stats.sampled_at - previous->sampled_at).count();
+                    if (seconds > 0) {
+                      stats.message_rate = (static_cast<double>(stats.message_count)
+                                            - static_cast<double>(previous->message_count)) / seconds;
+                    }
+                    else {
+                      stats.message_rate = previous->message_rate;
+                    }
+                  }
+
+                  queue_stats_.set(queue, std::make_shared<QueueStats>(stats));
+
+                  on_stats(stats);
+              })
+
+              .onError([this, queue, on_stats](const char *message) {
+                  control_failed_ = true;
+                  queue_stats_.del(queue);
+                  on_stats(capy::make_unexpected(Error(BrokerError::QUEUE_DECLARATION, message)));
+              });
+    }
+
+    Result<QueueStats> BrokerImpl::get_queue_stats(const std::string &queue, std::chrono::milliseconds ttl) {
+
+      auto previous = queue_stats_.get(queue);
+      auto now = std::chrono::steady_clock::now();
+
+      if (previous && ttl.count() > 0 && now - previous->sampled_at < ttl) {
+        return *previous;
+      }
+
+      ///
+      /// The loop thread would wait for the declaration it has to receive itself
+      ///
+      {
+        std::lock_guard lock(tasks_mutex_);
+        if (loop_running_ && loop_thread_id_ == std::this_thread::get_id()) {
+          return capy::make_unexpected(
+                  Error(CommonError::NOT_SUPPORTED, "queue statistics can not be waited by the loop thread"));
+        }
+      }
+
+      auto declaration = std::make_shared<std::promise<Result<QueueStats>>>();
+      auto received = declaration->get_future();
+
+      request_queue_stats(queue, [declaration](const Result<QueueStats>& stats){
+          try { declaration->set_value(stats); } catch (...) {}
+      });
+
+      if (received.wait_for(control_timeout) != std::future_status::ready) {
+        control_failed_ = true;
+        return capy::make_unexpected(Error(BrokerError::QUEUE_DECLARATION, "queue statistics timeout"));
+      }
+
+      return received.get();
+    }
+
+    DeferredQueueStats& BrokerImpl::sample_queue(const std::string &queue, std::chrono::milliseconds interval) {
+
+      if (auto sampler = samplers_.get(queue)) {
+        return *sampler;
+      }
+
+      samplers_.set(queue, std::make_shared<DeferredSampling>(interval));
+
+      auto deferred = samplers_.get(queue);
+
+      ///
+      /// Sampler timer is run by the loop, it stops when the sampler is removed from samplers
+      ///
+      post([this, queue]{
+
+          auto deferred = samplers_.get(queue);
+          if (!deferred) return;
+
+          deferred->start_timer(loop_.get(), [this, queue]{
+
+              if (!samplers_.has(queue)) return;
+
+              request_queue_stats(queue, [this, queue](const Result<QueueStats>& stats){
+
+                  auto deferred = samplers_.get(queue);
+                  if (!deferred) return;
+
+                  if (stats)
+                    deferred->report_data(*stats);
+                  else
+                    deferred->report_error(stats.error());
+              });
+          });
+      });
+
+      return *deferred;
+    }
+
+    void BrokerImpl::stop_sampling(const std::string &queue) {
+      ///
+      /// Sampler timer is closed by the loop thread
+      ///
+      post([this, queue]{ samplers_.del(queue); });
+    }
+
+    ///
+    /// MARK: - publish
+    ///
+
+    Error BrokerImpl::publish_message(const capy::json &message,
+                                      const std::string &routing_key,
+                                      uint8_t priority,
+                                      const std::string &id) {
+
+      if (stopping_) {
+        return Error(BrokerError::SHUTDOWN, error_string("message is not published to %s", routing_key.c_str()));
+      }
+
+      std::promise<Result<std::string>> queue_declaration;
+
+      CAPY_AMQP_TRACE_SPAN("publish");
+
+      auto encoding = trace::now();
+      auto data = json::to_msgpack(message);
+      trace::record("publish.encode", encoding);
+
+      ///
+      /// Messages are spooled after the earlier spooled ones until the spool is drained
+      ///
+      auto spool = get_spool();
+      auto message_id = id.empty() ? make_message_id() : id;
+
+      if (spool && (!spool->empty() || !connections_->is_available())) {
+        return spool_message(spool, routing_key, message_id, priority, data);
+      }
+
+      auto traceparent = trace::make_traceparent();
+
+      auto opening = trace::now();
+      auto channel = connections_->new_channel();
+      trace::record("publish.channel", opening);
+
+      std::promise<std::string> publish_barrier;
+
+      auto started = metrics_clock::now();
+      auto committing = trace::now();
+
+      channel->startTransaction();
+
+      publish_frames(*channel, exchange_name_, routing_key, data, AMQP::autodelete|AMQP::mandatory,
+                     [&traceparent, &message_id, priority](AMQP::Envelope &envelope, AMQP::Table &&headers){
+                         envelope.setDeliveryMode(2);
+                         envelope.setMessageID(message_id);
+                         if (priority > 0) envelope.setPriority(priority);
+                         stamp_envelope(envelope, traceparent, std::move(headers));
+                     });
+
+      channel->commitTransaction()
+              .onSuccess([&publish_barrier](){
+                  publish_barrier.set_value("");
+              })
+              .onError([&publish_barrier](const char *message) {
+                  publish_barrier.set_value(message);
+              });
+
+      auto error = publish_barrier.get_future().get();
+
+      trace::record("publish.commit", committing);
+
+      delete channel;
+
+      if (!error.empty()){
+
+        if (spool && connections_->is_lost()) {
+          return spool_message(spool, routing_key, message_id, priority, data);
+        }
+
+        metrics_->publish_errors.add();
+        return Error(amqp::BrokerError::PUBLISH, error);
+      }
+
+      metrics_->publish_latency.record(started);
+      metrics_->publish_count.add();
+      metrics_->publish_bytes.add(data.size());
+
+      return Error(amqp::CommonError::OK);
+    }
+
+    ///
+    /// MARK: - spool
+    ///
+
+    Error BrokerImpl::spool_message(const std::shared_ptr<Spool> &spool,
+                                    const std::string &routing_key,
+                                    const std::string &message_id,
+                                    uint8_t priority,
+                                    const std::vector<std::uint8_t> &data) {
+
+      if (auto error = spool->append(routing_key, message_id, priority, data)) {
+        metrics_->spool_rejected.add();
+        return error;
+      }
+
+      metrics_->spooled.add();
+
+      {
+        std::lock_guard lock(spool_mutex_);
+        spool_pending_ = true;
+      }
+
+      spool_wakeup_.notify_one();
+
+      return Error(amqp::CommonError::OK);
+    }
+
+    void BrokerImpl::drain() {
+
+      std::unique_lock lock(spool_mutex_);
+
+      while (draining_) {
+
+        auto spool = spool_;
+        auto failed = false;
+
+        spool_pending_ = false;
+
+        lock.unlock();
+
+        while (!spool->empty() && connections_->is_available()) {
+          {
+            std::lock_guard stop_lock(spool_mutex_);
+            if (!draining_) break;
+          }
+          if (drain_batch(spool)) {
+            failed = true;
+            break;
+          }
+        }
+
+        lock.lock();
+
+        ///
+        /// Failed batch and unavailable nodes are retried later, new messages do not wake up the drainer
+        ///
+        if (failed || !spool->empty()) {
+          spool_wakeup_.wait_for(lock, spool->get_spooling().retry_interval, [this]{ return !draining_; });
+        }
+        else {
+          spool_wakeup_.wait(lock, [this]{ return !draining_ || spool_pending_; });
+        }
+      }
+    }
+
+    Error BrokerImpl::drain_batch(const std::shared_ptr<Spool> &spool) {
+
+      Spool::Cursor cursor;
+
+      auto records = spool->read(spool_batch, cursor);
+
+      if (records.empty()) return Error(amqp::CommonError::OK);
+
+      struct Confirms {
+          std::mutex mutex;
+          std::promise<std::string> barrier;
+          uint64_t expected = 0;
+          uint64_t acked = 0;
+          bool published = false;
+          bool completed = false;
+
+          void complete(const std::string& error) {
+            if (completed) return;
+            completed = true;
+            barrier.set_value(error);
+          }
+
+          void check() {
+            if (published && acked >= expected) complete("");
+          }
+      };
+
+      auto confirms = std::make_shared<Confirms>();
+      auto completion = confirms->barrier.get_future();
+
+      auto channel = std::unique_ptr<Channel>(connections_->new_channel());
+
+      channel->onError([confirms](const char* message){
+          std::lock_guard lock(confirms->mutex);
+          confirms->complete(message);
+      });
+
+      channel->confirmSelect()
+              .onAck([confirms](uint64_t delivery_tag, bool multiple){
+                  std::lock_guard lock(confirms->mutex);
+                  confirms->acked = multiple ? std::max(confirms->acked, delivery_tag) : confirms->acked + 1;
+                  confirms->check();
+              })
+              .onNack([confirms](uint64_t, bool, bool){
+                  std::lock_guard lock(confirms->mutex);
+                  confirms->complete("spooled message is rejected by the broker");
+              })
+              .onError([confirms](const char* message){
+                  std::lock_guard lock(confirms->mutex);
+                  confirms->complete(message);
+              });
+
+      ///
+      /// Every frame of chunked message is confirmed
+      ///
+      uint64_t frames = 0;
+
+      for (auto& record: records) {
+
+        auto traceparent = trace::make_traceparent();
+        auto priority = record.priority;
+        auto& message_id = record.message_id;
+
+        publish_frames(*channel, exchange_name_, record.routing_key, record.data, AMQP::autodelete|AMQP::mandatory,
+                       [&traceparent, &frames, &message_id, priority](AMQP::Envelope &envelope, AMQP::Table &&headers){
+                           envelope.setDeliveryMode(2);
+                           if (!message_id.empty()) envelope.setMessageID(message_id);
+                           if (priority > 0) envelope.setPriority(priority);
+                           stamp_envelope(envelope, traceparent, std::move(headers));
+                           frames++;
+                       });
+      }
+
+      {
+        std::lock_guard lock(confirms->mutex);
+        confirms->expected = frames;
+        confirms->published = true;
+        confirms->check();
+      }
+
+      auto expires = std::chrono::steady_clock::now() + spool_confirm_timeout;
+
+      while (completion.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+
+        std::lock_guard lock(spool_mutex_);
+
+        if (!draining_ || std::chrono::steady_clock::now() >= expires) {
+          return Error(BrokerError::SPOOL, "spooled messages are not confirmed");
+        }
+      }
+
+      auto error = completion.get();
+
+      if (!error.empty()) return Error(BrokerError::SPOOL, error);
+
+      if (auto commit_error = spool->commit(cursor)) return commit_error;
+
+      metrics_->spool_drained.add(records.size());
+      metrics_->publish_count.add(records.size());
+
+      return Error(amqp::CommonError::OK);
+    }
+
+    void BrokerImpl::stop_draining() {
+
+      {
+        std::lock_guard lock(spool_mutex_);
+        draining_ = false;
+      }
+
+      spool_wakeup_.notify_all();
+
+      if (drainer_.joinable()) drainer_.join();
+    }
+
+    ///
+    /// MARK: - fetch
+    ///
+
+    inline static Payload to_payload(const std::vector<std::uint8_t> &buffer) {
+
+      try {
+        return json::from_msgpack(buffer);
+      }
+      catch (std::exception &exception) {
+        return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, exception.what()));
+      }
+      catch (...) {
+        return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "unknown error"));
+      }
+    }
+
+    /***
+     * Check the reply is the error object is sent by encode_replay()
+     * @param reply decoded reply
+     * @return true if the worker has failed
+     */
+    static bool is_error_reply(const capy::json &reply) {
+      return reply.is_array() && reply.size() == 2 && reply[0] == "error" && reply[1].is_object();
+    }
+
+    void BrokerImpl::complete_flight(const std::string &flight, const Payload &reply) {
+
+      if (flight.empty()) return;
+
+      std::vector<std::string> followers;
+
+      {
+        std::lock_guard lock(flights_mutex_);
+        auto found = flights_.find(flight);
+        if (found == flights_.end()) return;
+        followers.swap(found->second.followers);
+        flights_.erase(found);
+      }
+
+      for (auto& id: followers) {
+
+        auto deferred = fetchers_.get(id);
+
+        if (!deferred) continue;
+
+        if (reply) deferred->report_data(reply);
+        else deferred->report_error(reply.error());
+
+        fetchers_.del(id);
+      }
+    }
+
+    DeferredFetch& BrokerImpl::fetch_cached_message(
+            const capy::json &message,
+            const std::string &routing_key,
+            uint8_t priority) {
+
+      auto correlation_id = create_unique_id();
+
+      ///
+      /// Cached fetch is started by seal(), so the cached or shared reply is reported after the handlers are set.
+      /// It is started the same way when caching is disabled
+      ///
+      auto deferred = std::make_shared<capy::amqp::DeferredCachedFetching>(
+              [this, correlation_id, message, routing_key, priority]{
+                  start_cached_fetch(correlation_id, message, routing_key, priority);
+              });
+
+      fetchers_.set(correlation_id, deferred);
+
+      return *deferred;
+    }
+
+    void BrokerImpl::start_cached_fetch(const std::string &correlation_id,
+                                        const capy::json &message,
+                                        const std::string &routing_key,
+                                        uint8_t priority) {
+
+      auto cache = get_reply_cache();
+
+      if (!cache) {
+
+        fetch_message(message, routing_key, false, priority)
+
+                .on_data([this, correlation_id](const Payload &reply){
+                    if (auto deferred = fetchers_.get(correlation_id)) {
+                      deferred->report_data(reply);
+                      fetchers_.del(correlation_id);
+                    }
+                })
+
+                .on_error([this, correlation_id](const Error &error){
+                    if (auto deferred = fetchers_.get(correlation_id)) {
+                      deferred->report_error(error);
+                      fetchers_.del(correlation_id);
+                    }
+                })
+
+                .seal();
+
+        return;
+      }
+
+      auto request = json::to_msgpack(message);
+      auto flight = ReplyCache::make_key(routing_key, request);
+
+      if (auto reply = cache->get(flight, request)) {
+
+        metrics_->fetch_count.add();
+        metrics_->reply_cache_hits.add();
+
+        post_later([this, correlation_id, reply = std::move(*reply)]{
+            if (auto deferred = fetchers_.get(correlation_id)) {
+              deferred->report_data(reply);
+              fetchers_.del(correlation_id);
+            }
+        });
+
+        return;
+      }
+
+      {
+        std::lock_guard lock(flights_mutex_);
+
+        auto now = metrics_clock::now();
+        auto joined = flights_.find(flight);
+
+        ///
+        /// Fetch joined the identical one in flight gets its reply and opens no channel
+        ///
+        if (joined != flights_.end() && now - joined->second.started < cache->get_caching().ttl) {
+          metrics_->fetch_count.add();
+          metrics_->reply_cache_collapsed.add();
+          joined->second.followers.push_back(correlation_id);
+          return;
+        }
+
+        metrics_->reply_cache_misses.add();
+
+        ///
+        /// Fetch in flight longer than ttl is not joined, its reply may be lost, so the new fetch
+        /// completes the waiting ones too
+        ///
+        auto& leading = flights_[flight];
+        leading.started = now;
+        leading.followers.push_back(correlation_id);
+      }
+
+      auto& fetching = fetch_message(message, routing_key, false, priority);
+
+      fetching
+
+              .on_data([this, &fetching, cache, flight, request](const Payload &reply){
+                  ///
+                  /// Worker errors and replies that are not decoded are passed to the waiting fetches, not cached
+                  ///
+                  auto size = fetching.get_reply_size();
+                  if (reply && size > 0 && !is_error_reply(*reply)) cache->set(flight, request, *reply, size);
+                  complete_flight(flight, reply);
+              })
+
+              .on_error([this, flight](const Error &error){
+                  complete_flight(flight, capy::make_unexpected(error));
+              })
+
+              .seal();
+    }
+
+    DeferredFetching& BrokerImpl::fetch_message(
+            const capy::json &message,
+            const std::string &routing_key,
+            bool streaming,
+            uint8_t priority,
+            const std::string &id) {
+
+      auto correlation_id = create_unique_id();
+      auto started = metrics_clock::now();
+      auto tracing = trace::now();
+
+      metrics_->fetch_count.add();
+
+      fetchers_.set(correlation_id,
+                    std::make_shared<capy::amqp::DeferredFetching>(connections_.get()));
+
+      trace::record("fetch.channel", tracing);
+
+      auto  deferred = fetchers_.get(correlation_id).get();
+      auto& channel = deferred->get_channel();
+
+      channel
+
+              .declareQueue(AMQP::exclusive | AMQP::autodelete)
+
+              .onSuccess(
+                      [
+                              this,
+                              message,
+                              routing_key,
+                              correlation_id,
+                              started,
+                              tracing,
+                              streaming,
+                              priority,
+                              id
+                      ]
+                              (const std::string &name, uint32_t messagecount, uint32_t consumercount) {
+                          (void) consumercount;
+                          (void) messagecount;
+
+                          trace::record("fetch.declare", tracing);
+
+                          auto encoding = trace::now();
+                          auto data = json::to_msgpack(message);
+                          trace::record("fetch.encode", encoding);
+
+                          auto traceparent = trace::make_traceparent();
+                          auto message_id = id.empty() ? make_message_id() : id;
+
+                          if (!fetchers_.has(correlation_id)) {
+                            return;
+                          }
+
+                          auto& channel = fetchers_.get(correlation_id)->get_channel();
+
+                          channel.startTransaction();
+
+                          publish_frames(channel, exchange_name_, routing_key, data, AMQP::autodelete|AMQP::mandatory,
+                                         [&correlation_id, &name, &traceparent, &message_id, priority](AMQP::Envelope &envelope, AMQP::Table &&headers){
+                                             envelope.setDeliveryMode(2);
+                                             envelope.setMessageID(message_id);
+                                             if (priority > 0) envelope.setPriority(priority);
+                                             envelope.setCorrelationID(correlation_id);
+                                             envelope.setReplyTo(name);
+                                             stamp_envelope(envelope, traceparent, std::move(headers));
+                                         });
+
+                          metrics_->publish_count.add();
+                          metrics_->publish_bytes.add(data.size());
+
+                          auto committing = trace::now();
+
+                          channel
+                                  .commitTransaction()
+                                  .onSuccess([committing]{
+                                      trace::record("fetch.commit", committing);
+                                  })
+                                  .onError([this, correlation_id](const char *message) {
+                                      metrics_->publish_errors.add();
+                                      if (fetchers_.has(correlation_id))
+                                        fetchers_.get(correlation_id)->report_error(Error(BrokerError::PUBLISH, message));
+                                  });
+
+
+                          ///
+                          /// Streaming replay is acknowledged chunk by chunk, prefetch bounds received chunks
+                          ///
+                          if (streaming) channel.setQos(stream_prefetch);
+
+                          channel
+
+                                  .consume(name, streaming ? 0 : AMQP::noack)
+
+                                  .onReceived([name, this, correlation_id, started, tracing, streaming](
+
+                                          const AMQP::Message &message,
+                                          uint64_t deliveryTag,
+                                          bool redelivered) {
+
+                                      (void) redelivered;
+
+                                      if (streaming) {
+                                        receive_chunk(correlation_id, message, deliveryTag, started);
+                                        return;
+                                      }
+
+                                      std::vector<std::uint8_t> buffer;
+                                      auto assembled = assemble(message, buffer);
+
+                                      if (!assembled) {
+                                        if (fetchers_.has(correlation_id)) {
+                                          fetchers_.get(correlation_id)->report_error(assembled.error());
+                                          fetchers_.del(correlation_id);
+                                        }
+                                        return;
+                                      }
+
+                                      if (!*assembled) return;
+
+                                      metrics_->fetch_latency.record(started);
+                                      trace::record("fetch.roundtrip", tracing);
+
+                                      auto decoding = trace::now();
+
+                                      capy::json received;
+
+                                      try {
+                                        received = json::from_msgpack(buffer);
+                                        if (auto deferred = fetchers_.get(correlation_id))
+                                          deferred->set_reply_size(buffer.size());
+                                      }
+                                      catch (std::exception &exception) {
+                                        if (fetchers_.has(correlation_id))
+                                          fetchers_.get(correlation_id)->report_error(Error(BrokerError::DATA_RESPONSE, exception.what()));
+                                      }
+                                      catch (...) {
+                                        if (fetchers_.has(correlation_id))
+                                          fetchers_.get(correlation_id)->report_error(Error(BrokerError::DATA_RESPONSE, "unknown error"));
+                                      }
+
+                                      trace::record("fetch.decode", decoding);
+
+                                      {
+                                        ///
+                                        /// Report data callback
+                                        ///
+
+                                        try {
+                                          CAPY_AMQP_TRACE_SPAN("fetch.handler");
+                                          if (fetchers_.has(correlation_id))
+                                            fetchers_.get(correlation_id)->report_data(received);
+                                        }
+                                        catch (json::exception &exception) {
+                                          ///
+                                          /// Some programmatic exception is not processing properly
+                                          ///
+
+                                          throw_abort(exception.what());
+                                        }
+                                        catch (...) {
+                                          throw_abort("Unexpected exception...");
+                                        }
+
+                                        if (fetchers_.has(correlation_id))
+                                          fetchers_.del(correlation_id);
+
+                                      }
+
+                                  })
+
+                                  .onSuccess([this,correlation_id]{
+                                      if (fetchers_.has(correlation_id))
+                                        fetchers_.get(correlation_id)->report_success();
+                                  })
+
+                                  .onError([correlation_id, this](const char *message) {
+                                      if (fetchers_.has(correlation_id)){
+                                        fetchers_.get(correlation_id)->report_error(Error(BrokerError::DATA_RESPONSE, message));
+                                        fetchers_.del(correlation_id);
+                                      }
+                                  });
+
+                      })
+
+              .onError([this, correlation_id](const char *message) {
+                  if (fetchers_.has(correlation_id)){
+                    fetchers_.get(correlation_id)->report_error(Error(BrokerError::QUEUE_DECLARATION, message));
+                    fetchers_.del(correlation_id);
+                  }
+              });
+
+      return *deferred;
+    }
+
+    void BrokerImpl::receive_chunk(const std::string &correlation_id,
+                                   const AMQP::Message &message,
+                                   uint64_t delivery_tag,
+                                   const metrics_clock::time_point &started) {
+
+      auto deferred = fetchers_.get(correlation_id);
+
+      if (!deferred) return;
+
+      deferred->get_channel().ack(delivery_tag);
+
+      std::vector<std::uint8_t> buffer;
+      auto assembled = assemble(message, buffer);
+
+      if (assembled && !*assembled) return;
+
+      uint64_t sequence = 0;
+      bool last = true;
+
+      ///
+      /// Not streaming replay is the single chunk
+      ///
+      stream_position(message, sequence, last);
+
+      if (sequence == 0) metrics_->fetch_latency.record(started);
+
+      auto ready = deferred->order(sequence, last,
+                                   assembled ? to_payload(buffer) : capy::make_unexpected(assembled.error()));
+
+      try {
+        if (!ready) {
+          deferred->report_error(ready.error());
+          fetchers_.del(correlation_id);
+          return;
+        }
+
+        for (auto &chunk: *ready) {
+          deferred->report_data(chunk);
+        }
+      }
+      catch (json::exception &exception) {
+        ///
+        /// Some programmatic exception is not processing properly
+        ///
+
+        throw_abort(exception.what());
+      }
+      catch (...) {
+        throw_abort("Unexpected exception...");
+      }
+
+      if (deferred->is_complete()) {
+        fetchers_.del(correlation_id);
+      }
+    }
+
+    ///
+    /// MARK: - fetch many
+    ///
+
+    void BrokerImpl::complete_gathering(const std::string &correlation_id) {
+
+      auto deferred = gatherers_.get(correlation_id);
+
+      if (!deferred) return;
+
+      deferred->stop_timer();
+
+      gatherers_.del(correlation_id);
+
+      try {
+        deferred->report_data(deferred->get_payloads());
+      }
+      catch (json::exception &exception) {
+        ///
+        /// Some programmatic exception is not processing properly
+        ///
+
+        throw_abort(exception.what());
+      }
+      catch (...) {
+        throw_abort("Unexpected exception...");
+      }
+    }
+
+    DeferredFetchMany& BrokerImpl::fetch_many_messages(
+            const capy::json &message,
+            const std::vector<std::string> &routing_keys,
+            const FetchPolicy &policy) {
+
+      auto correlation_id = create_unique_id();
+
+      metrics_->fetch_count.add(routing_keys.size());
+
+      gatherers_.set(correlation_id,
+                     std::make_shared<capy::amqp::DeferredFetchingMany>(
+                             connections_.get(), routing_keys.size(), policy));
+
+      auto  deferred = gatherers_.get(correlation_id);
+      auto& channel = deferred->get_channel();
+
+      if (routing_keys.empty()) {
+        deferred->expire();
+        post_later([this, correlation_id]{
+            complete_gathering(correlation_id);
+        });
+        return *deferred;
+      }
+
+      if (policy.deadline.count() > 0) {
+        ///
+        /// Deadline timer reports partial replies, it is stopped when the gathering completes
+        ///
+        post([this, correlation_id]{
+            auto deferred = gatherers_.get(correlation_id);
+            if (!deferred) return;
+            deferred->start_timer(loop_.get(), [this, correlation_id]{
+                auto deferred = gatherers_.get(correlation_id);
+                if (deferred && deferred->expire()) complete_gathering(correlation_id);
+            });
+        });
+      }
+
+      channel
+
+              .declareQueue(AMQP::exclusive | AMQP::autodelete)
+
+              .onSuccess(
+                      [
+                              this,
+                              message,
+                              routing_keys,
+                              correlation_id
+                      ]
+                              (const std::string &name, uint32_t messagecount, uint32_t consumercount) {
+                          (void) consumercount;
+                          (void) messagecount;
+
+                          if (!gatherers_.has(correlation_id)) {
+                            return;
+                          }
+
+                          auto& channel = gatherers_.get(correlation_id)->get_channel();
+
+                          channel
+
+                                  .consume(name, AMQP::noack)
+
+                                  .onReceived([this, correlation_id](
+
+                                          const AMQP::Message &message,
+                                          uint64_t deliveryTag,
+                                          bool redelivered) {
+
+                                      (void) deliveryTag;
+                                      (void) redelivered;
+
+                                      ///
+                                      /// Replay correlation id is <request id>.<routing key index>
+                                      ///
+
+                                      auto& cid = message.correlationID();
+                                      auto dot = cid.rfind('.');
+
+                                      if (dot == std::string::npos) return;
+
+                                      size_t index = 0;
+
+                                      try {
+                                        index = std::stoul(cid.substr(dot + 1));
+                                      }
+                                      catch (...) {
+                                        return;
+                                      }
+
+                                      auto deferred = gatherers_.get(correlation_id);
+
+                                      if (!deferred) return;
+
+                                      std::vector<std::uint8_t> buffer;
+                                      auto assembled = assemble(message, buffer);
+
+                                      if (assembled && !*assembled) return;
+
+                                      metrics_->fetch_latency.record(deferred->get_started());
+
+                                      ///
+                                      /// Chunks of streaming replay share the correlation id, they are rejected
+                                      /// by the first one, so a worker fills its slot only once
+                                      ///
+                                      uint64_t sequence = 0;
+                                      bool last = false;
+
+                                      auto payload = !assembled
+                                                     ? Payload(capy::make_unexpected(assembled.error()))
+                                                     : stream_position(message, sequence, last)
+                                                       ? Payload(capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "streaming replay is not gathered")))
+                                                       : to_payload(buffer);
+
+                                      if (deferred->gather(index, payload)) {
+                                        complete_gathering(correlation_id);
+                                      }
+                                  })
+
+                                  .onSuccess([this, correlation_id]{
+                                      if (gatherers_.has(correlation_id))
+                                        gatherers_.get(correlation_id)->report_success();
+                                  })
+
+                                  .onError([correlation_id, this](const char *message) {
+                                      if (auto deferred = gatherers_.get(correlation_id)) {
+                                        deferred->expire();
+                                        deferred->report_error(Error(BrokerError::DATA_RESPONSE, message));
+                                        gatherers_.del(correlation_id);
+                                      }
+                                  });
+
+                          auto data = json::to_msgpack(message);
+                          auto traceparent = trace::make_traceparent();
+
+                          channel.startTransaction();
+
+                          for (size_t index = 0; index < routing_keys.size(); ++index) {
+
+                            auto message_id = make_message_id();
+                            auto cid = correlation_id + "." + std::to_string(index);
+                            auto span = trace::child_traceparent(traceparent);
+
+                            publish_frames(channel, exchange_name_, routing_keys[index], data, AMQP::autodelete|AMQP::mandatory,
+                                           [&message_id, &cid, &name, &span](AMQP::Envelope &envelope, AMQP::Table &&headers){
+                                               envelope.setDeliveryMode(2);
+                                               envelope.setMessageID(message_id);
+                                               envelope.setCorrelationID(cid);
+                                               envelope.setReplyTo(name);
+                                               stamp_envelope(envelope, span, std::move(headers));
+                                           });
+
+                            metrics_->publish_count.add();
+                            metrics_->publish_bytes.add(data.size());
+                          }
+
+                          channel
+                                  .commitTransaction()
+                                  .onError([this,correlation_id](const char *message) {
+                                      if (gatherers_.has(correlation_id))
+                                        gatherers_.get(correlation_id)->report_error(Error(BrokerError::PUBLISH, message));
+                                  });
+
+                      })
+
+              .onError([this, correlation_id](const char *message) {
+                  if (auto deferred = gatherers_.get(correlation_id)){
+                    deferred->expire();
+                    deferred->report_error(Error(BrokerError::QUEUE_DECLARATION, message));
+                    gatherers_.del(correlation_id);
+                  }
+              });
+
+      return *deferred;
+    }
+
+    ///
+    /// MARK: - sharding
+    ///
+
+    std::shared_ptr<ShardMap> BrokerImpl::get_shard_map(const std::string &prefix, uint32_t shards) {
+
+      auto map = shard_maps_.get(prefix);
+
+      ///
+      /// Map is rebuilt on membership change only
+      ///
+      if (!map || map->get_shards_count() != std::max<uint32_t>(shards, 1)) {
+        map = std::make_shared<ShardMap>(prefix, shards);
+        shard_maps_.set(prefix, map);
+      }
+
+      return map;
+    }
+
+    ///
+    /// MARK: - listen
+    ///
+
+    /***
+     * Listening queue arguments, they must be the same on every declaration
+     * @param policy listening policy
+     * @return queue arguments
+     */
+    static AMQP::Table queue_arguments(const ListenPolicy &policy) {
+      AMQP::Table arguments;
+      if (policy.max_priority > 0) {
+        arguments.set("x-max-priority", AMQP::UOctet(policy.max_priority));
+      }
+      return arguments;
+    }
+
+    DeferredListen& BrokerImpl::listen_messages(const std::string &queue,
+                                                const std::vector<std::string> &keys,
+                                                const ListenPolicy &policy) {
+
+      auto correlation_id = create_unique_id();
+
+      ///
+      /// Consumers are connected to the queue leader node if it is known
+      ///
+      auto leader = get_leader(queue);
+
+      listeners_.set(correlation_id,
+                     std::make_shared<capy::amqp::DeferredListening>(connections_.get(), policy, leader));
+
+      auto deferred = listeners_.get(correlation_id);
+
+      auto& channel = deferred->get_channel();
+
+      connections_->set_deferred(deferred, leader);
+
+      channel.onError([this, correlation_id](const char *message) {
+          listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::CHANNEL_MESSAGE, message));
+      });
+
+      // create a queue
+      channel
+
+              .declareQueue(queue, AMQP::durable, queue_arguments(policy))
+
+              .onSuccess([this, correlation_id, queue](const std::string &name, uint32_t messagecount, uint32_t consumercount) {
+                  (void) name;
+                  (void) consumercount;
+                  scale_consumers(correlation_id, queue, messagecount);
+              })
+
+              .onError([this, correlation_id](const char *message) {
+                  listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::QUEUE_DECLARATION, message));
+              });
+
+      for (auto &routing_key: keys) {
+
+        channel
+
+                .bindQueue(exchange_name_, queue, routing_key)
+
+                .onError([this, correlation_id, routing_key, queue](const char *message) {
+                    listeners_.get(correlation_id)->
+                            report_error(
+                            capy::Error(BrokerError::QUEUE_BINDING,
+                                        error_string("%s: %s:%s <- %s", message, exchange_name_.c_str())));
+                });
+      }
+
+      ///
+      /// The primary consumer shares the channel with queue declaration,
+      /// the others are started by scale_consumers when the queue is declared
+      ///
+      consume_messages(correlation_id, queue, &channel, true);
+
+      auto& listening_policy = deferred->get_policy();
+
+      if (listening_policy.max_concurrency > listening_policy.concurrency && listening_policy.scale_interval.count() > 0) {
+        ///
+        /// Queue depth is sampled by the loop timer of the listener, it is closed with the listener
+        ///
+        auto arguments = queue_arguments(listening_policy);
+
+        post([this, correlation_id, queue, arguments]{
+
+            auto deferred = listeners_.get(correlation_id);
+            if (!deferred) return;
+
+            deferred->start_scaling(loop_.get(), [this, correlation_id, queue, arguments]{
+
+                auto deferred = listeners_.get(correlation_id);
+                if (!deferred) return;
+
+                deferred->get_channel()
+                        .declareQueue(queue, AMQP::durable, arguments)
+                        .onSuccess([this, correlation_id, queue](const std::string &name, uint32_t messagecount, uint32_t consumercount) {
+                            (void) name;
+                            (void) consumercount;
+                            scale_consumers(correlation_id, queue, messagecount);
+                        });
+            });
+        });
+      }
+
+      return *deferred;
+    }
+
+    void BrokerImpl::scale_consumers(const std::string &correlation_id, const std::string &queue, uint32_t messagecount) {
+
+      auto deferred = listeners_.get(correlation_id);
+
+      if (!deferred) return;
+
+      auto expected = deferred->get_expected_consumers(messagecount);
+
+      while (deferred->get_consumers_count() < expected) {
+        consume_messages(correlation_id, queue, deferred->add_consumer(), false);
+      }
+
+      ///
+      /// Consumers are removed one by one to smooth queue depth spikes
+      ///
+      if (deferred->get_consumers_count() > expected) {
+        if (auto channel = deferred->remove_consumer()) {
+          channel->close()
+                  .onSuccess([channel]{ delete channel; })
+                  .onError([channel](const char *message) {
+                      (void) message;
+                      delete channel;
+                  });
+        }
+      }
+    }
+
+    void BrokerImpl::consume_messages(const std::string &correlation_id,
+                                      const std::string &queue,
+                                      Channel *channel,
+                                      bool primary) {
 
-    inline static std::string create_unique_id() {
-      static int n = 1;
-      std::ostringstream os;
-      os << n++;
-      return os.str();
-    }
+      auto prefetch = listeners_.get(correlation_id)->get_policy().prefetch;
 
-    BrokerImpl::BrokerImpl(const capy::amqp::Address &address,
-                           const std::string &exchange_name,
-                           uint16_t heartbeat_timeout):
-            exchange_name_(exchange_name),
-            loop_(std::shared_ptr<uv_loop_t>(uv_loop_t_allocator(), uv_loop_t_deallocator())),
-            connections_(std::make_unique<ConnectionCache>(address,loop_, heartbeat_timeout)),
-            fetchers_(),
-            listeners_()
-    {
+      if (prefetch > 0) {
+        channel->setQos(prefetch);
+      }
 
-    }
+      channel
 
-    BrokerImpl::~BrokerImpl() {
-      connections_->flush();
-    }
+              ->consume(queue)
 
-    void BrokerImpl::run(const Broker::Launch launch) {
+              .onReceived([this, correlation_id, queue, channel](
+                      const AMQP::Message &message,
+                      uint64_t deliveryTag,
+                      bool redelivered) {
 
-      switch (launch) {
-        case Broker::Launch ::async:
-        {
-          thread_loop_ = std::thread([this] {
 
-              /**
-                uv_timer_t timer_req;
+                  (void) redelivered;
 
-                timer_req.data = this;
+                  auto received_at = metrics_clock::now();
+                  auto tracing = trace::now();
 
-                uv_timer_init(loop_.get(), &timer_req);
-                xuv_timer_start(&timer_req, monitor, 0, 1000);
-               */
+                  Rpc rpc;
+                  unstamp_message(message, trace::wall_clock_us(), rpc);
 
-              uv_run(loop_.get(), UV_RUN_DEFAULT);
+                  if (rpc.queueing_delay.count() > 0) {
+                    metrics_->queueing_delay.record(static_cast<uint64_t>(rpc.queueing_delay.count()));
+                  }
 
-          });
+                  metrics_->listen_count.add();
+                  metrics_->listen_bytes.add(message.bodySize());
 
-          thread_loop_.detach();
-        }
-          break;
+                  auto replay_to = message.replyTo();
+                  auto routing_key = message.routingkey();
+                  auto cid = message.correlationID();
 
-        case Broker::Launch::sync:
-          uv_run(loop_.get(), UV_RUN_DEFAULT);
-          break;
-      }
-    }
+                  channel->ack(deliveryTag);
 
-    ///
-    /// MARK: - publish
-    ///
+                  metrics_->ack_latency.record(received_at);
+                  trace::record("listen.ack", tracing);
 
-    Error BrokerImpl::publish_message(const capy::json &message, const std::string &routing_key) {
-      std::promise<Result<std::string>> queue_declaration;
+                  ///
+                  /// Frames of large message are collected before decoding
+                  ///
+                  std::vector<std::uint8_t> buffer;
+                  auto assembled = assemble(message, buffer);
 
-      auto data = json::to_msgpack(message);
+                  if (!assembled) {
+                    metrics_->listen_errors.add();
+                    listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::CHANNEL_MESSAGE, assembled.error().message()));
+                    return;
+                  }
 
-      AMQP::Envelope envelope(static_cast<char*>((void *)data.data()), static_cast<uint64_t>(data.size()));
-      envelope.setDeliveryMode(2);
+                  if (!*assembled) return;
 
-      auto channel = connections_->new_channel();
+                  auto priority = message.hasPriority() ? message.priority() : uint8_t(0);
+                  auto max_priority = listeners_.get(correlation_id)->get_policy().max_priority;
 
-      std::promise<std::string> publish_barrier;
+                  rpc.routing_key = routing_key;
+                  rpc.priority = std::min(priority, max_priority);
 
-      channel->startTransaction();
+                  Delivery delivery{std::move(rpc), std::move(buffer), replay_to, cid, received_at, tracing};
 
-      channel->publish(exchange_name_, routing_key, envelope, AMQP::autodelete|AMQP::mandatory);
+                  ///
+                  /// Deliveries of priority queue read at once are reordered before handling
+                  ///
+                  if (max_priority == 0) {
+                    handle_delivery(correlation_id, delivery);
+                    return;
+                  }
+
+                  dispatch_->push(delivery.rpc.priority, [this, correlation_id, delivery = std::move(delivery)]() mutable {
+                      handle_delivery(correlation_id, delivery);
+                  });
 
-      channel->commitTransaction()
-              .onSuccess([&publish_barrier](){
-                  publish_barrier.set_value("");
               })
-              .onError([&publish_barrier](const char *message) {
-                  publish_barrier.set_value(message);
+
+              .onSuccess([this, correlation_id, channel, primary](const std::string &tag){
+                  auto deferred = listeners_.get(correlation_id);
+                  if (!deferred) return;
+                  deferred->set_consumer_tag(channel, tag);
+                  if (primary) deferred->report_success();
+              })
+
+              .onError([this, correlation_id, primary](const char *message) {
+                  auto deferred = listeners_.get(correlation_id);
+                  if (!deferred) return;
+                  deferred->report_error(capy::Error(BrokerError::QUEUE_CONSUMING, message));
+                  if (primary) {
+                    connections_->reset_deferred();
+                    listeners_.del(correlation_id);
+                  }
               });
+    }
 
-      auto error = publish_barrier.get_future().get();
+    Error BrokerImpl::decode_delivery(Delivery &delivery) {
 
-      delete channel;
+      auto decoding = trace::now();
 
-      if (!error.empty()){
-        return Error(amqp::BrokerError::PUBLISH, error);
+      try {
+        delivery.rpc.message = json::from_msgpack(delivery.body);
+      }
+      catch (json::exception &exception) {
+        metrics_->listen_errors.add();
+        return capy::Error(BrokerError::CHANNEL_MESSAGE, exception.what());
+      }
+      catch (...) {
+        metrics_->listen_errors.add();
+        return capy::Error(BrokerError::CHANNEL_MESSAGE, "unknown error");
       }
 
-      return Error(amqp::CommonError::OK);
+      trace::record("listen.decode", decoding);
+
+      return Error(CommonError::OK);
     }
 
+    ReplayImpl* BrokerImpl::make_replay(const Delivery &delivery,
+                                        const ErrorHandler &report_error,
+                                        const std::function<void()> &on_committed,
+                                        const std::shared_ptr<Deduplicator> &deduplicator) {
 
-    ///
-    /// MARK: - fetch
-    ///
+      auto replay_to = delivery.reply_to;
+      auto message_id = delivery.rpc.message_id;
+      auto cid = delivery.correlation_id;
+      auto received_at = delivery.received_at;
+      auto tracing = delivery.tracing;
+      auto traceparent = delivery.rpc.traceparent;
 
-    DeferredFetch& BrokerImpl::fetch_message(
-            const capy::json &message,
-            const std::string &routing_key) {
+      ReplayImpl *replay = new ReplayImpl();
 
-      auto correlation_id = create_unique_id();
+      replays_++;
 
-      fetchers_.set(correlation_id,
-                    std::make_shared<capy::amqp::DeferredFetching>(connections_.get()));
+      replay->set_chunk([this, cid, replay_to, report_error, traceparent](Replay* r){
 
-      auto  deferred = fetchers_.get(correlation_id).get();
-      auto& channel = deferred->get_channel();
+          auto impl = static_cast<ReplayImpl*>(r);
 
-      channel
+          auto data = encode_replay(r->message, false);
+          auto sequence = impl->sequence_++;
 
-              .declareQueue(AMQP::exclusive | AMQP::autodelete)
+          ///
+          /// Chunks are published through the same channel to keep their order
+          ///
+          if (!impl->stream_) {
+            impl->stream_ = connections_->new_channel();
+            impl->stream_->startTransaction();
+          }
 
-              .onSuccess(
-                      [
-                              this,
-                              message,
-                              routing_key,
-                              correlation_id
-                      ]
-                              (const std::string &name, uint32_t messagecount, uint32_t consumercount) {
-                          (void) consumercount;
-                          (void) messagecount;
+          auto span = trace::child_traceparent(traceparent);
 
-                          auto data = json::to_msgpack(message);
+          publish_frames(*impl->stream_, "", replay_to, data, 0,
+                         [&cid, &span, sequence](AMQP::Envelope &envelope, AMQP::Table &&headers){
+                             envelope.setCorrelationID(cid);
+                             set_stream_headers(headers, sequence, false);
+                             stamp_envelope(envelope, span, std::move(headers));
+                         });
 
-                          auto envelope = std::make_shared<AMQP::Envelope>(
-                                  static_cast<char*>((void *)data.data()),
-                                  static_cast<uint64_t>(data.size()));
+          metrics_->publish_count.add();
+          metrics_->publish_bytes.add(data.size());
 
-                          envelope->setDeliveryMode(2);
-                          envelope->setCorrelationID(correlation_id);
-                          envelope->setReplyTo(name);
+          impl->stream_->commitTransaction()
+                  .onError([this, report_error](const char *message) {
+                      metrics_->publish_errors.add();
+                      report_error(capy::Error(BrokerError::PUBLISH, message));
+                  });
 
-                          if (!fetchers_.has(correlation_id)) {
-                            return;
-                          }
+          r->message = capy::json();
+      });
 
-                          auto& channel = fetchers_.get(correlation_id)->get_channel();
+      replay->set_commit([this, cid, replay_to, report_error, on_committed, received_at, tracing, traceparent,
+                                 deduplicator, message_id](Replay* r){
 
-                          channel.startTransaction();
+          auto encoding = trace::now();
 
-                          channel
-                                  .publish(exchange_name_, routing_key, *envelope, AMQP::autodelete|AMQP::mandatory);
+          auto impl = static_cast<ReplayImpl*>(r);
+          auto streaming = impl->stream_ != nullptr;
 
-                          channel
-                                  .commitTransaction()
-                                  .onError([this,correlation_id](const char *message) {
-                                      if (fetchers_.has(correlation_id))
-                                        fetchers_.get(correlation_id)->report_error(Error(BrokerError::PUBLISH, message));
-                                  });
+          auto data = encode_replay(r->message, streaming);
+          auto sequence = impl->sequence_;
 
+          trace::record("listen.replay.encode", encoding);
 
-                          channel
+          auto channel = streaming ? impl->stream_ : connections_->new_channel();
+          auto committing = trace::now();
 
-                                  .consume(name, AMQP::noack)
+          impl->stream_ = nullptr;
 
-                                  .onReceived([name, this, correlation_id](
+          if (!streaming) channel->startTransaction();
 
-                                          const AMQP::Message &message,
-                                          uint64_t deliveryTag,
-                                          bool redelivered) {
+          auto span = trace::child_traceparent(traceparent);
 
-                                      (void) deliveryTag;
-                                      (void) redelivered;
+          publish_frames(*channel, "", replay_to, data, 0,
+                         [&cid, &span, streaming, sequence](AMQP::Envelope &envelope, AMQP::Table &&headers){
+                             envelope.setCorrelationID(cid);
+                             if (streaming) set_stream_headers(headers, sequence, true);
+                             stamp_envelope(envelope, span, std::move(headers));
+                         });
 
-                                      std::vector<std::uint8_t> buffer(
-                                              static_cast<std::uint8_t *>((void *) message.body()),
-                                              static_cast<std::uint8_t *>((void *) message.body()) + message.bodySize());
+          metrics_->publish_count.add();
+          metrics_->publish_bytes.add(data.size());
 
-                                      capy::json received;
+          ///
+          /// Streaming replay is not kept, duplicates of its request are skipped
+          ///
+          Deduplicator::Replay kept = nullptr;
 
-                                      try {
-                                        received = json::from_msgpack(buffer);
-                                      }
-                                      catch (std::exception &exception) {
-                                        if (fetchers_.has(correlation_id))
-                                          fetchers_.get(correlation_id)->report_error(Error(BrokerError::DATA_RESPONSE, exception.what()));
-                                      }
-                                      catch (...) {
-                                        if (fetchers_.has(correlation_id))
-                                          fetchers_.get(correlation_id)->report_error(Error(BrokerError::DATA_RESPONSE, "unknown error"));
-                                      }
+          if (deduplicator && !streaming) kept = std::make_shared<const std::vector<std::uint8_t>>(data);
 
-                                      {
-                                        ///
-                                        /// Report data callback
-                                        ///
+          channel->commitTransaction()
+                  .onSuccess([this, r, channel, received_at, tracing, committing, on_committed, deduplicator, message_id, kept]{
+                      if (deduplicator) deduplicator->reply(message_id, kept);
+                      metrics_->replay_latency.record(received_at);
+                      trace::record("listen.replay.commit", committing);
+                      trace::record("listen.replay", tracing);
+                      delete r;
+                      delete channel;
+                      replays_--;
+                      if (on_committed) on_committed();
+                  })
+                  .onError([this, r, channel, report_error, on_committed, deduplicator, message_id](const char *message) {
+                      if (deduplicator) deduplicator->forget(message_id);
+                      metrics_->publish_errors.add();
+                      report_error(capy::Error(BrokerError::PUBLISH, message));
+                      delete r;
+                      delete channel;
+                      replays_--;
+                      if (on_committed) on_committed();
+                  });
+      });
 
-                                        try {
-                                          if (fetchers_.has(correlation_id))
-                                            fetchers_.get(correlation_id)->report_data(received);
-                                        }
-                                        catch (json::exception &exception) {
-                                          ///
-                                          /// Some programmatic exception is not processing properly
-                                          ///
+      return replay;
+    }
 
-                                          throw_abort(exception.what());
-                                        }
-                                        catch (...) {
-                                          throw_abort("Unexpected exception...");
-                                        }
+    void BrokerImpl::resend_replay(const Delivery &delivery,
+                                   const Deduplicator::Replay &replay,
+                                   const ErrorHandler &report_error) {
 
-                                        if (fetchers_.has(correlation_id))
-                                          fetchers_.del(correlation_id);
+      auto channel = connections_->new_channel();
+      auto cid = delivery.correlation_id;
+      auto span = trace::child_traceparent(delivery.rpc.traceparent);
 
-                                      }
+      replays_++;
 
-                                  })
+      channel->startTransaction();
 
-                                  .onSuccess([this,correlation_id]{
-                                      if (fetchers_.has(correlation_id))
-                                        fetchers_.get(correlation_id)->report_success();
-                                  })
+      publish_frames(*channel, "", delivery.reply_to, *replay, 0,
+                     [&cid, &span](AMQP::Envelope &envelope, AMQP::Table &&headers){
+                         envelope.setCorrelationID(cid);
+                         stamp_envelope(envelope, span, std::move(headers));
+                     });
 
-                                  .onError([correlation_id, this](const char *message) {
-                                      if (fetchers_.has(correlation_id)){
-                                        fetchers_.get(correlation_id)->report_error(Error(BrokerError::DATA_RESPONSE, message));
-                                        fetchers_.del(correlation_id);
-                                      }
+      metrics_->duplicate_replays.add();
+      metrics_->publish_count.add();
+      metrics_->publish_bytes.add(replay->size());
 
-                                  });
+      channel->commitTransaction()
+              .onSuccess([this, channel]{
+                  delete channel;
+                  replays_--;
+              })
+              .onError([this, channel, report_error](const char *message) {
+                  metrics_->publish_errors.add();
+                  report_error(capy::Error(BrokerError::PUBLISH, message));
+                  delete channel;
+                  replays_--;
+              });
+    }
 
-                      })
+    void BrokerImpl::handle_delivery(const std::string &correlation_id, Delivery &delivery) {
 
-              .onError([this, correlation_id](const char *message) {
-                  if (fetchers_.has(correlation_id)){
-                    fetchers_.get(correlation_id)->report_error(Error(BrokerError::QUEUE_DECLARATION, message));
-                    fetchers_.del(correlation_id);
-                  }
-              });
+      auto listener = listeners_.get(correlation_id);
 
-      return *deferred;
+      if (!listener) return;
+
+      auto report_error = [this, correlation_id](const Error &error){
+          if (auto listener = listeners_.get(correlation_id)) listener->report_error(error);
+      };
+
+      ///
+      /// Duplicate is skipped before decoding, the first request replay is sent again if it is kept
+      ///
+      auto& deduplicator = listener->get_deduplicator();
+
+      if (deduplicator && !delivery.rpc.message_id.empty()) {
+
+        auto seen = deduplicator->check(delivery.rpc.message_id);
+
+        if (seen.state != Deduplicator::State::fresh) {
+          metrics_->duplicates.add();
+          if (seen.replay && !delivery.reply_to.empty()) resend_replay(delivery, seen.replay, report_error);
+          return;
+        }
+      }
+
+      if (auto error = decode_delivery(delivery)) {
+        if (deduplicator) deduplicator->forget(delivery.rpc.message_id);
+        listener->report_error(error);
+        return;
+      }
+
+      connections_->reset_deferred();
+
+      auto replay = make_replay(delivery, report_error, nullptr, deduplicator);
+
+      try {
+
+        auto handler_started = metrics_clock::now();
+        auto handling = trace::now();
+
+        listener->report_data(delivery.rpc, replay);
+
+        metrics_->handler_time.record(handler_started);
+        trace::record("listen.handler", handling);
+
+      }
+
+      catch (json::exception &exception) {
+        ///
+        /// Some programmatic exception is not processing properly
+        ///
+
+        connections_->reset_deferred();
+        listeners_.del(correlation_id);
+        throw_abort(exception.what());
+      }
+      catch (...) {
+        connections_->reset_deferred();
+        listeners_.del(correlation_id);
+        throw_abort("Unexpected exception...");
+      }
     }
 
     ///
-    /// MARK: - listen
+    /// MARK: - listen batch
     ///
-    DeferredListen& BrokerImpl::listen_messages(const std::string &queue,
-                                                const std::vector<std::string> &keys) {
+
+    DeferredListenBatch& BrokerImpl::listen_batch_messages(const std::string &queue,
+                                                           const std::vector<std::string> &keys,
+                                                           size_t max_batch,
+                                                           std::chrono::milliseconds max_wait,
+                                                           const ListenPolicy &policy) {
 
       auto correlation_id = create_unique_id();
 
-      listeners_.set(correlation_id,
-                     std::make_shared<capy::amqp::DeferredListening>(connections_.get()));
+      batch_listeners_.set(correlation_id,
+                           std::make_shared<capy::amqp::DeferredListeningBatch>(connections_.get(), max_batch, max_wait,
+                                                                                get_leader(queue)));
 
-      auto deferred = listeners_.get(correlation_id);
+      auto deferred = batch_listeners_.get(correlation_id);
 
       auto& channel = deferred->get_channel();
 
-      connections_->set_deferred(deferred);
-
       channel.onError([this, correlation_id](const char *message) {
-          listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::CHANNEL_MESSAGE, message));
+          if (auto listener = batch_listeners_.get(correlation_id))
+            listener->report_error(capy::Error(BrokerError::CHANNEL_MESSAGE, message));
       });
 
-      // create a queue
       channel
 
-              .declareQueue(queue, AMQP::durable)
+              .declareQueue(queue, AMQP::durable, queue_arguments(policy))
 
               .onError([this, correlation_id](const char *message) {
-                  listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::QUEUE_DECLARATION, message));
+                  if (auto listener = batch_listeners_.get(correlation_id))
+                    listener->report_error(capy::Error(BrokerError::QUEUE_DECLARATION, message));
               });
 
       for (auto &routing_key: keys) {
@@ -317,129 +2298,161 @@ namespace capy::amqp {
                 .bindQueue(exchange_name_, queue, routing_key)
 
                 .onError([this, correlation_id, routing_key, queue](const char *message) {
-                    listeners_.get(correlation_id)->
-                            report_error(
-                            capy::Error(BrokerError::QUEUE_BINDING,
-                                        error_string("%s: %s:%s <- %s", message, exchange_name_.c_str())));
+                    if (auto listener = batch_listeners_.get(correlation_id))
+                      listener->report_error(
+                              capy::Error(BrokerError::QUEUE_BINDING,
+                                          error_string("%s: %s:%s <- %s",
+                                                       message, exchange_name_.c_str(), queue.c_str(), routing_key.c_str())));
                 });
       }
 
+      ///
+      /// Unacknowledged deliveries cover the batch waiting for commits and the next one being assembled
+      ///
+      channel.setQos(static_cast<uint16_t>(deferred->get_max_batch() * 2));
+
       channel
 
               .consume(queue)
 
-              .onReceived([this, correlation_id, queue](
+              .onReceived([this, correlation_id](
                       const AMQP::Message &message,
                       uint64_t deliveryTag,
                       bool redelivered) {
 
-
                   (void) redelivered;
 
-                  std::vector<std::uint8_t> buffer(
-                          static_cast<std::uint8_t *>((void*)message.body()),
-                          static_cast<std::uint8_t *>((void*)message.body()) + message.bodySize());
-
-                  auto replay_to = message.replyTo();
-                  auto routing_key = message.routingkey();
-                  auto cid = message.correlationID();
+                  auto deferred = batch_listeners_.get(correlation_id);
 
-                  capy::json received;
+                  if (!deferred) return;
 
-                  listeners_.get(correlation_id)->get_channel().ack(deliveryTag);
+                  auto received_at = metrics_clock::now();
+                  auto tracing = trace::now();
 
+                  Rpc rpc;
+                  unstamp_message(message, trace::wall_clock_us(), rpc);
 
-                  try {
-                    received = json::from_msgpack(buffer);
-                  }
-                  catch (json::exception &exception) {
-                    listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::CHANNEL_MESSAGE, exception.what()));
-                    return;
+                  if (rpc.queueing_delay.count() > 0) {
+                    metrics_->queueing_delay.record(static_cast<uint64_t>(rpc.queueing_delay.count()));
                   }
-                  catch (...) {
-                    listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::CHANNEL_MESSAGE, "unknown error"));
+
+                  metrics_->listen_count.add();
+                  metrics_->listen_bytes.add(message.bodySize());
+
+                  std::vector<std::uint8_t> buffer;
+                  auto assembled = assemble(message, buffer);
+
+                  ///
+                  /// Frames and broken messages are not batched, they are acknowledged at once.
+                  /// Multiple ack of the later batch does not touch already acknowledged deliveries
+                  ///
+                  if (!assembled || !*assembled) {
+                    deferred->get_channel().ack(deliveryTag);
+                    if (!assembled) {
+                      metrics_->listen_errors.add();
+                      deferred->report_error(capy::Error(BrokerError::CHANNEL_MESSAGE, assembled.error().message()));
+                    }
                     return;
                   }
 
-                  connections_->reset_deferred();
+                  rpc.routing_key = message.routingkey();
+                  rpc.priority = message.hasPriority() ? message.priority() : uint8_t(0);
+
+                  Delivery delivery{std::move(rpc), std::move(buffer), message.replyTo(), message.correlationID(), received_at, tracing};
 
-                  ReplayImpl *replay = new ReplayImpl();
+                  auto error = decode_delivery(delivery);
 
-                  replay->set_commit([this, cid, replay_to, correlation_id](Replay* r){
+                  auto batch = deferred->get_batch();
 
-                      capy::json error_json;
+                  auto replay = make_replay(delivery,
+                                            [this, correlation_id](const Error &error){
+                                                if (auto listener = batch_listeners_.get(correlation_id))
+                                                  listener->report_error(error);
+                                            },
+                                            [this, correlation_id, batch]{
+                                                commit_batch(correlation_id, batch);
+                                            });
 
-                      if (!r->message.has_value()) {
+                  ///
+                  /// Request is moved to the batch, broken message is passed to the handler as error
+                  ///
+                  auto full = deferred->push(error ? Request(capy::make_unexpected(error)) : Request(std::move(delivery.rpc)),
+                                             replay,
+                                             deliveryTag);
 
-                        error_json = {"error",
-                                      {{"code", r->message.error().value()}, {"message", r->message.error().message()}}};
+                  if (full) {
+                    flush_batch(correlation_id);
+                  }
+                  else if (batch->requests.size() == 1) {
+                    deferred->start_timer(loop_.get(), [this, correlation_id]{
+                        flush_batch(correlation_id);
+                    });
+                  }
+              })
 
-                      } else if (r->message.value().empty()) {
+              .onSuccess([this, correlation_id](const std::string &tag){
+                  auto listener = batch_listeners_.get(correlation_id);
+                  if (!listener) return;
+                  listener->set_consumer_tag(&listener->get_channel(), tag);
+                  listener->report_success();
+              })
 
-                        error_json = {"error",
-                                      {{"code", BrokerError::EMPTY_REPLAY}, {"message", "worker replay is empty"}}};
+              .onError([this, correlation_id](const char *message) {
+                  auto deferred = batch_listeners_.get(correlation_id);
+                  if (!deferred) return;
+                  deferred->report_error(capy::Error(BrokerError::QUEUE_CONSUMING, message));
+                  batch_listeners_.del(correlation_id);
+              });
 
-                      }
+      return *deferred;
+    }
 
-                      auto data = json::to_msgpack(error_json.empty() ? r->message.value() : error_json);
+    void BrokerImpl::flush_batch(const std::string &correlation_id) {
 
-                      AMQP::Envelope envelope(static_cast<char *>((void *) data.data()),
-                                              static_cast<uint64_t>(data.size()));
+      auto deferred = batch_listeners_.get(correlation_id);
 
-                      envelope.setCorrelationID(cid);
+      if (!deferred) return;
 
-                      auto channel = connections_->new_channel();
+      deferred->stop_timer();
 
-                      channel->startTransaction();
+      auto batch = deferred->take();
 
-                      channel->publish("", replay_to, envelope);
+      if (!batch) return;
 
-                      channel->commitTransaction()
-                              .onSuccess([r,channel]{
-                                  delete r;
-                                  delete channel;
-                              })
-                              .onError([this, r, channel,  correlation_id](const char *message) {
-                                  listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::PUBLISH, message));
-                                  delete r;
-                                  delete channel;
-                              });
-                  });
+      try {
 
+        auto handler_started = metrics_clock::now();
+        auto handling = trace::now();
 
-                  try {
+        deferred->report_data(Requests(batch->requests.data(), batch->requests.size()),
+                              Replays(batch->replays.data(), batch->replays.size()));
 
-                    listeners_.get(correlation_id)->report_data(Rpc(routing_key, received), replay);
+        metrics_->handler_time.record(handler_started);
+        trace::record("listen.batch.handler", handling);
 
-                  }
+      }
 
-                  catch (json::exception &exception) {
-                    ///
-                    /// Some programmatic exception is not processing properly
-                    ///
+      catch (json::exception &exception) {
+        batch_listeners_.del(correlation_id);
+        throw_abort(exception.what());
+      }
+      catch (...) {
+        batch_listeners_.del(correlation_id);
+        throw_abort("Unexpected exception...");
+      }
+    }
 
-                    connections_->reset_deferred();
-                    listeners_.del(correlation_id);
-                    throw_abort(exception.what());
-                  }
-                  catch (...) {
-                    connections_->reset_deferred();
-                    listeners_.del(correlation_id);
-                    throw_abort("Unexpected exception...");
-                  }
+    void BrokerImpl::commit_batch(const std::string &correlation_id, const std::shared_ptr<ListenBatch> &batch) {
 
-              })
+      if (batch->pending.fetch_sub(1) != 1) return;
 
-              .onSuccess([this, correlation_id]{
-                  listeners_.get(correlation_id)->report_success();
-              })
+      auto deferred = batch_listeners_.get(correlation_id);
 
-              .onError([this, correlation_id](const char *message) {
-                  connections_->reset_deferred();
-                  listeners_.get(correlation_id)->report_error(capy::Error(BrokerError::QUEUE_CONSUMING, message));
-                  listeners_.del(correlation_id);
-              });
+      if (!deferred) return;
 
-      return *deferred;
+      if (auto tag = deferred->commit(batch)) {
+        deferred->get_channel().ack(tag, AMQP::multiple);
+        metrics_->ack_latency.record(batch->started);
+      }
     }
-}
\ No newline at end of file
+}
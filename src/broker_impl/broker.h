@@ -7,12 +7,22 @@
 #include "handler.h"
 #include "capy/amqp_broker.h"
 #include "pool.h"
+#include "metrics.h"
+#include "chunking.h"
+#include "compression.h"
+#include "priority.h"
+#include "trace.h"
+#include "spool.h"
+#include "dedup.h"
+#include "reply_cache.h"
 
 #include "capy/amqp_deferred.h"
 #include "capy/dispatchq.h"
 
 #include <assert.h>
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <thread>
 #include <future>
 
@@ -32,13 +42,22 @@ namespace capy::amqp {
         virtual  ~ReplayImpl();
 
         virtual void commit() override;
+        virtual void send_chunk() override;
 
         void set_commit(const Handler& commit_handler);
+        void set_chunk(const Handler& chunk_handler);
         void on_complete(const Handler& complete_handler) override ;
 
     private:
         std::optional<Handler> commit_handler_;
+        std::optional<Handler> chunk_handler_;
         std::optional<Handler> complete_handler_;
+
+        ///
+        /// Streaming replay state: sent chunks count and the channel keeps chunks order
+        ///
+        uint64_t sequence_ = 0;
+        Channel* stream_ = nullptr;
     };
 
     inline static uv_loop_t * uv_loop_t_allocator() {
@@ -59,35 +78,98 @@ namespace capy::amqp {
       return AMQP::Login(login.get_username(), login.get_password());
     }
 
-    inline static  AMQP::Address to_address(const capy::amqp::Address& address) {
-      return AMQP::Address(address.get_hostname(), address.get_port(), to_login(address.get_login()), address.get_vhost());
-    }
-
-    class Channel: public AMQP::TcpChannel{
-        typedef AMQP::TcpChannel __TcpChannel;
+    class Channel: public AMQP::Channel{
+        typedef AMQP::Channel __Channel;
     public:
-        using __TcpChannel::__TcpChannel;
-        virtual ~Channel() override {}
+        Channel(AMQP::Connection *connection, const std::shared_ptr<Metrics>& metrics):
+                __Channel(connection),
+                metrics_(metrics)
+        {
+          metrics_->channels_opened.add();
+        }
+
+        virtual ~Channel() override {
+          metrics_->channels_closed.add();
+        }
+
+    private:
+        std::shared_ptr<Metrics> metrics_;
     };
 
 
     struct Connection {
     private:
         std::shared_ptr<uv_loop_t> loop_;
+        std::shared_ptr<NodeSelector> nodes_;
+        size_t node_;
+        uint64_t epoch_;
+        std::atomic_bool released_;
         std::shared_ptr<ConnectionHandler> handler_;
-        std::unique_ptr<AMQP::TcpConnection> connection_;
+        std::unique_ptr<AMQP::Connection> connection_;
 
     public:
 
-        Connection(const capy::amqp::Address& address, const std::shared_ptr<uv_loop_t>& loop, uint16_t heartbeat_timeout):
+        /***
+         * Open connection, the socket is connected by the loop thread
+         * @param post runs task by the loop thread
+         */
+        Connection(const capy::amqp::Address& address,
+                   const std::shared_ptr<NodeSelector>& nodes,
+                   size_t node,
+                   const std::shared_ptr<uv_loop_t>& loop,
+                   const ConnectionHandler::Post& post,
+                   uint16_t heartbeat_timeout,
+                   const ConnectionOptions& options,
+                   const std::shared_ptr<Metrics>& metrics):
                 loop_(loop),
-                handler_(std::make_shared<ConnectionHandler>(loop_.get(), heartbeat_timeout)),
-                connection_(std::make_unique<AMQP::TcpConnection>(handler_.get(),to_address(address)))//,
+                nodes_(nodes),
+                node_(node),
+                epoch_(nodes->get_epoch()),
+                released_(false),
+                handler_(ConnectionHandler::Make(loop_.get(), heartbeat_timeout, options, metrics, nodes, node)),
+                connection_(std::make_unique<AMQP::Connection>(handler_.get(), to_login(address.get_login()), address.get_vhost()))
         {
+          metrics->connections_opened.add();
+          handler_->attach(connection_.get());
+          post([handler = handler_]{ handler->start(); });
+        }
 
+        ~Connection() {
+          handler_->stop();
+          release();
         }
 
-        AMQP::TcpConnection* get_conection() { return connection_.get(); };
+        AMQP::Connection* get_conection() { return connection_.get(); };
+
+        bool is_lost() const { return handler_->lost; }
+
+        /***
+         * Check the connection has no room for a new channel
+         * @param channel_max channels limit, zero means no limit
+         * @return true if the limit is reached
+         */
+        bool is_full(uint16_t channel_max) const {
+          return channel_max > 0 && connection_->channels() >= channel_max;
+        }
+
+        size_t get_node() const { return node_; }
+
+        uint64_t get_epoch() const { return epoch_; }
+
+        /***
+         * Stop counting the connection on its node, it is called once
+         */
+        void release() {
+          if (!released_.exchange(true)) nodes_->released(node_);
+        }
+
+        /***
+         * Close connection gracefully, the connection is lost when the server confirms closing
+         */
+        void close() {
+          handler_->closing = true;
+          connection_->close();
+        }
 
         void set_deferred(const std::shared_ptr<capy::amqp::DeferredListen>& aDeferred) {
           handler_->deferred = aDeferred;
@@ -103,7 +185,11 @@ namespace capy::amqp {
     };
 
     class DeferredFetching;
+    class DeferredFetchingMany;
     class DeferredListening;
+    class DeferredListeningBatch;
+    struct ListenBatch;
+    class DeferredSampling;
 
     class ConnectionCache {
 
@@ -111,83 +197,565 @@ namespace capy::amqp {
         ConnectionCache(
                 const capy::amqp::Address &address,
                 const std::shared_ptr<uv_loop_t>& loop,
-                uint16_t heartbeat_timeout):
+                const ConnectionHandler::Post& post,
+                uint16_t heartbeat_timeout,
+                const ConnectionOptions& options,
+                const std::shared_ptr<Metrics>& metrics):
                 loop_(loop),
+                post_(post),
                 address_(address),
+                nodes_(std::make_shared<NodeSelector>(address.get_nodes())),
                 connections_(),
-                heartbeat_timeout_(heartbeat_timeout)
+                pinned_(),
+                retired_mutex_(),
+                retired_(),
+                heartbeat_timeout_(heartbeat_timeout),
+                options_(options),
+                metrics_(metrics)
         {}
 
         void flush() {
           connections_.flush();
+          pinned_.flush();
+          std::lock_guard lock(retired_mutex_);
+          retired_.clear();
         }
 
-        void set_deferred(const std::shared_ptr<capy::amqp::DeferredListen>& aDeferred) {
-          get_conection()->set_deferred(aDeferred);
+        const std::shared_ptr<NodeSelector>& get_nodes() const { return nodes_; }
+
+        /***
+         * Check some node is not excluded by recent failure
+         */
+        bool is_available() const {
+          for (size_t i = 0; i < nodes_->size(); ++i) {
+            if (nodes_->is_available(i)) return true;
+          }
+          return false;
         }
 
-        void reset_deferred() {
-          get_conection()->reset_deferred();
+        /***
+         * Check the connection of the current thread is lost
+         */
+        bool is_lost() {
+          auto connection = connections_.get(std::this_thread::get_id());
+          return !connection || connection->is_lost();
         }
 
-        Channel* new_channel() {
-          auto id = std::this_thread::get_id();
+        /***
+         * Close all connections gracefully, listeners are not notified about closing.
+         * It is called by the loop thread
+         */
+        void close() {
+          for (auto& id: connections_.keys()) {
+            if (auto connection = connections_.get(id)) {
+              connection->reset_deferred();
+              connection->close();
+            }
+          }
+          for (auto& node: pinned_.keys()) {
+            if (auto connection = pinned_.get(node)) {
+              connection->reset_deferred();
+              connection->close();
+            }
+          }
+          std::lock_guard lock(retired_mutex_);
+          for (auto& connection: retired_) {
+            if (!connection->is_lost()) connection->close();
+          }
+        }
 
-          if (!connections_.has(id)) {
-            auto _connection = std::make_shared<Connection>(address_, loop_, heartbeat_timeout_);
-            connections_.set(id, _connection);
-            return new Channel(_connection->get_conection());
+        /***
+         * Check all connections are closed
+         * @return true if no connection is open
+         */
+        bool is_closed() {
+          for (auto& id: connections_.keys()) {
+            auto connection = connections_.get(id);
+            if (connection && !connection->is_lost()) return false;
+          }
+          for (auto& node: pinned_.keys()) {
+            auto connection = pinned_.get(node);
+            if (connection && !connection->is_lost()) return false;
           }
-          else {
-            return new Channel(connections_.get(id)->get_conection());
+          std::lock_guard lock(retired_mutex_);
+          for (auto& connection: retired_) {
+            if (!connection->is_lost()) return false;
           }
+          return true;
+        }
+
+        void set_deferred(const std::shared_ptr<capy::amqp::DeferredListen>& aDeferred, size_t node = NodeSelector::npos) {
+          get_conection(node)->set_deferred(aDeferred);
         }
 
+        void reset_deferred() {
+          get_conection()->reset_deferred();
+        }
+
+        /***
+         * Open channel
+         * @param node the channel is opened on the node connection, npos means the thread connection
+         * @return channel is owned by caller
+         */
+        Channel* new_channel(size_t node = NodeSelector::npos) {
+          return new Channel(get_conection(node)->get_conection(), metrics_);
+        }
+
+        const std::shared_ptr<Metrics>& get_metrics() const { return metrics_; }
+
         ConnectionCache(const ConnectionCache& ) = delete;
         ConnectionCache(ConnectionCache&& ) = delete;
 
     private:
         std::shared_ptr<uv_loop_t> loop_;
+        ConnectionHandler::Post post_;
         capy::amqp::Address address_;
+        std::shared_ptr<NodeSelector> nodes_;
         capy::Cache<std::thread::id, Connection> connections_;
+        capy::Cache<size_t, Connection> pinned_;
+        std::mutex retired_mutex_;
+        std::vector<std::shared_ptr<Connection>> retired_;
         uint16_t heartbeat_timeout_;
+        ConnectionOptions options_;
+        std::shared_ptr<Metrics> metrics_;
 
         Connection* get_conection() {
           auto id = std::this_thread::get_id();
-          if (!connections_.has(id)) {
-            connections_.set(id, std::make_shared<Connection>(address_, loop_, heartbeat_timeout_));
+          auto connection = connections_.get(id);
+
+          ///
+          /// Connection is moved to the recovered node, its open channels are kept by the retired connection
+          ///
+          ///
+          /// Full connection is retired as well, the next one is opened for new channels
+          ///
+          if (connection && !connection->is_lost()
+              && (connection->is_full(options_.channel_max)
+                  || nodes_->should_move(connection->get_node(), connection->get_epoch()))) {
+            retire(connection);
+            connection = nullptr;
+          }
+
+          if (!connection || connection->is_lost()) {
+            if (connection) metrics_->reconnects.add();
+            connection = std::make_shared<Connection>(address_, nodes_, nodes_->select(), loop_, post_, heartbeat_timeout_, options_, metrics_);
+            connections_.set(id, connection);
+          }
+          return connection.get();
+        }
+
+        /***
+         * Get connection to the node shared by all threads, the thread connection is used
+         * if the node is not set or failed
+         */
+        Connection* get_conection(size_t node) {
+
+          if (node == NodeSelector::npos || !nodes_->is_available(node)) return get_conection();
+
+          auto connection = pinned_.get(node);
+
+          if (connection && !connection->is_lost() && connection->is_full(options_.channel_max)) {
+            retire(connection);
+            connection = nullptr;
           }
-          return connections_.get(id).get();
+
+          if (!connection || connection->is_lost()) {
+            if (connection) metrics_->reconnects.add();
+            nodes_->acquire(node);
+            connection = std::make_shared<Connection>(address_, nodes_, node, loop_, post_, heartbeat_timeout_, options_, metrics_);
+            pinned_.set(node, connection);
+          }
+
+          return connection.get();
         }
+
+        /***
+         * Stop using connection for new channels, it is closed when its channels are closed
+         */
+        void retire(const std::shared_ptr<Connection>& connection) {
+
+          connection->release();
+
+          std::lock_guard lock(retired_mutex_);
+
+          retired_.erase(std::remove_if(retired_.begin(), retired_.end(), [](const std::shared_ptr<Connection>& retired){
+              if (retired->is_lost()) return true;
+              if (retired->get_conection()->channels() == 0) retired->close();
+              return false;
+          }), retired_.end());
+
+          retired_.push_back(connection);
+        }
+    };
+
+    /***
+     * Received request is waiting for the handler
+     */
+    struct Delivery {
+        Rpc rpc;
+        std::vector<std::uint8_t> body;
+        std::string reply_to;
+        std::string correlation_id;
+        metrics_clock::time_point received_at;
+        trace::Stamp tracing;
+    };
+
+    /***
+     * Cached fetch is published to the broker, identical fetches wait for its reply
+     */
+    struct Flight {
+        metrics_clock::time_point started;
+        std::vector<std::string> followers;
     };
 
     class BrokerImpl {
         friend class Broker;
 
+        /***
+         * Unacknowledged chunks of streaming replay
+         */
+        static constexpr uint16_t stream_prefetch = 64;
+
+        /***
+         * Spooled messages are republished by batches
+         */
+        static constexpr size_t spool_batch = 128;
+
+        /***
+         * Batch is retried if it is not confirmed in time
+         */
+        static constexpr std::chrono::seconds spool_confirm_timeout = std::chrono::seconds(30);
+
     private:
 
         std::string exchange_name_;
+        std::shared_ptr<Metrics> metrics_;
         std::shared_ptr<uv_loop_t> loop_;
         std::unique_ptr<ConnectionCache> connections_;
+        std::unique_ptr<PriorityDispatch> dispatch_;
         capy::Cache<std::string, DeferredFetching> fetchers_;
+        capy::Cache<std::string, DeferredFetchingMany> gatherers_;
         capy::Cache<std::string, DeferredListening> listeners_;
+        capy::Cache<std::string, DeferredListeningBatch> batch_listeners_;
+        capy::Cache<std::string, DeferredSampling> samplers_;
+        capy::Cache<std::string, QueueStats> queue_stats_;
+        capy::Cache<std::string, ShardMap> shard_maps_;
+        std::mutex control_mutex_;
+        std::unique_ptr<Channel> control_;
+        std::atomic_bool control_failed_;
+        mutable std::mutex chunking_mutex_;
+        Chunking chunking_;
+        Reassembler reassembler_;
+        std::shared_ptr<Codec> codec_;
+        mutable std::mutex leaders_mutex_;
+        std::map<std::string, std::string> leaders_;
         std::thread thread_loop_;
 
+        ///
+        /// Cached fetches: replies cache and identical fetches in flight, followers are keyed by the cache key
+        ///
+        mutable std::mutex reply_cache_mutex_;
+        std::shared_ptr<ReplyCache> reply_cache_;
+        std::mutex flights_mutex_;
+        std::map<std::string, Flight> flights_;
+
+        ///
+        /// Publishes spool is drained by its own thread
+        ///
+        std::mutex spool_mutex_;
+        std::condition_variable spool_wakeup_;
+        std::shared_ptr<Spool> spool_;
+        bool draining_;
+        bool spool_pending_;
+        std::thread drainer_;
+
+        ///
+        /// Shutdown state: consumers cancellation and replays in flight
+        ///
+        std::atomic_bool stopping_;
+        std::atomic_bool released_;
+        std::atomic_bool cancelled_;
+        std::atomic<size_t> cancelling_;
+        std::atomic<size_t> replays_;
+
+        ///
+        /// Tasks are posted to the loop thread
+        ///
+        std::mutex tasks_mutex_;
+        std::vector<std::function<void()>> tasks_;
+        uv_async_t* wakeup_;
+        bool loop_running_;
+        std::thread::id loop_thread_id_;
+
+        /***
+         * Run task by the loop thread, it is run by the caller if the loop is not running
+         * or the caller is the loop thread
+         * @param task task
+         */
+        void post(const std::function<void()>& task);
+
+        /***
+         * Run task by the loop thread in the next loop iteration, even if the caller is the loop thread
+         * @param task task
+         */
+        void post_later(const std::function<void()>& task);
+
+        static void run_tasks(uv_async_t* handle);
+
+        /***
+         * Run loop until it is stopped or has no active handles, the broker released
+         * by the loop thread is deleted when the loop returns
+         */
+        void loop();
+
+        /***
+         * Broker deleter, the last reference released by the loop thread stops the loop
+         * and the broker is deleted when uv_run returns
+         * @param impl broker
+         */
+        static void Release(BrokerImpl* impl);
+
+        /***
+         * Send basic.cancel to every consumer and pass partially assembled batches to handlers
+         */
+        void cancel_consumers();
+
+        /***
+         * Close channels and connections, it is called by the loop thread
+         */
+        void close_connections();
+
+        void complete_gathering(const std::string& correlation_id);
+
+        std::shared_ptr<ReplyCache> get_reply_cache() const;
+
+        /***
+         * Report the reply of cached fetch to the fetches joined it, the leader one included
+         * @param flight cache key of the fetch
+         * @param reply decoded reply or error
+         */
+        void complete_flight(const std::string& flight, const Payload& reply);
+
+        /***
+         * Report the cached reply, join the identical fetch in flight or fetch the reply and cache it.
+         * The reply is passed through if caching is disabled
+         * @param correlation_id sealed cached fetch
+         * @param message request
+         * @param routing_key routing key
+         * @param priority request priority
+         */
+        void start_cached_fetch(const std::string& correlation_id,
+                                const json& message,
+                                const std::string& routing_key,
+                                uint8_t priority);
+
+        using EnvelopePreparer = std::function<void(AMQP::Envelope &envelope, AMQP::Table &&headers)>;
+
+        /***
+         * Publish message, it is compressed if it exceeds compression threshold and then
+         * split to frames if it exceeds chunking threshold
+         * @param prepare sets envelope properties and headers of every frame
+         */
+        void publish_frames(AMQP::Channel &channel,
+                            const std::string &exchange,
+                            const std::string &routing_key,
+                            const std::vector<std::uint8_t> &data,
+                            int flags,
+                            const EnvelopePreparer &prepare);
+
+        /***
+         * Collect message frames
+         * @param buffer the whole decompressed message when it is assembled
+         * @return true if the message is assembled, false if more frames are expected or error
+         */
+        Result<bool> assemble(const AMQP::Message &message, std::vector<std::uint8_t> &buffer);
+
+        /***
+         * Decompress assembled message according to its content-encoding
+         */
+        Result<bool> decompress(const AMQP::Message &message, std::vector<std::uint8_t> &buffer);
+
+        void receive_chunk(const std::string& correlation_id,
+                           const AMQP::Message& message,
+                           uint64_t delivery_tag,
+                           const metrics_clock::time_point& started);
+
+        void consume_messages(const std::string& correlation_id, const std::string& queue, Channel* channel, bool primary);
+
+        /***
+         * Decode request and call listener handler
+         * @param correlation_id listener id
+         * @param delivery assembled request
+         */
+        void handle_delivery(const std::string& correlation_id, Delivery& delivery);
+
+        /***
+         * Decode request message
+         * @param delivery assembled request, decoded message is put to the request
+         * @return decoding error
+         */
+        Error decode_delivery(Delivery& delivery);
+
+        /***
+         * Create replay of the request
+         * @param delivery request
+         * @param report_error publishing errors handler
+         * @param on_committed it is called when the replay transaction is completed
+         * @param deduplicator committed replay is kept for the duplicate requests
+         * @return replay is deleted when it is committed
+         */
+        ReplayImpl* make_replay(const Delivery& delivery,
+                                const ErrorHandler& report_error,
+                                const std::function<void()>& on_committed = nullptr,
+                                const std::shared_ptr<Deduplicator>& deduplicator = nullptr);
+
+        /***
+         * Send the kept replay to the duplicate request
+         * @param delivery duplicate request
+         * @param replay encoded replay of the first request
+         * @param report_error publishing errors handler
+         */
+        void resend_replay(const Delivery& delivery,
+                           const Deduplicator::Replay& replay,
+                           const ErrorHandler& report_error);
+
+        /***
+         * Pass the current batch to the listener handler
+         * @param correlation_id batch listener id
+         */
+        void flush_batch(const std::string& correlation_id);
+
+        /***
+         * Count committed replay of the batch, deliveries are acknowledged when all replays are committed
+         * @param correlation_id batch listener id
+         * @param batch handled batch
+         */
+        void commit_batch(const std::string& correlation_id, const std::shared_ptr<ListenBatch>& batch);
+
+        void scale_consumers(const std::string& correlation_id, const std::string& queue, uint32_t messagecount);
+
+        using QueueStatsHandler = std::function<void(const Result<QueueStats>& stats)>;
+
+        /***
+         * Passively declare the queue on the control channel, the handler is called by the loop thread
+         * @param queue queue name
+         * @param on_stats statistics handler
+         */
+        void request_queue_stats(const std::string& queue, const QueueStatsHandler& on_stats);
+
+        std::shared_ptr<Spool> get_spool();
+
+        /***
+         * Append message to the spool and wake up the drainer
+         */
+        Error spool_message(const std::shared_ptr<Spool>& spool,
+                            const std::string& routing_key,
+                            const std::string& message_id,
+                            uint8_t priority,
+                            const std::vector<std::uint8_t>& data);
+
+        /***
+         * Drainer thread: spooled messages are republished while some node is available
+         */
+        void drain();
+
+        /***
+         * Republish the next batch of spooled messages, the batch is committed when all messages are confirmed
+         * @param spool publishes spool
+         * @return error if some message is not confirmed
+         */
+        Error drain_batch(const std::shared_ptr<Spool>& spool);
+
+        void stop_draining();
+
     public:
 
-        BrokerImpl(const capy::amqp::Address &address, const std::string &exchange_name, uint16_t heartbeat_timeout);
+        BrokerImpl(const capy::amqp::Address &address,
+                   const std::string &exchange_name,
+                   uint16_t heartbeat_timeout,
+                   const ConnectionOptions &options = ConnectionOptions());
         BrokerImpl(const BrokerImpl&) = delete;
         BrokerImpl(BrokerImpl&&) = delete;
 
         ~BrokerImpl();
 
-        DeferredListen& listen_messages(const std::string &queue, const std::vector<std::string> &keys);
+        DeferredListen& listen_messages(const std::string &queue,
+                                        const std::vector<std::string> &keys,
+                                        const ListenPolicy& policy);
+
+        DeferredListenBatch& listen_batch_messages(const std::string &queue,
+                                                   const std::vector<std::string> &keys,
+                                                   size_t max_batch,
+                                                   std::chrono::milliseconds max_wait,
+                                                   const ListenPolicy &policy);
+
+        DeferredFetching& fetch_message(const json& message,
+                                     const std::string& routing_key,
+                                     bool streaming = false,
+                                     uint8_t priority = 0,
+                                     const std::string& message_id = "");
+
+        /***
+         * Fetch through the reply cache, it is started when the returned deferred is sealed,
+         * whether caching is enabled or not
+         * @param message request
+         * @param routing_key routing key
+         * @param priority request priority
+         * @return deferred reply
+         */
+        DeferredFetch& fetch_cached_message(const json& message,
+                                            const std::string& routing_key,
+                                            uint8_t priority = 0);
+
+        DeferredFetchMany& fetch_many_messages(const json& message,
+                                               const std::vector<std::string>& routing_keys,
+                                               const FetchPolicy& policy);
+
+        Error publish_message(const json &message,
+                              const std::string &routing_key,
+                              uint8_t priority = 0,
+                              const std::string &message_id = "");
+
+
+        Result<QueueStats> get_queue_stats(const std::string& queue, std::chrono::milliseconds ttl);
+
+        DeferredQueueStats& sample_queue(const std::string& queue, std::chrono::milliseconds interval);
+
+        void stop_sampling(const std::string& queue);
+
+        void set_chunking(const Chunking &chunking);
 
-        DeferredFetch& fetch_message(const json& message, const std::string& routing_key);
+        Chunking get_chunking() const;
 
-        Error publish_message(const json &message, const std::string &routing_key);
+        std::shared_ptr<ShardMap> get_shard_map(const std::string& prefix, uint32_t shards);
 
+        Error set_compression(const Compression &compression);
+
+        Error set_spooling(const Spooling &spooling);
+
+        void set_reply_caching(const ReplyCaching &caching);
+
+        std::shared_ptr<Codec> get_codec() const;
+
+        void set_queue_leaders(const std::map<std::string, std::string>& leaders);
+
+        /***
+         * Get leader node of the queue
+         * @param queue queue name
+         * @return node index or NodeSelector::npos if leader is unknown
+         */
+        size_t get_leader(const std::string& queue) const;
+
+        void set_node_selection(const NodeSelection& selection);
+
+        std::vector<NodeState> get_nodes() const;
 
         void run(const capy::amqp::Broker::Launch launch);
+
+        Error run(const capy::amqp::Broker::Launch launch, const ThreadAffinity& affinity);
+
+        Error shutdown(std::chrono::milliseconds deadline);
+
+        MetricsSnapshot get_metrics();
     };
 }
\ No newline at end of file
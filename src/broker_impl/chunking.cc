@@ -0,0 +1,159 @@
+//
+// Created by denn nevera on 2019-07-19.
+//
+
+#include "chunking.h"
+#include "capy/amqp_broker.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+namespace capy::amqp {
+
+    std::string make_message_id() {
+
+      static const char digits[] = "0123456789abcdef";
+      thread_local std::mt19937_64 generator(std::random_device{}());
+
+      std::string id(32, '0');
+
+      for (size_t i = 0; i < id.size(); i += 16) {
+        auto value = generator();
+        for (size_t j = i; j < i + 16; ++j, value >>= 4) {
+          id[j] = digits[value & 0xf];
+        }
+      }
+
+      return id;
+    }
+
+    Reassembler::Reassembler(size_t memory_cap, std::chrono::milliseconds partial_ttl):
+            mutex_(),
+            partials_(),
+            pending_bytes_(0),
+            memory_cap_(memory_cap),
+            partial_ttl_(partial_ttl)
+    {}
+
+    Result<Reassembler::State> Reassembler::push(const Frame &frame,
+                                                 const std::uint8_t *data,
+                                                 size_t length,
+                                                 std::vector<std::uint8_t> &message) {
+
+      ///
+      /// Frame position comes from the peer: it is checked without overflow, and frames count must
+      /// match the frame length, so the received frames map is not larger than the message
+      ///
+      auto malformed = frame.total == 0
+                       || frame.index >= frame.total
+                       || frame.offset > frame.size
+                       || length > frame.size - frame.offset
+                       || frame.total > std::max<uint64_t>(frame.size, 1);
+
+      if (!malformed && frame.index + 1 < frame.total) {
+        malformed = length == 0
+                    || frame.offset != static_cast<uint64_t>(frame.index) * length
+                    || frame.total != (frame.size + length - 1) / length;
+      }
+      else if (!malformed) {
+        malformed = frame.offset + length != frame.size;
+      }
+
+      if (malformed) {
+        return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE,
+                                           error_string("malformed frame %u/%u of message %s",
+                                                        frame.index, frame.total, frame.message_id.c_str())));
+      }
+
+      std::lock_guard lock(mutex_);
+
+      auto now = std::chrono::steady_clock::now();
+      auto it = partials_.find(frame.message_id);
+
+      if (it == partials_.end()) {
+
+        if (frame.size > memory_cap_) {
+          return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE,
+                                             error_string("chunked message %s size %llu exceeds memory cap",
+                                                          frame.message_id.c_str(),
+                                                          static_cast<unsigned long long>(frame.size))));
+        }
+
+        evict(static_cast<size_t>(frame.size), now);
+
+        Partial partial;
+        partial.buffer.resize(static_cast<size_t>(frame.size));
+        partial.received.resize(frame.total, false);
+        partial.started = now;
+        partial.reserved = partial.buffer.size() + (partial.received.size() + 7) / 8;
+
+        pending_bytes_ += partial.reserved;
+
+        it = partials_.emplace(frame.message_id, std::move(partial)).first;
+      }
+
+      auto& partial = it->second;
+
+      if (partial.buffer.size() != frame.size || partial.received.size() != frame.total) {
+        drop(it);
+        return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE,
+                                           error_string("inconsistent frames of message %s", frame.message_id.c_str())));
+      }
+
+      if (!partial.received[frame.index]) {
+        if (length > 0) std::memcpy(partial.buffer.data() + frame.offset, data, length);
+        partial.received[frame.index] = true;
+        partial.received_count++;
+      }
+
+      if (partial.received_count < frame.total) {
+        return State::partial;
+      }
+
+      message = std::move(partial.buffer);
+      drop(it);
+
+      return State::complete;
+    }
+
+    void Reassembler::set_memory_cap(size_t memory_cap) {
+      std::lock_guard lock(mutex_);
+      memory_cap_ = memory_cap;
+    }
+
+    size_t Reassembler::get_pending_bytes() const {
+      std::lock_guard lock(mutex_);
+      return pending_bytes_;
+    }
+
+    size_t Reassembler::get_pending_count() const {
+      std::lock_guard lock(mutex_);
+      return partials_.size();
+    }
+
+    void Reassembler::drop(std::unordered_map<std::string, Partial>::iterator it) {
+      pending_bytes_ -= std::min(pending_bytes_, it->second.reserved);
+      partials_.erase(it);
+    }
+
+    void Reassembler::evict(size_t required, const std::chrono::steady_clock::time_point &now) {
+
+      for (auto it = partials_.begin(); it != partials_.end();) {
+        if (now - it->second.started > partial_ttl_) {
+          auto expired = it++;
+          drop(expired);
+        }
+        else {
+          ++it;
+        }
+      }
+
+      while (!partials_.empty() && pending_bytes_ + required > memory_cap_) {
+        auto oldest = std::min_element(partials_.begin(), partials_.end(), [](const auto& a, const auto& b){
+            return a.second.started < b.second.started;
+        });
+        drop(oldest);
+      }
+    }
+}
@@ -0,0 +1,100 @@
+//
+// Created by denn nevera on 2019-07-19.
+//
+
+#pragma once
+
+#include "capy/amqp_common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace capy::amqp {
+
+    /***
+     * Random chunked message id is unique between publishers
+     * @return hex string
+     */
+    std::string make_message_id();
+
+    /***
+     * Frames of chunked message are assembled to the buffer is preallocated for the whole message.
+     * Partially assembled messages are limited by memory cap, the oldest ones are dropped to fit it
+     */
+    class Reassembler {
+
+    public:
+
+        enum class State:int {
+            /**
+             * more frames are expected
+             */
+            partial = 0,
+            /**
+             * message is assembled
+             */
+            complete
+        };
+
+        /***
+         * Frame position in the chunked message
+         */
+        struct Frame {
+            std::string message_id;
+            uint32_t index = 0;
+            uint32_t total = 0;
+            uint64_t offset = 0;
+            uint64_t size = 0;
+        };
+
+        /***
+         * Create reassembler
+         * @param memory_cap partially assembled messages memory cap in bytes
+         * @param partial_ttl partially assembled message is dropped if it is not completed in time
+         */
+        explicit Reassembler(size_t memory_cap,
+                             std::chrono::milliseconds partial_ttl = std::chrono::milliseconds(60000));
+
+        Reassembler(const Reassembler&) = delete;
+        Reassembler(Reassembler&&) = delete;
+
+        /***
+         * Put frame of chunked message
+         * @param frame frame position
+         * @param data frame data
+         * @param length frame data length
+         * @param message assembled message if state is complete
+         * @return state or error if frame is malformed or message exceeds memory cap
+         */
+        Result<State> push(const Frame& frame, const std::uint8_t* data, size_t length, std::vector<std::uint8_t>& message);
+
+        void set_memory_cap(size_t memory_cap);
+
+        size_t get_pending_bytes() const;
+
+        size_t get_pending_count() const;
+
+    private:
+
+        struct Partial {
+            std::vector<std::uint8_t> buffer;
+            std::vector<bool> received;
+            uint32_t received_count = 0;
+            size_t reserved = 0;
+            std::chrono::steady_clock::time_point started;
+        };
+
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, Partial> partials_;
+        size_t pending_bytes_;
+        size_t memory_cap_;
+        std::chrono::milliseconds partial_ttl_;
+
+        void drop(std::unordered_map<std::string, Partial>::iterator it);
+        void evict(size_t required, const std::chrono::steady_clock::time_point& now);
+    };
+}
@@ -0,0 +1,306 @@
+//
+// Created by denn nevera on 2019-07-22.
+//
+
+#include "compression.h"
+
+#ifdef CAPY_AMQP_WITH_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#ifdef CAPY_AMQP_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+namespace capy::amqp {
+
+    static const std::string lz4_encoding = "lz4";
+    static const std::string zstd_encoding = "zstd";
+    static const std::string no_encoding;
+
+    ///
+    /// MARK: - per-thread contexts
+    ///
+
+#ifdef CAPY_AMQP_WITH_LZ4
+    static LZ4_stream_t* lz4_stream() {
+      thread_local std::unique_ptr<LZ4_stream_t, int(*)(LZ4_stream_t*)> stream(LZ4_createStream(), LZ4_freeStream);
+      return stream.get();
+    }
+
+    static LZ4_streamHC_t* lz4hc_stream() {
+      thread_local std::unique_ptr<LZ4_streamHC_t, int(*)(LZ4_streamHC_t*)> stream(LZ4_createStreamHC(), LZ4_freeStreamHC);
+      return stream.get();
+    }
+#endif
+
+#ifdef CAPY_AMQP_WITH_ZSTD
+    static ZSTD_CCtx* zstd_compression() {
+      thread_local std::unique_ptr<ZSTD_CCtx, size_t(*)(ZSTD_CCtx*)> context(ZSTD_createCCtx(), ZSTD_freeCCtx);
+      return context.get();
+    }
+
+    static ZSTD_DCtx* zstd_decompression() {
+      thread_local std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx*)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+      return context.get();
+    }
+#endif
+
+    ///
+    /// MARK: - dictionaries
+    ///
+
+    struct Codec::Dictionaries {
+#ifdef CAPY_AMQP_WITH_ZSTD
+        ZSTD_CDict* compression = nullptr;
+        ZSTD_DDict* decompression = nullptr;
+#endif
+        std::string raw;
+
+        ~Dictionaries() {
+#ifdef CAPY_AMQP_WITH_ZSTD
+          ZSTD_freeCDict(compression);
+          ZSTD_freeDDict(decompression);
+#endif
+        }
+    };
+
+    bool Codec::is_supported(Compression::Codec codec) {
+      switch (codec) {
+        case Compression::Codec::none:
+          return true;
+        case Compression::Codec::lz4:
+#ifdef CAPY_AMQP_WITH_LZ4
+          return true;
+#else
+          return false;
+#endif
+        case Compression::Codec::zstd:
+#ifdef CAPY_AMQP_WITH_ZSTD
+          return true;
+#else
+          return false;
+#endif
+      }
+      return false;
+    }
+
+    bool Codec::is_compressed(const std::string &encoding) {
+      return encoding == lz4_encoding || encoding == zstd_encoding;
+    }
+
+    Result<std::shared_ptr<Codec>> Codec::Make(const Compression &options) {
+      if (!is_supported(options.codec)) {
+        return capy::make_unexpected(Error(CommonError::NOT_SUPPORTED, "compression codec is not supported by the build"));
+      }
+      return std::shared_ptr<Codec>(new Codec(options));
+    }
+
+    Codec::Codec(const Compression &options):
+            options_(options),
+            encoding_(options.codec == Compression::Codec::lz4
+                      ? lz4_encoding
+                      : options.codec == Compression::Codec::zstd ? zstd_encoding : no_encoding),
+            dictionaries_(std::make_unique<Dictionaries>())
+    {
+      dictionaries_->raw = options.dictionary;
+
+#ifdef CAPY_AMQP_WITH_ZSTD
+      if (!options.dictionary.empty()) {
+        auto level = options.level == 0 ? ZSTD_CLEVEL_DEFAULT : options.level;
+        dictionaries_->compression = ZSTD_createCDict(options.dictionary.data(), options.dictionary.size(), level);
+        dictionaries_->decompression = ZSTD_createDDict(options.dictionary.data(), options.dictionary.size());
+      }
+#endif
+    }
+
+    Codec::~Codec() = default;
+
+    const std::string& Codec::get_encoding() const {
+      return encoding_;
+    }
+
+    ///
+    /// MARK: - compression
+    ///
+
+    bool Codec::compress(const std::vector<std::uint8_t> &data, std::vector<std::uint8_t> &compressed) const {
+
+      if (encoding_.empty() || data.size() < options_.threshold) return false;
+
+#ifdef CAPY_AMQP_WITH_LZ4
+      if (options_.codec == Compression::Codec::lz4) {
+
+        if (data.size() > static_cast<size_t>(LZ4_MAX_INPUT_SIZE)) return false;
+
+        ///
+        /// Block is prefixed by original size, little endian
+        ///
+        auto size = static_cast<uint32_t>(data.size());
+        compressed.resize(sizeof(size) + static_cast<size_t>(LZ4_compressBound(static_cast<int>(size))));
+
+        for (size_t i = 0; i < sizeof(size); ++i) compressed[i] = static_cast<std::uint8_t>(size >> (8 * i));
+
+        auto source = reinterpret_cast<const char*>(data.data());
+        auto destination = reinterpret_cast<char*>(compressed.data() + sizeof(size));
+        auto capacity = static_cast<int>(compressed.size() - sizeof(size));
+        int written = 0;
+
+        ///
+        /// Positive level is LZ4 HC level, higher compresses more. Negative level is acceleration
+        /// of the fast mode, lower compresses less, like zstd negative levels. Blocks are decoded the same way
+        ///
+        if (options_.level > 0) {
+
+          auto stream = lz4hc_stream();
+          LZ4_resetStreamHC_fast(stream, std::min(options_.level, LZ4HC_CLEVEL_MAX));
+
+          if (!dictionaries_->raw.empty()) {
+            LZ4_loadDictHC(stream, dictionaries_->raw.data(), static_cast<int>(dictionaries_->raw.size()));
+          }
+
+          written = LZ4_compress_HC_continue(stream, source, destination, static_cast<int>(size), capacity);
+        }
+        else {
+
+          auto stream = lz4_stream();
+          LZ4_resetStream_fast(stream);
+
+          if (!dictionaries_->raw.empty()) {
+            LZ4_loadDict(stream, dictionaries_->raw.data(), static_cast<int>(dictionaries_->raw.size()));
+          }
+
+          written = LZ4_compress_fast_continue(stream, source, destination, static_cast<int>(size), capacity,
+                                               options_.level < 0 ? -options_.level : 1);
+        }
+
+        if (written <= 0) return false;
+
+        compressed.resize(sizeof(size) + static_cast<size_t>(written));
+
+        return compressed.size() < data.size();
+      }
+#endif
+
+#ifdef CAPY_AMQP_WITH_ZSTD
+      if (options_.codec == Compression::Codec::zstd) {
+
+        compressed.resize(ZSTD_compressBound(data.size()));
+
+        auto context = zstd_compression();
+        size_t written = 0;
+
+        if (dictionaries_->compression) {
+          written = ZSTD_compress_usingCDict(context,
+                                             compressed.data(), compressed.size(),
+                                             data.data(), data.size(),
+                                             dictionaries_->compression);
+        }
+        else {
+          written = ZSTD_compressCCtx(context,
+                                      compressed.data(), compressed.size(),
+                                      data.data(), data.size(),
+                                      options_.level == 0 ? ZSTD_CLEVEL_DEFAULT : options_.level);
+        }
+
+        if (ZSTD_isError(written)) return false;
+
+        compressed.resize(written);
+
+        return compressed.size() < data.size();
+      }
+#endif
+
+      (void) compressed;
+
+      return false;
+    }
+
+    ///
+    /// MARK: - decompression
+    ///
+
+    Result<std::vector<std::uint8_t>> Codec::decompress(const std::string &encoding,
+                                                        const std::vector<std::uint8_t> &data) const {
+
+#ifdef CAPY_AMQP_WITH_LZ4
+      if (encoding == lz4_encoding) {
+
+        uint32_t size = 0;
+
+        if (data.size() < sizeof(size)) {
+          return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "lz4 payload is truncated"));
+        }
+
+        for (size_t i = 0; i < sizeof(size); ++i) size |= static_cast<uint32_t>(data[i]) << (8 * i);
+
+        if (size > max_decompressed_size) {
+          return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "lz4 payload exceeds size limit"));
+        }
+
+        std::vector<std::uint8_t> decompressed(size);
+
+        auto read = dictionaries_->raw.empty()
+                    ? LZ4_decompress_safe(reinterpret_cast<const char*>(data.data() + sizeof(size)),
+                                          reinterpret_cast<char*>(decompressed.data()),
+                                          static_cast<int>(data.size() - sizeof(size)),
+                                          static_cast<int>(size))
+                    : LZ4_decompress_safe_usingDict(reinterpret_cast<const char*>(data.data() + sizeof(size)),
+                                                    reinterpret_cast<char*>(decompressed.data()),
+                                                    static_cast<int>(data.size() - sizeof(size)),
+                                                    static_cast<int>(size),
+                                                    dictionaries_->raw.data(),
+                                                    static_cast<int>(dictionaries_->raw.size()));
+
+        if (read < 0 || static_cast<uint32_t>(read) != size) {
+          return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "lz4 payload is corrupted"));
+        }
+
+        return decompressed;
+      }
+#endif
+
+#ifdef CAPY_AMQP_WITH_ZSTD
+      if (encoding == zstd_encoding) {
+
+        auto size = ZSTD_getFrameContentSize(data.data(), data.size());
+
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+          return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "zstd payload has no content size"));
+        }
+
+        if (size > max_decompressed_size) {
+          return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "zstd payload exceeds size limit"));
+        }
+
+        std::vector<std::uint8_t> decompressed(static_cast<size_t>(size));
+
+        auto context = zstd_decompression();
+
+        auto read = dictionaries_->decompression
+                    ? ZSTD_decompress_usingDDict(context,
+                                                 decompressed.data(), decompressed.size(),
+                                                 data.data(), data.size(),
+                                                 dictionaries_->decompression)
+                    : ZSTD_decompressDCtx(context,
+                                          decompressed.data(), decompressed.size(),
+                                          data.data(), data.size());
+
+        if (ZSTD_isError(read) || read != decompressed.size()) {
+          return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "zstd payload is corrupted"));
+        }
+
+        return decompressed;
+      }
+#endif
+
+      (void) data;
+
+      return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE,
+                                         error_string("unsupported content encoding: %s", encoding.c_str())));
+    }
+}
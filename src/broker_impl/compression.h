@@ -0,0 +1,85 @@
+//
+// Created by denn nevera on 2019-07-22.
+//
+
+#pragma once
+
+#include "capy/amqp_broker.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace capy::amqp {
+
+    /***
+     * Payload codec. Compression contexts are kept per thread, dictionaries are prepared once and shared
+     */
+    class Codec {
+
+    public:
+
+        /***
+         * Decompressed payload size limit
+         */
+        static constexpr size_t max_decompressed_size = size_t(1) << 30;
+
+        /***
+         * Create codec
+         * @param options compression options
+         * @return codec or error if the codec is not supported by the build
+         */
+        static Result<std::shared_ptr<Codec>> Make(const Compression& options);
+
+        /***
+         * Check codec is supported by the build
+         * @param codec codec
+         * @return true if supported
+         */
+        static bool is_supported(Compression::Codec codec);
+
+        /***
+         * Check content encoding is produced by the codec, other encodings are set by foreign publishers
+         * @param encoding message content-encoding
+         * @return true if it is lz4 or zstd
+         */
+        static bool is_compressed(const std::string& encoding);
+
+        ~Codec();
+
+        Codec(const Codec&) = delete;
+        Codec(Codec&&) = delete;
+
+        /***
+         * Content encoding of compressed messages
+         * @return lz4, zstd or empty string
+         */
+        const std::string& get_encoding() const;
+
+        /***
+         * Compress serialized message
+         * @param data serialized message
+         * @param compressed compressed message
+         * @return false if message is less than threshold or it is not compressible
+         */
+        bool compress(const std::vector<std::uint8_t>& data, std::vector<std::uint8_t>& compressed) const;
+
+        /***
+         * Decompress received message
+         * @param encoding message content-encoding
+         * @param data received data
+         * @return decompressed message or error
+         */
+        Result<std::vector<std::uint8_t>> decompress(const std::string& encoding, const std::vector<std::uint8_t>& data) const;
+
+    private:
+        struct Dictionaries;
+
+        explicit Codec(const Compression& options);
+
+        Compression options_;
+        std::string encoding_;
+        std::unique_ptr<Dictionaries> dictionaries_;
+    };
+}
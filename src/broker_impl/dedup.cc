@@ -0,0 +1,242 @@
+//
+// Created by denn nevera on 2019-08-09.
+//
+
+#include "dedup.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+namespace capy::amqp {
+
+    ///
+    /// MARK: - cuckoo filter
+    ///
+
+    CuckooFilter::CuckooFilter(size_t capacity):
+            slots_(),
+            mask_(0),
+            random_(0x9E3779B97F4A7C15ull)
+    {
+      size_t buckets = 1;
+      while (buckets * bucket_size < 2 * std::max<size_t>(capacity, 1)) buckets <<= 1;
+      slots_.assign(buckets * bucket_size, 0);
+      mask_ = buckets - 1;
+    }
+
+    uint16_t CuckooFilter::fingerprint(uint64_t hash) {
+      auto value = static_cast<uint16_t>(hash >> 48);
+      return value == 0 ? 1 : value;
+    }
+
+    size_t CuckooFilter::alternate(size_t index, uint16_t fingerprint) const {
+      return (index ^ static_cast<size_t>(fingerprint * 0x5bd1e995ull)) & mask_;
+    }
+
+    bool CuckooFilter::put(size_t index, uint16_t fingerprint) {
+      auto bucket = slots_.begin() + index * bucket_size;
+      auto slot = std::find(bucket, bucket + bucket_size, 0);
+      if (slot == bucket + bucket_size) return false;
+      *slot = fingerprint;
+      return true;
+    }
+
+    bool CuckooFilter::has(size_t index, uint16_t fingerprint) const {
+      auto bucket = slots_.begin() + index * bucket_size;
+      return std::find(bucket, bucket + bucket_size, fingerprint) != bucket + bucket_size;
+    }
+
+    bool CuckooFilter::insert(uint64_t hash) {
+
+      auto value = fingerprint(hash);
+      auto index = static_cast<size_t>(hash) & mask_;
+
+      if (put(index, value) || put(alternate(index, value), value)) return true;
+
+      for (size_t kick = 0; kick < max_kicks; ++kick) {
+
+        random_ ^= random_ << 13;
+        random_ ^= random_ >> 7;
+        random_ ^= random_ << 17;
+
+        if (kick == 0 && (random_ & 1)) index = alternate(index, value);
+
+        std::swap(value, slots_[index * bucket_size + random_ % bucket_size]);
+
+        index = alternate(index, value);
+
+        if (put(index, value)) return true;
+      }
+
+      return false;
+    }
+
+    bool CuckooFilter::contains(uint64_t hash) const {
+      auto value = fingerprint(hash);
+      auto index = static_cast<size_t>(hash) & mask_;
+      return has(index, value) || has(alternate(index, value), value);
+    }
+
+    bool CuckooFilter::erase(uint64_t hash) {
+
+      auto value = fingerprint(hash);
+      auto index = static_cast<size_t>(hash) & mask_;
+
+      for (auto bucket_index: {index, alternate(index, value)}) {
+        auto bucket = slots_.begin() + bucket_index * bucket_size;
+        auto slot = std::find(bucket, bucket + bucket_size, value);
+        if (slot != bucket + bucket_size) {
+          *slot = 0;
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    void CuckooFilter::clear() {
+      std::fill(slots_.begin(), slots_.end(), 0);
+    }
+
+    ///
+    /// MARK: - deduplicator
+    ///
+
+    Deduplicator::Deduplicator(const Deduplication &deduplication):
+            deduplication_(deduplication),
+            mutex_(),
+            filter_(deduplication.capacity),
+            filtering_(true),
+            entries_(),
+            kept_(),
+            index_(),
+            replay_bytes_(0)
+    {
+      deduplication_.capacity = std::max<size_t>(deduplication_.capacity, 1);
+    }
+
+    uint64_t Deduplicator::hash(const std::string &message_id) {
+      uint64_t value = std::hash<std::string>()(message_id);
+      value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+      value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+      return value ^ (value >> 31);
+    }
+
+    Deduplicator::Seen Deduplicator::check(const std::string &message_id, clock::time_point now) {
+
+      std::lock_guard lock(mutex_);
+
+      expire(now);
+
+      auto message_hash = hash(message_id);
+
+      ///
+      /// Most of messages are not seen, the filter answers without the index lookup
+      ///
+      if (!filtering_ || filter_.contains(message_hash)) {
+
+        auto found = index_.find(message_id);
+
+        if (found != index_.end()) {
+          auto entry = found->second;
+          entry->seen = now;
+          entries_.splice(entries_.begin(), entries_, entry);
+          if (entry->replay) kept_.splice(kept_.begin(), kept_, entry->kept);
+          return Seen{entry->replay ? State::replied : State::duplicate, entry->replay};
+        }
+      }
+
+      entries_.push_front(Entry{message_id, message_hash, now, nullptr, kept_.end()});
+      index_[message_id] = entries_.begin();
+
+      if (filtering_ && !filter_.insert(message_hash)) rebuild_filter();
+
+      while (entries_.size() > deduplication_.capacity) remove(std::prev(entries_.end()));
+
+      return Seen();
+    }
+
+    void Deduplicator::reply(const std::string &message_id, const Replay &replay) {
+
+      std::lock_guard lock(mutex_);
+
+      auto found = index_.find(message_id);
+
+      if (found == index_.end()) return;
+
+      auto entry = found->second;
+
+      release_replay(entry);
+
+      if (!replay || replay->size() > deduplication_.max_replay_bytes) return;
+
+      entry->replay = replay;
+      entry->kept = kept_.insert(kept_.begin(), entry);
+      replay_bytes_ += replay->size();
+
+      drop_replays();
+    }
+
+    void Deduplicator::forget(const std::string &message_id) {
+
+      std::lock_guard lock(mutex_);
+
+      auto found = index_.find(message_id);
+
+      if (found != index_.end()) remove(found->second);
+    }
+
+    size_t Deduplicator::size() const {
+      std::lock_guard lock(mutex_);
+      return entries_.size();
+    }
+
+    size_t Deduplicator::get_replay_bytes() const {
+      std::lock_guard lock(mutex_);
+      return replay_bytes_;
+    }
+
+    void Deduplicator::expire(clock::time_point now) {
+      while (!entries_.empty() && now - entries_.back().seen >= deduplication_.window) {
+        remove(std::prev(entries_.end()));
+      }
+    }
+
+    void Deduplicator::remove(Entries::iterator entry) {
+      if (filtering_) filter_.erase(entry->hash);
+      release_replay(entry);
+      index_.erase(entry->message_id);
+      entries_.erase(entry);
+    }
+
+    void Deduplicator::release_replay(Entries::iterator entry) {
+      if (!entry->replay) return;
+      replay_bytes_ -= entry->replay->size();
+      entry->replay = nullptr;
+      kept_.erase(entry->kept);
+      entry->kept = kept_.end();
+    }
+
+    void Deduplicator::drop_replays() {
+      while (replay_bytes_ > deduplication_.max_replay_bytes && !kept_.empty()) {
+        release_replay(kept_.back());
+      }
+    }
+
+    /***
+     * Fingerprint is lost by the failed insertion, the filter is refilled from the index.
+     * The index is used alone if the filter can not hold it
+     */
+    void Deduplicator::rebuild_filter() {
+
+      filter_.clear();
+
+      for (auto& entry: entries_) {
+        if (!filter_.insert(entry.hash)) {
+          filtering_ = false;
+          return;
+        }
+      }
+    }
+}
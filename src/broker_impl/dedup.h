@@ -0,0 +1,165 @@
+//
+// Created by denn nevera on 2019-08-09.
+//
+
+#pragma once
+
+#include "capy/amqp_broker.h"
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace capy::amqp {
+
+    /***
+     * Cuckoo filter of 16-bit fingerprints, it answers "not seen" without touching the exact index.
+     * Fingerprint has two candidate buckets, a full bucket evicts its random fingerprint to the alternate one
+     */
+    class CuckooFilter {
+
+    public:
+
+        static constexpr size_t bucket_size = 4;
+        static constexpr size_t max_kicks = 500;
+
+        /***
+         * Create filter
+         * @param capacity expected items count, buckets are sized for 50% load
+         */
+        explicit CuckooFilter(size_t capacity);
+
+        /***
+         * Insert item hash
+         * @return false if the filter is full, some fingerprint is lost then
+         */
+        bool insert(uint64_t hash);
+
+        /***
+         * Check item hash may be inserted, false positives are possible
+         */
+        bool contains(uint64_t hash) const;
+
+        /***
+         * Erase inserted item hash
+         */
+        bool erase(uint64_t hash);
+
+        void clear();
+
+    private:
+
+        std::vector<uint16_t> slots_;
+        size_t mask_;
+        uint64_t random_;
+
+        static uint16_t fingerprint(uint64_t hash);
+        size_t alternate(size_t index, uint16_t fingerprint) const;
+        bool put(size_t index, uint16_t fingerprint);
+        bool has(size_t index, uint16_t fingerprint) const;
+    };
+
+    /***
+     * Message ids seen by listener are kept in the exact LRU index behind the cuckoo filter.
+     * Id is forgotten when it is not seen during the window or it is the least recently seen one
+     * over capacity. Replays are kept with their ids until replays bytes limit is exceeded
+     */
+    class Deduplicator {
+
+    public:
+
+        using clock = std::chrono::steady_clock;
+        using Replay = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+        enum class State:int {
+            /**
+             * message id is not seen, it is kept as pending
+             */
+            fresh = 0,
+            /**
+             * message is handled or it is handling now, its replay is not kept
+             */
+            duplicate,
+            /**
+             * message is handled and its replay is kept
+             */
+            replied
+        };
+
+        struct Seen {
+            State state = State::fresh;
+            Replay replay = nullptr;
+        };
+
+        explicit Deduplicator(const Deduplication& deduplication);
+
+        Deduplicator(const Deduplicator&) = delete;
+        Deduplicator(Deduplicator&&) = delete;
+
+        /***
+         * Check message is seen, fresh message id is kept until its replay is set or it is forgotten
+         * @param message_id message id
+         * @param now receiving time
+         * @return seen state and kept replay
+         */
+        Seen check(const std::string& message_id, clock::time_point now = clock::now());
+
+        /***
+         * Set replay of the handled message
+         * @param message_id message id
+         * @param replay encoded replay, nullptr marks the message handled without keeping its replay
+         */
+        void reply(const std::string& message_id, const Replay& replay);
+
+        /***
+         * Forget message id, the message is handled again when it is redelivered
+         * @param message_id message id
+         */
+        void forget(const std::string& message_id);
+
+        size_t size() const;
+
+        size_t get_replay_bytes() const;
+
+    private:
+
+        struct Entry;
+
+        using Entries = std::list<Entry>;
+
+        ///
+        /// Entries with replays in the least recently seen order
+        ///
+        using Kept = std::list<Entries::iterator>;
+
+        struct Entry {
+            std::string message_id;
+            uint64_t hash = 0;
+            clock::time_point seen;
+            Replay replay = nullptr;
+            Kept::iterator kept;
+        };
+
+        Deduplication deduplication_;
+        mutable std::mutex mutex_;
+        CuckooFilter filter_;
+        bool filtering_;
+        Entries entries_;
+        Kept kept_;
+        std::unordered_map<std::string, Entries::iterator> index_;
+        size_t replay_bytes_;
+
+        static uint64_t hash(const std::string& message_id);
+
+        void expire(clock::time_point now);
+        void remove(Entries::iterator entry);
+        void release_replay(Entries::iterator entry);
+        void drop_replays();
+        void rebuild_filter();
+    };
+}
@@ -0,0 +1,517 @@
+//
+// Created by denn nevera on 2019-08-02.
+//
+
+#include "handler.h"
+#include "transport_uv.h"
+#include "transport_uring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace capy::amqp {
+
+    std::shared_ptr<ConnectionHandler> ConnectionHandler::Make(uv_loop_t* loop,
+                                                               uint16_t heartbeat_timeout,
+                                                               const ConnectionOptions& options,
+                                                               const std::shared_ptr<Metrics>& metrics,
+                                                               const std::shared_ptr<NodeSelector>& nodes,
+                                                               size_t node) {
+#if CAPY_AMQP_WITH_IO_URING
+      if (options.transport == ConnectionOptions::Transport::io_uring) {
+        return std::make_shared<UringTransport>(loop, heartbeat_timeout, options, metrics, nodes, node);
+      }
+#endif
+      return std::make_shared<UvTransport>(loop, heartbeat_timeout, options, metrics, nodes, node);
+    }
+
+    Error ConnectionHandler::Check(ConnectionOptions::Transport transport) {
+
+      switch (transport) {
+
+        case ConnectionOptions::Transport::libuv:
+          return Error(CommonError::OK);
+
+        case ConnectionOptions::Transport::io_uring:
+#if CAPY_AMQP_WITH_IO_URING
+          return UringTransport::Check();
+#else
+          return Error(CommonError::NOT_SUPPORTED, "io_uring transport is not supported by the build");
+#endif
+      }
+
+      return Error(CommonError::NOT_SUPPORTED, "unknown transport");
+    }
+
+    ConnectionHandler::ConnectionHandler(uv_loop_t* loop,
+                                         uint16_t heartbeat_timeout,
+                                         const ConnectionOptions& options,
+                                         const std::shared_ptr<Metrics>& metrics,
+                                         const std::shared_ptr<NodeSelector>& nodes,
+                                         size_t node):
+            loop_(loop),
+            heartbeat_timeout_(heartbeat_timeout),
+            options_(options),
+            metrics_(metrics),
+            nodes_(nodes),
+            node_(node),
+            started_(NodeSelector::clock::now()),
+            loop_thread_(),
+            last_read_(NodeSelector::clock::now())
+    {}
+
+    ConnectionHandler::~ConnectionHandler() = default;
+
+    ///
+    /// MARK: - control
+    ///
+
+    void ConnectionHandler::attach(AMQP::Connection* connection) {
+      std::lock_guard lock(connection_mutex_);
+      connection_ = connection;
+    }
+
+    void ConnectionHandler::start() {
+
+      {
+        std::lock_guard lock(state_mutex_);
+
+        if (stopped_) return;
+
+        uv_check_init(loop_, &check_);
+        uv_async_init(loop_, &async_, on_async);
+        uv_timer_init(loop_, &heartbeat_);
+        uv_timer_init(loop_, &connecting_);
+
+        check_.data = async_.data = heartbeat_.data = connecting_.data = this;
+
+        ///
+        /// Flushing and heartbeats do not keep the loop alive, the socket does
+        ///
+        uv_unref(reinterpret_cast<uv_handle_t*>(&check_));
+        uv_unref(reinterpret_cast<uv_handle_t*>(&async_));
+        uv_unref(reinterpret_cast<uv_handle_t*>(&heartbeat_));
+        uv_unref(reinterpret_cast<uv_handle_t*>(&connecting_));
+
+        uv_check_start(&check_, on_check);
+
+        ///
+        /// Resolving, connecting and the handshake are limited by one timer, it is stopped by onReady
+        ///
+        if (options_.connection_timeout.count() > 0) {
+          auto timeout = static_cast<uint64_t>(options_.connection_timeout.count());
+          uv_timer_start(&connecting_, on_connection_timeout, timeout, 0);
+        }
+
+        self_ = shared_from_this();
+        open_ = true;
+      }
+
+      if (auto status = open()) {
+        fail(uv_strerror(status));
+        return;
+      }
+
+      auto& node = nodes_->get_node(node_);
+
+      struct addrinfo hints = {};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+
+      resolving_ = shared_from_this();
+      resolve_.data = this;
+
+      auto port = std::to_string(node.port);
+
+      if (auto status = uv_getaddrinfo(loop_, &resolve_, on_resolved, node.hostname.c_str(), port.c_str(), &hints)) {
+        resolving_.reset();
+        fail(uv_strerror(status));
+      }
+    }
+
+    void ConnectionHandler::stop() {
+
+      {
+        std::lock_guard lock(connection_mutex_);
+        connection_ = nullptr;
+      }
+
+      std::lock_guard lock(state_mutex_);
+
+      if (stopped_) return;
+
+      stopped_ = true;
+
+      if (open_) uv_async_send(&async_);
+    }
+
+    void ConnectionHandler::fail(const char *message) {
+
+      if (lost.exchange(true)) return;
+
+      metrics_->connections_lost.add();
+
+      if (!closing) {
+        nodes_->failed(node_);
+      }
+
+      if (deferred) {
+        deferred->report_error(capy::Error(capy::amqp::BrokerError::CONNECTION_LOST, message));
+      }
+
+      {
+        std::lock_guard lock(connection_mutex_);
+        if (connection_) connection_->fail(message);
+      }
+
+      close_handles();
+    }
+
+    void ConnectionHandler::close_handles() {
+
+      {
+        std::lock_guard lock(state_mutex_);
+        if (!open_) return;
+        open_ = false;
+        stopped_ = true;
+      }
+
+      connected_ = false;
+
+      if (resolving_) uv_cancel(reinterpret_cast<uv_req_t*>(&resolve_));
+
+      close_transport();
+
+      close_handle(reinterpret_cast<uv_handle_t*>(&check_));
+      close_handle(reinterpret_cast<uv_handle_t*>(&async_));
+      close_handle(reinterpret_cast<uv_handle_t*>(&heartbeat_));
+      close_handle(reinterpret_cast<uv_handle_t*>(&connecting_));
+    }
+
+    void ConnectionHandler::close_handle(uv_handle_t *handle) {
+      handle->data = this;
+      closing_handles_++;
+      uv_close(handle, on_closed);
+    }
+
+    ///
+    /// MARK: - transport
+    ///
+
+    void ConnectionHandler::on_connect(int fd) {
+
+      if (auto error = apply_options(fd)) {
+        if (deferred) deferred->report_error(error);
+      }
+
+      connected_ = true;
+      last_read_ = NodeSelector::clock::now();
+
+      ///
+      /// Protocol header and handshake frames were buffered while connecting
+      ///
+      flush();
+    }
+
+    void ConnectionHandler::receive(const char *data, size_t size) {
+
+      ///
+      /// Connection may be released by callbacks of the parsed frames
+      ///
+      auto self = shared_from_this();
+
+      touch_loop();
+      last_read_ = NodeSelector::clock::now();
+
+      std::lock_guard lock(connection_mutex_);
+
+      if (!connection_) return;
+
+      if (input_.empty()) {
+        auto parsed = static_cast<size_t>(connection_->parse(data, size));
+        if (parsed < size) input_.assign(data + parsed, data + size);
+        return;
+      }
+
+      input_.insert(input_.end(), data, data + size);
+
+      auto parsed = static_cast<size_t>(connection_->parse(input_.data(), input_.size()));
+
+      input_.erase(input_.begin(), input_.begin() + static_cast<std::ptrdiff_t>(std::min(parsed, input_.size())));
+    }
+
+    bool ConnectionHandler::has_output() {
+      std::lock_guard lock(output_mutex_);
+      return output_bytes_ > 0;
+    }
+
+    size_t ConnectionHandler::take_output(std::vector<std::vector<char>> &blocks) {
+
+      std::lock_guard lock(output_mutex_);
+
+      if (output_bytes_ == 0) return 0;
+
+      if (output_offset_ > 0) {
+        auto& first = output_.front();
+        first.erase(first.begin(), first.begin() + static_cast<std::ptrdiff_t>(output_offset_));
+        output_offset_ = 0;
+      }
+
+      auto bytes = output_bytes_;
+
+      blocks.swap(output_);
+      output_.clear();
+
+      record_flush(bytes);
+
+      return bytes;
+    }
+
+    size_t ConnectionHandler::take_output(char *buffer, size_t capacity) {
+
+      std::lock_guard lock(output_mutex_);
+
+      size_t bytes = 0;
+
+      while (bytes < capacity && !output_.empty()) {
+
+        auto& first = output_.front();
+        auto size = std::min(first.size() - output_offset_, capacity - bytes);
+
+        std::memcpy(buffer + bytes, first.data() + output_offset_, size);
+
+        bytes += size;
+        output_offset_ += size;
+
+        if (output_offset_ == first.size()) {
+          output_.erase(output_.begin());
+          output_offset_ = 0;
+        }
+      }
+
+      if (bytes > 0) record_flush(bytes);
+
+      return bytes;
+    }
+
+    void ConnectionHandler::record_flush(size_t bytes) {
+
+      output_bytes_ -= bytes;
+
+      metrics_->write_flushes.add();
+      metrics_->write_bytes.add(bytes);
+      metrics_->flush_size.record(static_cast<uint64_t>(bytes));
+
+      if (output_bytes_ == 0) {
+        metrics_->write_frames.add(output_frames_);
+        output_frames_ = 0;
+      }
+    }
+
+    ///
+    /// MARK: - AMQP callbacks
+    ///
+
+    void ConnectionHandler::onData(AMQP::Connection *connection, const char *data, size_t size) {
+
+      (void) connection;
+
+      bool wakeup = false;
+      bool overflow = false;
+
+      {
+        std::lock_guard lock(output_mutex_);
+
+        wakeup = output_bytes_ == 0;
+
+        if (output_.empty() || output_.back().size() + size > block_size) {
+          output_.emplace_back();
+          output_.back().reserve(std::max(block_size, size));
+        }
+
+        output_.back().insert(output_.back().end(), data, data + size);
+        output_bytes_ += size;
+        output_frames_++;
+
+        overflow = output_bytes_ >= flush_threshold;
+      }
+
+      if (overflow && loop_thread_.load(std::memory_order_relaxed) == std::this_thread::get_id()) {
+        flush();
+        return;
+      }
+
+      ///
+      /// Frames from other threads are flushed by the loop thread, the loop thread flushes
+      /// its own frames at the end of the iteration
+      ///
+      if (wakeup || overflow) {
+        std::lock_guard lock(state_mutex_);
+        if (open_ && !stopped_) uv_async_send(&async_);
+      }
+    }
+
+    void ConnectionHandler::onReady(AMQP::Connection *connection) {
+      (void) connection;
+      ready_ = true;
+      nodes_->connected(node_, NodeSelector::clock::now() - started_);
+
+      std::lock_guard lock(state_mutex_);
+      if (open_) uv_timer_stop(&connecting_);
+    }
+
+    void ConnectionHandler::onError(AMQP::Connection *connection, const char *message) {
+      (void) connection;
+      if (deferred) {
+        deferred->report_error(capy::Error(capy::amqp::BrokerError::CONNECTION, message));
+      }
+    }
+
+    void ConnectionHandler::onClosed(AMQP::Connection *connection) {
+      (void) connection;
+      fail("connection closed");
+    }
+
+    void ConnectionHandler::onHeartbeat(AMQP::Connection *connection) {
+      connection->heartbeat();
+    }
+
+    uint16_t ConnectionHandler::onNegotiate(AMQP::Connection *connection, uint16_t interval) {
+
+      (void) connection;
+      (void) interval;
+
+      if (heartbeat_timeout_ > 0) {
+        std::lock_guard lock(state_mutex_);
+        if (open_) {
+          auto period = static_cast<uint64_t>(heartbeat_timeout_) * 1000 / 2;
+          uv_timer_start(&heartbeat_, on_heartbeat, period, period);
+        }
+      }
+
+      return heartbeat_timeout_;
+    }
+
+    capy::Error ConnectionHandler::apply_options(int fd) const {
+
+      auto set = [fd](int level, int name, int value) {
+          return setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+      };
+
+      if (options_.tcp_nodelay && !set(IPPROTO_TCP, TCP_NODELAY, 1)) {
+        return capy::Error(capy::amqp::BrokerError::CONNECTION, "TCP_NODELAY is not applied");
+      }
+
+      if (options_.send_buffer > 0 && !set(SOL_SOCKET, SO_SNDBUF, options_.send_buffer)) {
+        return capy::Error(capy::amqp::BrokerError::CONNECTION, "SO_SNDBUF is not applied");
+      }
+
+      if (options_.receive_buffer > 0 && !set(SOL_SOCKET, SO_RCVBUF, options_.receive_buffer)) {
+        return capy::Error(capy::amqp::BrokerError::CONNECTION, "SO_RCVBUF is not applied");
+      }
+
+      if (options_.keepalive.count() > 0) {
+
+        auto idle = static_cast<int>(options_.keepalive.count());
+
+#if defined(__APPLE__)
+        auto applied = set(SOL_SOCKET, SO_KEEPALIVE, 1) && set(IPPROTO_TCP, TCP_KEEPALIVE, idle);
+#elif defined(TCP_KEEPIDLE)
+        auto applied = set(SOL_SOCKET, SO_KEEPALIVE, 1) && set(IPPROTO_TCP, TCP_KEEPIDLE, idle);
+#else
+        auto applied = set(SOL_SOCKET, SO_KEEPALIVE, 1);
+        (void) idle;
+#endif
+        if (!applied) {
+          return capy::Error(capy::amqp::BrokerError::CONNECTION, "TCP keepalive is not applied");
+        }
+      }
+
+      return capy::Error(capy::amqp::CommonError::OK);
+    }
+
+    ///
+    /// MARK: - libuv callbacks
+    ///
+
+    void ConnectionHandler::on_resolved(uv_getaddrinfo_t *request, int status, struct addrinfo *result) {
+
+      auto handler = static_cast<ConnectionHandler*>(request->data);
+      auto self = std::move(handler->resolving_);
+
+      if (status < 0 || !handler->open_) {
+        if (result) uv_freeaddrinfo(result);
+        if (status < 0 && status != UV_ECANCELED) handler->fail(uv_strerror(status));
+        return;
+      }
+
+      status = handler->connect(result->ai_addr);
+
+      uv_freeaddrinfo(result);
+
+      if (status < 0) handler->fail(uv_strerror(status));
+    }
+
+    void ConnectionHandler::on_check(uv_check_t *handle) {
+      auto handler = static_cast<ConnectionHandler*>(handle->data);
+      handler->touch_loop();
+      handler->flush();
+    }
+
+    void ConnectionHandler::on_async(uv_async_t *handle) {
+
+      auto handler = static_cast<ConnectionHandler*>(handle->data);
+
+      handler->touch_loop();
+
+      bool stopped = false;
+
+      {
+        std::lock_guard lock(handler->state_mutex_);
+        stopped = handler->stopped_;
+      }
+
+      handler->flush();
+
+      if (stopped) handler->close_handles();
+    }
+
+    void ConnectionHandler::on_heartbeat(uv_timer_t *handle) {
+
+      auto handler = static_cast<ConnectionHandler*>(handle->data);
+
+      auto silence = NodeSelector::clock::now() - handler->last_read_;
+
+      if (silence > std::chrono::seconds(2 * handler->heartbeat_timeout_)) {
+        handler->fail("heartbeat timeout");
+        return;
+      }
+
+      std::lock_guard lock(handler->connection_mutex_);
+      if (handler->connection_) handler->connection_->heartbeat();
+    }
+
+    void ConnectionHandler::on_connection_timeout(uv_timer_t *handle) {
+
+      auto handler = static_cast<ConnectionHandler*>(handle->data);
+
+      if (handler->ready_) return;
+
+      handler->fail("connection timeout");
+    }
+
+    void ConnectionHandler::on_closed(uv_handle_t *handle) {
+
+      auto handler = static_cast<ConnectionHandler*>(handle->data);
+
+      if (--handler->closing_handles_ > 0) return;
+
+      ///
+      /// The handler may be destroyed by releasing itself
+      ///
+      auto self = std::move(handler->self_);
+    }
+}
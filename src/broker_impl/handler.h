@@ -6,95 +6,283 @@
 
 #include <uv.h>
 #include <amqpcpp.h>
-#include <amqpcpp/libuv.h>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "capy/amqp_broker.h"
+#include "metrics.h"
+#include "nodes.h"
 
 namespace capy::amqp {
 
     /**
-    *  Custom handler
+    *  Connection I/O driven by the broker loop. Outgoing frames are accumulated per connection and
+    *  written by one request at the end of the loop iteration, or at once when the buffered bytes
+    *  exceed the flush threshold. Handles are used by the loop thread only, frames may be sent by
+    *  any thread. Socket connecting, reading and writing are implemented by the transport
     */
-    class ConnectionHandler : public AMQP::LibUvHandler {
+    class ConnectionHandler : public AMQP::ConnectionHandler, public std::enable_shared_from_this<ConnectionHandler> {
+
+    public:
+
+        using Post = std::function<void(const std::function<void()>& task)>;
+
+        /**
+         * Buffered output is written at once when it exceeds the threshold
+         */
+        static constexpr size_t flush_threshold = 64 * 1024;
+
+        /**
+         * Output buffer block size, larger frames take their own block
+         */
+        static constexpr size_t block_size = 64 * 1024;
+
+        /***
+         * Create handler of the transport
+         * @param loop broker loop
+         * @param heartbeat_timeout heartbeat interval is proposed to the server
+         * @param options socket options, the transport is chosen by options
+         * @param metrics broker metrics
+         * @param nodes cluster nodes
+         * @param node connected node index
+         * @return handler
+         */
+        static std::shared_ptr<ConnectionHandler> Make(uv_loop_t* loop,
+                                                       uint16_t heartbeat_timeout,
+                                                       const ConnectionOptions& options,
+                                                       const std::shared_ptr<Metrics>& metrics,
+                                                       const std::shared_ptr<NodeSelector>& nodes,
+                                                       size_t node);
+
+        /***
+         * Check the transport is supported by the build and the system
+         * @param transport socket I/O backend
+         * @return error if the transport can not be used
+         */
+        static Error Check(ConnectionOptions::Transport transport);
+
+        ConnectionHandler(const ConnectionHandler&) = delete;
+        ConnectionHandler(ConnectionHandler&&) = delete;
+
+        /**
+         *  Destructor
+         */
+        virtual ~ConnectionHandler();
+
+        /***
+         * Set AMQP connection is driven by the handler
+         * @param connection AMQP connection, it is detached by stop()
+         */
+        void attach(AMQP::Connection* connection);
+
+        /***
+         * Resolve the node and connect the socket, it is called by the loop thread.
+         * Frames sent before the socket is connected are kept in the output buffer
+         */
+        void start();
+
+        /***
+         * Detach the AMQP connection and close the socket, it may be called by any thread.
+         * The handler is kept alive by its handles until they are closed
+         */
+        void stop();
+
+        std::shared_ptr<capy::amqp::DeferredListen> deferred = nullptr;
+
+        /**
+         * Connection has been lost and can not be used anymore
+         */
+        std::atomic_bool lost = false;
+
+        /**
+         * Connection is closed by the client, the node is not failed
+         */
+        std::atomic_bool closing = false;
+
+    protected:
+
+        ConnectionHandler(uv_loop_t* loop,
+                          uint16_t heartbeat_timeout,
+                          const ConnectionOptions& options,
+                          const std::shared_ptr<Metrics>& metrics,
+                          const std::shared_ptr<NodeSelector>& nodes,
+                          size_t node);
+
+        uv_loop_t* loop_;
+
+        ///
+        /// Socket is connected, it is changed by the loop thread
+        ///
+        bool connected_ = false;
+
+        /***
+         * Open transport handles, it is called by start()
+         * @return libuv error code
+         */
+        virtual int open() = 0;
+
+        /***
+         * Connect socket to the resolved node address
+         * @param address node address
+         * @return libuv error code
+         */
+        virtual int connect(const struct sockaddr* address) = 0;
+
+        /***
+         * Write buffered frames, it is called by the loop thread
+         */
+        virtual void flush() = 0;
+
+        /***
+         * Close socket and transport handles, handles are closed by close_handle()
+         */
+        virtual void close_transport() = 0;
+
+        /***
+         * Socket is connected: options are applied and buffered frames are flushed
+         * @param fd socket descriptor
+         */
+        void on_connect(int fd);
+
+        /***
+         * Pass received bytes to the AMQP connection, incomplete frames are kept until the next read
+         * @param data received bytes
+         * @param size bytes count
+         */
+        void receive(const char* data, size_t size);
+
+        /***
+         * Take all buffered frames, flush metrics are recorded
+         * @param blocks buffered blocks
+         * @return bytes count
+         */
+        size_t take_output(std::vector<std::vector<char>>& blocks);
+
+        /***
+         * Copy buffered frames to the buffer, flush metrics are recorded
+         * @param buffer output buffer
+         * @param capacity buffer size
+         * @return bytes count
+         */
+        size_t take_output(char* buffer, size_t capacity);
+
+        /***
+         * Check frames are waiting for the flush
+         */
+        bool has_output();
+
+        /***
+         * Close handle owned by the handler, the last close callback releases the handler
+         * @param handle initialized handle
+         */
+        void close_handle(uv_handle_t* handle);
+
+        /***
+         * Connection is lost: AMQP connection is failed, the socket is closed
+         * @param message reason
+         */
+        void fail(const char* message);
+
+        void touch_loop() { loop_thread_.store(std::this_thread::get_id(), std::memory_order_relaxed); }
+
     private:
+
         uint16_t heartbeat_timeout_;
+        ConnectionOptions options_;
+        std::shared_ptr<Metrics> metrics_;
+        std::shared_ptr<NodeSelector> nodes_;
+        size_t node_;
+        NodeSelector::clock::time_point started_;
+        bool ready_ = false;
+
+        ///
+        /// AMQP connection is detached by stop()
+        ///
+        std::recursive_mutex connection_mutex_;
+        AMQP::Connection* connection_ = nullptr;
+
+        ///
+        /// Handles state: handles are initialized by start() and closed once
+        ///
+        std::mutex state_mutex_;
+        bool open_ = false;
+        bool stopped_ = false;
+        size_t closing_handles_ = 0;
+        std::shared_ptr<ConnectionHandler> self_;
+        std::atomic<std::thread::id> loop_thread_;
+
+        uv_check_t check_;
+        uv_async_t async_;
+        uv_timer_t heartbeat_;
+        uv_timer_t connecting_;
+        uv_getaddrinfo_t resolve_;
+        std::shared_ptr<ConnectionHandler> resolving_;
+        NodeSelector::clock::time_point last_read_;
+
+        ///
+        /// Output frames are waiting for the flush, the first block may be taken partially
+        ///
+        std::mutex output_mutex_;
+        std::vector<std::vector<char>> output_;
+        size_t output_offset_ = 0;
+        size_t output_bytes_ = 0;
+        size_t output_frames_ = 0;
+
+        ///
+        /// Incomplete frames of the previous reads
+        ///
+        std::vector<char> input_;
 
         /**
-         *  Method that is called when a connection error occurs
-         *  @param  connection
-         *  @param  message
+         *  Method that is called by AMQP-CPP when data has to be sent over the network
          */
-        virtual void onError(AMQP::TcpConnection* connection, const char* message) override {
-          (void) connection;
-          if (deferred) {
-            deferred->report_error(capy::Error(capy::amqp::BrokerError::CONNECTION, message));
-          }
-        }
+        virtual void onData(AMQP::Connection *connection, const char *data, size_t size) override;
 
         /**
-         *  Method that is called when the TCP connection ends up in a connected state
-         *  @param  connection  The TCP connection
+         *  Method that is called when the AMQP login handshake has been completed,
+         *  the handshake round trip is measured for the node selection
          */
-        virtual void onConnected(AMQP::TcpConnection* connection) override {
-          (void) connection;
-        }
+        virtual void onReady(AMQP::Connection *connection) override;
 
         /**
-         *  Method that is called when the TCP connection ends up in a connected state
-         *  This method is called after the TCP connection has been set up, but before
-         *  the (optional) secure TLS connection is ready, and before the AMQP login
-         *  handshake has been completed. If this step has been set, the onLost()
-         *  method will also always be called when the connection is closed.
-         *  @param  connection  The TCP connection
-         */
-        virtual void onClosed(AMQP::TcpConnection *connection) override
-        {
-          // make sure compilers dont complain about unused parameters
-          (void) connection;
-        }
+         *  Method that is called when a connection error occurs
+         */
+        virtual void onError(AMQP::Connection *connection, const char *message) override;
 
         /**
-         *  Method that is called when the TCP connection is lost or closed. This
-         *  is always called if you have also received a call to onConnected().
-         *  @param  connection  The TCP connection
-         */
-        virtual void onLost(AMQP::TcpConnection *connection) override
-        {
-          // make sure compilers dont complain about unused parameters
-          (void) connection;
-          if (deferred) {
-            deferred->report_error(capy::Error(capy::amqp::BrokerError::CONNECTION_LOST, "connection lost"));
-          }
-        }
-
-        virtual void onHeartbeat(AMQP::TcpConnection *connection) override
-        {
-          connection->heartbeat();
-        }
-
-        virtual uint16_t onNegotiate(AMQP::TcpConnection *connection, uint16_t interval) override
-        {
-          (void) interval;
-          (void) connection;
-          return heartbeat_timeout_;
-        }
+         *  Method that is called when the AMQP connection is closed by the close handshake
+         */
+        virtual void onClosed(AMQP::Connection *connection) override;
+
+        virtual void onHeartbeat(AMQP::Connection *connection) override;
+
+        virtual uint16_t onNegotiate(AMQP::Connection *connection, uint16_t interval) override;
 
-    public:
         /**
-         *  Constructor
-         *  @param  uv_loop
+         *  Apply socket options to the connected socket
+         *  @param  fd socket descriptor
+         *  @return error if some option is not applied
          */
-        ConnectionHandler(uv_loop_t* loop, uint16_t heartbeat_timeout):
-        AMQP::LibUvHandler(loop),
-        heartbeat_timeout_(heartbeat_timeout)
-        {
-        }
+        capy::Error apply_options(int fd) const;
 
-        /**
-         *  Destructor
+        /***
+         * Close handles, the last close callback releases the handler
          */
-        virtual ~ConnectionHandler() = default;
+        void close_handles();
 
-        std::shared_ptr<capy::amqp::DeferredListen> deferred = nullptr;
+        /***
+         * Record metrics of the taken bytes, frames are counted when the buffer is drained.
+         * It is called under the output lock
+         */
+        void record_flush(size_t bytes);
+
+        static void on_resolved(uv_getaddrinfo_t* request, int status, struct addrinfo* result);
+        static void on_check(uv_check_t* handle);
+        static void on_async(uv_async_t* handle);
+        static void on_heartbeat(uv_timer_t* handle);
+        static void on_connection_timeout(uv_timer_t* handle);
+        static void on_closed(uv_handle_t* handle);
     };
 }
@@ -0,0 +1,190 @@
+//
+// Created by denn nevera on 2019-07-12.
+//
+
+#pragma once
+
+#include "capy/amqp_metrics.h"
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+namespace capy::amqp {
+
+    using metrics_clock = std::chrono::steady_clock;
+
+    /***
+     * Lock-free HDR-like histogram. Every thread records into its own shard,
+     * shards are merged on snapshot reading
+     */
+    class Histogram {
+
+    public:
+
+        static constexpr size_t shards_count = 8;
+
+        Histogram():shards_(){
+          for (auto& shard: shards_) {
+            shard = std::make_unique<Shard>();
+          }
+        }
+
+        Histogram(const Histogram&) = delete;
+        Histogram(Histogram&&) = delete;
+
+        void record(uint64_t microseconds) {
+          auto& shard = *shards_[shard_index()];
+          shard.buckets[HistogramSnapshot::bucket_index(microseconds)].fetch_add(1, std::memory_order_relaxed);
+          shard.count.fetch_add(1, std::memory_order_relaxed);
+          shard.sum.fetch_add(microseconds, std::memory_order_relaxed);
+          update_min(shard.min, microseconds);
+          update_max(shard.max, microseconds);
+        }
+
+        void record(const metrics_clock::time_point& since) {
+          record(static_cast<uint64_t>(
+                         std::chrono::duration_cast<std::chrono::microseconds>(metrics_clock::now() - since).count()));
+        }
+
+        HistogramSnapshot snapshot() const {
+
+          HistogramSnapshot snapshot;
+          snapshot.buckets.resize(HistogramSnapshot::bucket_count(), 0);
+          snapshot.min = UINT64_MAX;
+
+          for (auto& shard: shards_) {
+            for (size_t i = 0; i < snapshot.buckets.size(); ++i) {
+              snapshot.buckets[i] += shard->buckets[i].load(std::memory_order_relaxed);
+            }
+            snapshot.count += shard->count.load(std::memory_order_relaxed);
+            snapshot.sum += shard->sum.load(std::memory_order_relaxed);
+            snapshot.min = std::min(snapshot.min, shard->min.load(std::memory_order_relaxed));
+            snapshot.max = std::max(snapshot.max, shard->max.load(std::memory_order_relaxed));
+          }
+
+          if (snapshot.count == 0) snapshot.min = 0;
+
+          return snapshot;
+        }
+
+    private:
+
+        struct alignas(64) Shard {
+            std::vector<std::atomic<uint64_t>> buckets;
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> sum;
+            std::atomic<uint64_t> min;
+            std::atomic<uint64_t> max;
+
+            Shard():buckets(HistogramSnapshot::bucket_count()), count(0), sum(0), min(UINT64_MAX), max(0){}
+        };
+
+        std::array<std::unique_ptr<Shard>, shards_count> shards_;
+
+        static size_t shard_index() {
+          static std::atomic<size_t> next(0);
+          thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % shards_count;
+          return index;
+        }
+
+        static void update_min(std::atomic<uint64_t>& target, uint64_t value) {
+          auto current = target.load(std::memory_order_relaxed);
+          while (value < current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+        }
+
+        static void update_max(std::atomic<uint64_t>& target, uint64_t value) {
+          auto current = target.load(std::memory_order_relaxed);
+          while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+        }
+    };
+
+    /***
+     * Lock-free monotonic counter
+     */
+    class Counter {
+    public:
+        Counter():value_(0){}
+
+        void add(uint64_t value = 1) { value_.fetch_add(value, std::memory_order_relaxed); }
+        uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> value_;
+    };
+
+    /***
+     * Broker metrics registry
+     */
+    struct Metrics {
+
+        Counter publish_count;
+        Counter publish_bytes;
+        Counter publish_errors;
+        Counter fetch_count;
+        Counter listen_count;
+        Counter listen_bytes;
+        Counter listen_errors;
+        Counter connections_opened;
+        Counter connections_lost;
+        Counter reconnects;
+        Counter channels_opened;
+        Counter channels_closed;
+        Counter write_flushes;
+        Counter write_frames;
+        Counter write_bytes;
+        Counter spooled;
+        Counter spool_drained;
+        Counter spool_rejected;
+        Counter duplicates;
+        Counter duplicate_replays;
+        Counter reply_cache_hits;
+        Counter reply_cache_misses;
+        Counter reply_cache_collapsed;
+
+        Histogram publish_latency;
+        Histogram fetch_latency;
+        Histogram handler_time;
+        Histogram ack_latency;
+        Histogram replay_latency;
+        Histogram queueing_delay;
+        Histogram flush_size;
+
+        MetricsSnapshot snapshot() const {
+          MetricsSnapshot s;
+          s.publish_count = publish_count.get();
+          s.publish_bytes = publish_bytes.get();
+          s.publish_errors = publish_errors.get();
+          s.fetch_count = fetch_count.get();
+          s.listen_count = listen_count.get();
+          s.listen_bytes = listen_bytes.get();
+          s.listen_errors = listen_errors.get();
+          s.connections_opened = connections_opened.get();
+          s.connections_lost = connections_lost.get();
+          s.reconnects = reconnects.get();
+          s.channels_opened = channels_opened.get();
+          s.channels_closed = channels_closed.get();
+          s.write_flushes = write_flushes.get();
+          s.write_frames = write_frames.get();
+          s.write_bytes = write_bytes.get();
+          s.spooled = spooled.get();
+          s.spool_drained = spool_drained.get();
+          s.spool_rejected = spool_rejected.get();
+          s.duplicates = duplicates.get();
+          s.duplicate_replays = duplicate_replays.get();
+          s.reply_cache_hits = reply_cache_hits.get();
+          s.reply_cache_misses = reply_cache_misses.get();
+          s.reply_cache_collapsed = reply_cache_collapsed.get();
+          s.publish_latency = publish_latency.snapshot();
+          s.fetch_latency = fetch_latency.snapshot();
+          s.handler_time = handler_time.snapshot();
+          s.ack_latency = ack_latency.snapshot();
+          s.replay_latency = replay_latency.snapshot();
+          s.queueing_delay = queueing_delay.snapshot();
+          s.flush_size = flush_size.snapshot();
+          return s;
+        }
+    };
+}
@@ -0,0 +1,247 @@
+//
+// Created by denn nevera on 2019-07-30.
+//
+
+#pragma once
+
+#include "capy/amqp_address.h"
+#include "capy/amqp_broker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace capy::amqp {
+
+    /***
+     * Cluster nodes of the address with handshake RTT, connections count and failures.
+     * Connections ask the selector for a node, report handshake completion or failure and
+     * release the node when they are dropped. A failed node which completes handshake again
+     * starts a new epoch, connections of the older epochs may be moved to it
+     */
+    class NodeSelector {
+
+    public:
+
+        using clock = std::chrono::steady_clock;
+
+        static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+        /***
+         * Weight of the last handshake in smoothed RTT, 1/rtt_weight
+         */
+        static constexpr int64_t rtt_weight = 4;
+
+        explicit NodeSelector(const std::vector<Address::Node>& nodes, const NodeSelection& selection = NodeSelection()):
+                nodes_(nodes),
+                states_(nodes.size()),
+                selection_(selection),
+                mutex_(),
+                epoch_(0)
+        {}
+
+        NodeSelector(const NodeSelector&) = delete;
+        NodeSelector(NodeSelector&&) = delete;
+
+        void set_selection(const NodeSelection& selection) {
+          std::lock_guard lock(mutex_);
+          selection_ = selection;
+        }
+
+        size_t size() const { return nodes_.size(); }
+
+        const Address::Node& get_node(size_t index) const { return nodes_.at(index); }
+
+        uint64_t get_epoch() const { return epoch_.load(std::memory_order_acquire); }
+
+        /***
+         * Find node by host or host:port
+         * @param node node name
+         * @return node index or npos
+         */
+        size_t find(const std::string& node) const {
+          for (size_t i = 0; i < nodes_.size(); ++i) {
+            auto& hostname = nodes_[i].hostname;
+            if (node == hostname || node == hostname + ":" + std::to_string(nodes_[i].port)) return i;
+          }
+          return npos;
+        }
+
+        /***
+         * Check the node is not excluded by recent failure
+         * @param index node index
+         * @param now current time
+         * @return true if the node can be connected
+         */
+        bool is_available(size_t index, clock::time_point now = clock::now()) const {
+          std::lock_guard lock(mutex_);
+          return is_available(states_.at(index), now);
+        }
+
+        /***
+         * Count connection opened to the node chosen by caller
+         * @param index node index
+         */
+        void acquire(size_t index) {
+          std::lock_guard lock(mutex_);
+          states_.at(index).connections++;
+        }
+
+        /***
+         * Select node of the new connection and count the connection
+         * @param now current time
+         * @return node index
+         */
+        size_t select(clock::time_point now = clock::now()) {
+
+          std::lock_guard lock(mutex_);
+
+          auto best = npos;
+
+          for (size_t i = 0; i < states_.size(); ++i) {
+            if (!is_available(states_[i], now)) continue;
+            if (best == npos || is_better(states_[i], states_[best])) best = i;
+          }
+
+          ///
+          /// All nodes are failed, the earliest one is retried
+          ///
+          if (best == npos) {
+            best = 0;
+            for (size_t i = 1; i < states_.size(); ++i) {
+              if (states_[i].failed_at < states_[best].failed_at) best = i;
+            }
+          }
+
+          states_[best].connections++;
+
+          return best;
+        }
+
+        /***
+         * Connection handshake is completed
+         * @param index node index
+         * @param rtt handshake round trip
+         */
+        void connected(size_t index, clock::duration rtt) {
+
+          std::lock_guard lock(mutex_);
+
+          auto& state = states_.at(index);
+          auto us = std::chrono::duration_cast<std::chrono::microseconds>(rtt);
+
+          state.rtt = state.rtt.count() == 0 ? us : state.rtt + (us - state.rtt) / rtt_weight;
+
+          if (state.failed) {
+            state.failed = false;
+            epoch_.fetch_add(1, std::memory_order_release);
+          }
+        }
+
+        /***
+         * Connection to the node is failed or lost
+         * @param index node index
+         * @param now current time
+         */
+        void failed(size_t index, clock::time_point now = clock::now()) {
+          std::lock_guard lock(mutex_);
+          auto& state = states_.at(index);
+          state.failed = true;
+          state.failed_at = now;
+        }
+
+        /***
+         * Connection is dropped
+         * @param index node index
+         */
+        void released(size_t index) {
+          std::lock_guard lock(mutex_);
+          auto& state = states_.at(index);
+          if (state.connections > 0) state.connections--;
+        }
+
+        /***
+         * Check the connection should be moved to the less loaded node after a node recovery
+         * @param index node of the connection
+         * @param epoch epoch of the connection
+         * @param now current time
+         * @return true if the connection should be reopened
+         */
+        bool should_move(size_t index, uint64_t epoch, clock::time_point now = clock::now()) const {
+
+          if (epoch == get_epoch()) return false;
+
+          std::lock_guard lock(mutex_);
+
+          if (!selection_.rebalance || selection_.policy != NodeSelection::Policy::balanced) return false;
+
+          auto least = std::numeric_limits<size_t>::max();
+
+          for (size_t i = 0; i < states_.size(); ++i) {
+            if (i == index || !is_available(states_[i], now)) continue;
+            least = std::min(least, states_[i].connections);
+          }
+
+          return least != std::numeric_limits<size_t>::max() && states_.at(index).connections > least + 1;
+        }
+
+        std::vector<NodeState> get_states(clock::time_point now = clock::now()) const {
+
+          std::lock_guard lock(mutex_);
+
+          std::vector<NodeState> states;
+
+          for (size_t i = 0; i < states_.size(); ++i) {
+            states.push_back(NodeState{
+                    nodes_[i].hostname,
+                    nodes_[i].port,
+                    states_[i].rtt,
+                    states_[i].connections,
+                    is_available(states_[i], now)});
+          }
+
+          return states;
+        }
+
+    private:
+
+        struct State {
+            std::chrono::microseconds rtt = std::chrono::microseconds(0);
+            size_t connections = 0;
+            bool failed = false;
+            clock::time_point failed_at;
+        };
+
+        std::vector<Address::Node> nodes_;
+        std::vector<State> states_;
+        NodeSelection selection_;
+        mutable std::mutex mutex_;
+        std::atomic<uint64_t> epoch_;
+
+        bool is_available(const State& state, clock::time_point now) const {
+          return !state.failed || now - state.failed_at >= selection_.retry_after;
+        }
+
+        bool is_better(const State& a, const State& b) const {
+
+          ///
+          /// Node is not measured yet is probed first
+          ///
+          auto rtt_a = a.rtt.count();
+          auto rtt_b = b.rtt.count();
+
+          if (selection_.policy == NodeSelection::Policy::fastest) {
+            if (rtt_a != rtt_b) return rtt_a < rtt_b;
+            return a.connections < b.connections;
+          }
+
+          if (a.connections != b.connections) return a.connections < b.connections;
+
+          return rtt_a < rtt_b;
+        }
+    };
+}
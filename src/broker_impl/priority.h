@@ -0,0 +1,132 @@
+//
+// Created by denn nevera on 2019-07-23.
+//
+
+#pragma once
+
+#include "capy/amqp_function.h"
+
+#include <uv.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace capy::amqp {
+
+    /***
+     * Priority dispatch queue between consumers and handlers. Deliveries read by the loop in the same
+     * poll phase are queued and handled in the check phase, the higher priority first, deliveries of
+     * the same priority are handled in arrival order. The queue is used by the loop thread only
+     */
+    class PriorityDispatch {
+
+    public:
+
+        using Job = SmallFunction<void()>;
+
+        /***
+         * Create dispatch queue
+         * @param loop queue is drained in the loop check phase, nullptr means it is drained manually
+         */
+        explicit PriorityDispatch(uv_loop_t* loop):
+                heap_(),
+                sequence_(0),
+                check_(nullptr),
+                draining_(false)
+        {
+          if (!loop) return;
+          check_ = new uv_check_t;
+          uv_check_init(loop, check_);
+          check_->data = this;
+          ///
+          /// Check handle must not keep the loop alive
+          ///
+          uv_unref(reinterpret_cast<uv_handle_t*>(check_));
+        }
+
+        PriorityDispatch(const PriorityDispatch&) = delete;
+        PriorityDispatch(PriorityDispatch&&) = delete;
+
+        ~PriorityDispatch() {
+          close();
+        }
+
+        /***
+         * Close the check handle, it is freed by the loop when the closing is completed. It is called
+         * by the loop thread or when the loop is not running, queued deliveries are drained manually since then
+         */
+        void close() {
+          if (!check_) return;
+          uv_check_stop(check_);
+          uv_close(reinterpret_cast<uv_handle_t*>(check_), [](uv_handle_t* handle){
+              delete reinterpret_cast<uv_check_t*>(handle);
+          });
+          check_ = nullptr;
+        }
+
+        /***
+         * Queue delivery handling
+         * @param priority delivery priority
+         * @param job handling
+         */
+        void push(uint8_t priority, Job&& job) {
+          heap_.push_back(Item{priority, sequence_++, std::move(job)});
+          std::push_heap(heap_.begin(), heap_.end(), before);
+          if (check_ && heap_.size() == 1) {
+            uv_check_start(check_, [](uv_check_t* handle){
+                static_cast<PriorityDispatch*>(handle->data)->drain();
+            });
+          }
+        }
+
+        /***
+         * Handle all queued deliveries
+         * @return handled deliveries count
+         */
+        size_t drain() {
+
+          if (draining_) return 0;
+
+          draining_ = true;
+          size_t count = 0;
+
+          while (!heap_.empty()) {
+            std::pop_heap(heap_.begin(), heap_.end(), before);
+            auto job = std::move(heap_.back().job);
+            heap_.pop_back();
+            job();
+            count++;
+          }
+
+          if (check_) uv_check_stop(check_);
+
+          draining_ = false;
+
+          return count;
+        }
+
+        /***
+         * Queued deliveries count
+         */
+        size_t size() const { return heap_.size(); }
+
+    private:
+
+        struct Item {
+            uint8_t priority;
+            uint64_t sequence;
+            Job job;
+        };
+
+        static bool before(const Item& a, const Item& b) {
+          if (a.priority != b.priority) return a.priority < b.priority;
+          return a.sequence > b.sequence;
+        }
+
+        std::vector<Item> heap_;
+        uint64_t sequence_;
+        uv_check_t* check_;
+        bool draining_;
+    };
+}
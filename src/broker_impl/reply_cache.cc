@@ -0,0 +1,113 @@
+//
+// Created by denn nevera on 2019-08-12.
+//
+
+#include "reply_cache.h"
+
+#include <functional>
+#include <iterator>
+
+namespace capy::amqp {
+
+    ReplyCache::ReplyCache(const ReplyCaching &caching):
+            caching_(caching),
+            shard_max_bytes_(caching.max_bytes / shards_count),
+            shards_()
+    {}
+
+    std::string ReplyCache::make_key(const std::string &routing_key, const std::vector<std::uint8_t> &request) {
+
+      ///
+      /// FNV-1a
+      ///
+      uint64_t hash = 0xcbf29ce484222325ull;
+
+      for (auto byte: request) {
+        hash ^= byte;
+        hash *= 0x100000001b3ull;
+      }
+
+      return routing_key + "#" + std::to_string(hash);
+    }
+
+    ReplyCache::Shard& ReplyCache::get_shard(const std::string &key) {
+      return shards_[std::hash<std::string>()(key) % shards_count];
+    }
+
+    std::optional<json> ReplyCache::get(const std::string &key,
+                                        const std::vector<std::uint8_t> &request,
+                                        clock::time_point now) {
+
+      auto& shard = get_shard(key);
+
+      std::lock_guard lock(shard.mutex);
+
+      auto found = shard.index.find(key);
+
+      if (found == shard.index.end()) return std::nullopt;
+
+      auto entry = found->second;
+
+      if (entry->expires <= now) {
+        remove(shard, entry);
+        return std::nullopt;
+      }
+
+      if (entry->request != request) return std::nullopt;
+
+      shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+
+      return entry->reply;
+    }
+
+    void ReplyCache::set(const std::string &key,
+                         const std::vector<std::uint8_t> &request,
+                         const json &reply,
+                         size_t reply_size,
+                         clock::time_point now) {
+
+      auto bytes = key.size() + request.size() + reply_size;
+
+      if (bytes > shard_max_bytes_) return;
+
+      auto& shard = get_shard(key);
+
+      std::lock_guard lock(shard.mutex);
+
+      auto found = shard.index.find(key);
+
+      if (found != shard.index.end()) remove(shard, found->second);
+
+      while (!shard.entries.empty() && shard.bytes + bytes > shard_max_bytes_) {
+        remove(shard, std::prev(shard.entries.end()));
+      }
+
+      shard.entries.push_front(Entry{key, request, reply, bytes, now + caching_.ttl});
+      shard.index[key] = shard.entries.begin();
+      shard.bytes += bytes;
+    }
+
+    size_t ReplyCache::size() const {
+      size_t count = 0;
+      for (auto& shard: shards_) {
+        std::lock_guard lock(shard.mutex);
+        count += shard.entries.size();
+      }
+      return count;
+    }
+
+    size_t ReplyCache::get_bytes() const {
+      size_t bytes = 0;
+      for (auto& shard: shards_) {
+        std::lock_guard lock(shard.mutex);
+        bytes += shard.bytes;
+      }
+      return bytes;
+    }
+
+    void ReplyCache::remove(Shard &shard, Entries::iterator entry) {
+      shard.bytes -= entry->bytes;
+      shard.index.erase(entry->key);
+      shard.entries.erase(entry);
+    }
+}
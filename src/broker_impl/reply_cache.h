@@ -0,0 +1,105 @@
+//
+// Created by denn nevera on 2019-08-12.
+//
+
+#pragma once
+
+#include "capy/amqp_broker.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace capy::amqp {
+
+    /***
+     * Fetch replies are cached by routing key and serialized request. Keys are spread over shards,
+     * every shard is LRU bounded by its part of the bytes limit, so lookups of different keys
+     * do not contend. Expired reply is dropped by the lookup
+     */
+    class ReplyCache {
+
+    public:
+
+        using clock = std::chrono::steady_clock;
+
+        static constexpr size_t shards_count = 16;
+
+        explicit ReplyCache(const ReplyCaching& caching);
+
+        ReplyCache(const ReplyCache&) = delete;
+        ReplyCache(ReplyCache&&) = delete;
+
+        /***
+         * Make cache key of the request
+         * @param routing_key request routing key
+         * @param request msgpack serialized request
+         * @return routing key and request hash
+         */
+        static std::string make_key(const std::string& routing_key, const std::vector<std::uint8_t>& request);
+
+        /***
+         * Find cached reply
+         * @param key cache key
+         * @param request serialized request, it is compared to the cached one to exclude hash collisions
+         * @param now lookup time
+         * @return reply if it is cached and not expired
+         */
+        std::optional<json> get(const std::string& key,
+                                const std::vector<std::uint8_t>& request,
+                                clock::time_point now = clock::now());
+
+        /***
+         * Cache reply
+         * @param key cache key
+         * @param request serialized request
+         * @param reply decoded reply
+         * @param reply_size serialized reply size is accounted in the bytes limit
+         * @param now caching time
+         */
+        void set(const std::string& key,
+                 const std::vector<std::uint8_t>& request,
+                 const json& reply,
+                 size_t reply_size,
+                 clock::time_point now = clock::now());
+
+        size_t size() const;
+
+        size_t get_bytes() const;
+
+        const ReplyCaching& get_caching() const { return caching_; }
+
+    private:
+
+        struct Entry {
+            std::string key;
+            std::vector<std::uint8_t> request;
+            json reply;
+            size_t bytes = 0;
+            clock::time_point expires;
+        };
+
+        using Entries = std::list<Entry>;
+
+        struct Shard {
+            mutable std::mutex mutex;
+            Entries entries;
+            std::unordered_map<std::string, Entries::iterator> index;
+            size_t bytes = 0;
+        };
+
+        ReplyCaching caching_;
+        size_t shard_max_bytes_;
+        std::array<Shard, shards_count> shards_;
+
+        Shard& get_shard(const std::string& key);
+
+        static void remove(Shard& shard, Entries::iterator entry);
+    };
+}
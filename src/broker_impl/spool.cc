@@ -0,0 +1,449 @@
+//
+// Created by denn nevera on 2019-08-07.
+//
+
+#include "spool.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace capy::amqp {
+
+    static constexpr uint32_t segment_magic = 0x50534143; // "CASP"
+    static constexpr uint32_t segment_version = 1;
+
+    ///
+    /// Two header slots are followed by records
+    ///
+    static constexpr size_t slot_size = 64;
+    static constexpr size_t header_size = 2 * slot_size;
+
+    ///
+    /// Record: body size, body checksum, then body: priority, routing key size, message id size,
+    /// routing key, message id, data
+    ///
+    static constexpr size_t record_header_size = 2 * sizeof(uint32_t);
+    static constexpr size_t record_prefix_size = sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t);
+
+    static const std::string segment_extension = ".spool";
+
+    struct HeaderSlot {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t sequence;
+        uint64_t generation;
+        uint64_t drained;
+        uint32_t checksum;
+        uint32_t reserved;
+    };
+
+    static_assert(sizeof(HeaderSlot) <= slot_size, "header slot does not fit");
+
+    static uint32_t crc32(const char* data, size_t size) {
+
+      static const auto table = []{
+          std::array<uint32_t, 256> table{};
+          for (uint32_t i = 0; i < table.size(); ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+          }
+          return table;
+      }();
+
+      uint32_t c = 0xFFFFFFFFu;
+
+      for (size_t i = 0; i < size; ++i) {
+        c = table[(c ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (c >> 8);
+      }
+
+      return c ^ 0xFFFFFFFFu;
+    }
+
+    static std::string segment_path(const std::string& directory, uint64_t sequence) {
+      char name[32];
+      std::snprintf(name, sizeof(name), "%020llu", static_cast<unsigned long long>(sequence));
+      return directory + "/" + name + segment_extension;
+    }
+
+    static Error system_error(const char* what, const std::string& path) {
+      return Error(BrokerError::SPOOL, error_string("%s %s: %s", what, path.c_str(), strerror(errno)));
+    }
+
+    ///
+    /// MARK: - segment
+    ///
+
+    struct Spool::Segment {
+
+        uint64_t sequence = 0;
+        std::string path;
+        int fd = -1;
+        char* data = nullptr;
+        size_t size = 0;
+        uint64_t generation = 0;
+        uint64_t drained = header_size;
+        uint64_t committed = header_size;
+
+        ~Segment() {
+          if (data) munmap(data, size);
+          if (fd >= 0) ::close(fd);
+        }
+
+        Error map(bool create, size_t segment_size) {
+
+          fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+
+          if (fd < 0) return system_error("segment is not opened", path);
+
+          if (create) {
+            if (ftruncate(fd, static_cast<off_t>(segment_size)) != 0) return system_error("segment is not allocated", path);
+            size = segment_size;
+          }
+          else {
+            struct stat st = {};
+            if (fstat(fd, &st) != 0) return system_error("segment is not opened", path);
+            size = static_cast<size_t>(st.st_size);
+          }
+
+          if (size < header_size) return Error(BrokerError::SPOOL, error_string("segment %s is truncated", path.c_str()));
+
+          auto mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+          if (mapped == MAP_FAILED) return system_error("segment is not mapped", path);
+
+          data = static_cast<char*>(mapped);
+
+          return Error(CommonError::OK);
+        }
+
+        /***
+         * Write the next header generation to the older slot
+         */
+        Error write_header() {
+
+          HeaderSlot slot = {};
+
+          slot.magic = segment_magic;
+          slot.version = segment_version;
+          slot.sequence = sequence;
+          slot.generation = ++generation;
+          slot.drained = drained;
+          slot.checksum = crc32(reinterpret_cast<const char*>(&slot), offsetof(HeaderSlot, checksum));
+
+          std::memcpy(data + (generation % 2) * slot_size, &slot, sizeof(slot));
+
+          if (msync(data, header_size, MS_SYNC) != 0) return system_error("segment header is not written", path);
+
+          return Error(CommonError::OK);
+        }
+
+        /***
+         * Restore the latest valid header, records are drained from the start if both slots are torn
+         */
+        void read_header() {
+
+          for (size_t index = 0; index < 2; ++index) {
+
+            HeaderSlot slot;
+            std::memcpy(&slot, data + index * slot_size, sizeof(slot));
+
+            if (slot.magic != segment_magic || slot.version != segment_version || slot.sequence != sequence) continue;
+            if (slot.checksum != crc32(reinterpret_cast<const char*>(&slot), offsetof(HeaderSlot, checksum))) continue;
+            if (slot.drained < header_size || slot.drained > size) continue;
+
+            if (slot.generation > generation) {
+              generation = slot.generation;
+              drained = slot.drained;
+            }
+          }
+        }
+
+        /***
+         * Find the end of complete records
+         */
+        void scan() {
+
+          auto offset = drained;
+
+          while (offset + record_header_size <= size) {
+
+            uint32_t body_size = 0, checksum = 0;
+            std::memcpy(&body_size, data + offset, sizeof(body_size));
+            std::memcpy(&checksum, data + offset + sizeof(body_size), sizeof(checksum));
+
+            if (body_size < record_prefix_size || offset + record_header_size + body_size > size) break;
+            if (crc32(data + offset + record_header_size, body_size) != checksum) break;
+
+            offset += record_header_size + body_size;
+          }
+
+          committed = offset;
+        }
+
+        bool is_drained() const { return drained >= committed; }
+    };
+
+    ///
+    /// MARK: - spool
+    ///
+
+    Spool::Spool(const Spooling &spooling):
+            spooling_(spooling),
+            mutex_(),
+            segments_(),
+            next_sequence_(0)
+    {}
+
+    Spool::~Spool() = default;
+
+    Result<std::shared_ptr<Spool>> Spool::Open(const Spooling &spooling) {
+
+      if (spooling.directory.empty()) {
+        return capy::make_unexpected(Error(BrokerError::SPOOL, "spool directory is not set"));
+      }
+
+      if (spooling.segment_size <= header_size || spooling.max_bytes < spooling.segment_size) {
+        return capy::make_unexpected(Error(BrokerError::SPOOL, "spool segment size does not fit disk usage limit"));
+      }
+
+      if (::mkdir(spooling.directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        return capy::make_unexpected(system_error("spool directory is not created", spooling.directory));
+      }
+
+      auto dir = opendir(spooling.directory.c_str());
+
+      if (!dir) return capy::make_unexpected(system_error("spool directory is not opened", spooling.directory));
+
+      std::vector<uint64_t> sequences;
+
+      while (auto entry = readdir(dir)) {
+
+        std::string name = entry->d_name;
+
+        if (name.size() <= segment_extension.size()) continue;
+        if (name.compare(name.size() - segment_extension.size(), segment_extension.size(), segment_extension) != 0) continue;
+
+        auto digits = name.substr(0, name.size() - segment_extension.size());
+
+        if (!std::all_of(digits.begin(), digits.end(), ::isdigit)) continue;
+
+        sequences.push_back(std::stoull(digits));
+      }
+
+      closedir(dir);
+
+      std::sort(sequences.begin(), sequences.end());
+
+      auto spool = std::shared_ptr<Spool>(new Spool(spooling));
+
+      for (auto sequence: sequences) {
+
+        auto segment = std::make_shared<Segment>();
+
+        segment->sequence = sequence;
+        segment->path = segment_path(spooling.directory, sequence);
+
+        if (auto error = segment->map(false, spooling.segment_size)) {
+          return capy::make_unexpected(error);
+        }
+
+        segment->read_header();
+        segment->scan();
+
+        spool->segments_.push_back(std::move(segment));
+        spool->next_sequence_ = sequence + 1;
+      }
+
+      ///
+      /// Drained segments are left by the process is stopped before their deletion
+      ///
+      while (spool->segments_.size() > 1 && spool->segments_.front()->is_drained()) {
+        spool->remove_segment(spool->segments_.front());
+        spool->segments_.pop_front();
+      }
+
+      return spool;
+    }
+
+    Result<std::shared_ptr<Spool::Segment>> Spool::create_segment() {
+
+      auto segment = std::make_shared<Segment>();
+
+      segment->sequence = next_sequence_;
+      segment->path = segment_path(spooling_.directory, next_sequence_);
+
+      if (auto error = segment->map(true, spooling_.segment_size)) {
+        ::unlink(segment->path.c_str());
+        return capy::make_unexpected(error);
+      }
+
+      if (auto error = segment->write_header()) {
+        ::unlink(segment->path.c_str());
+        return capy::make_unexpected(error);
+      }
+
+      next_sequence_++;
+
+      return segment;
+    }
+
+    void Spool::remove_segment(std::shared_ptr<Segment> &segment) {
+      auto path = segment->path;
+      segment.reset();
+      ::unlink(path.c_str());
+    }
+
+    Error Spool::append(const std::string &routing_key,
+                        const std::string &message_id,
+                        uint8_t priority,
+                        const std::vector<std::uint8_t> &data) {
+
+      if (routing_key.size() > UINT16_MAX || message_id.size() > UINT8_MAX) {
+        return Error(BrokerError::SPOOL, "routing key or message id is too long to spool");
+      }
+
+      auto body_size = record_prefix_size + routing_key.size() + message_id.size() + data.size();
+      auto record_size = record_header_size + body_size;
+
+      if (header_size + record_size > spooling_.segment_size || body_size > UINT32_MAX) {
+        return Error(BrokerError::SPOOL, error_string("message size %zu exceeds spool segment size", data.size()));
+      }
+
+      std::lock_guard lock(mutex_);
+
+      if (segments_.empty() || segments_.back()->committed + record_size > segments_.back()->size) {
+
+        if ((segments_.size() + 1) * spooling_.segment_size > spooling_.max_bytes) {
+          return Error(BrokerError::SPOOL, "spool is full");
+        }
+
+        auto segment = create_segment();
+
+        if (!segment) return segment.error();
+
+        segments_.push_back(std::move(*segment));
+      }
+
+      auto& segment = *segments_.back();
+      auto record = segment.data + segment.committed;
+      auto body = record + record_header_size;
+
+      auto key_size = static_cast<uint16_t>(routing_key.size());
+      auto id_size = static_cast<uint8_t>(message_id.size());
+      auto payload = body + record_prefix_size + routing_key.size() + message_id.size();
+
+      std::memcpy(body, &priority, sizeof(priority));
+      std::memcpy(body + sizeof(priority), &key_size, sizeof(key_size));
+      std::memcpy(body + sizeof(priority) + sizeof(key_size), &id_size, sizeof(id_size));
+      std::memcpy(body + record_prefix_size, routing_key.data(), routing_key.size());
+      std::memcpy(body + record_prefix_size + routing_key.size(), message_id.data(), message_id.size());
+      if (!data.empty()) std::memcpy(payload, data.data(), data.size());
+
+      ///
+      /// Size is written the last, so the incomplete record is never recovered
+      ///
+      auto size = static_cast<uint32_t>(body_size);
+      auto checksum = crc32(body, body_size);
+
+      std::memcpy(record + sizeof(size), &checksum, sizeof(checksum));
+      std::memcpy(record, &size, sizeof(size));
+
+      segment.committed += record_size;
+
+      return Error(CommonError::OK);
+    }
+
+    std::vector<Spool::Record> Spool::read(size_t max_count, Cursor &cursor) {
+
+      std::lock_guard lock(mutex_);
+
+      std::vector<Record> records;
+
+      auto segment = std::find_if(segments_.begin(), segments_.end(), [](const std::shared_ptr<Segment>& segment){
+          return !segment->is_drained();
+      });
+
+      if (segment == segments_.end()) return records;
+
+      auto& current = **segment;
+      auto offset = current.drained;
+
+      while (records.size() < max_count && offset < current.committed) {
+
+        uint32_t body_size = 0;
+        std::memcpy(&body_size, current.data + offset, sizeof(body_size));
+
+        auto body = current.data + offset + record_header_size;
+
+        Record record;
+        uint16_t key_size = 0;
+        uint8_t id_size = 0;
+
+        std::memcpy(&record.priority, body, sizeof(record.priority));
+        std::memcpy(&key_size, body + sizeof(record.priority), sizeof(key_size));
+        std::memcpy(&id_size, body + sizeof(record.priority) + sizeof(key_size), sizeof(id_size));
+
+        auto key = body + record_prefix_size;
+
+        record.routing_key.assign(key, key_size);
+        record.message_id.assign(key + key_size, id_size);
+        record.data.assign(key + key_size + id_size, body + body_size);
+
+        records.push_back(std::move(record));
+
+        offset += record_header_size + body_size;
+      }
+
+      cursor.segment = current.sequence;
+      cursor.offset = offset;
+
+      return records;
+    }
+
+    Error Spool::commit(const Cursor &cursor) {
+
+      std::lock_guard lock(mutex_);
+
+      Error error(CommonError::OK);
+
+      for (auto& segment: segments_) {
+        if (segment->sequence != cursor.segment || cursor.offset <= segment->drained) continue;
+        segment->drained = std::min<uint64_t>(cursor.offset, segment->committed);
+        error = segment->write_header();
+      }
+
+      ///
+      /// The last segment is kept for appending
+      ///
+      while (segments_.size() > 1 && segments_.front()->is_drained()) {
+        remove_segment(segments_.front());
+        segments_.pop_front();
+      }
+
+      return error;
+    }
+
+    bool Spool::empty() const {
+      std::lock_guard lock(mutex_);
+      return std::all_of(segments_.begin(), segments_.end(), [](const std::shared_ptr<Segment>& segment){
+          return segment->is_drained();
+      });
+    }
+
+    size_t Spool::get_bytes() const {
+      std::lock_guard lock(mutex_);
+      size_t bytes = 0;
+      for (auto& segment: segments_) bytes += segment->size;
+      return bytes;
+    }
+}
@@ -0,0 +1,113 @@
+//
+// Created by denn nevera on 2019-08-07.
+//
+
+#pragma once
+
+#include "capy/amqp_broker.h"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace capy::amqp {
+
+    /***
+     * Append-only log of publishes is kept in memory-mapped segment files. Records are appended to the
+     * last segment and read from the first one, segments are deleted when all their records are drained.
+     * Segment header has two checksummed slots written in turn, so a torn header write keeps the previous
+     * one. Records are checksummed, recovery stops at the first incomplete record
+     */
+    class Spool {
+
+    public:
+
+        /***
+         * Spooled publish
+         */
+        struct Record {
+            std::string routing_key;
+            std::string message_id;
+            uint8_t priority = 0;
+            std::vector<std::uint8_t> data;
+        };
+
+        /***
+         * Position after the read records, it is committed when the records are confirmed
+         */
+        struct Cursor {
+            uint64_t segment = 0;
+            uint64_t offset = 0;
+        };
+
+        /***
+         * Open spool directory and recover segments left by the previous process
+         * @param spooling options
+         * @return spool or error
+         */
+        static Result<std::shared_ptr<Spool>> Open(const Spooling& spooling);
+
+        Spool(const Spool&) = delete;
+        Spool(Spool&&) = delete;
+
+        ~Spool();
+
+        /***
+         * Append record to the last segment, the next segment is created when it is full
+         * @param routing_key message routing key
+         * @param message_id message id is kept by republishing
+         * @param priority message priority
+         * @param data serialized message
+         * @return error if the spool is full or the record does not fit a segment
+         */
+        Error append(const std::string& routing_key,
+                     const std::string& message_id,
+                     uint8_t priority,
+                     const std::vector<std::uint8_t>& data);
+
+        /***
+         * Read records from the first not drained segment
+         * @param max_count max records count
+         * @param cursor position after the read records
+         * @return records in the append order
+         */
+        std::vector<Record> read(size_t max_count, Cursor& cursor);
+
+        /***
+         * Mark records before the cursor drained, drained segments are deleted
+         * @param cursor position is returned by read()
+         * @return error if the segment header is not written
+         */
+        Error commit(const Cursor& cursor);
+
+        /***
+         * Check all records are drained
+         */
+        bool empty() const;
+
+        /***
+         * Disk space taken by segments
+         */
+        size_t get_bytes() const;
+
+        const Spooling& get_spooling() const { return spooling_; }
+
+    private:
+
+        struct Segment;
+
+        Spooling spooling_;
+        mutable std::mutex mutex_;
+        std::deque<std::shared_ptr<Segment>> segments_;
+        uint64_t next_sequence_;
+
+        explicit Spool(const Spooling& spooling);
+
+        Result<std::shared_ptr<Segment>> create_segment();
+
+        void remove_segment(std::shared_ptr<Segment>& segment);
+    };
+}
@@ -0,0 +1,132 @@
+//
+// Created by denn nevera on 2019-07-17.
+//
+
+#pragma once
+
+#include "capy/amqp_trace.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+namespace capy::amqp::trace {
+
+    ///
+    /// MARK: - W3C trace context
+    ///
+
+    /***
+     * Create traceparent of a new trace: 00-<trace id>-<span id>-01
+     * @return traceparent header value
+     */
+    std::string make_traceparent();
+
+    /***
+     * Create traceparent of a child span of the same trace
+     * @param parent parent traceparent, a new trace is started if it is not valid
+     * @return traceparent header value
+     */
+    std::string child_traceparent(const std::string& parent);
+
+    /***
+     * Check traceparent format
+     * @param traceparent header value
+     * @return true if it is valid
+     */
+    bool is_traceparent(const std::string& traceparent);
+
+    /***
+     * Wall clock is used to stamp publishing time, it is comparable between hosts
+     * @return microseconds since epoch
+     */
+    uint64_t wall_clock_us();
+
+    ///
+    /// MARK: - spans
+    ///
+
+#ifdef CAPY_AMQP_TRACING
+
+    /***
+     * Span begin timestamp, nanoseconds of CLOCK_MONOTONIC
+     */
+    struct Stamp {
+        uint64_t ns = 0;
+    };
+
+    inline Stamp now() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return Stamp{static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec)};
+    }
+
+    struct Event {
+        const char* name;
+        uint64_t begin;
+        uint64_t end;
+    };
+
+    /***
+     * Per-thread ring of spans. The owner thread is the only writer, older spans are overwritten
+     */
+    struct Ring {
+        static constexpr size_t capacity = 8192;
+
+        std::array<Event, capacity> events;
+        std::atomic<uint64_t> head;
+        uint32_t thread;
+
+        explicit Ring(uint32_t id): events(), head(0), thread(id) {}
+
+        void push(const char* name, uint64_t begin, uint64_t end) {
+          auto index = head.load(std::memory_order_relaxed);
+          events[index % capacity] = Event{name, begin, end};
+          head.store(index + 1, std::memory_order_release);
+        }
+    };
+
+    /***
+     * Ring of the current thread, it is registered on the first use
+     */
+    Ring& local_ring();
+
+    /***
+     * Record finished span
+     * @param name static span name
+     * @param begin span begin stamp
+     */
+    inline void record(const char* name, const Stamp& begin) {
+      local_ring().push(name, begin.ns, now().ns);
+    }
+
+    /***
+     * Scoped span
+     */
+    class Span {
+    public:
+        explicit Span(const char* name): name_(name), begin_(now()) {}
+        ~Span() { record(name_, begin_); }
+    private:
+        const char* name_;
+        Stamp begin_;
+    };
+
+#define CAPY_AMQP_TRACE_CONCAT_(a, b) a##b
+#define CAPY_AMQP_TRACE_CONCAT(a, b) CAPY_AMQP_TRACE_CONCAT_(a, b)
+#define CAPY_AMQP_TRACE_SPAN(name) capy::amqp::trace::Span CAPY_AMQP_TRACE_CONCAT(capy_trace_span_, __LINE__)(name)
+
+#else
+
+    struct Stamp {};
+
+    inline Stamp now() { return Stamp{}; }
+
+    inline void record(const char*, const Stamp&) {}
+
+#define CAPY_AMQP_TRACE_SPAN(name)
+
+#endif
+}
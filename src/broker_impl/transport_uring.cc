@@ -0,0 +1,306 @@
+//
+// Created by denn nevera on 2019-08-05.
+//
+
+#include "transport_uring.h"
+
+#if CAPY_AMQP_WITH_IO_URING
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+namespace capy::amqp {
+
+    Error UringTransport::Check() {
+
+      struct io_uring ring;
+
+      if (io_uring_queue_init(2, &ring, 0) < 0) {
+        return Error(CommonError::NOT_SUPPORTED, "io_uring is not supported by the kernel");
+      }
+
+      int status = 0;
+      auto buffers = io_uring_setup_buf_ring(&ring, 1, buffer_group, 0, &status);
+
+      if (buffers) io_uring_free_buf_ring(&ring, buffers, 1, buffer_group);
+
+      io_uring_queue_exit(&ring);
+
+      if (!buffers) {
+        return Error(CommonError::NOT_SUPPORTED, "io_uring provided buffers are not supported by the kernel");
+      }
+
+      return Error(CommonError::OK);
+    }
+
+    UringTransport::UringTransport(uv_loop_t* loop,
+                                   uint16_t heartbeat_timeout,
+                                   const ConnectionOptions& options,
+                                   const std::shared_ptr<Metrics>& metrics,
+                                   const std::shared_ptr<NodeSelector>& nodes,
+                                   size_t node):
+            ConnectionHandler(loop, heartbeat_timeout, options, metrics, nodes, node),
+            address_(),
+            read_buffers_(buffers_count * buffer_size),
+            write_buffer_(write_capacity)
+    {}
+
+    UringTransport::~UringTransport() {
+
+      if (ring_ready_) {
+
+        ///
+        /// Requests are cancelled before the buffers are released
+        ///
+        if (fd_ >= 0) {
+          if (auto sqe = io_uring_get_sqe(&ring_)) {
+            io_uring_prep_cancel_fd(sqe, fd_, IORING_ASYNC_CANCEL_ALL);
+            io_uring_submit_and_wait(&ring_, 1);
+          }
+        }
+
+        if (buffers_) io_uring_free_buf_ring(&ring_, buffers_, buffers_count, buffer_group);
+
+        io_uring_queue_exit(&ring_);
+      }
+
+      if (fd_ >= 0) ::close(fd_);
+    }
+
+    int UringTransport::open() {
+
+      if (auto status = io_uring_queue_init(ring_entries, &ring_, 0)) return status;
+
+      ring_ready_ = true;
+
+      struct iovec registered = {write_buffer_.data(), write_buffer_.size()};
+
+      if (auto status = io_uring_register_buffers(&ring_, &registered, 1)) return status;
+
+      int status = 0;
+
+      buffers_ = io_uring_setup_buf_ring(&ring_, buffers_count, buffer_group, 0, &status);
+
+      if (!buffers_) return status;
+
+      for (unsigned i = 0; i < buffers_count; ++i) {
+        io_uring_buf_ring_add(buffers_,
+                              read_buffers_.data() + i * buffer_size,
+                              buffer_size,
+                              static_cast<unsigned short>(i),
+                              io_uring_buf_ring_mask(buffers_count),
+                              static_cast<int>(i));
+      }
+
+      io_uring_buf_ring_advance(buffers_, buffers_count);
+
+      if (auto status = uv_poll_init(loop_, &poll_, ring_.ring_fd)) return status;
+
+      polling_ = true;
+      poll_.data = this;
+
+      return uv_poll_start(&poll_, UV_READABLE, on_poll);
+    }
+
+    int UringTransport::connect(const struct sockaddr *address) {
+
+      auto size = address->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+      std::memcpy(&address_, address, size);
+
+      fd_ = ::socket(address->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+      if (fd_ < 0) return -errno;
+
+      auto sqe = get_sqe(connecting);
+
+      if (!sqe) return UV_ENOBUFS;
+
+      io_uring_prep_connect(sqe, fd_, reinterpret_cast<struct sockaddr*>(&address_), static_cast<socklen_t>(size));
+
+      return 0;
+    }
+
+    void UringTransport::flush() {
+
+      if (closed_) return;
+
+      if (connected_ && !writing_) write_next();
+
+      ///
+      /// Requests of the loop iteration are submitted together
+      ///
+      if (io_uring_sq_ready(&ring_) > 0) {
+        auto status = io_uring_submit(&ring_);
+        if (status < 0) fail(strerror(-status));
+      }
+    }
+
+    void UringTransport::close_transport() {
+
+      closed_ = true;
+
+      if (polling_) close_handle(reinterpret_cast<uv_handle_t*>(&poll_));
+
+      if (fd_ >= 0) ::shutdown(fd_, SHUT_RDWR);
+    }
+
+    struct io_uring_sqe* UringTransport::get_sqe(Operation operation) {
+
+      auto sqe = io_uring_get_sqe(&ring_);
+
+      ///
+      /// Submission queue is full, it is submitted out of the batch
+      ///
+      if (!sqe) {
+        io_uring_submit(&ring_);
+        sqe = io_uring_get_sqe(&ring_);
+      }
+
+      if (sqe) io_uring_sqe_set_data64(sqe, operation);
+
+      return sqe;
+    }
+
+    void UringTransport::receive_next() {
+
+      auto sqe = get_sqe(receiving);
+
+      if (!sqe) {
+        fail("io_uring submission queue is full");
+        return;
+      }
+
+      io_uring_prep_recv_multishot(sqe, fd_, nullptr, 0, 0);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = buffer_group;
+    }
+
+    void UringTransport::write_next() {
+
+      if (write_offset_ == write_size_) {
+        write_size_ = take_output(write_buffer_.data(), write_buffer_.size());
+        write_offset_ = 0;
+        if (write_size_ == 0) return;
+      }
+
+      auto sqe = get_sqe(writing);
+
+      if (!sqe) {
+        fail("io_uring submission queue is full");
+        return;
+      }
+
+      io_uring_prep_write_fixed(sqe,
+                                fd_,
+                                write_buffer_.data() + write_offset_,
+                                static_cast<unsigned>(write_size_ - write_offset_),
+                                0,
+                                0);
+      writing_ = true;
+    }
+
+    void UringTransport::recycle(unsigned buffer) {
+      io_uring_buf_ring_add(buffers_,
+                            read_buffers_.data() + buffer * buffer_size,
+                            buffer_size,
+                            static_cast<unsigned short>(buffer),
+                            io_uring_buf_ring_mask(buffers_count),
+                            0);
+      io_uring_buf_ring_advance(buffers_, 1);
+    }
+
+    void UringTransport::complete(struct io_uring_cqe *cqe) {
+
+      auto result = cqe->res;
+
+      switch (io_uring_cqe_get_data64(cqe)) {
+
+        case connecting:
+
+          if (result < 0) {
+            fail(strerror(-result));
+            return;
+          }
+
+          receive_next();
+          on_connect(fd_);
+          break;
+
+        case receiving:
+
+          if (cqe->flags & IORING_CQE_F_BUFFER) {
+            auto buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (result > 0) receive(read_buffers_.data() + buffer * buffer_size, static_cast<size_t>(result));
+            if (closed_) return;
+            recycle(buffer);
+          }
+
+          if (result == 0) {
+            fail("connection closed by peer");
+            return;
+          }
+
+          if (result < 0 && result != -ENOBUFS) {
+            if (result != -ECANCELED) fail(strerror(-result));
+            return;
+          }
+
+          ///
+          /// Multishot receive is terminated when provided buffers are exhausted
+          ///
+          if (!(cqe->flags & IORING_CQE_F_MORE)) receive_next();
+          break;
+
+        case writing:
+
+          writing_ = false;
+
+          if (result < 0) {
+            if (result != -ECANCELED) fail(strerror(-result));
+            return;
+          }
+
+          write_offset_ += static_cast<size_t>(result);
+
+          write_next();
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    void UringTransport::on_poll(uv_poll_t *handle, int status, int events) {
+
+      (void) events;
+
+      auto transport = static_cast<UringTransport*>(handle->data);
+      auto self = transport->shared_from_this();
+
+      transport->touch_loop();
+
+      if (status < 0) {
+        transport->fail(uv_strerror(status));
+        return;
+      }
+
+      struct io_uring_cqe* cqes[ring_entries];
+
+      while (!transport->closed_) {
+
+        auto count = io_uring_peek_batch_cqe(&transport->ring_, cqes, ring_entries);
+
+        if (count == 0) break;
+
+        for (unsigned i = 0; i < count && !transport->closed_; ++i) {
+          transport->complete(cqes[i]);
+        }
+
+        io_uring_cq_advance(&transport->ring_, count);
+      }
+    }
+}
+
+#endif
@@ -0,0 +1,103 @@
+//
+// Created by denn nevera on 2019-08-05.
+//
+
+#pragma once
+
+#if CAPY_AMQP_WITH_IO_URING
+
+#include "handler.h"
+
+#include <liburing.h>
+#include <sys/socket.h>
+
+namespace capy::amqp {
+
+    /***
+     * Connection I/O over io_uring. Completions are reaped when the ring descriptor is polled by the
+     * broker loop, requests prepared during the loop iteration are submitted by one call at its end.
+     * Buffered frames are written from the registered buffer, the socket is read by multishot receive
+     * into the provided buffers ring
+     */
+    class UringTransport: public ConnectionHandler {
+
+    public:
+
+        static constexpr unsigned ring_entries = 64;
+
+        /**
+         * Provided receive buffers, the count is a power of 2
+         */
+        static constexpr unsigned buffers_count = 16;
+        static constexpr size_t buffer_size = 16 * 1024;
+        static constexpr int buffer_group = 0;
+
+        /**
+         * Registered write buffer size, larger output is written by several requests
+         */
+        static constexpr size_t write_capacity = 4 * block_size;
+
+        /***
+         * Check the kernel supports io_uring and provided buffers ring
+         * @return error if io_uring can not be used
+         */
+        static Error Check();
+
+        UringTransport(uv_loop_t* loop,
+                       uint16_t heartbeat_timeout,
+                       const ConnectionOptions& options,
+                       const std::shared_ptr<Metrics>& metrics,
+                       const std::shared_ptr<NodeSelector>& nodes,
+                       size_t node);
+
+        ~UringTransport() override;
+
+    protected:
+
+        int open() override;
+
+        int connect(const struct sockaddr* address) override;
+
+        void flush() override;
+
+        void close_transport() override;
+
+    private:
+
+        enum Operation: uint64_t {
+            connecting = 1,
+            receiving,
+            writing
+        };
+
+        struct io_uring ring_;
+        bool ring_ready_ = false;
+        struct io_uring_buf_ring* buffers_ = nullptr;
+        uv_poll_t poll_;
+        bool polling_ = false;
+        bool closed_ = false;
+        int fd_ = -1;
+
+        struct sockaddr_storage address_;
+
+        std::vector<char> read_buffers_;
+        std::vector<char> write_buffer_;
+        size_t write_size_ = 0;
+        size_t write_offset_ = 0;
+        bool writing_ = false;
+
+        struct io_uring_sqe* get_sqe(Operation operation);
+
+        void receive_next();
+
+        void write_next();
+
+        void recycle(unsigned buffer);
+
+        void complete(struct io_uring_cqe* cqe);
+
+        static void on_poll(uv_poll_t* handle, int status, int events);
+    };
+}
+
+#endif
@@ -0,0 +1,129 @@
+//
+// Created by denn nevera on 2019-08-05.
+//
+
+#include "transport_uv.h"
+
+namespace capy::amqp {
+
+    /***
+     * Write request owns buffers until the write is completed
+     */
+    struct UvTransport::WriteRequest {
+        uv_write_t request;
+        std::vector<std::vector<char>> blocks;
+        std::shared_ptr<ConnectionHandler> handler;
+    };
+
+    UvTransport::UvTransport(uv_loop_t* loop,
+                             uint16_t heartbeat_timeout,
+                             const ConnectionOptions& options,
+                             const std::shared_ptr<Metrics>& metrics,
+                             const std::shared_ptr<NodeSelector>& nodes,
+                             size_t node):
+            ConnectionHandler(loop, heartbeat_timeout, options, metrics, nodes, node),
+            read_buffer_(read_size)
+    {}
+
+    UvTransport::~UvTransport() = default;
+
+    int UvTransport::open() {
+      tcp_.data = this;
+      return uv_tcp_init(loop_, &tcp_);
+    }
+
+    int UvTransport::connect(const struct sockaddr *address) {
+      connect_.data = this;
+      return uv_tcp_connect(&connect_, &tcp_, address, on_connected);
+    }
+
+    void UvTransport::flush() {
+
+      if (!connected_) return;
+
+      auto write = new WriteRequest;
+
+      if (take_output(write->blocks) == 0) {
+        delete write;
+        return;
+      }
+
+      std::vector<uv_buf_t> buffers;
+      buffers.reserve(write->blocks.size());
+
+      for (auto& block: write->blocks) {
+        buffers.push_back(uv_buf_init(block.data(), static_cast<unsigned int>(block.size())));
+      }
+
+      write->handler = shared_from_this();
+      write->request.data = write;
+
+      if (auto status = uv_write(&write->request,
+                                 reinterpret_cast<uv_stream_t*>(&tcp_),
+                                 buffers.data(),
+                                 static_cast<unsigned int>(buffers.size()),
+                                 on_written)) {
+        delete write;
+        fail(uv_strerror(status));
+      }
+    }
+
+    void UvTransport::close_transport() {
+      close_handle(reinterpret_cast<uv_handle_t*>(&tcp_));
+    }
+
+    void UvTransport::on_connected(uv_connect_t *request, int status) {
+
+      auto transport = static_cast<UvTransport*>(request->data);
+
+      if (status < 0) {
+        if (status != UV_ECANCELED) transport->fail(uv_strerror(status));
+        return;
+      }
+
+      uv_os_fd_t fd;
+
+      if (uv_fileno(reinterpret_cast<uv_handle_t*>(&transport->tcp_), &fd) != 0) fd = -1;
+
+      if (auto error = uv_read_start(reinterpret_cast<uv_stream_t*>(&transport->tcp_), on_alloc, on_read)) {
+        transport->fail(uv_strerror(error));
+        return;
+      }
+
+      transport->on_connect(fd);
+    }
+
+    void UvTransport::on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buffer) {
+
+      (void) suggested;
+
+      auto transport = static_cast<UvTransport*>(handle->data);
+
+      *buffer = uv_buf_init(transport->read_buffer_.data(), static_cast<unsigned int>(transport->read_buffer_.size()));
+    }
+
+    void UvTransport::on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buffer) {
+
+      auto transport = static_cast<UvTransport*>(stream->data);
+
+      if (nread == 0) return;
+
+      if (nread < 0) {
+        transport->fail(nread == UV_EOF ? "connection closed by peer" : uv_strerror(static_cast<int>(nread)));
+        return;
+      }
+
+      transport->receive(buffer->base, static_cast<size_t>(nread));
+    }
+
+    void UvTransport::on_written(uv_write_t *request, int status) {
+
+      auto write = static_cast<WriteRequest*>(request->data);
+
+      if (status < 0 && status != UV_ECANCELED) {
+        static_cast<UvTransport*>(write->handler.get())->fail(uv_strerror(status));
+      }
+
+      delete write;
+    }
+}
@@ -0,0 +1,55 @@
+//
+// Created by denn nevera on 2019-08-05.
+//
+
+#pragma once
+
+#include "handler.h"
+
+namespace capy::amqp {
+
+    /***
+     * Connection I/O over libuv TCP handle, buffered frames are written by one uv_write (writev)
+     */
+    class UvTransport: public ConnectionHandler {
+
+    public:
+
+        /**
+         * Minimal free space of the read buffer
+         */
+        static constexpr size_t read_size = 64 * 1024;
+
+        UvTransport(uv_loop_t* loop,
+                    uint16_t heartbeat_timeout,
+                    const ConnectionOptions& options,
+                    const std::shared_ptr<Metrics>& metrics,
+                    const std::shared_ptr<NodeSelector>& nodes,
+                    size_t node);
+
+        ~UvTransport() override;
+
+    protected:
+
+        int open() override;
+
+        int connect(const struct sockaddr* address) override;
+
+        void flush() override;
+
+        void close_transport() override;
+
+    private:
+
+        struct WriteRequest;
+
+        uv_tcp_t tcp_;
+        uv_connect_t connect_;
+        std::vector<char> read_buffer_;
+
+        static void on_connected(uv_connect_t* request, int status);
+        static void on_alloc(uv_handle_t* handle, size_t suggested, uv_buf_t* buffer);
+        static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buffer);
+        static void on_written(uv_write_t* request, int status);
+    };
+}
@@ -6,9 +6,10 @@
 
 namespace capy::amqp {
 
-    DeferredConections::DeferredConections(ConnectionCache* connections):
+    DeferredConections::DeferredConections(ConnectionCache* connections, size_t node):
             connections_(connections),
-            channel_(std::unique_ptr<Channel>(connections_->new_channel()))
+            node_(node),
+            channel_(connections_ ? std::unique_ptr<Channel>(connections_->new_channel(node_)) : nullptr)
     {
 
     }
@@ -17,4 +18,356 @@ namespace capy::amqp {
       return *channel_;
     }
 
+    void DeferredConections::set_consumer_tag(Channel *channel, const std::string &tag) {
+      std::lock_guard lock(tags_mutex_);
+      consumer_tags_[channel] = tag;
+    }
+
+    std::vector<std::pair<Channel*, std::string>> DeferredConections::get_consumer_tags() const {
+      std::lock_guard lock(tags_mutex_);
+      return std::vector<std::pair<Channel*, std::string>>(consumer_tags_.begin(), consumer_tags_.end());
+    }
+
+    void DeferredConections::remove_consumer_tag(Channel *channel) {
+      std::lock_guard lock(tags_mutex_);
+      consumer_tags_.erase(channel);
+    }
+
+
+    Result<Payloads> DeferredFetching::order(uint64_t sequence, bool last, const Payload& payload) {
+      std::lock_guard lock(mutex_);
+
+      if (complete_ || sequence < next_) return Payloads();
+
+      if (pending_.size() >= stream_window) {
+        return capy::make_unexpected(Error(BrokerError::DATA_RESPONSE, "streaming replay is out of order window"));
+      }
+
+      pending_.emplace(sequence, std::make_pair(last, payload));
+
+      Payloads ready;
+
+      for (auto it = pending_.begin(); it != pending_.end() && it->first == next_; it = pending_.erase(it)) {
+
+        auto& [is_last, chunk] = it->second;
+
+        if (!(is_last && chunk && chunk->is_null())) ready.push_back(chunk);
+
+        next_++;
+
+        if (is_last) {
+          complete_ = true;
+          pending_.clear();
+          break;
+        }
+      }
+
+      return ready;
+    }
+
+    bool DeferredFetching::is_complete() const {
+      std::lock_guard lock(mutex_);
+      return complete_;
+    }
+
+    void DeferredCachedFetching::on_sealed() {
+      ///
+      /// The fetch may be completed and released by the loop thread as soon as it is started
+      ///
+      auto start = std::move(start_);
+      start_ = nullptr;
+      if (start) start();
+    }
+
+    DeferredListening::DeferredListening(ConnectionCache* connections,
+                                         const ListenPolicy& policy,
+                                         size_t node,
+                                         const Error &error):
+            DeferredListen(error),
+            DeferredConections(connections, node),
+            policy_(policy),
+            mutex_(),
+            consumers_(),
+            deduplicator_(policy.deduplication.capacity > 0 ? std::make_shared<Deduplicator>(policy.deduplication) : nullptr),
+            timer_(nullptr),
+            on_sample_()
+    {
+      policy_.concurrency = std::max<size_t>(policy_.concurrency, 1);
+      policy_.max_concurrency = std::max(policy_.max_concurrency, policy_.concurrency);
+      policy_.depth_per_consumer = std::max<uint32_t>(policy_.depth_per_consumer, 1);
+    }
+
+    DeferredListening::~DeferredListening() {
+      if (timer_) {
+        uv_timer_stop(timer_);
+        uv_close(reinterpret_cast<uv_handle_t*>(timer_), [](uv_handle_t* handle){
+            delete reinterpret_cast<uv_timer_t*>(handle);
+        });
+      }
+    }
+
+    void DeferredListening::start_scaling(uv_loop_t* loop, const std::function<void()>& on_sample) {
+
+      auto interval = static_cast<uint64_t>(policy_.scale_interval.count());
+
+      if (interval == 0 || timer_) return;
+
+      timer_ = new uv_timer_t;
+      uv_timer_init(loop, timer_);
+      timer_->data = this;
+
+      ///
+      /// Sampling does not keep the loop alive
+      ///
+      uv_unref(reinterpret_cast<uv_handle_t*>(timer_));
+
+      on_sample_ = on_sample;
+
+      uv_timer_start(timer_, [](uv_timer_t* handle){
+          auto on_sample = static_cast<DeferredListening*>(handle->data)->on_sample_;
+          if (on_sample) on_sample();
+      }, interval, interval);
+    }
+
+    Channel* DeferredListening::add_consumer() {
+      std::lock_guard lock(mutex_);
+      consumers_.emplace_back(connections_->new_channel(node_));
+      return consumers_.back().get();
+    }
+
+    Channel* DeferredListening::remove_consumer() {
+      std::lock_guard lock(mutex_);
+      if (consumers_.empty()) return nullptr;
+      auto channel = consumers_.back().release();
+      consumers_.pop_back();
+      remove_consumer_tag(channel);
+      return channel;
+    }
+
+    size_t DeferredListening::get_consumers_count() const {
+      std::lock_guard lock(mutex_);
+      return consumers_.size() + 1;
+    }
+
+    size_t DeferredListening::get_expected_consumers(uint32_t messagecount) const {
+      size_t expected = (static_cast<size_t>(messagecount) + policy_.depth_per_consumer - 1) / policy_.depth_per_consumer;
+      return std::clamp(expected, policy_.concurrency, policy_.max_concurrency);
+    }
+
+    DeferredListeningBatch::DeferredListeningBatch(ConnectionCache* connections,
+                                                   size_t max_batch,
+                                                   std::chrono::milliseconds max_wait,
+                                                   size_t node,
+                                                   const Error &error):
+            DeferredListenBatch(error),
+            DeferredConections(connections, node),
+            max_batch_(std::clamp<size_t>(max_batch, 1, UINT16_MAX / 2)),
+            max_wait_(max_wait),
+            mutex_(),
+            batch_(nullptr),
+            uncommitted_(),
+            timer_(nullptr),
+            on_expire_()
+    {
+    }
+
+    DeferredListeningBatch::~DeferredListeningBatch() {
+      if (timer_) {
+        uv_timer_stop(timer_);
+        uv_close(reinterpret_cast<uv_handle_t*>(timer_), [](uv_handle_t* handle){
+            delete reinterpret_cast<uv_timer_t*>(handle);
+        });
+      }
+    }
+
+    std::shared_ptr<ListenBatch> DeferredListeningBatch::get_batch() {
+      std::lock_guard lock(mutex_);
+      if (!batch_) {
+        batch_ = std::make_shared<ListenBatch>();
+        batch_->requests.reserve(max_batch_);
+        batch_->replays.reserve(max_batch_);
+        batch_->started = metrics_clock::now();
+      }
+      return batch_;
+    }
+
+    bool DeferredListeningBatch::push(Request&& request, Replay* replay, uint64_t delivery_tag) {
+      std::lock_guard lock(mutex_);
+      batch_->requests.emplace_back(std::move(request));
+      batch_->replays.push_back(replay);
+      batch_->last_tag = delivery_tag;
+      batch_->pending++;
+      return batch_->requests.size() >= max_batch_;
+    }
+
+    std::shared_ptr<ListenBatch> DeferredListeningBatch::take() {
+      std::lock_guard lock(mutex_);
+      auto batch = std::move(batch_);
+      if (batch) uncommitted_.push_back(batch);
+      return batch;
+    }
+
+    uint64_t DeferredListeningBatch::commit(const std::shared_ptr<ListenBatch>& batch) {
+      std::lock_guard lock(mutex_);
+
+      batch->committed = true;
+
+      ///
+      /// Multiple ack covers all earlier deliveries, so it waits for earlier batches
+      ///
+      uint64_t tag = 0;
+
+      while (!uncommitted_.empty() && uncommitted_.front()->committed) {
+        tag = uncommitted_.front()->last_tag;
+        uncommitted_.pop_front();
+      }
+
+      return tag;
+    }
+
+    void DeferredListeningBatch::start_timer(uv_loop_t* loop, const std::function<void()>& on_expire) {
+
+      if (max_wait_.count() <= 0) return;
+
+      if (!timer_) {
+        timer_ = new uv_timer_t;
+        uv_timer_init(loop, timer_);
+        timer_->data = this;
+      }
+
+      on_expire_ = on_expire;
+
+      uv_timer_start(timer_, [](uv_timer_t* handle){
+          auto deferred = static_cast<DeferredListeningBatch*>(handle->data);
+          if (deferred->on_expire_) deferred->on_expire_();
+      }, static_cast<uint64_t>(max_wait_.count()), 0);
+    }
+
+    void DeferredListeningBatch::stop_timer() {
+      if (timer_) uv_timer_stop(timer_);
+    }
+
+    DeferredSampling::DeferredSampling(std::chrono::milliseconds interval, const Error &error):
+            DeferredQueueStats(error),
+            interval_(std::max(interval, std::chrono::milliseconds(1))),
+            timer_(nullptr),
+            on_sample_()
+    {
+    }
+
+    DeferredSampling::~DeferredSampling() {
+      if (timer_) {
+        uv_timer_stop(timer_);
+        uv_close(reinterpret_cast<uv_handle_t*>(timer_), [](uv_handle_t* handle){
+            delete reinterpret_cast<uv_timer_t*>(handle);
+        });
+      }
+    }
+
+    void DeferredSampling::start_timer(uv_loop_t* loop, const std::function<void()>& on_sample) {
+
+      if (timer_) return;
+
+      auto interval = static_cast<uint64_t>(interval_.count());
+
+      timer_ = new uv_timer_t;
+      uv_timer_init(loop, timer_);
+      timer_->data = this;
+
+      ///
+      /// Sampling does not keep the loop alive
+      ///
+      uv_unref(reinterpret_cast<uv_handle_t*>(timer_));
+
+      on_sample_ = on_sample;
+
+      uv_timer_start(timer_, [](uv_timer_t* handle){
+          auto on_sample = static_cast<DeferredSampling*>(handle->data)->on_sample_;
+          if (on_sample) on_sample();
+      }, interval, interval);
+    }
+
+    DeferredFetchingMany::DeferredFetchingMany(ConnectionCache* connections,
+                                               size_t count,
+                                               const FetchPolicy& policy,
+                                               const Error &error):
+            DeferredFetchMany(error),
+            DeferredConections(connections),
+            count_(count),
+            started_(metrics_clock::now()),
+            quorum_(policy.complete == FetchPolicy::Complete::first_k ? std::min(policy.k, count) : count),
+            deadline_(policy.deadline),
+            mutex_(),
+            payloads_(count, capy::make_unexpected(Error(BrokerError::NO_REPLAY, "no replay received"))),
+            filled_(count, false),
+            received_(0),
+            completed_(false),
+            timer_(nullptr),
+            on_expire_()
+    {
+    }
+
+    DeferredFetchingMany::~DeferredFetchingMany() {
+      if (timer_) {
+        uv_timer_stop(timer_);
+        uv_close(reinterpret_cast<uv_handle_t*>(timer_), [](uv_handle_t* handle){
+            delete reinterpret_cast<uv_timer_t*>(handle);
+        });
+      }
+    }
+
+    bool DeferredFetchingMany::gather(size_t index, const Payload& payload) {
+      std::lock_guard lock(mutex_);
+
+      if (completed_ || index >= count_ || filled_[index]) return false;
+
+      filled_[index] = true;
+      payloads_[index] = payload;
+
+      if (++received_ < quorum_) return false;
+
+      completed_ = true;
+
+      return true;
+    }
+
+    bool DeferredFetchingMany::expire() {
+      std::lock_guard lock(mutex_);
+
+      if (completed_) return false;
+
+      completed_ = true;
+
+      return true;
+    }
+
+    void DeferredFetchingMany::start_timer(uv_loop_t* loop, const std::function<void()>& on_expire) {
+
+      if (deadline_.count() <= 0) return;
+
+      if (!timer_) {
+        timer_ = new uv_timer_t;
+        uv_timer_init(loop, timer_);
+        timer_->data = this;
+      }
+
+      on_expire_ = on_expire;
+
+      uv_timer_start(timer_, [](uv_timer_t* handle){
+          ///
+          /// Handler may destroy the gatherer
+          ///
+          auto on_expire = static_cast<DeferredFetchingMany*>(handle->data)->on_expire_;
+          if (on_expire) on_expire();
+      }, static_cast<uint64_t>(deadline_.count()), 0);
+    }
+
+    void DeferredFetchingMany::stop_timer() {
+      if (timer_) uv_timer_stop(timer_);
+    }
+
+    Payloads DeferredFetchingMany::get_payloads() const {
+      std::lock_guard lock(mutex_);
+      return payloads_;
+    }
 }
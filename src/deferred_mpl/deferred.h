@@ -7,6 +7,10 @@
 #include "capy/amqp_deferred.h"
 #include "../broker_impl/broker.h"
 
+#include <mutex>
+#include <deque>
+#include <map>
+
 namespace capy::amqp {
 
     /***
@@ -16,14 +20,39 @@ namespace capy::amqp {
 
     public:
 
-        DeferredConections(ConnectionCache* connections);
+        /***
+         * Open deferred channel
+         * @param connections connections cache, the channel is not opened if it is nullptr
+         * @param node channels are opened on the node connection, npos means the thread connection
+         */
+        DeferredConections(ConnectionCache* connections, size_t node = NodeSelector::npos);
         Channel& get_channel() const;
 
+        size_t get_node() const { return node_; }
+
+        /***
+         * Remember consumer tag to cancel the consumer on shutdown
+         * @param channel consuming channel
+         * @param tag consumer tag received by basic.consume-ok
+         */
+        void set_consumer_tag(Channel* channel, const std::string& tag);
+
+        /***
+         * Get consumers are started on the channels
+         * @return channel and consumer tag pairs
+         */
+        std::vector<std::pair<Channel*, std::string>> get_consumer_tags() const;
+
     protected:
         ConnectionCache* connections_;
+        size_t node_;
+
+        void remove_consumer_tag(Channel* channel);
 
     private:
         std::unique_ptr<Channel> channel_;
+        mutable std::mutex tags_mutex_;
+        std::map<Channel*, std::string> consumer_tags_;
     };
 
 
@@ -34,16 +63,292 @@ namespace capy::amqp {
         DeferredFetching(ConnectionCache* connections, const Error &error = Error(CommonError::OK)):
                 DeferredFetch(error), DeferredConections(connections)  {}
 
+        /***
+         * Streaming chunks may be received ahead of order up to the window size
+         */
+        static constexpr size_t stream_window = 256;
+
+        /***
+         * Put streaming chunk to the reordering window
+         * @param sequence chunk sequence number
+         * @param last end of stream marker
+         * @param payload chunk payload, empty end of stream marker is not reported
+         * @return chunks are ready to report in order or error if the window overflows
+         */
+        Result<Payloads> order(uint64_t sequence, bool last, const Payload& payload);
+
+        /***
+         * Check all chunks up to the end of stream have been ordered
+         * @return true if the stream is complete
+         */
+        bool is_complete() const;
+
+        /***
+         * Received reply size is set by the loop thread before the decoded reply is reported
+         * @param size serialized reply size
+         */
+        void set_reply_size(size_t size) { reply_size_ = size; }
+
+        /***
+         * Get received reply size
+         * @return serialized reply size or zero if the reply is not decoded
+         */
+        size_t get_reply_size() const { return reply_size_; }
+
+    private:
+        mutable std::mutex mutex_;
+        std::map<uint64_t, std::pair<bool, Payload>> pending_;
+        uint64_t next_ = 0;
+        bool complete_ = false;
+        size_t reply_size_ = 0;
+    };
+
+    /***
+     * Fetch through the reply cache. It is started by seal(), so the cached or shared reply
+     * is not reported before the handlers are set
+     */
+    class DeferredCachedFetching: public DeferredFetching {
+    public:
+
+        using Start = std::function<void()>;
+
+        explicit DeferredCachedFetching(Start start):
+                DeferredFetching(nullptr), start_(std::move(start)) {}
+
+    protected:
+        void on_sealed() override;
+
+    private:
+        Start start_;
     };
 
     class DeferredListening: public DeferredListen, public DeferredConections  {
     public:
         using DeferredListen::DeferredListen;
 
-        DeferredListening(ConnectionCache* connections,  const Error &error = Error(CommonError::OK)):
-                DeferredListen(error), DeferredConections(connections)
-        {
+        DeferredListening(ConnectionCache* connections,
+                          const ListenPolicy& policy = ListenPolicy(),
+                          size_t node = NodeSelector::npos,
+                          const Error &error = Error(CommonError::OK));
+
+        /***
+         * The listener must be destroyed by the loop thread when the scaling timer has been started
+         */
+        ~DeferredListening();
+
+        const ListenPolicy& get_policy() const { return policy_; }
+
+        /***
+         * Start repeating queue depth sampling timer of the policy scale interval, it is called by the loop thread
+         * @param loop broker loop
+         * @param on_sample timer handler
+         */
+        void start_scaling(uv_loop_t* loop, const std::function<void()>& on_sample);
+
+        /***
+         * Open channel of the next consumer, the primary consumer uses get_channel()
+         * @return channel owned by the listener
+         */
+        Channel* add_consumer();
+
+        /***
+         * Release channel of the last added consumer
+         * @return channel is owned by caller or nullptr if only the primary consumer is left
+         */
+        Channel* remove_consumer();
+
+        /***
+         * Consumers count including the primary consumer
+         * @return count
+         */
+        size_t get_consumers_count() const;
+
+        /***
+         * Consumers count is expected for the queue depth according to the policy
+         * @param messagecount queue depth
+         * @return count
+         */
+        size_t get_expected_consumers(uint32_t messagecount) const;
+
+        /***
+         * Message ids of the handled requests
+         * @return nullptr if deduplication is disabled by the policy
+         */
+        const std::shared_ptr<Deduplicator>& get_deduplicator() const { return deduplicator_; }
+
+    private:
+        ListenPolicy policy_;
+        mutable std::mutex mutex_;
+        std::vector<std::unique_ptr<Channel>> consumers_;
+        std::shared_ptr<Deduplicator> deduplicator_;
+        uv_timer_t* timer_;
+        std::function<void()> on_sample_;
+    };
+
+    /***
+     * Batch of requests is assembled on the loop thread
+     */
+    struct ListenBatch {
+        std::vector<Request> requests;
+        std::vector<Replay*> replays;
+        uint64_t last_tag = 0;
+        metrics_clock::time_point started;
+
+        /***
+         * Uncommitted replays count
+         */
+        std::atomic<size_t> pending = 0;
+
+        bool committed = false;
+    };
+
+    class DeferredListeningBatch: public DeferredListenBatch, public DeferredConections  {
+    public:
+        using DeferredListenBatch::DeferredListenBatch;
+
+        DeferredListeningBatch(ConnectionCache* connections,
+                               size_t max_batch,
+                               std::chrono::milliseconds max_wait,
+                               size_t node = NodeSelector::npos,
+                               const Error &error = Error(CommonError::OK));
+
+        /***
+         * The listener must be destroyed by the loop thread when the timer has been started
+         */
+        ~DeferredListeningBatch();
+
+        size_t get_max_batch() const { return max_batch_; }
+
+        /***
+         * Get the batch being assembled, it is created by the first request
+         * @return current batch
+         */
+        std::shared_ptr<ListenBatch> get_batch();
+
+        /***
+         * Add request to the current batch
+         * @param request decoded request
+         * @param replay request replay
+         * @param delivery_tag request delivery tag
+         * @return true if the batch is full
+         */
+        bool push(Request&& request, Replay* replay, uint64_t delivery_tag);
+
+        /***
+         * Take the current batch for handling, it waits for commits in the delivery order
+         * @return batch or nullptr if no requests have been received
+         */
+        std::shared_ptr<ListenBatch> take();
+
+        /***
+         * Mark all replays of the batch committed
+         * @param batch taken batch
+         * @return delivery tag to acknowledge with multiple flag, zero if an earlier batch is not committed
+         */
+        uint64_t commit(const std::shared_ptr<ListenBatch>& batch);
+
+        /***
+         * Start max wait timer of the current batch, it is called by the loop thread
+         * @param loop broker loop
+         * @param on_expire timer handler
+         */
+        void start_timer(uv_loop_t* loop, const std::function<void()>& on_expire);
+
+        void stop_timer();
+
+    private:
+        size_t max_batch_;
+        std::chrono::milliseconds max_wait_;
+        std::mutex mutex_;
+        std::shared_ptr<ListenBatch> batch_;
+        std::deque<std::shared_ptr<ListenBatch>> uncommitted_;
+        uv_timer_t* timer_;
+        std::function<void()> on_expire_;
+    };
+
+    class DeferredSampling: public DeferredQueueStats {
+    public:
+        using DeferredQueueStats::DeferredQueueStats;
+
+        DeferredSampling(std::chrono::milliseconds interval, const Error &error = Error(CommonError::OK));
+
+        /***
+         * The sampler must be destroyed by the loop thread when the timer has been started
+         */
+        ~DeferredSampling();
+
+        /***
+         * Start repeating sampling timer, it is called by the loop thread
+         * @param loop broker loop
+         * @param on_sample timer handler
+         */
+        void start_timer(uv_loop_t* loop, const std::function<void()>& on_sample);
+
+    private:
+        std::chrono::milliseconds interval_;
+        uv_timer_t* timer_;
+        std::function<void()> on_sample_;
+    };
+
+    class DeferredFetchingMany: public DeferredFetchMany, public DeferredConections {
+    public:
+        using DeferredFetchMany::DeferredFetchMany;
+
+        DeferredFetchingMany(ConnectionCache* connections,
+                             size_t count,
+                             const FetchPolicy& policy,
+                             const Error &error = Error(CommonError::OK));
+
+        /***
+         * The gatherer must be destroyed by the loop thread when the timer has been started
+         */
+        ~DeferredFetchingMany();
+
+        /***
+         * Put worker replay to its slot, the slot is filled by the first replay only
+         * @param index slot index
+         * @param payload replay
+         * @return true if the replay completes gathering according to the policy
+         */
+        bool gather(size_t index, const Payload& payload);
+
+        /***
+         * Complete gathering when deadline expires
+         * @return true if the gathering has not been completed before
+         */
+        bool expire();
+
+        /***
+         * Start policy deadline timer, it is called by the loop thread
+         * @param loop broker loop
+         * @param on_expire timer handler
+         */
+        void start_timer(uv_loop_t* loop, const std::function<void()>& on_expire);
+
+        void stop_timer();
+
+        /***
+         * Gathered replies, missed slots contain BrokerError::NO_REPLAY error
+         * @return replies ordered as routing keys
+         */
+        Payloads get_payloads() const;
+
+        size_t get_count() const { return count_; }
+
+        const metrics_clock::time_point& get_started() const { return started_; }
+
+    private:
+        size_t count_;
+        metrics_clock::time_point started_;
+        size_t quorum_;
+        std::chrono::milliseconds deadline_;
 
-        }
+        mutable std::mutex mutex_;
+        Payloads payloads_;
+        std::vector<bool> filled_;
+        size_t received_;
+        bool completed_;
+        uv_timer_t* timer_;
+        std::function<void()> on_expire_;
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,105 @@
+//
+// Created by denn nevera on 2019-07-19.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/chunking.h"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace capy::amqp;
+
+static std::vector<Reassembler::Frame> split(const std::string& id, size_t size, size_t frame_size) {
+  std::vector<Reassembler::Frame> frames;
+  auto total = static_cast<uint32_t>((size + frame_size - 1) / frame_size);
+  for (uint32_t i = 0; i < total; ++i) {
+    frames.push_back({id, i, total, i * frame_size, size});
+  }
+  return frames;
+}
+
+TEST(Chunking, Reassemble) {
+
+  std::vector<std::uint8_t> data(10000);
+  std::iota(data.begin(), data.end(), 0);
+
+  Reassembler reassembler(1 << 20);
+
+  auto frames = split("m1", data.size(), 3000);
+  std::reverse(frames.begin(), frames.end());
+
+  std::vector<std::uint8_t> message;
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    auto& frame = frames[i];
+    auto length = std::min<size_t>(3000, data.size() - frame.offset);
+    auto state = reassembler.push(frame, data.data() + frame.offset, length, message);
+
+    ASSERT_TRUE(state);
+    EXPECT_EQ(*state, i + 1 < frames.size() ? Reassembler::State::partial : Reassembler::State::complete);
+  }
+
+  EXPECT_EQ(message, data);
+  EXPECT_EQ(reassembler.get_pending_bytes(), 0u);
+  EXPECT_EQ(reassembler.get_pending_count(), 0u);
+}
+
+TEST(Chunking, MemoryCap) {
+
+  std::vector<std::uint8_t> data(1000, 1);
+  std::vector<std::uint8_t> message;
+
+  Reassembler reassembler(1500);
+
+  EXPECT_FALSE(reassembler.push({"big", 0, 2, 0, 2000}, data.data(), 1000, message));
+
+  ASSERT_TRUE(reassembler.push({"m1", 0, 2, 0, 1000}, data.data(), 500, message));
+  EXPECT_EQ(reassembler.get_pending_bytes(), 1001u);
+
+  ///
+  /// the oldest partial message is dropped to fit the cap
+  ///
+  ASSERT_TRUE(reassembler.push({"m2", 0, 2, 0, 1000}, data.data(), 500, message));
+  EXPECT_EQ(reassembler.get_pending_count(), 1u);
+  EXPECT_EQ(reassembler.get_pending_bytes(), 1001u);
+
+  auto state = reassembler.push({"m2", 1, 2, 500, 1000}, data.data(), 500, message);
+  ASSERT_TRUE(state);
+  EXPECT_EQ(*state, Reassembler::State::complete);
+  EXPECT_EQ(message.size(), 1000u);
+
+  EXPECT_FALSE(reassembler.push({"bad", 2, 2, 0, 1000}, data.data(), 500, message));
+  EXPECT_FALSE(reassembler.push({"bad", 0, 2, 900, 1000}, data.data(), 500, message));
+}
+
+TEST(Chunking, MalformedFrames) {
+
+  std::vector<std::uint8_t> data(1000, 1);
+  std::vector<std::uint8_t> message;
+
+  Reassembler reassembler(1 << 20);
+
+  ///
+  /// Offset is wrapped over the message size
+  ///
+  EXPECT_FALSE(reassembler.push({"wrap", 1, 2, UINT64_MAX - 100, 1000}, data.data(), 500, message));
+  EXPECT_FALSE(reassembler.push({"wrap", 0, 1, UINT64_MAX, 1000}, data.data(), 1000, message));
+
+  ///
+  /// Frames count does not match the frame length
+  ///
+  EXPECT_FALSE(reassembler.push({"count", 0, UINT32_MAX, 0, 1000}, data.data(), 500, message));
+  EXPECT_FALSE(reassembler.push({"count", 0, 3, 0, 1000}, data.data(), 500, message));
+  EXPECT_FALSE(reassembler.push({"count", 1, 2, 400, 1000}, data.data(), 500, message));
+
+  EXPECT_EQ(reassembler.get_pending_count(), 0u);
+  EXPECT_EQ(reassembler.get_pending_bytes(), 0u);
+
+  ///
+  /// Received frames map is accounted in the pending bytes
+  ///
+  ASSERT_TRUE(reassembler.push({"m1", 0, 2, 0, 1000}, data.data(), 500, message));
+  EXPECT_EQ(reassembler.get_pending_bytes(), 1001u);
+}
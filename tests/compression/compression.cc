@@ -0,0 +1,115 @@
+//
+// Created by denn nevera on 2019-07-22.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/compression.h"
+
+using namespace capy::amqp;
+
+static std::vector<std::uint8_t> sample(size_t size) {
+  auto body = capy::json::to_msgpack(capy::json({{"action", "compress"}, {"payload", std::string(size, 'c')}}));
+  return std::vector<std::uint8_t>(body.begin(), body.end());
+}
+
+static void round_trip(const Compression& options, const std::string& encoding) {
+
+  if (!Codec::is_supported(options.codec)) {
+    EXPECT_FALSE(Codec::Make(options));
+    return;
+  }
+
+  auto codec = Codec::Make(options);
+  ASSERT_TRUE(codec);
+  EXPECT_EQ((*codec)->get_encoding(), encoding);
+
+  auto data = sample(64 * 1024);
+  std::vector<std::uint8_t> compressed;
+
+  ASSERT_TRUE((*codec)->compress(data, compressed));
+  EXPECT_LT(compressed.size(), data.size());
+
+  auto decompressed = (*codec)->decompress(encoding, compressed);
+  ASSERT_TRUE(decompressed);
+  EXPECT_EQ(*decompressed, data);
+
+  compressed.resize(compressed.size() / 2);
+  EXPECT_FALSE((*codec)->decompress(encoding, compressed));
+}
+
+TEST(Compression, None) {
+
+  auto codec = Codec::Make(Compression());
+  ASSERT_TRUE(codec);
+
+  std::vector<std::uint8_t> compressed;
+  EXPECT_FALSE((*codec)->compress(sample(64 * 1024), compressed));
+  EXPECT_TRUE((*codec)->get_encoding().empty());
+  EXPECT_FALSE((*codec)->decompress("gzip", sample(16)));
+}
+
+TEST(Compression, ForeignEncoding) {
+  EXPECT_TRUE(Codec::is_compressed("lz4"));
+  EXPECT_TRUE(Codec::is_compressed("zstd"));
+  EXPECT_FALSE(Codec::is_compressed(""));
+  EXPECT_FALSE(Codec::is_compressed("utf-8"));
+  EXPECT_FALSE(Codec::is_compressed("identity"));
+}
+
+TEST(Compression, Threshold) {
+
+  for (auto options: {Compression::LZ4(4096), Compression::Zstd(3, 4096)}) {
+
+    if (!Codec::is_supported(options.codec)) continue;
+
+    auto codec = Codec::Make(options);
+    ASSERT_TRUE(codec);
+
+    std::vector<std::uint8_t> compressed;
+    EXPECT_FALSE((*codec)->compress(sample(1024), compressed));
+    EXPECT_TRUE((*codec)->compress(sample(8192), compressed));
+  }
+}
+
+TEST(Compression, LZ4) {
+  round_trip(Compression::LZ4(), "lz4");
+}
+
+TEST(Compression, LZ4HighCompression) {
+
+  round_trip(Compression::LZ4(1024, 9), "lz4");
+
+  if (!Codec::is_supported(Compression::Codec::lz4)) return;
+
+  ///
+  /// HC level does not compress less than the fast mode, negative level is decoded the same way
+  ///
+  auto data = sample(64 * 1024);
+  std::vector<std::uint8_t> fast, high, faster;
+
+  ASSERT_TRUE((*Codec::Make(Compression::LZ4(1024, 0)))->compress(data, fast));
+  ASSERT_TRUE((*Codec::Make(Compression::LZ4(1024, 9)))->compress(data, high));
+  ASSERT_TRUE((*Codec::Make(Compression::LZ4(1024, -8)))->compress(data, faster));
+
+  EXPECT_LE(high.size(), fast.size());
+
+  auto decompressed = (*Codec::Make(Compression::LZ4()))->decompress("lz4", faster);
+  ASSERT_TRUE(decompressed);
+  EXPECT_EQ(*decompressed, data);
+}
+
+TEST(Compression, Zstd) {
+  round_trip(Compression::Zstd(), "zstd");
+}
+
+TEST(Compression, Dictionary) {
+
+  auto words = sample(512);
+  auto dictionary = std::string(words.begin(), words.end());
+
+  for (auto options: {Compression::LZ4(), Compression::Zstd()}) {
+    options.dictionary = dictionary;
+    round_trip(options, options.codec == Compression::Codec::lz4 ? "lz4" : "zstd");
+  }
+}
@@ -0,0 +1,126 @@
+//
+// Created by denn nevera on 2019-08-09.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/dedup.h"
+
+#include <string>
+#include <vector>
+
+using capy::amqp::CuckooFilter;
+using capy::amqp::Deduplication;
+using capy::amqp::Deduplicator;
+
+static Deduplicator::Replay make_replay(size_t size) {
+  return std::make_shared<const std::vector<std::uint8_t>>(size, 1);
+}
+
+TEST(Dedup, CuckooFilter) {
+
+  CuckooFilter filter(10000);
+
+  for (uint64_t i = 0; i < 10000; ++i) {
+    EXPECT_TRUE(filter.insert(i * 0x9E3779B97F4A7C15ull));
+  }
+
+  for (uint64_t i = 0; i < 10000; ++i) {
+    EXPECT_TRUE(filter.contains(i * 0x9E3779B97F4A7C15ull));
+  }
+
+  size_t false_positives = 0;
+
+  for (uint64_t i = 10000; i < 20000; ++i) {
+    if (filter.contains(i * 0x9E3779B97F4A7C15ull)) false_positives++;
+  }
+
+  EXPECT_LT(false_positives, 100);
+
+  for (uint64_t i = 0; i < 5000; ++i) {
+    EXPECT_TRUE(filter.erase(i * 0x9E3779B97F4A7C15ull));
+  }
+
+  for (uint64_t i = 5000; i < 10000; ++i) {
+    EXPECT_TRUE(filter.contains(i * 0x9E3779B97F4A7C15ull));
+  }
+}
+
+TEST(Dedup, Replied) {
+
+  Deduplication deduplication;
+  deduplication.capacity = 100;
+
+  Deduplicator deduplicator(deduplication);
+
+  EXPECT_EQ(deduplicator.check("a").state, Deduplicator::State::fresh);
+  EXPECT_EQ(deduplicator.check("a").state, Deduplicator::State::duplicate);
+
+  auto replay = make_replay(10);
+  deduplicator.reply("a", replay);
+
+  auto seen = deduplicator.check("a");
+
+  EXPECT_EQ(seen.state, Deduplicator::State::replied);
+  EXPECT_EQ(seen.replay, replay);
+  EXPECT_EQ(deduplicator.get_replay_bytes(), 10);
+
+  deduplicator.forget("a");
+
+  EXPECT_EQ(deduplicator.check("a").state, Deduplicator::State::fresh);
+  EXPECT_EQ(deduplicator.get_replay_bytes(), 0);
+}
+
+TEST(Dedup, Window) {
+
+  Deduplication deduplication;
+  deduplication.capacity = 100;
+  deduplication.window = std::chrono::milliseconds(100);
+
+  Deduplicator deduplicator(deduplication);
+
+  auto now = Deduplicator::clock::now();
+
+  EXPECT_EQ(deduplicator.check("a", now).state, Deduplicator::State::fresh);
+  EXPECT_EQ(deduplicator.check("b", now + std::chrono::milliseconds(60)).state, Deduplicator::State::fresh);
+
+  ///
+  /// Duplicate within the window slides it
+  ///
+  EXPECT_EQ(deduplicator.check("a", now + std::chrono::milliseconds(90)).state, Deduplicator::State::duplicate);
+  EXPECT_EQ(deduplicator.check("b", now + std::chrono::milliseconds(170)).state, Deduplicator::State::fresh);
+  EXPECT_EQ(deduplicator.check("a", now + std::chrono::milliseconds(180)).state, Deduplicator::State::duplicate);
+  EXPECT_EQ(deduplicator.check("a", now + std::chrono::milliseconds(300)).state, Deduplicator::State::fresh);
+}
+
+TEST(Dedup, Bounds) {
+
+  Deduplication deduplication;
+  deduplication.capacity = 1000;
+  deduplication.max_replay_bytes = 1000;
+
+  Deduplicator deduplicator(deduplication);
+
+  for (int i = 0; i < 5000; ++i) {
+    auto id = std::to_string(i);
+    EXPECT_EQ(deduplicator.check(id).state, Deduplicator::State::fresh);
+    deduplicator.reply(id, make_replay(100));
+  }
+
+  EXPECT_EQ(deduplicator.size(), 1000);
+  EXPECT_LE(deduplicator.get_replay_bytes(), 1000);
+
+  ///
+  /// The most recent replays are kept, the least recent ids are forgotten
+  ///
+  EXPECT_EQ(deduplicator.check("4999").state, Deduplicator::State::replied);
+  EXPECT_EQ(deduplicator.check("4000").state, Deduplicator::State::duplicate);
+  EXPECT_EQ(deduplicator.check("0").state, Deduplicator::State::fresh);
+
+  ///
+  /// Replay over the limit is not kept
+  ///
+  EXPECT_EQ(deduplicator.check("large").state, Deduplicator::State::fresh);
+  deduplicator.reply("large", make_replay(2000));
+  EXPECT_EQ(deduplicator.check("large").state, Deduplicator::State::duplicate);
+}
@@ -0,0 +1,62 @@
+//
+// Created by denn nevera on 2019-07-25.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/deferred_mpl/deferred.h"
+
+using namespace capy::amqp;
+
+static std::shared_ptr<ListenBatch> make_batch(DeferredListeningBatch& deferred, uint64_t first_tag) {
+
+  ///
+  /// The batch is created by the first request
+  ///
+  deferred.get_batch();
+
+  for (uint64_t tag = first_tag; tag < first_tag + deferred.get_max_batch(); ++tag) {
+    deferred.push(Request(Rpc()), nullptr, tag);
+  }
+
+  return deferred.take();
+}
+
+TEST(BatchDeferred, CommitInDeliveryOrder) {
+
+  DeferredListeningBatch deferred(nullptr, 2, std::chrono::milliseconds(0));
+
+  auto first = make_batch(deferred, 1);
+  auto second = make_batch(deferred, 3);
+
+  ASSERT_TRUE(first);
+  ASSERT_TRUE(second);
+  EXPECT_EQ(first->last_tag, 2u);
+  EXPECT_EQ(second->last_tag, 4u);
+
+  ///
+  /// Multiple ack of the second batch would acknowledge the first one, so it waits
+  ///
+  EXPECT_EQ(deferred.commit(second), 0u);
+
+  ///
+  /// The first batch commit acknowledges both batches at once
+  ///
+  EXPECT_EQ(deferred.commit(first), second->last_tag);
+}
+
+TEST(BatchDeferred, CommitInOrder) {
+
+  DeferredListeningBatch deferred(nullptr, 2, std::chrono::milliseconds(0));
+
+  auto first = make_batch(deferred, 1);
+  auto second = make_batch(deferred, 3);
+
+  EXPECT_EQ(deferred.commit(first), first->last_tag);
+  EXPECT_EQ(deferred.commit(second), second->last_tag);
+
+  ///
+  /// Nothing is taken if no request has been received
+  ///
+  EXPECT_FALSE(deferred.take());
+}
\ No newline at end of file
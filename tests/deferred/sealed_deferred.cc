@@ -0,0 +1,144 @@
+//
+// Created by denn nevera on 2019-07-18.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/deferred_mpl/deferred.h"
+
+#include <array>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace capy::amqp;
+
+TEST(Deferred, SmallFunctionStorage) {
+
+  int calls = 0;
+
+  SmallFunction<void(int)> small([&calls](int v){ calls += v; });
+  EXPECT_TRUE(small.is_stored_inline());
+
+  std::array<char, 128> big_state{};
+  SmallFunction<void(int)> big([&calls, big_state](int v){ calls += v + big_state[0]; });
+  EXPECT_FALSE(big.is_stored_inline());
+
+  small(1);
+  big(2);
+
+  SmallFunction<void(int)> moved(std::move(big));
+  EXPECT_FALSE(static_cast<bool>(big));
+  moved(3);
+
+  EXPECT_EQ(calls, 6);
+
+  SmallFunction<void(int)> empty(std::function<void(int)>{});
+  EXPECT_FALSE(static_cast<bool>(empty));
+}
+
+TEST(Deferred, SealedDispatch) {
+
+  DeferredFetch deferred;
+
+  std::atomic<size_t> received(0);
+  std::atomic<size_t> errors(0);
+
+  deferred
+          .on_data([&received](const Payload& payload){
+              if (payload) received++;
+          })
+          .on_error([&errors](const capy::Error&){
+              errors++;
+          })
+          .seal();
+
+  EXPECT_TRUE(deferred.is_sealed());
+
+  ///
+  /// handlers are not replaced after sealing
+  ///
+  deferred.on_data([](const Payload&){ FAIL(); });
+
+  Payload payload = capy::json({{"ok", true}});
+
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&deferred, &payload]{
+        for (int i = 0; i < 10000; ++i) deferred.report_data(payload);
+    });
+  }
+
+  for (auto& thread: threads) thread.join();
+
+  EXPECT_EQ(received, 40000u);
+
+  deferred.report_error(capy::Error(BrokerError::DATA_RESPONSE, "failed"));
+
+  EXPECT_EQ(errors, 1u);
+  EXPECT_FALSE(deferred);
+
+  deferred.report_data(payload);
+
+  EXPECT_EQ(received, 40000u);
+}
+
+TEST(Deferred, StartedBySeal) {
+
+  size_t started = 0;
+  size_t received = 0;
+
+  DeferredCachedFetching deferred([&]{
+      ///
+      /// Handlers are set when the fetch is started
+      ///
+      started++;
+      deferred.report_data(capy::json({{"ok", true}}));
+  });
+
+  deferred.on_data([&received](const Payload& payload){
+      if (payload) received++;
+  });
+
+  EXPECT_EQ(started, 0u);
+
+  deferred.seal();
+  deferred.seal();
+
+  EXPECT_EQ(started, 1u);
+  EXPECT_EQ(received, 1u);
+}
+
+TEST(Deferred, ReentrantRegistration) {
+
+  DeferredFetch deferred;
+
+  size_t received = 0;
+  size_t rejected = 0;
+
+  deferred
+          .on_error([&rejected](const capy::Error& error){
+              if (error.value() == static_cast<int>(CommonError::NOT_SUPPORTED)) rejected++;
+          })
+          .on_data([&](const Payload&){
+              received++;
+              ///
+              /// Handler of the unsealed object is not replaced by the handler
+              ///
+              deferred.on_data([](const Payload&){ FAIL(); });
+              deferred.seal();
+          });
+
+  Payload payload = capy::json({{"ok", true}});
+
+  deferred.report_data(payload);
+
+  EXPECT_EQ(rejected, 1u);
+  EXPECT_TRUE(deferred.is_sealed());
+
+  deferred.report_data(payload);
+
+  EXPECT_EQ(received, 2u);
+  EXPECT_EQ(rejected, 1u);
+}
@@ -0,0 +1,134 @@
+//
+// Created by denn nevera on 2019-07-19.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/deferred_mpl/deferred.h"
+
+using namespace capy::amqp;
+
+static Payload chunk(int index) {
+  return capy::json({{"chunk", index}});
+}
+
+static int index_of(const Payload& payload) {
+  return payload->at("chunk").get<int>();
+}
+
+TEST(StreamingDeferred, OutOfOrder) {
+
+  DeferredFetching deferred(nullptr);
+
+  auto ready = deferred.order(2, false, chunk(2));
+
+  EXPECT_TRUE(ready);
+  EXPECT_TRUE(ready->empty());
+
+  ready = deferred.order(1, false, chunk(1));
+
+  EXPECT_TRUE(ready);
+  EXPECT_TRUE(ready->empty());
+
+  ///
+  /// The first chunk releases the chunks are waiting for it
+  ///
+  ready = deferred.order(0, false, chunk(0));
+
+  EXPECT_TRUE(ready);
+  EXPECT_EQ(ready->size(), 3u);
+
+  for (size_t i = 0; i < ready->size(); ++i) {
+    EXPECT_EQ(index_of(ready->at(i)), static_cast<int>(i));
+  }
+
+  EXPECT_FALSE(deferred.is_complete());
+
+  ready = deferred.order(3, true, chunk(3));
+
+  EXPECT_TRUE(ready);
+  EXPECT_EQ(ready->size(), 1u);
+  EXPECT_EQ(index_of(ready->at(0)), 3);
+  EXPECT_TRUE(deferred.is_complete());
+}
+
+TEST(StreamingDeferred, Duplicates) {
+
+  DeferredFetching deferred(nullptr);
+
+  auto ready = deferred.order(0, false, chunk(0));
+
+  EXPECT_TRUE(ready);
+  EXPECT_EQ(ready->size(), 1u);
+
+  ///
+  /// Redelivered chunk is older than the next expected one
+  ///
+  ready = deferred.order(0, false, chunk(0));
+
+  EXPECT_TRUE(ready);
+  EXPECT_TRUE(ready->empty());
+
+  ///
+  /// Duplicate of the waiting chunk is reported once
+  ///
+  ready = deferred.order(2, false, chunk(2));
+  EXPECT_TRUE(ready && ready->empty());
+
+  ready = deferred.order(2, false, chunk(-2));
+  EXPECT_TRUE(ready && ready->empty());
+
+  ready = deferred.order(1, false, chunk(1));
+
+  EXPECT_TRUE(ready);
+  EXPECT_EQ(ready->size(), 2u);
+  EXPECT_EQ(index_of(ready->at(0)), 1);
+  EXPECT_EQ(index_of(ready->at(1)), 2);
+}
+
+TEST(StreamingDeferred, WindowOverflow) {
+
+  DeferredFetching deferred(nullptr);
+
+  ///
+  /// The first chunk is lost, the window is filled by the later ones
+  ///
+  for (uint64_t sequence = 1; sequence <= DeferredFetching::stream_window; ++sequence) {
+    auto ready = deferred.order(sequence, false, chunk(static_cast<int>(sequence)));
+    EXPECT_TRUE(ready);
+    EXPECT_TRUE(ready->empty());
+  }
+
+  auto ready = deferred.order(DeferredFetching::stream_window + 1, false, chunk(0));
+
+  EXPECT_FALSE(ready);
+  EXPECT_EQ(ready.error().value(), static_cast<int>(BrokerError::DATA_RESPONSE));
+  EXPECT_FALSE(deferred.is_complete());
+}
+
+TEST(StreamingDeferred, EmptyEndMarker) {
+
+  DeferredFetching deferred(nullptr);
+
+  auto ready = deferred.order(1, true, capy::json());
+
+  EXPECT_TRUE(ready && ready->empty());
+  EXPECT_FALSE(deferred.is_complete());
+
+  ready = deferred.order(0, false, chunk(0));
+
+  ///
+  /// Empty end of stream marker completes the stream and is not reported
+  ///
+  EXPECT_TRUE(ready);
+  EXPECT_EQ(ready->size(), 1u);
+  EXPECT_EQ(index_of(ready->at(0)), 0);
+  EXPECT_TRUE(deferred.is_complete());
+
+  ///
+  /// Chunks after the end of stream are dropped
+  ///
+  ready = deferred.order(2, false, chunk(2));
+
+  EXPECT_TRUE(ready && ready->empty());
+}
\ No newline at end of file
@@ -0,0 +1,88 @@
+//
+// Created by denn nevera on 2019-07-12.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/metrics.h"
+
+#include <thread>
+#include <vector>
+
+TEST(Metrics, HistogramBuckets) {
+
+  using capy::amqp::HistogramSnapshot;
+
+  for (uint64_t v: {0ul, 1ul, 31ul, 32ul, 33ul, 100ul, 1000ul, 123456ul, 1ul << 30}) {
+    auto index = HistogramSnapshot::bucket_index(v);
+    EXPECT_LE(v, HistogramSnapshot::bucket_upper_bound(index));
+    if (index > 0) {
+      EXPECT_GT(v, HistogramSnapshot::bucket_upper_bound(index - 1));
+    }
+  }
+
+  EXPECT_EQ(HistogramSnapshot::bucket_index(UINT64_MAX), HistogramSnapshot::bucket_count() - 1);
+}
+
+TEST(Metrics, HistogramShards) {
+
+  capy::amqp::Histogram histogram;
+
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&histogram]{
+        for (uint64_t i = 1; i <= 1000; ++i) {
+          histogram.record(i);
+        }
+    });
+  }
+
+  for (auto& thread: threads) thread.join();
+
+  auto snapshot = histogram.snapshot();
+
+  EXPECT_EQ(snapshot.count, 4000u);
+  EXPECT_EQ(snapshot.min, 1u);
+  EXPECT_EQ(snapshot.max, 1000u);
+  EXPECT_EQ(snapshot.sum, 4u * 500500u);
+
+  auto p50 = snapshot.value_at_percentile(50);
+  EXPECT_GE(p50, 500u);
+  EXPECT_LE(p50, 520u);
+  EXPECT_EQ(snapshot.value_at_percentile(100), 1000u);
+}
+
+TEST(Metrics, Prometheus) {
+
+  capy::amqp::Metrics metrics;
+
+  metrics.publish_count.add(3);
+  metrics.fetch_latency.record(1500);
+
+  auto text = capy::amqp::to_prometheus(metrics.snapshot());
+
+  EXPECT_NE(text.find("capy_amqp_publish_total 3\n"), std::string::npos);
+  EXPECT_NE(text.find("capy_amqp_fetch_latency_seconds_bucket{le=\"0.0025\"} 1\n"), std::string::npos);
+  EXPECT_NE(text.find("capy_amqp_fetch_latency_seconds_bucket{le=\"0.001\"} 0\n"), std::string::npos);
+  EXPECT_NE(text.find("capy_amqp_fetch_latency_seconds_count 1\n"), std::string::npos);
+}
+
+TEST(Metrics, FlushSize) {
+
+  capy::amqp::Metrics metrics;
+
+  metrics.write_flushes.add(2);
+  metrics.write_frames.add(10);
+  metrics.write_bytes.add(5000);
+  metrics.flush_size.record(1000);
+  metrics.flush_size.record(4000);
+
+  auto text = capy::amqp::to_prometheus(metrics.snapshot());
+
+  EXPECT_NE(text.find("capy_amqp_write_flushes_total 2\n"), std::string::npos);
+  EXPECT_NE(text.find("capy_amqp_write_frames_total 10\n"), std::string::npos);
+  EXPECT_NE(text.find("capy_amqp_flush_size_bytes_bucket{le=\"1024\"} 1\n"), std::string::npos);
+  EXPECT_NE(text.find("capy_amqp_flush_size_bytes_bucket{le=\"4096\"} 2\n"), std::string::npos);
+  EXPECT_NE(text.find("capy_amqp_flush_size_bytes_sum 5000\n"), std::string::npos);
+}
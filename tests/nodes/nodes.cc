@@ -0,0 +1,95 @@
+//
+// Created by denn nevera on 2019-07-30.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/nodes.h"
+
+using namespace capy::amqp;
+
+static std::vector<Address::Node> cluster() {
+  return {{"h1", 5672}, {"h2", 5672}, {"h3", 5672}};
+}
+
+TEST(Nodes, Balanced) {
+
+  NodeSelector nodes(cluster());
+
+  std::vector<size_t> counts(3, 0);
+
+  for (int i = 0; i < 9; ++i) counts[nodes.select()]++;
+
+  EXPECT_EQ(counts, std::vector<size_t>({3, 3, 3}));
+}
+
+TEST(Nodes, Fastest) {
+
+  NodeSelection selection;
+  selection.policy = NodeSelection::Policy::fastest;
+
+  NodeSelector nodes(cluster(), selection);
+
+  nodes.connected(0, std::chrono::milliseconds(30));
+  nodes.connected(1, std::chrono::milliseconds(2));
+  nodes.connected(2, std::chrono::milliseconds(10));
+
+  EXPECT_EQ(nodes.select(), 1u);
+  EXPECT_EQ(nodes.select(), 1u);
+
+  auto states = nodes.get_states();
+
+  EXPECT_EQ(states[1].connections, 2u);
+  EXPECT_EQ(states[1].rtt, std::chrono::microseconds(2000));
+}
+
+TEST(Nodes, FailoverAndRebalance) {
+
+  NodeSelector nodes(cluster());
+
+  auto now = NodeSelector::clock::now();
+
+  nodes.failed(2, now);
+
+  std::vector<size_t> counts(3, 0);
+
+  for (int i = 0; i < 6; ++i) counts[nodes.select(now)]++;
+
+  EXPECT_EQ(counts, std::vector<size_t>({3, 3, 0}));
+
+  auto epoch = nodes.get_epoch();
+
+  EXPECT_FALSE(nodes.should_move(0, epoch, now));
+
+  ///
+  /// Failed node is probed after retry interval and recovers
+  ///
+  auto later = now + NodeSelection().retry_after;
+
+  EXPECT_EQ(nodes.select(later), 2u);
+
+  nodes.connected(2, std::chrono::milliseconds(1));
+
+  EXPECT_NE(nodes.get_epoch(), epoch);
+  EXPECT_TRUE(nodes.should_move(0, epoch, later));
+
+  nodes.released(0);
+  EXPECT_EQ(nodes.select(later), 2u);
+
+  EXPECT_FALSE(nodes.should_move(0, epoch, later));
+}
+
+TEST(Nodes, Leader) {
+
+  NodeSelector nodes({{"h1", 5672}, {"h2", 5673}});
+
+  EXPECT_EQ(nodes.find("h2"), 1u);
+  EXPECT_EQ(nodes.find("h2:5673"), 1u);
+  EXPECT_EQ(nodes.find("h2:5672"), NodeSelector::npos);
+  EXPECT_EQ(nodes.find("h3"), NodeSelector::npos);
+
+  nodes.acquire(1);
+
+  EXPECT_EQ(nodes.get_states()[1].connections, 1u);
+  EXPECT_EQ(nodes.select(), 0u);
+}
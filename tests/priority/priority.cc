@@ -0,0 +1,72 @@
+//
+// Created by denn nevera on 2019-07-23.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/priority.h"
+
+using namespace capy::amqp;
+
+TEST(Priority, Order) {
+
+  PriorityDispatch dispatch(nullptr);
+  std::vector<int> handled;
+
+  std::vector<std::pair<uint8_t,int>> deliveries = {{0, 1}, {5, 2}, {0, 3}, {9, 4}, {5, 5}, {1, 6}};
+
+  for (auto& delivery: deliveries) {
+    auto id = delivery.second;
+    dispatch.push(delivery.first, [&handled, id]{ handled.push_back(id); });
+  }
+
+  EXPECT_EQ(dispatch.size(), deliveries.size());
+  EXPECT_EQ(dispatch.drain(), deliveries.size());
+  EXPECT_EQ(dispatch.size(), 0u);
+
+  EXPECT_EQ(handled, std::vector<int>({4, 2, 5, 6, 1, 3}));
+}
+
+TEST(Priority, LoopCheckPhase) {
+
+  uv_loop_t loop;
+  uv_loop_init(&loop);
+
+  std::vector<int> handled;
+
+  {
+    PriorityDispatch dispatch(&loop);
+
+    ///
+    /// Deliveries queued in the same loop iteration are handled together after it
+    ///
+    uv_timer_t timer;
+    uv_timer_init(&loop, &timer);
+
+    struct Context { PriorityDispatch* dispatch; std::vector<int>* handled; } context{&dispatch, &handled};
+    timer.data = &context;
+
+    uv_timer_start(&timer, [](uv_timer_t* handle){
+        auto context = static_cast<Context*>(handle->data);
+        for (int i = 0; i < 4; ++i) {
+          auto handled = context->handled;
+          context->dispatch->push(static_cast<uint8_t>(i), [handled, i]{ handled->push_back(i); });
+        }
+        EXPECT_TRUE(context->handled->empty());
+        uv_close(reinterpret_cast<uv_handle_t*>(handle), nullptr);
+    }, 0, 0);
+
+    uv_run(&loop, UV_RUN_DEFAULT);
+
+    EXPECT_EQ(dispatch.size(), 0u);
+  }
+
+  EXPECT_EQ(handled, std::vector<int>({3, 2, 1, 0}));
+
+  ///
+  /// Check handle of the destroyed dispatch is closed by the next pass
+  ///
+  uv_run(&loop, UV_RUN_NOWAIT);
+
+  EXPECT_EQ(uv_loop_close(&loop), 0);
+}
@@ -0,0 +1,86 @@
+//
+// Created by denn nevera on 2019-08-12.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/reply_cache.h"
+
+#include <string>
+#include <vector>
+
+using capy::amqp::ReplyCache;
+using capy::amqp::ReplyCaching;
+
+TEST(ReplyCache, Key) {
+
+  auto request = capy::json::to_msgpack(capy::json({{"action", "find"}, {"id", 1}}));
+  auto other = capy::json::to_msgpack(capy::json({{"action", "find"}, {"id", 2}}));
+
+  EXPECT_EQ(ReplyCache::make_key("echo.find", request), ReplyCache::make_key("echo.find", request));
+  EXPECT_NE(ReplyCache::make_key("echo.find", request), ReplyCache::make_key("echo.list", request));
+  EXPECT_NE(ReplyCache::make_key("echo.find", request), ReplyCache::make_key("echo.find", other));
+}
+
+TEST(ReplyCache, Ttl) {
+
+  ReplyCaching caching;
+  caching.max_bytes = 1024 * 1024;
+  caching.ttl = std::chrono::milliseconds(100);
+
+  ReplyCache cache(caching);
+
+  auto request = capy::json::to_msgpack(capy::json({{"id", 1}}));
+  auto key = ReplyCache::make_key("echo.find", request);
+  auto now = ReplyCache::clock::now();
+
+  EXPECT_FALSE(cache.get(key, request, now));
+
+  cache.set(key, request, capy::json({{"name", "one"}}), 16, now);
+
+  auto reply = cache.get(key, request, now + std::chrono::milliseconds(50));
+
+  ASSERT_TRUE(reply);
+  EXPECT_EQ((*reply)["name"], "one");
+
+  ///
+  /// Hash collision is not a hit
+  ///
+  EXPECT_FALSE(cache.get(key, capy::json::to_msgpack(capy::json({{"id", 2}})), now));
+
+  EXPECT_FALSE(cache.get(key, request, now + std::chrono::milliseconds(100)));
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.get_bytes(), 0);
+}
+
+TEST(ReplyCache, Bytes) {
+
+  ReplyCaching caching;
+  caching.max_bytes = ReplyCache::shards_count * 1000;
+
+  ReplyCache cache(caching);
+
+  std::vector<std::string> keys;
+  std::vector<std::vector<std::uint8_t>> requests;
+
+  for (int i = 0; i < 1000; ++i) {
+    requests.push_back(capy::json::to_msgpack(capy::json({{"id", i}})));
+    keys.push_back(ReplyCache::make_key("echo.find", requests.back()));
+    cache.set(keys.back(), requests.back(), capy::json(i), 100);
+
+    ///
+    /// The first key is used, so it is not evicted
+    ///
+    EXPECT_TRUE(cache.get(keys.front(), requests.front()));
+  }
+
+  EXPECT_LE(cache.get_bytes(), caching.max_bytes);
+  EXPECT_LT(cache.size(), 1000);
+  EXPECT_TRUE(cache.get(keys.back(), requests.back()));
+
+  ///
+  /// Reply over the shard limit is not cached
+  ///
+  cache.set("large", requests.front(), capy::json(0), 2000);
+  EXPECT_FALSE(cache.get("large", requests.front()));
+}
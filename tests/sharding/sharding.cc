@@ -0,0 +1,70 @@
+//
+// Created by denn nevera on 2019-07-24.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+
+using namespace capy::amqp;
+
+TEST(Sharding, StableHash) {
+  EXPECT_EQ(ShardMap::hash(""), 14695981039346656037ull);
+  EXPECT_EQ(ShardMap::hash("a"), 0xaf63dc4c8601ec8cull);
+  EXPECT_EQ(ShardMap::jump(0, 1000), 0u);
+}
+
+TEST(Sharding, Balance) {
+
+  ShardMap map("orders", 16);
+  std::vector<size_t> counts(16, 0);
+
+  for (int i = 0; i < 160000; ++i) {
+    auto shard = map.get_shard("order-" + std::to_string(i));
+    ASSERT_LT(shard, 16u);
+    counts[shard]++;
+  }
+
+  for (auto count: counts) {
+    EXPECT_NEAR(static_cast<double>(count), 10000.0, 600.0);
+  }
+
+  EXPECT_EQ(map.get_routing_key("order-1"), "orders." + std::to_string(map.get_shard("order-1")));
+}
+
+TEST(Sharding, MinimalMovement) {
+
+  ShardMap before("orders", 10);
+  ShardMap after("orders", 11);
+
+  size_t moved = 0;
+
+  for (int i = 0; i < 100000; ++i) {
+    auto key = "order-" + std::to_string(i);
+    auto from = before.get_shard(key);
+    auto to = after.get_shard(key);
+    if (from != to) {
+      EXPECT_EQ(to, 10u);
+      moved++;
+    }
+  }
+
+  EXPECT_NEAR(static_cast<double>(moved), 100000.0 / 11, 1000.0);
+}
+
+TEST(Sharding, Claim) {
+
+  ShardMap map("orders", 10);
+  std::vector<int> claimed(10, 0);
+
+  for (uint32_t worker = 0; worker < 3; ++worker) {
+    auto range = ShardRange::Claim(10, worker, 3);
+    for (auto& key: map.get_routing_keys(range)) {
+      claimed[std::stoul(key.substr(key.find('.') + 1))]++;
+    }
+  }
+
+  EXPECT_EQ(claimed, std::vector<int>(10, 1));
+
+  EXPECT_TRUE(ShardRange::Claim(2, 2, 4).empty());
+  EXPECT_TRUE(ShardRange::Claim(10, 3, 3).empty());
+}
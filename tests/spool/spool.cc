@@ -0,0 +1,201 @@
+//
+// Created by denn nevera on 2019-08-07.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/spool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using capy::amqp::Spool;
+using capy::amqp::Spooling;
+
+static std::string make_directory() {
+  char path[] = "/tmp/capy-spool-XXXXXX";
+  EXPECT_NE(mkdtemp(path), nullptr);
+  return path;
+}
+
+static std::vector<std::string> list_segments(const std::string& directory) {
+  std::vector<std::string> segments;
+  if (auto dir = opendir(directory.c_str())) {
+    while (auto entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name != "." && name != "..") segments.push_back(directory + "/" + name);
+    }
+    closedir(dir);
+  }
+  return segments;
+}
+
+static void remove_directory(const std::string& directory) {
+  for (auto& segment: list_segments(directory)) unlink(segment.c_str());
+  rmdir(directory.c_str());
+}
+
+static std::vector<std::uint8_t> make_data(size_t size, uint8_t seed) {
+  std::vector<std::uint8_t> data(size);
+  for (size_t i = 0; i < size; ++i) data[i] = static_cast<uint8_t>(seed + i);
+  return data;
+}
+
+TEST(Spool, AppendReadCommit) {
+
+  Spooling spooling;
+  spooling.directory = make_directory();
+  spooling.segment_size = 4096;
+  spooling.max_bytes = 64 * 1024;
+
+  auto spool = Spool::Open(spooling);
+
+  ASSERT_TRUE(spool);
+  EXPECT_TRUE((*spool)->empty());
+
+  for (uint8_t i = 0; i < 40; ++i) {
+    EXPECT_FALSE((*spool)->append("key." + std::to_string(i), "id." + std::to_string(i), i % 3, make_data(200, i)));
+  }
+
+  EXPECT_FALSE((*spool)->empty());
+  EXPECT_GT(list_segments(spooling.directory).size(), 1);
+
+  size_t count = 0;
+
+  while (!(*spool)->empty()) {
+
+    Spool::Cursor cursor;
+    auto records = (*spool)->read(7, cursor);
+
+    ASSERT_FALSE(records.empty());
+
+    for (auto& record: records) {
+      auto index = static_cast<uint8_t>(count++);
+      EXPECT_EQ(record.routing_key, "key." + std::to_string(index));
+      EXPECT_EQ(record.message_id, "id." + std::to_string(index));
+      EXPECT_EQ(record.priority, index % 3);
+      EXPECT_EQ(record.data, make_data(200, index));
+    }
+
+    EXPECT_FALSE((*spool)->commit(cursor));
+  }
+
+  EXPECT_EQ(count, 40);
+  EXPECT_EQ(list_segments(spooling.directory).size(), 1);
+
+  spool->reset();
+  remove_directory(spooling.directory);
+}
+
+TEST(Spool, Recovery) {
+
+  Spooling spooling;
+  spooling.directory = make_directory();
+  spooling.segment_size = 4096;
+
+  {
+    auto spool = Spool::Open(spooling);
+    ASSERT_TRUE(spool);
+
+    for (uint8_t i = 0; i < 30; ++i) {
+      EXPECT_FALSE((*spool)->append("recovery", "", 0, make_data(100, i)));
+    }
+
+    Spool::Cursor cursor;
+    EXPECT_EQ((*spool)->read(10, cursor).size(), 10);
+    EXPECT_FALSE((*spool)->commit(cursor));
+
+    ///
+    /// Read but not committed records are recovered
+    ///
+    EXPECT_EQ((*spool)->read(5, cursor).size(), 5);
+  }
+
+  auto spool = Spool::Open(spooling);
+
+  ASSERT_TRUE(spool);
+
+  size_t count = 10;
+
+  while (!(*spool)->empty()) {
+    Spool::Cursor cursor;
+    for (auto& record: (*spool)->read(100, cursor)) {
+      EXPECT_EQ(record.data, make_data(100, static_cast<uint8_t>(count++)));
+    }
+    EXPECT_FALSE((*spool)->commit(cursor));
+  }
+
+  EXPECT_EQ(count, 30);
+
+  spool->reset();
+  remove_directory(spooling.directory);
+}
+
+TEST(Spool, TornRecord) {
+
+  Spooling spooling;
+  spooling.directory = make_directory();
+  spooling.segment_size = 4096;
+
+  {
+    auto spool = Spool::Open(spooling);
+    ASSERT_TRUE(spool);
+    EXPECT_FALSE((*spool)->append("torn", "", 0, make_data(100, 1)));
+    EXPECT_FALSE((*spool)->append("torn", "", 0, make_data(100, 2)));
+  }
+
+  ///
+  /// Corrupt the body of the second record
+  ///
+  auto segments = list_segments(spooling.directory);
+  ASSERT_EQ(segments.size(), 1);
+
+  auto fd = open(segments.front().c_str(), O_RDWR);
+  ASSERT_GE(fd, 0);
+  uint8_t garbage = 0xFF;
+  auto second = 128 + 8 + 4 + 4 + 100;
+  EXPECT_EQ(pwrite(fd, &garbage, 1, second + 8 + 4 + 4 + 50), 1);
+  close(fd);
+
+  auto spool = Spool::Open(spooling);
+  ASSERT_TRUE(spool);
+
+  Spool::Cursor cursor;
+  auto records = (*spool)->read(10, cursor);
+
+  ASSERT_EQ(records.size(), 1);
+  EXPECT_EQ(records.front().data, make_data(100, 1));
+
+  spool->reset();
+  remove_directory(spooling.directory);
+}
+
+TEST(Spool, Full) {
+
+  Spooling spooling;
+  spooling.directory = make_directory();
+  spooling.segment_size = 4096;
+  spooling.max_bytes = 2 * 4096;
+
+  auto spool = Spool::Open(spooling);
+  ASSERT_TRUE(spool);
+
+  capy::Error error(capy::amqp::CommonError::OK);
+  size_t count = 0;
+
+  while (!(error = (*spool)->append("full", "", 0, make_data(500, 0)))) count++;
+
+  EXPECT_EQ(error.value(), static_cast<int>(capy::amqp::BrokerError::SPOOL));
+  EXPECT_GT(count, 0);
+  EXPECT_LE((*spool)->get_bytes(), spooling.max_bytes);
+
+  EXPECT_TRUE((*spool)->append("large", "", 0, make_data(8192, 0)));
+
+  spool->reset();
+  remove_directory(spooling.directory);
+}
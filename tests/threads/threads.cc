@@ -0,0 +1,101 @@
+//
+// Created by denn nevera on 2019-07-25.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+
+#include <thread>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+using namespace capy::amqp;
+
+#ifdef __linux__
+
+TEST(Threads, PinAndName) {
+
+  std::thread([]{
+
+      auto affinity = ThreadAffinity::Pinned({0}, "capy-loop-test");
+      EXPECT_FALSE(affinity.apply());
+
+      auto current = ThreadAffinity::Current();
+      EXPECT_EQ(current.cpus, std::vector<int>({0}));
+      EXPECT_EQ(current.name, "capy-loop-test");
+
+      ///
+      /// Threads started by the pinned thread inherit its placement
+      ///
+      std::thread([]{
+          auto inherited = ThreadAffinity::Current();
+          EXPECT_EQ(inherited.cpus, std::vector<int>({0}));
+          EXPECT_EQ(inherited.name, "capy-loop-test");
+      }).join();
+
+  }).join();
+}
+
+TEST(Threads, Restore) {
+
+  std::thread([]{
+
+      auto original = ThreadAffinity::Current();
+
+      EXPECT_FALSE(ThreadAffinity::Pinned({0}, "capy-pinned").apply());
+      EXPECT_FALSE(original.apply());
+
+      EXPECT_EQ(ThreadAffinity::Current().cpus, original.cpus);
+      EXPECT_EQ(ThreadAffinity::Current().name, original.name);
+
+  }).join();
+}
+
+TEST(Threads, MemoryPolicy) {
+
+  std::thread([]{
+
+      ///
+      /// Memory policy set by the application, e.g. inherited from numactl --membind
+      ///
+      unsigned long nodes = 1;
+      if (syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, &nodes, 8 * sizeof(nodes)) != 0) {
+        std::cout << " set_mempolicy is not permitted, skipped" << std::endl;
+        return;
+      }
+
+      auto original = ThreadAffinity::Current();
+      EXPECT_EQ(original.memory_mode, MPOL_INTERLEAVE);
+
+      auto pinned = ThreadAffinity::Pinned({0});
+      pinned.numa_local = false;
+
+      EXPECT_FALSE(pinned.apply());
+      EXPECT_EQ(ThreadAffinity::Current().memory_mode, MPOL_INTERLEAVE);
+
+      EXPECT_FALSE(ThreadAffinity::Pinned({0}).apply());
+      EXPECT_FALSE(original.apply());
+
+      auto restored = ThreadAffinity::Current();
+      EXPECT_EQ(restored.memory_mode, MPOL_INTERLEAVE);
+      EXPECT_EQ(restored.memory_nodes, original.memory_nodes);
+
+  }).join();
+}
+
+TEST(Threads, InvalidCpu) {
+  std::thread([]{
+      EXPECT_TRUE(ThreadAffinity::Pinned({-1}).apply());
+  }).join();
+}
+
+#endif
+
+TEST(Threads, Range) {
+  EXPECT_EQ(ThreadAffinity::Range(2, 5), std::vector<int>({2, 3, 4, 5}));
+  EXPECT_TRUE(ThreadAffinity().empty());
+}
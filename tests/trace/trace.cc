@@ -0,0 +1,90 @@
+//
+// Created by denn nevera on 2019-07-17.
+//
+
+#include "capy/amqp.h"
+#include "gtest/gtest.h"
+#include "../../src/broker_impl/trace.h"
+
+#include <thread>
+#include <vector>
+
+using namespace capy::amqp;
+
+TEST(Trace, ChromeJson) {
+
+  trace::reset();
+
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([]{
+        for (int i = 0; i < 100; ++i) {
+          CAPY_AMQP_TRACE_SPAN("test.span");
+          auto begin = trace::now();
+          trace::record("test.record", begin);
+        }
+    });
+  }
+
+  for (auto& thread: threads) thread.join();
+
+  auto dump = capy::json::parse(trace::to_chrome_json());
+
+  ASSERT_TRUE(dump["traceEvents"].is_array());
+
+  size_t spans = 0;
+
+  for (auto& event: dump["traceEvents"]) {
+    if (event["ph"] != "X") continue;
+    EXPECT_GE(event["dur"].get<double>(), 0);
+    spans++;
+  }
+
+  EXPECT_EQ(spans, trace::enabled() ? 800u : 0u);
+}
+
+TEST(Trace, RingOverwrite) {
+
+  if (!trace::enabled()) return;
+
+  trace::reset();
+
+  std::thread([]{
+      auto begin = trace::now();
+      for (int i = 0; i < 20000; ++i) {
+        trace::record("test.overwrite", begin);
+      }
+  }).join();
+
+  auto dump = capy::json::parse(trace::to_chrome_json());
+
+  size_t spans = 0;
+  for (auto& event: dump["traceEvents"]) {
+    if (event["ph"] == "X") spans++;
+  }
+
+  EXPECT_LE(spans, 8192u);
+}
+
+TEST(Trace, TraceParent) {
+
+  auto parent = trace::make_traceparent();
+
+  EXPECT_TRUE(trace::is_traceparent(parent));
+  EXPECT_EQ(parent.size(), 55u);
+  EXPECT_NE(parent, trace::make_traceparent());
+
+  auto child = trace::child_traceparent(parent);
+
+  EXPECT_TRUE(trace::is_traceparent(child));
+  EXPECT_EQ(child.substr(0, 36), parent.substr(0, 36));
+  EXPECT_NE(child.substr(36, 16), parent.substr(36, 16));
+  EXPECT_EQ(child.substr(52), parent.substr(52));
+
+  EXPECT_FALSE(trace::is_traceparent(""));
+  EXPECT_FALSE(trace::is_traceparent("00-00000000000000000000000000000000-b7ad6b7169203331-01"));
+  EXPECT_FALSE(trace::is_traceparent("00-0AF7651916CD43DD8448EB211C80319C-b7ad6b7169203331-01"));
+  EXPECT_TRUE(trace::is_traceparent("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01"));
+  EXPECT_TRUE(trace::is_traceparent(trace::child_traceparent("broken")));
+}